@@ -0,0 +1,52 @@
+#ifndef KERNEL_ENDPOINT_H
+#define KERNEL_ENDPOINT_H
+
+#include <types.h>
+#include <util.h>
+#include <kernel/list_struct.h>
+#include <kernel/thread.h>
+
+// The maximum number of endpoints that may exist at once.
+#define MAX_ENDPOINTS           128
+
+// The maximum number of threads that may hold capabilities at once.
+#define MAX_CAP_TABLES          64
+
+// The number of capabilities that a thread may hold.
+#define CAP_TABLE_SLOTS         32
+
+#define NULL_ENDPOINT           0
+
+typedef uint16_t endpoint_id_t;
+
+struct Capability {
+    endpoint_id_t endpoint;     // `NULL_ENDPOINT`, if the slot is free
+    uint16_t rights;
+};
+
+typedef struct Capability cap_t;
+
+struct Endpoint {
+    list_t sender_wait_queue;   // Threads waiting to send a message through the endpoint
+    list_t receiver_wait_queue; // Threads waiting to receive a message from the endpoint
+    uint16_t ref_count;         // Capabilities that refer to the endpoint. Free if 0.
+    uint16_t receiver_count;    // Capabilities that carry `CAP_RECEIVE`
+};
+
+typedef struct Endpoint endpoint_t;
+
+WARN_UNUSED NON_NULL_PARAMS int endpoint_create(tcb_t *thread);
+WARN_UNUSED NON_NULL_PARAMS int endpoint_grant(tcb_t *thread, cap_handle_t handle, tcb_t *target,
+                                               unsigned int rights);
+WARN_UNUSED NON_NULL_PARAMS int endpoint_read(tcb_t *thread, cap_handle_t handle, unsigned int *rights,
+                                              size_t *waiting_senders, size_t *waiting_receivers);
+WARN_UNUSED NON_NULL_PARAMS int endpoint_revoke(tcb_t *thread, cap_handle_t handle);
+NON_NULL_PARAMS void endpoint_release_caps(tcb_t *thread);
+
+WARN_UNUSED NON_NULL_PARAM(1) int endpoint_send(tcb_t *sender, cap_handle_t handle, uint32_t subject,
+                                                uint16_t flags, void *send_buffer, size_t send_buffer_length);
+WARN_UNUSED NON_NULL_PARAM(1) int endpoint_receive(tcb_t *recipient, cap_handle_t handle, uint16_t flags,
+                                                   void *recv_buffer, size_t recv_buffer_length);
+NON_NULL_PARAMS void endpoint_detach(tcb_t *thread);
+
+#endif /* KERNEL_ENDPOINT_H */
@@ -0,0 +1,35 @@
+#ifndef KERNEL_FAULT_H
+#define KERNEL_FAULT_H
+
+#include <types.h>
+#include <util.h>
+#include <kernel/thread.h>
+#include <os/msg/kernel.h>
+
+// The maximum number of address spaces that may have anonymous regions delegated to the kernel.
+#define MAX_ANON_ADDR_SPACES    32
+
+// The maximum number of anonymous regions per address space.
+#define MAX_ANON_REGIONS        16
+
+// The maximum number of free frames the kernel will hold for resolving anonymous faults.
+#define ANON_RESERVE_SIZE       256
+
+// The pager is sent a MEMORY_MSG once the frame reserve drops below this level.
+#define ANON_RESERVE_LOW        32
+
+WARN_UNUSED int anon_region_add(paddr_t addr_space, addr_t start, addr_t end);
+WARN_UNUSED int anon_region_remove(paddr_t addr_space, addr_t start, addr_t end);
+
+size_t anon_reserve_donate(const pbase_t *frames, size_t count);
+size_t anon_reserve_withdraw(pbase_t *frames, size_t count);
+size_t anon_reserve_count(void);
+
+WARN_UNUSED NON_NULL_PARAMS int handle_anon_fault(tcb_t *tcb, addr_t fault_addr, uint32_t error_code);
+
+NON_NULL_PARAMS int send_page_fault(tcb_t *tcb, const ExecutionState *state, addr_t fault_address,
+                                    uint32_t error_code);
+WARN_UNUSED NON_NULL_PARAM(1) int reply_page_fault(tcb_t *pager, tid_t tid, const struct PageFaultReply *reply,
+                                                   size_t reply_length);
+
+#endif /* KERNEL_FAULT_H */
@@ -245,6 +245,9 @@ WARN_UNUSED static inline paddr_t get_root_page_map(void)
 WARN_UNUSED unsigned int map_temp(addr_t virt, paddr_t base, unsigned int count);
 WARN_UNUSED unsigned int unmap_temp(addr_t virt, unsigned int count);
 
+WARN_UNUSED int destroy_user_mappings(paddr_t pdir, pbase_t *frames, size_t *frame_count,
+    pbase_t *large_frames, size_t *large_count);
+
 WARN_UNUSED NON_NULL_PARAMS int read_pmap_entry(paddr_t pbase, unsigned int entry, pmap_entry_t *pmap_entry);
 WARN_UNUSED int write_pmap_entry(paddr_t pbase, unsigned int entry, pmap_entry_t buffer);
 
@@ -83,14 +83,16 @@ struct ThreadControlBlock {
 
     uint32_t event_mask;
     uint32_t pending_events;
-    uint8_t available[4];
+    uint8_t wait_for_fault_reply;   // Thread is blocked until its pager replies to a page fault
+    uint8_t available[3];
 
     // 32 bytes
 
     void* cap_table;
     size_t cap_table_size;
 
-    uint8_t available2[8];
+    addr_t fault_address;           // Faulting address of the outstanding page fault
+    uint32_t fault_error_code;
 
     // 48 bytes
 
@@ -100,7 +102,8 @@ struct ThreadControlBlock {
 
     // 64 bytes
 
-    uint8_t available3[4];
+    uint16_t wait_endpoint;         // Endpoint whose queue the thread is blocked in, if any
+    uint8_t available3[2];
 
     ExecutionState user_exec_state;
     uint32_t root_pmap;
@@ -131,6 +134,7 @@ NON_NULL_PARAMS void thread_switch_context(tcb_t* thread, bool do_x_save);
 WARN_UNUSED NON_NULL_PARAMS int thread_remove_from_list(tcb_t* thread);
 WARN_UNUSED NON_NULL_PARAMS int thread_wakeup(tcb_t* thread);
 WARN_UNUSED NON_NULL_PARAMS int thread_sleep(tcb_t *thread, unsigned int duration, int granularity);
+WARN_UNUSED bool thread_uses_root_pmap(paddr_t root_pmap);
 
 extern tcb_t* init_server_thread;
 extern tcb_t* init_pager_thread;
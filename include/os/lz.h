@@ -0,0 +1,39 @@
+#ifndef OS_LZ_H
+#define OS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The largest input that can be compressed in one call. Matches are found through
+   16-bit offsets, so this covers any run of pages up to 64 KiB. */
+
+#define LZ_MAX_INPUT        65536u
+#define LZ_ERROR            ((size_t)-1)
+
+/* A compressed boot module starts with a header, followed by the module cut into blocks
+   of LZ_MODULE_BLOCK_SIZE bytes (the last one may be shorter). Each block is its
+   compressed length as a little-endian 32-bit value, then the compressed data. A block
+   that doesn't get smaller is stored as it is, with LZ_MODULE_STORED set in its length.
+   The init server decompresses such modules before it loads them. */
+
+#define LZ_MODULE_MAGIC         0x5A4C4253u     /* "SBLZ" */
+#define LZ_MODULE_BLOCK_SIZE    LZ_MAX_INPUT
+#define LZ_MODULE_STORED        0x80000000u
+
+struct LzModuleHeader {
+    uint32_t magic;
+    uint32_t length;    // The length of the decompressed module, in bytes
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+size_t lz_compress(const void *src, size_t src_length, void *dest, size_t dest_length);
+size_t lz_decompress(const void *src, size_t src_length, void *dest, size_t dest_length);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* OS_LZ_H */
@@ -11,6 +11,9 @@ extern size_t heapSize;
 extern void *heapStart;
 extern void *heapEnd;
 void *sbrk( int increment );
+void *mapPages( size_t length );
+int unmapPages( void *addr, size_t length );
+void *remapPages( void *addr, size_t oldLength, size_t newLength, int mayMove );
 
 #ifdef __cplusplus
 }
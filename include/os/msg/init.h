@@ -12,6 +12,13 @@
 
 #define MAX_NAME_LEN			32
 
+#define NAME_CACHE_DEVICE		2       // Maps the name service's generation counters read-only
+#define NAME_CACHE_BUCKETS		1024u   // Generation counters in the page. Names hash into them with FNV-1a.
+
+#define PORT_PUBLIC			0x01u   // Any thread may send to and receive from the port
+#define PORT_NOBLOCK			0x01u   // Fail instead of waiting on a full or empty port
+#define PORT_MAX_MESSAGE		512u
+
 struct MapRequest {
     addr_t addr;
     int device;
@@ -29,6 +36,34 @@ struct UnmapRequest {
     size_t length;
 };
 
+struct RemapRequest {
+    addr_t addr;
+    size_t oldLength;
+    size_t newLength;
+    int flags;
+};
+
+struct ForkRequest {
+    addr_t entry;   // where the new thread starts
+    addr_t stack;   // the new thread's stack pointer
+};
+
+struct ForkResponse {
+    tid_t tid;
+};
+
+struct CreateShmRequest {
+    size_t length;
+};
+
+struct CreateShmResponse {
+    int device;   // the device that maps the new shared memory object
+};
+
+struct DestroyShmRequest {
+    int device;
+};
+
 struct CreatePortRequest {
     pid_t pid;
     int flags;
@@ -44,14 +79,29 @@ struct DestroyPortRequest {
 
 struct SendMessageRequest {
     pid_t port;
-    addr_t buffer;
-    size_t bufferLen;
+    int flags;
+    size_t length;
+    uint8_t data[];
 };
 
 struct ReceiveMessageRequest {
     pid_t port;
-    addr_t buffer;    // The buffer set aside for a message (leave NULL to automatically choose)
-    size_t bufferLen; // The maximum amount of space for a message
+    int flags;
+    size_t maxMessages;
+    size_t bufferLen; // The size of the receive buffer. Must fit at least one message of PORT_MAX_MESSAGE bytes.
+};
+
+/* A receive buffer starts with the number of messages that it holds. Each message
+   follows as a PortMessageHeader plus its data. */
+
+struct ReceiveMessageResponse {
+    uint32_t count;
+    uint8_t messages[];
+};
+
+struct PortMessageHeader {
+    tid_t sender;
+    uint16_t length;
 };
 
 struct RegisterServerRequest {
@@ -9,6 +9,7 @@
 #define EXCEPTION_MSG           0xFFFFFFFFu
 #define EXIT_MSG		0xFFFFFFFEu
 #define MEMORY_MSG              0xFFFFFFFDu
+#define PAGE_FAULT_MSG          0xFFFFFFFBu
 
 struct ExceptionMessage
 {
@@ -42,10 +43,43 @@ struct ExceptionMessage
   tid_t who;
 };
 
-struct ExitMessage
+/* Sent to a pager when one of its threads page faults. The thread stays blocked
+   until the pager sends a `PageFaultReply` back to it with the same subject. */
+
+struct PageFaultMessage
 {
+  uint32_t fault_address;
+  uint32_t error_code;
+  uint32_t eip;
   tid_t who;
+};
+
+/* Maps `count` consecutive frames, starting at `frame`, to the pages starting at `start`.
+   The range must contain the faulting page and must not cross a page table.
+   If `PM_PAGE_SIZED` is set, then a single large page is mapped instead. If `PM_UNMAPPED`
+   is set, then nothing is mapped and the thread is just resumed. `PM_DIRTY` marks the
+   new pages as already modified. */
+
+struct PageFaultReply
+{
+  uint32_t start;
+  pbase_t frame;
+  uint32_t count;
+  uint32_t flags;
+};
+
+struct ExitMessage
+{
   int  status_code;
+  tid_t who;
+};
+
+/* Sent (without blocking) to a pager when the kernel's anonymous frame reserve is running low. */
+
+struct MemoryMessage
+{
+  uint32_t reserve_count;
+  tid_t who;
 };
 
 struct IrqMessage
@@ -13,6 +13,7 @@
 #define MSG_NOBLOCK         0x01u
 #define MSG_STD             0x00u
 #define MSG_EMPTY           0x02u   // Only subject is sent
+#define MSG_ENDPOINT        0x04u   // The target is an endpoint capability handle instead of a TID
 #define MSG_KERNEL          0x80u
 
 typedef struct {
@@ -17,10 +17,8 @@
 #define LOOKUP_NAME		10
 //#define LOOKUP_TID		4
 //#define MAP_TID			5
-//#define CREATE_SHM		6
 //#define ATTACH_SHM_REG		7
 //#define DETACH_SHM_REG		8
-//#define DELETE_SHM		9
 //#define CONNECT_REQ		10
 #define UNREGISTER_NAME		11
 //#define CHANGE_IO_PERM		12
@@ -37,6 +35,10 @@
 #define DESTROY_PORT		6
 #define SEND_MESSAGE		7
 #define RECEIVE_MESSAGE		8
+#define CREATE_SHM		14
+#define DESTROY_SHM		15
+#define REMAP_MEM		16
+#define FORK_THREAD		17
 
 
 #define GEN_REPLY_TYPE		0x80000000
@@ -49,6 +51,8 @@
 #define MEM_FLG_IO		    0x10		// Map IO memory instead
 #define MEM_FLG_NOCACHE     0x20
 
+#define REMAP_MAYMOVE		0x01		// The memory may be moved to a new address if it can't grow in place
+
 struct GenericReq
 {
   int request;
@@ -64,8 +68,14 @@ struct ExecReq
 
 addr_t mapMem(addr_t addr, int device, size_t length, uint64_t offset, int flags);
 int unmapMem(addr_t addr, size_t length);
+addr_t remapMem(addr_t addr, size_t oldLength, size_t newLength, int flags);
+tid_t forkThread(addr_t entry, addr_t stack);
+int createShm(size_t length);
+int destroyShm(int shm);
 pid_t createPort(pid_t port, int flags);
 int destroyPort(pid_t port);
+int sendPortMessage(pid_t port, const void *data, size_t length, int flags);
+int receivePortMessages(pid_t port, void *buffer, size_t bufferLen, size_t maxMessages, int flags);
 int registerServer(int type, int id);
 int unregisterServer(void);
 int registerName(const char *name);
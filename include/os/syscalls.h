@@ -32,6 +32,13 @@
 
 #define SL_INF_DURATION         0xFFFFFFFFu
 
+#define CAP_SEND                0x01u       // Messages may be sent through the endpoint
+#define CAP_RECEIVE             0x02u       // Messages may be received from the endpoint
+#define CAP_GRANT               0x04u       // The capability may be copied to another thread
+#define CAP_ALL                 (CAP_SEND | CAP_RECEIVE | CAP_GRANT)
+
+#define NULL_CAP                ((cap_handle_t)0)
+
 /*
 #define PM_PRESENT              0x01u
 #define PM_NOT_PRESENT          0u
@@ -295,6 +302,14 @@ typedef struct {
     int level;
 } SysUpdatePageMappingsArgs;
 
+typedef struct {
+    paddr_t addr_space;     // No thread may be running in the address space.
+    pbase_t* frames;        // Receives the mapped 4 KiB frames and the removed page tables.
+    size_t frame_count;     // The length of `frames`. Set to the number of frames returned.
+    pbase_t* large_frames;  // Receives the first frame of each mapped 4 MiB page.
+    size_t large_count;     // The length of `large_frames`. Set to the number of frames returned.
+} SysDestroyPageMappingsArgs;
+
 typedef struct {
     void* entry;
     paddr_t addr_space;
@@ -335,6 +350,49 @@ typedef struct {
     unsigned int irq;    // Event interrupts can't be destroyed.
 } SysDestroyIntArgs;
 
+typedef struct {
+    paddr_t addr_space;
+    addr_t start;
+    size_t length;
+} SysCreateAnonRegionArgs;
+
+typedef struct {
+    pbase_t* frames;    // If NULL, then only the number of reserved frames is returned.
+    size_t count;
+} SysReadAnonRegionArgs;
+
+typedef struct {
+    const pbase_t* frames;
+    size_t count;
+} SysUpdateAnonRegionArgs;
+
+typedef struct {
+    paddr_t addr_space;
+    addr_t start;
+    size_t length;      // If both `start` and `length` are 0, then all regions in the address space are revoked.
+} SysDestroyAnonRegionArgs;
+
+// Creating a capability creates a new endpoint. The handle is returned and carries `CAP_ALL`.
+
+typedef struct {
+    cap_handle_t handle;
+    unsigned int rights;        // Set to the rights that the handle carries.
+    size_t waiting_senders;     // Set to the number of threads blocked sending through the endpoint.
+    size_t waiting_receivers;   // Set to the number of threads blocked receiving from the endpoint.
+} SysReadCapArgs;
+
+// Grants a copy of a capability to another thread. The new handle is returned.
+
+typedef struct {
+    cap_handle_t handle;
+    tid_t tid;
+    unsigned int rights;        // Masked by the rights of `handle`.
+} SysUpdateCapArgs;
+
+typedef struct {
+    cap_handle_t handle;
+} SysDestroyCapArgs;
+
 typedef enum {
     SL_SECONDS,
     SL_MILLISECONDS,
@@ -345,7 +403,8 @@ typedef enum {
     RES_PAGE_MAPPING,
     RES_TCB,
     RES_INT,
-    RES_CAP
+    RES_CAP,
+    RES_ANON_REGION
 } SysResource;
 
 #ifdef __cplusplus
@@ -447,6 +506,11 @@ int sys_wait(void);
 int sys_event_poll(int mask);
 int sys_event_eoi(int mask);
 
+// Send or receive through an endpoint by setting `MSG_ENDPOINT` and putting the handle in `target`
+int sys_endpoint_create(void);
+int sys_endpoint_grant(cap_handle_t handle, tid_t tid, unsigned int rights);
+int sys_endpoint_revoke(cap_handle_t handle);
+
 #ifdef __cplusplus
 };
 #else
@@ -51,6 +51,7 @@ typedef i64 int64;
 typedef i64 quad;
 
 typedef unsigned short int tid_t;
+typedef unsigned short int cap_handle_t;
 typedef int pid_t;
 
 typedef unsigned long int pbase_t;
@@ -0,0 +1,478 @@
+#include <kernel/bits.h>
+#include <kernel/debug.h>
+#include <kernel/endpoint.h>
+#include <kernel/error.h>
+#include <kernel/list.h>
+#include <kernel/memory.h>
+#include <kernel/message.h>
+#include <kernel/schedule.h>
+#include <kernel/thread.h>
+#include <os/msg/message.h>
+#include <oslib.h>
+
+/*
+    An endpoint is a message queue that isn't tied to a thread. Any number of threads may
+    send through an endpoint and any number may receive from it. A message sent to an
+    endpoint goes to whichever receiver has been blocked on it the longest, so a service
+    can be served by a pool of threads while its clients only know the endpoint.
+
+    Endpoints are reached through capabilities. A thread's capability table is referred
+    to by its TCB's `cap_table` and a handle is one more than the index of a slot in it.
+    The thread that creates an endpoint receives a capability with all rights and may
+    grant copies of it (with the same or fewer rights) to other threads. An endpoint is
+    freed once the last capability to it is revoked.
+
+    A thread that's blocked on an endpoint sits in the endpoint's sender or receiver queue
+    instead of another thread's queue, and its `wait_endpoint` is set. A blocked receiver
+    waits for any sender, so the delivery itself is done by `send_message()` and
+    `receive_message()` once a peer has been picked from the queue. Starting the peer
+    detaches it from the endpoint. A receiver that's blocked on an endpoint may still be
+    sent messages directly by TID. Only messages that came through an endpoint carry
+    `MSG_ENDPOINT` in their flags.
+*/
+
+static endpoint_t endpoints[MAX_ENDPOINTS];
+static cap_t cap_tables[MAX_CAP_TABLES][CAP_TABLE_SLOTS];
+static bool cap_table_used[MAX_CAP_TABLES];
+
+static endpoint_t *get_endpoint(endpoint_id_t id);
+static cap_t *get_cap(tcb_t *thread, cap_handle_t handle, unsigned int rights);
+static cap_handle_t alloc_cap(tcb_t *thread);
+static void drop_cap(cap_t *cap);
+static void fail_waiting_threads(list_t *queue);
+static size_t count_waiting_threads(const list_t *queue);
+
+static endpoint_t *get_endpoint(endpoint_id_t id)
+{
+    return (id == NULL_ENDPOINT || id > MAX_ENDPOINTS) ? NULL : &endpoints[id - 1];
+}
+
+/**
+ Look up a capability in a thread's capability table.
+
+ @param thread The thread that holds the capability.
+ @param handle The capability's handle.
+ @param rights The rights that the capability must carry.
+ @return The capability. `NULL`, if the handle is invalid or lacks any of the rights.
+ */
+static cap_t *get_cap(tcb_t *thread, cap_handle_t handle, unsigned int rights)
+{
+    if(handle == NULL_CAP || handle > thread->cap_table_size) {
+        return NULL;
+    }
+
+    cap_t *cap = &((cap_t *)thread->cap_table)[handle - 1];
+
+    return (cap->endpoint != NULL_ENDPOINT && (cap->rights & rights) == rights) ? cap : NULL;
+}
+
+/**
+ Reserve a free slot in a thread's capability table. A table is given to the
+ thread if it doesn't have one yet.
+
+ @return The handle of the slot. `NULL_CAP`, if no slot is available.
+ */
+static cap_handle_t alloc_cap(tcb_t *thread)
+{
+    if(!thread->cap_table) {
+        for(size_t i = 0; i < MAX_CAP_TABLES; i++) {
+            if(!cap_table_used[i]) {
+                cap_table_used[i] = true;
+                memset(cap_tables[i], 0, sizeof cap_tables[i]);
+
+                thread->cap_table = cap_tables[i];
+                thread->cap_table_size = CAP_TABLE_SLOTS;
+                break;
+            }
+        }
+
+        if(!thread->cap_table) {
+            RET_MSG(NULL_CAP, "No capability tables are available.");
+        }
+    }
+
+    cap_t *table = (cap_t *)thread->cap_table;
+
+    for(size_t i = 0; i < thread->cap_table_size; i++) {
+        if(table[i].endpoint == NULL_ENDPOINT) {
+            return (cap_handle_t)(i + 1);
+        }
+    }
+
+    RET_MSG(NULL_CAP, "Capability table is full.");
+}
+
+/**
+ Clear a capability slot and drop its reference to the endpoint. Senders that are
+ blocked on an endpoint fail once no capability to receive from it is left, since
+ their messages could never be picked up.
+ */
+static void drop_cap(cap_t *cap)
+{
+    endpoint_t *endpoint = get_endpoint(cap->endpoint);
+
+    KASSERT(endpoint && endpoint->ref_count > 0);
+
+    if(endpoint) {
+        if(IS_FLAG_SET(cap->rights, CAP_RECEIVE) && --endpoint->receiver_count == 0) {
+            fail_waiting_threads(&endpoint->sender_wait_queue);
+        }
+
+        endpoint->ref_count--;
+    }
+
+    cap->endpoint = NULL_ENDPOINT;
+    cap->rights = 0;
+}
+
+// Start every thread in an endpoint queue with a failed send or receive.
+
+static void fail_waiting_threads(list_t *queue)
+{
+    while(!LIST_IS_EMPTY(queue)) {
+        tcb_t *thread = get_tcb(queue->tail_tid);
+
+        if(!thread) {
+            break;
+        }
+
+        // The endpoint has no receivers left, as if the sender had tried to send just now
+
+        thread->user_exec_state.eax = (uint32_t)E_UNREACH;
+
+        if(IS_ERROR(thread_start(thread))) {
+            endpoint_detach(thread);
+        }
+    }
+}
+
+static size_t count_waiting_threads(const list_t *queue)
+{
+    size_t count = 0;
+
+    for(tcb_t *thread = get_tcb(queue->head_tid); thread; thread = get_tcb(thread->next_tid)) {
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ Create an endpoint.
+
+ @param thread The thread that will hold the endpoint's first capability.
+ @return The handle of a capability with all rights, on success. `E_FAIL`, if no
+ endpoints or capability slots are available.
+ */
+NON_NULL_PARAMS int endpoint_create(tcb_t *thread)
+{
+    endpoint_id_t id = NULL_ENDPOINT;
+
+    for(size_t i = 0; i < MAX_ENDPOINTS; i++) {
+        if(endpoints[i].ref_count == 0) {
+            id = (endpoint_id_t)(i + 1);
+            break;
+        }
+    }
+
+    if(id == NULL_ENDPOINT) {
+        RET_MSG(E_FAIL, "No endpoints are available.");
+    }
+
+    cap_handle_t handle = alloc_cap(thread);
+
+    if(handle == NULL_CAP) {
+        return E_FAIL;
+    }
+
+    endpoint_t *endpoint = get_endpoint(id);
+    cap_t *cap = &((cap_t *)thread->cap_table)[handle - 1];
+
+    memset(endpoint, 0, sizeof *endpoint);
+    endpoint->ref_count = 1;
+    endpoint->receiver_count = 1;
+
+    cap->endpoint = id;
+    cap->rights = CAP_ALL;
+
+    return (int)handle;
+}
+
+/**
+ Copy a capability into another thread's capability table.
+
+ @param thread The thread that holds the capability. It must carry `CAP_GRANT`.
+ @param handle The capability's handle.
+ @param target The thread that receives the copy.
+ @param rights The rights of the copy. They're limited to those of the original.
+ @return The handle of the copy in `target`'s table, on success. `E_PERM`, if the
+ capability can't be granted. `E_INVALID_ARG`, if the copy would carry no rights.
+ `E_UNREACH`, if the target isn't active. `E_FAIL`, if the target's table is full.
+ */
+NON_NULL_PARAMS int endpoint_grant(tcb_t *thread, cap_handle_t handle, tcb_t *target, unsigned int rights)
+{
+    cap_t *cap = get_cap(thread, handle, CAP_GRANT);
+
+    if(!cap) {
+        RET_MSG(E_PERM, "Capability can't be granted.");
+    }
+
+    endpoint_t *endpoint = get_endpoint(cap->endpoint);
+
+    if(!endpoint) {
+        RET_MSG(E_FAIL, "Capability refers to an invalid endpoint.");
+    }
+
+    rights &= cap->rights;
+
+    if(rights == 0) {
+        RET_MSG(E_INVALID_ARG, "Granted capability would carry no rights.");
+    } else if(target->thread_state == INACTIVE || target->thread_state == ZOMBIE) {
+        RET_MSG(E_UNREACH, "Target is not an active thread.");
+    }
+
+    cap_handle_t target_handle = alloc_cap(target);
+
+    if(target_handle == NULL_CAP) {
+        return E_FAIL;
+    }
+
+    cap_t *target_cap = &((cap_t *)target->cap_table)[target_handle - 1];
+
+    target_cap->endpoint = cap->endpoint;
+    target_cap->rights = (uint16_t)rights;
+
+    endpoint->ref_count++;
+
+    if(IS_FLAG_SET(rights, CAP_RECEIVE)) {
+        endpoint->receiver_count++;
+    }
+
+    return (int)target_handle;
+}
+
+/**
+ Report the rights of a capability and how many threads are blocked on its endpoint.
+
+ @return `E_OK` on success. `E_INVALID_ARG`, if the handle is invalid.
+ */
+NON_NULL_PARAMS int endpoint_read(tcb_t *thread, cap_handle_t handle, unsigned int *rights,
+                                  size_t *waiting_senders, size_t *waiting_receivers)
+{
+    cap_t *cap = get_cap(thread, handle, 0);
+
+    if(!cap) {
+        RET_MSG(E_INVALID_ARG, "Invalid capability handle.");
+    }
+
+    endpoint_t *endpoint = get_endpoint(cap->endpoint);
+
+    if(!endpoint) {
+        RET_MSG(E_FAIL, "Capability refers to an invalid endpoint.");
+    }
+
+    *rights = cap->rights;
+    *waiting_senders = count_waiting_threads(&endpoint->sender_wait_queue);
+    *waiting_receivers = count_waiting_threads(&endpoint->receiver_wait_queue);
+
+    return E_OK;
+}
+
+/**
+ Remove a capability from a thread's capability table.
+
+ @return `E_OK` on success. `E_INVALID_ARG`, if the handle is invalid.
+ */
+NON_NULL_PARAMS int endpoint_revoke(tcb_t *thread, cap_handle_t handle)
+{
+    cap_t *cap = get_cap(thread, handle, 0);
+
+    if(!cap) {
+        RET_MSG(E_INVALID_ARG, "Invalid capability handle.");
+    }
+
+    drop_cap(cap);
+    return E_OK;
+}
+
+/**
+ Revoke all of a thread's capabilities and give up its capability table.
+
+ @param thread The thread, which must not be blocked on an endpoint.
+ */
+NON_NULL_PARAMS void endpoint_release_caps(tcb_t *thread)
+{
+    cap_t *table = (cap_t *)thread->cap_table;
+
+    if(!table) {
+        return;
+    }
+
+    for(size_t i = 0; i < thread->cap_table_size; i++) {
+        if(table[i].endpoint != NULL_ENDPOINT) {
+            drop_cap(&table[i]);
+        }
+    }
+
+    cap_table_used[(table - &cap_tables[0][0]) / CAP_TABLE_SLOTS] = false;
+
+    thread->cap_table = NULL;
+    thread->cap_table_size = 0;
+}
+
+/**
+    Send a message through an endpoint.
+
+    The message goes to the receiver that has been waiting on the endpoint the longest.
+    If no receiver is waiting, then the sender blocks in the endpoint's sender queue.
+    The register layout is the same as for `send_message()`.
+
+    @param sender - The thread sending the message.
+    @param handle - A capability to the endpoint that carries `CAP_SEND`.
+    @param flags - Message flags. `MSG_KERNEL` may not be set.
+
+    @return
+        * The same values as `send_message()`.
+        * `E_PERM`, if the handle doesn't allow sending.
+        * `E_UNREACH`, if no thread is able to receive from the endpoint.
+*/
+NON_NULL_PARAM(1) int endpoint_send(tcb_t *sender, cap_handle_t handle, uint32_t subject, uint16_t flags,
+                                    void *send_buffer, size_t send_buffer_length)
+{
+    cap_t *cap = get_cap(sender, handle, CAP_SEND);
+
+    if(!cap) {
+        RET_MSG(E_PERM, "Capability doesn't allow sending.");
+    } else if(IS_FLAG_SET(flags, MSG_KERNEL)) {
+        RET_MSG(E_INVALID_ARG, "Kernel messages can't be sent through an endpoint.");
+    } else if(send_buffer_length > 0 && send_buffer == NULL) {
+        RET_MSG(E_INVALID_ARG, "Send buffer is NULL, but send length is non-zero.");
+    }
+
+    endpoint_id_t id = cap->endpoint;
+    endpoint_t *endpoint = get_endpoint(id);
+
+    if(!endpoint) {
+        RET_MSG(E_FAIL, "Capability refers to an invalid endpoint.");
+    } else if(endpoint->receiver_count == 0) {
+        RET_MSG(E_UNREACH, "No thread can receive from the endpoint.");
+    }
+
+    if(!LIST_IS_EMPTY(&endpoint->receiver_wait_queue)) {
+        return send_message(sender, endpoint->receiver_wait_queue.tail_tid, subject, flags, send_buffer,
+                            send_buffer_length);
+    } else if(IS_FLAG_SET(flags, MSG_NOBLOCK)) {
+        return E_BLOCK;
+    }
+
+    if(IS_ERROR(thread_remove_from_list(sender))) {
+        RET_MSG(E_FAIL, "Unable to detach sender from run queue.");
+    }
+
+    list_enqueue(&endpoint->sender_wait_queue, sender);
+
+    sender->thread_state = WAIT_FOR_RECV;
+    sender->wait_tid = ANY_RECIPIENT;
+    sender->wait_endpoint = id;
+    sender->wait_for_kernel_msg = 0;
+
+    sender->user_exec_state.eax = (uint32_t)E_INTERRUPT;
+    sender->user_exec_state.ebx = (uint32_t)send_buffer;
+    sender->user_exec_state.ecx = (uint32_t)flags;
+    sender->user_exec_state.esi = (uint32_t)subject;
+    sender->user_exec_state.edi = (uint32_t)send_buffer_length;
+
+    thread_switch_context(schedule(processor_get_current()), true);
+
+    // Does not return
+    UNREACHABLE;
+
+    return E_FAIL;
+}
+
+/**
+    Receive a message from an endpoint.
+
+    The message is taken from the sender that has been waiting on the endpoint the
+    longest. If no sender is waiting, then the recipient blocks in the endpoint's
+    receiver queue. The register layout is the same as for `receive_message()`.
+
+    @param recipient - The thread receiving the message.
+    @param handle - A capability to the endpoint that carries `CAP_RECEIVE`.
+    @param flags - Message flags. `MSG_KERNEL` may not be set.
+
+    @return
+        * The same values as `receive_message()`.
+        * `E_PERM`, if the handle doesn't allow receiving.
+*/
+NON_NULL_PARAM(1) int endpoint_receive(tcb_t *recipient, cap_handle_t handle, uint16_t flags, void *recv_buffer,
+                                       size_t recv_buffer_length)
+{
+    cap_t *cap = get_cap(recipient, handle, CAP_RECEIVE);
+
+    if(!cap) {
+        RET_MSG(E_PERM, "Capability doesn't allow receiving.");
+    } else if(IS_FLAG_SET(flags, MSG_KERNEL)) {
+        RET_MSG(E_INVALID_ARG, "Kernel messages can't be received from an endpoint.");
+    } else if(recv_buffer_length > 0 && recv_buffer == NULL) {
+        RET_MSG(E_INVALID_ARG, "Receive buffer is NULL, but receive length is non-zero.");
+    }
+
+    endpoint_id_t id = cap->endpoint;
+    endpoint_t *endpoint = get_endpoint(id);
+
+    if(!endpoint) {
+        RET_MSG(E_FAIL, "Capability refers to an invalid endpoint.");
+    }
+
+    if(!LIST_IS_EMPTY(&endpoint->sender_wait_queue)) {
+        tcb_t *sender = get_tcb(endpoint->sender_wait_queue.tail_tid);
+
+        // Address the sender to this recipient, so that receive_message() accepts it
+
+        sender->wait_tid = get_tid(recipient);
+
+        return receive_message(recipient, get_tid(sender), flags, recv_buffer, recv_buffer_length);
+    } else if(IS_FLAG_SET(flags, MSG_NOBLOCK)) {
+        return E_BLOCK;
+    }
+
+    if(IS_ERROR(thread_remove_from_list(recipient))) {
+        RET_MSG(E_FAIL, "Unable to detach recipient from run queue.");
+    }
+
+    list_enqueue(&endpoint->receiver_wait_queue, recipient);
+
+    recipient->thread_state = WAIT_FOR_SEND;
+    recipient->wait_tid = ANY_SENDER;
+    recipient->wait_endpoint = id;
+    recipient->wait_for_kernel_msg = 0;
+
+    recipient->user_exec_state.eax = (uint32_t)E_INTERRUPT;
+    recipient->user_exec_state.ebx = (uint32_t)recv_buffer;
+    recipient->user_exec_state.ecx = (uint32_t)flags;
+    recipient->user_exec_state.edi = (uint32_t)recv_buffer_length;
+
+    thread_switch_context(schedule(processor_get_current()), true);
+
+    // Does not return
+    UNREACHABLE;
+
+    return E_FAIL;
+}
+
+/** Remove a thread from the endpoint queue that it's blocked in.
+
+ @param thread The thread to be detached. Does nothing if the thread isn't
+ blocked on an endpoint.
+ */
+NON_NULL_PARAMS void endpoint_detach(tcb_t *thread)
+{
+    endpoint_t *endpoint = get_endpoint(thread->wait_endpoint);
+    thread->wait_endpoint = NULL_ENDPOINT;
+
+    if(endpoint) {
+        list_remove(thread->thread_state == WAIT_FOR_RECV ? &endpoint->sender_wait_queue
+                                                          : &endpoint->receiver_wait_queue, thread);
+    }
+}
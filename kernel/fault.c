@@ -0,0 +1,586 @@
+#include <kernel/bits.h>
+#include <kernel/debug.h>
+#include <kernel/error.h>
+#include <kernel/fault.h>
+#include <kernel/memory.h>
+#include <kernel/message.h>
+#include <kernel/mm.h>
+#include <kernel/paging.h>
+#include <kernel/schedule.h>
+#include <kernel/thread.h>
+#include <os/msg/kernel.h>
+#include <os/msg/message.h>
+#include <oslib.h>
+
+/*
+    Anonymous zero-fill regions may be delegated to the kernel by a pager. Faults on
+    not-present pages within those regions are resolved in the kernel using frames
+    from a reserve that the pager keeps stocked. This avoids a round trip to the pager
+    for first-touch faults. Anything else (present pages, large pages, swapped-out pages,
+    or an empty reserve) is left for the pager to handle.
+
+    Every other user page fault is sent to the pager as a `PageFaultMessage` and the
+    faulting thread stays blocked until the pager replies with a `PageFaultReply`. The
+    kernel installs the mapping described by the reply and restarts the thread as part
+    of the same send.
+*/
+
+struct AnonRegion {
+    addr_t start;
+    addr_t end;
+};
+
+struct AnonAddrSpace {
+    paddr_t root_pmap;  // 0 if the entry is unused
+    size_t region_count;
+    struct AnonRegion regions[MAX_ANON_REGIONS];
+};
+
+static struct AnonAddrSpace anon_addr_spaces[MAX_ANON_ADDR_SPACES];
+
+static pbase_t anon_reserve[ANON_RESERVE_SIZE];
+static size_t anon_reserve_top;
+static bool reserve_low_notified;
+
+static struct AnonAddrSpace* find_addr_space(paddr_t root_pmap, bool create);
+static bool anon_reserve_take(pbase_t *frame);
+static void notify_reserve_low(tcb_t* tcb);
+static int map_fault_pages(tcb_t *thread, const struct PageFaultReply *reply);
+static int map_fault_large_page(tcb_t *thread, const struct PageFaultReply *reply);
+
+static struct AnonAddrSpace* find_addr_space(paddr_t root_pmap, bool create)
+{
+    struct AnonAddrSpace* free_entry = NULL;
+
+    for(size_t i = 0; i < MAX_ANON_ADDR_SPACES; i++) {
+        if(anon_addr_spaces[i].root_pmap == root_pmap) {
+            return &anon_addr_spaces[i];
+        } else if(!free_entry && anon_addr_spaces[i].root_pmap == 0) {
+            free_entry = &anon_addr_spaces[i];
+        }
+    }
+
+    if(create && free_entry) {
+        free_entry->root_pmap = root_pmap;
+        free_entry->region_count = 0;
+        return free_entry;
+    }
+
+    return NULL;
+}
+
+/**
+ Delegate an anonymous zero-fill region to the kernel.
+
+ Overlapping and adjacent regions are coalesced.
+
+ @param addr_space The physical address of the root page map.
+ @param start The page-aligned start of the region.
+ @param end The page-aligned end of the region (exclusive).
+ @return `E_OK` on success. `E_INVALID_ARG` if the region is malformed or overlaps
+ kernel memory. `E_FAIL` if there's no room left to track the region.
+ */
+int anon_region_add(paddr_t addr_space, addr_t start, addr_t end)
+{
+    struct AnonAddrSpace* space;
+
+    if(start >= end || !IS_ALIGNED(start, PAGE_SIZE) || !IS_ALIGNED(end, PAGE_SIZE)
+       || end > ALIGN_DOWN(KERNEL_VSTART, PAGE_TABLE_SIZE)) {
+        RET_MSG(E_INVALID_ARG, "Invalid anonymous region.");
+    }
+
+    space = find_addr_space(addr_space, true);
+
+    if(!space) {
+        RET_MSG(E_FAIL, "No more address spaces can have anonymous regions.");
+    }
+
+    for(size_t i = 0; i < space->region_count;) {
+        struct AnonRegion* region = &space->regions[i];
+
+        if(region->start <= end && start <= region->end) {
+            start = MIN(start, region->start);
+            end = MAX(end, region->end);
+            *region = space->regions[--space->region_count];
+        } else {
+            i++;
+        }
+    }
+
+    if(space->region_count == MAX_ANON_REGIONS) {
+        RET_MSG(E_FAIL, "Too many anonymous regions in address space.");
+    }
+
+    space->regions[space->region_count++] = (struct AnonRegion){ .start = start, .end = end };
+
+    return E_OK;
+}
+
+/**
+ Revoke part of a delegated anonymous region.
+
+ Faults within the revoked range will be sent to the pager.
+
+ @param addr_space The physical address of the root page map.
+ @param start The page-aligned start of the range.
+ @param end The page-aligned end of the range (exclusive). If `start` and `end` are
+ both 0, then every region in the address space is revoked.
+ @return `E_OK` on success. `E_FAIL` if a region would have to be split, but there's
+ no room for it.
+ */
+int anon_region_remove(paddr_t addr_space, addr_t start, addr_t end)
+{
+    struct AnonAddrSpace* space = find_addr_space(addr_space, false);
+
+    if(!space) {
+        return E_OK;
+    }
+
+    if(start == 0 && end == 0) {
+        space->region_count = 0;
+    }
+
+    for(size_t i = 0; i < space->region_count;) {
+        struct AnonRegion* region = &space->regions[i];
+
+        if(region->end <= start || end <= region->start) {
+            i++;
+        } else if(region->start < start && end < region->end) {
+            if(space->region_count == MAX_ANON_REGIONS) {
+                RET_MSG(E_FAIL, "Unable to split anonymous region.");
+            }
+
+            space->regions[space->region_count++] = (struct AnonRegion){ .start = end, .end = region->end };
+            region->end = start;
+            i++;
+        } else if(region->start < start) {
+            region->end = start;
+            i++;
+        } else if(end < region->end) {
+            region->start = end;
+            i++;
+        } else {
+            *region = space->regions[--space->region_count];
+        }
+    }
+
+    if(space->region_count == 0) {
+        space->root_pmap = 0;
+    }
+
+    return E_OK;
+}
+
+/**
+ Add free frames to the reserve used for resolving anonymous faults.
+
+ @param frames The frame numbers to donate.
+ @param count The number of frames in `frames`.
+ @return The number of frames that were accepted. The caller keeps the remainder.
+ */
+size_t anon_reserve_donate(const pbase_t *frames, size_t count)
+{
+    size_t accepted = 0;
+
+    for(; accepted < count && anon_reserve_top < ANON_RESERVE_SIZE; accepted++) {
+        // Frames above 4 GiB can't be mapped by a non-PAE PTE
+
+        if(frames[accepted] >= (1ul << 20)) {
+            break;
+        }
+
+        anon_reserve[anon_reserve_top++] = frames[accepted];
+    }
+
+    if(anon_reserve_top >= ANON_RESERVE_LOW) {
+        reserve_low_notified = false;
+    }
+
+    return accepted;
+}
+
+/**
+ Take unused frames back out of the reserve.
+
+ @param frames The buffer that will hold the withdrawn frame numbers.
+ @param count The maximum number of frames to withdraw.
+ @return The number of frames that were withdrawn.
+ */
+size_t anon_reserve_withdraw(pbase_t *frames, size_t count)
+{
+    size_t withdrawn = 0;
+
+    for(; withdrawn < count && anon_reserve_top > 0; withdrawn++) {
+        frames[withdrawn] = anon_reserve[--anon_reserve_top];
+    }
+
+    return withdrawn;
+}
+
+size_t anon_reserve_count(void)
+{
+    return anon_reserve_top;
+}
+
+static bool anon_reserve_take(pbase_t *frame)
+{
+    if(anon_reserve_top == 0) {
+        return false;
+    }
+
+    *frame = anon_reserve[--anon_reserve_top];
+    return true;
+}
+
+static void notify_reserve_low(tcb_t* tcb)
+{
+    struct MemoryMessage message_data = {
+        .reserve_count = (uint32_t)anon_reserve_top,
+        .who = get_tid(tcb)
+    };
+
+    // The faulting thread must not block here, so if the pager isn't ready, then
+    // try again on the next fault.
+
+    if(tcb->pager != NULL_TID && send_message(tcb, tcb->pager, MEMORY_MSG, MSG_KERNEL | MSG_NOBLOCK,
+                                              &message_data, sizeof message_data) == E_OK) {
+        reserve_low_notified = true;
+    }
+}
+
+/**
+ Attempt to resolve a page fault on a delegated anonymous region.
+
+ The fault must have occurred in the current address space.
+
+ @param tcb The faulting thread.
+ @param fault_addr The faulting address (from CR2).
+ @param error_code The page fault error code.
+ @return `E_OK` if the fault was resolved and the thread may resume. `E_FAIL` if the
+ fault needs to be handled by the pager.
+ */
+int handle_anon_fault(tcb_t *tcb, addr_t fault_addr, uint32_t error_code)
+{
+    addr_t page_addr = ALIGN_DOWN(fault_addr, PAGE_SIZE);
+    pde_t* pde = CURRENT_PDE(page_addr);
+    pte_t* pte = CURRENT_PTE(page_addr);
+    struct AnonAddrSpace* space;
+    bool in_region = false;
+
+    if(IS_FLAG_SET(error_code, PAGING_ERR_PRES) || !IS_FLAG_SET(error_code, PAGING_ERR_USER)) {
+        return E_FAIL;
+    }
+
+    space = find_addr_space(tcb->root_pmap & CR3_BASE_MASK, false);
+
+    if(!space) {
+        return E_FAIL;
+    }
+
+    for(size_t i = 0; i < space->region_count; i++) {
+        if(page_addr >= space->regions[i].start && page_addr < space->regions[i].end) {
+            in_region = true;
+            break;
+        }
+    }
+
+    if(!in_region) {
+        return E_FAIL;
+    }
+
+    // A non-zero, non-present entry refers to a page that the pager has swapped out.
+
+    if(pde->is_present) {
+        if(pde->is_page_sized || pte->value != 0 || anon_reserve_top == 0) {
+            return E_FAIL;
+        }
+    } else {
+        if(pde->value != 0 || anon_reserve_top < 2) {
+            return E_FAIL;
+        }
+
+        pde_t new_pde = {
+            .base = anon_reserve[--anon_reserve_top],
+            .is_read_write = 1,
+            .is_user = 1,
+            .is_present = 1
+        };
+
+        *pde = new_pde;
+
+        // Clear the new page table through the recursive mapping
+
+        invalidate_page((addr_t)pte);
+        memset((void *)ALIGN_DOWN((addr_t)pte, PAGE_SIZE), 0, PAGE_SIZE);
+    }
+
+    pte_t new_pte = {
+        .base = anon_reserve[--anon_reserve_top],
+        .is_read_write = 1,
+        .is_user = 1,
+        .is_present = 1
+    };
+
+    *pte = new_pte;
+    memset((void *)page_addr, 0, PAGE_SIZE);
+
+    if(anon_reserve_top < ANON_RESERVE_LOW && !reserve_low_notified) {
+        notify_reserve_low(tcb);
+    }
+
+    return E_OK;
+}
+
+/**
+ Send a page fault to the faulting thread's pager and block the thread until the
+ pager replies.
+
+ The message is built from the thread's TCB, so if the pager isn't ready to receive,
+ the thread waits in the pager's sender queue like any other kernel message.
+
+ @param tcb The faulting thread. It must be the current thread.
+ @param state The user state of the thread at the time of the fault.
+ @param fault_address The faulting address (from CR2).
+ @param error_code The page fault error code.
+ @return Does not return on success. `E_UNREACH` if the thread has no pager.
+ `E_FAIL` if the message couldn't be sent.
+ */
+int send_page_fault(tcb_t *tcb, const ExecutionState *state, addr_t fault_address, uint32_t error_code)
+{
+    tcb_t* pager = get_tcb(tcb->pager);
+    struct PageFaultMessage message_data = {
+        .fault_address = fault_address,
+        .error_code = error_code,
+        .eip = state->eip,
+        .who = get_tid(tcb)
+    };
+
+    if(!pager) {
+        RET_MSG(E_UNREACH, "Thread doesn't have a pager.");
+    }
+
+    switch(send_message(tcb, tcb->pager, PAGE_FAULT_MSG, MSG_KERNEL | MSG_NOBLOCK,
+                        &message_data, sizeof message_data)) {
+        case E_OK:
+            if(IS_ERROR(thread_pause(tcb))) {
+                RET_MSG(E_FAIL, "Unable to pause faulting thread.");
+            }
+            break;
+        case E_BLOCK:
+            if(IS_ERROR(thread_remove_from_list(tcb))) {
+                RET_MSG(E_FAIL, "Unable to detach faulting thread from run queue.");
+            }
+
+            attach_sender_wait_queue(tcb, pager);
+            tcb->wait_for_kernel_msg = 1;
+            break;
+        default:
+            RET_MSG(E_FAIL, "Unable to send page fault message to pager.");
+    }
+
+    // send_message() may have written to the sender's registers, so save the state afterwards
+
+    tcb->user_exec_state = *state;
+    tcb->fault_address = fault_address;
+    tcb->fault_error_code = error_code;
+    tcb->wait_for_fault_reply = 1;
+
+    thread_switch_context(schedule(processor_get_current()), true);
+
+    // Does not return
+    UNREACHABLE;
+
+    return E_FAIL;
+}
+
+/**
+ Install the mapping described by a pager's reply to a page fault and restart the
+ faulting thread.
+
+ Any thread in the pager's address space may reply, so that a multithreaded pager can
+ resolve faults on whichever thread handled them.
+
+ @param pager The thread that sent the reply.
+ @param tid The TID of the faulting thread.
+ @param reply The mapping descriptor.
+ @param reply_length The length of the reply, in bytes.
+ @return `E_OK` on success. `E_INVALID_ARG` if the thread isn't waiting on a page fault
+ reply or the descriptor is malformed. `E_PERM` if the sender isn't the thread's pager
+ or a thread in the same address space.
+ `E_OVERWRITE` if a page in the range is already mapped and `PM_OVERWRITE` isn't set.
+ `E_NOT_MAPPED` if a page table is needed, but the frame reserve is empty. `E_FAIL` on
+ failure.
+ */
+int reply_page_fault(tcb_t *pager, tid_t tid, const struct PageFaultReply *reply, size_t reply_length)
+{
+    tcb_t* thread = get_tcb(tid);
+    tcb_t* thread_pager;
+    int result;
+
+    if(!thread || !thread->wait_for_fault_reply || thread->thread_state != PAUSED) {
+        RET_MSG(E_INVALID_ARG, "Thread isn't waiting for a page fault reply.");
+    }
+
+    thread_pager = get_tcb(thread->pager);
+
+    if(thread->pager != get_tid(pager)
+       && (!thread_pager || (thread_pager->root_pmap & CR3_BASE_MASK) != (pager->root_pmap & CR3_BASE_MASK))) {
+        RET_MSG(E_PERM, "Only a thread's pager may reply to its page faults.");
+    } else if(!reply || reply_length < sizeof *reply) {
+        RET_MSG(E_INVALID_ARG, "Page fault reply is too short.");
+    }
+
+    if(!IS_FLAG_SET(reply->flags, PM_UNMAPPED)) {
+        result = IS_FLAG_SET(reply->flags, PM_PAGE_SIZED) ? map_fault_large_page(thread, reply)
+                 : map_fault_pages(thread, reply);
+
+        if(result != E_OK) {
+            return result;
+        }
+    }
+
+    thread->wait_for_fault_reply = 0;
+
+    if(IS_ERROR(thread_start(thread))) {
+        RET_MSG(E_FAIL, "Unable to restart faulting thread.");
+    }
+
+    return E_OK;
+}
+
+static int map_fault_pages(tcb_t *thread, const struct PageFaultReply *reply)
+{
+    paddr_t root_pmap = thread->root_pmap & CR3_BASE_MASK;
+    addr_t fault_page = ALIGN_DOWN(thread->fault_address, PAGE_SIZE);
+    addr_t start = reply->start;
+    addr_t end = start + reply->count * PAGE_SIZE;
+    bool is_current = root_pmap == get_root_page_map();
+    bool overwrite = IS_FLAG_SET(reply->flags, PM_OVERWRITE);
+    pde_t pde;
+    pte_t* page_table = (pte_t*)KERNEL_TEMP_START;
+
+    if(reply->count == 0 || reply->count > PAGE_TABLE_SIZE / PAGE_SIZE || !IS_ALIGNED(start, PAGE_SIZE)
+       || end <= start || fault_page < start || fault_page >= end
+       || PDE_INDEX(start) != PDE_INDEX(end - PAGE_SIZE)
+       || end > ALIGN_DOWN(KERNEL_VSTART, PAGE_TABLE_SIZE)
+       || reply->frame >= (1ul << 20) || reply->count > (1ul << 20) - reply->frame) {
+        RET_MSG(E_INVALID_ARG, "Invalid page range in page fault reply.");
+    }
+
+    if(IS_ERROR(read_pde(&pde, PDE_INDEX(start), root_pmap))) {
+        RET_MSG(E_FAIL, "Unable to read PDE.");
+    }
+
+    if(pde.is_present && (pde.is_page_sized || !pde.is_user)) {
+        RET_MSG(E_OVERWRITE, "Page fault reply overlaps a large page or kernel page table.");
+    } else if(!pde.is_present) {
+        pbase_t table_frame;
+
+        if(pde.value != 0 && !overwrite) {
+            RET_MSG(E_OVERWRITE, "Page directory entry is in use.");
+        } else if(!anon_reserve_take(&table_frame)) {
+            RET_MSG(E_NOT_MAPPED, "No frames are available for a new page table.");
+        } else if(clear_phys_frames(PBASE_TO_PADDR(table_frame), 1) != 1) {
+            anon_reserve[anon_reserve_top++] = table_frame;
+            RET_MSG(E_FAIL, "Unable to clear new page table.");
+        }
+
+        pde = (pde_t){
+            .base = table_frame,
+            .is_read_write = 1,
+            .is_user = 1,
+            .is_present = 1
+        };
+
+        if(IS_ERROR(write_pde(PDE_INDEX(start), pde, root_pmap))) {
+            RET_MSG(E_FAIL, "Unable to write PDE.");
+        }
+    }
+
+    if(map_temp((addr_t)page_table, PBASE_TO_PADDR(pde.base), 1) != 1) {
+        RET_MSG(E_FAIL, "Unable to map page table.");
+    }
+
+    if(!overwrite) {
+        for(size_t i = 0; i < reply->count; i++) {
+            if(page_table[PTE_INDEX(start) + i].is_present) {
+                if(unmap_temp((addr_t)page_table, 1) != 1) {
+                    RET_MSG(E_FAIL, "Unable to unmap page table.");
+                }
+
+                RET_MSG(E_OVERWRITE, "Page is already mapped.");
+            }
+        }
+    }
+
+    for(size_t i = 0; i < reply->count; i++) {
+        pte_t* pte = &page_table[PTE_INDEX(start) + i];
+        bool was_present = !!pte->is_present;
+
+        *pte = (pte_t){
+            .base = (paging_table_entry_t)(reply->frame + i),
+            .is_read_write = !IS_FLAG_SET(reply->flags, PM_READ_ONLY),
+            .is_user = 1,
+            .pcd = IS_FLAG_SET(reply->flags, PM_UNCACHED),
+            .pwt = IS_FLAG_SET(reply->flags, PM_WRITETHRU),
+            .dirty = IS_FLAG_SET(reply->flags, PM_DIRTY),
+            .is_present = 1
+        };
+
+        if(was_present && is_current) {
+            invalidate_page(start + i * PAGE_SIZE);
+        }
+    }
+
+    if(unmap_temp((addr_t)page_table, 1) != 1) {
+        RET_MSG(E_FAIL, "Unable to unmap page table.");
+    }
+
+    return E_OK;
+}
+
+static int map_fault_large_page(tcb_t *thread, const struct PageFaultReply *reply)
+{
+    paddr_t root_pmap = thread->root_pmap & CR3_BASE_MASK;
+    addr_t start = ALIGN_DOWN(thread->fault_address, LARGE_PAGE_SIZE);
+    pmap_entry_t entry;
+
+    if(reply->count > 1 || !IS_ALIGNED(reply->frame, LARGE_PAGE_SIZE / PAGE_SIZE)
+       || reply->frame >= (1ul << 28) || start >= ALIGN_DOWN(KERNEL_VSTART, PAGE_TABLE_SIZE)) {
+        RET_MSG(E_INVALID_ARG, "Invalid large page in page fault reply.");
+    }
+
+    if(IS_ERROR(read_pmap_entry(root_pmap, PDE_INDEX(start), &entry))) {
+        RET_MSG(E_FAIL, "Unable to read PDE.");
+    }
+
+    // Replacing a page table would leak it, so the pager has to unmap it first
+
+    if(entry.pde.is_present && !entry.pde.is_page_sized) {
+        RET_MSG(E_OVERWRITE, "Page fault reply overlaps a page table.");
+    } else if(entry.value != 0 && !IS_FLAG_SET(reply->flags, PM_OVERWRITE)) {
+        RET_MSG(E_OVERWRITE, "Large page is already mapped.");
+    }
+
+    bool was_present = !!entry.pde.is_present;
+
+    entry.value = 0;
+    entry.large_pde.is_present = 1;
+    entry.large_pde.is_read_write = !IS_FLAG_SET(reply->flags, PM_READ_ONLY);
+    entry.large_pde.is_user = 1;
+    entry.large_pde.pcd = IS_FLAG_SET(reply->flags, PM_UNCACHED);
+    entry.large_pde.pwt = IS_FLAG_SET(reply->flags, PM_WRITETHRU);
+    entry.large_pde.dirty = IS_FLAG_SET(reply->flags, PM_DIRTY);
+    entry.large_pde.is_page_sized = 1;
+    set_large_pde_base(&entry.large_pde, reply->frame);
+
+    if(IS_ERROR(write_pmap_entry(root_pmap, PDE_INDEX(start), entry))) {
+        RET_MSG(E_FAIL, "Unable to write PDE.");
+    }
+
+    if(was_present && root_pmap == get_root_page_map()) {
+        invalidate_page(start);
+    }
+
+    return E_OK;
+}
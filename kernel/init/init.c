@@ -148,6 +148,17 @@ DISC_DATA void* kboot_stack_top = kboot_stack + sizeof kboot_stack;
 
 DISC_DATA bool apic_calibrated = false;
 DISC_DATA unsigned int apic_ticks = 0;
+
+#define MAX_BOOT_MARKS          16
+
+// The time-stamp counter at the end of each boot phase
+struct BootMark {
+    const char* phase;
+    uint64_t tsc;
+};
+
+DISC_DATA static struct BootMark boot_marks[MAX_BOOT_MARKS];
+DISC_DATA static size_t boot_mark_count = 0;
 DISC_CODE NAKED noreturn void pit_handler(void);
 DISC_CODE uint16_t get_pit_count(void);
 
@@ -168,6 +179,10 @@ DISC_CODE void add_idt_entry(void (*f)(void), unsigned int entry_num,
     unsigned int dpl);
 DISC_CODE void load_idt(void);
 DISC_CODE void init_apic_timer(void);
+DISC_CODE static unsigned int calibrate_apic_with_tsc(uint64_t tsc_hz);
+DISC_CODE static unsigned int calibrate_apic_with_pit(void);
+DISC_CODE static void mark_boot_phase(const char* phase);
+DISC_CODE static void dump_boot_timeline(void);
 DISC_CODE int enable_apic(void);
 DISC_CODE int setup_pit_sleep(unsigned int microseconds);
 
@@ -240,69 +255,133 @@ void init_pic(void)
 
 /* Various call once functions */
 
+/* Records the time-stamp counter at the end of a boot phase. */
+
+void mark_boot_phase(const char* phase)
+{
+    if(boot_mark_count < MAX_BOOT_MARKS) {
+        boot_marks[boot_mark_count].phase = phase;
+        boot_marks[boot_mark_count].tsc = __rdtsc();
+        boot_mark_count++;
+    }
+}
+
+/* Prints how long each boot phase took. The init server prints the rest of the
+   timeline from the same counter. */
+
+void dump_boot_timeline(void)
+{
+    kprintfln("Boot timeline (TSC cycles):");
+
+    for(size_t i = 0; i < boot_mark_count; i++) {
+        kprintfln("  %-16s %20llu (+%llu)", boot_marks[i].phase, boot_marks[i].tsc,
+                  i == 0 ? 0ull : boot_marks[i].tsc - boot_marks[i-1].tsc);
+    }
+}
+
+/* The LAPIC timer needs the number of ticks that it counts in 10 ms (divided by 2).
+
+   If CPUID reports the core crystal clock's frequency, then that's the timer's
+   frequency, and nothing needs to be measured. If it only reports the TSC's
+   frequency, then the timer is timed against the TSC for 1 ms. Otherwise, it's timed
+   against the PIT for 10 ms. */
+
 void init_apic_timer(void)
 {
     apic_ptr_t timer_reg = LAPIC_REG(LAPIC_TIMER);
     apic_ptr_t timer_div_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_DCR);
-    apic_ptr_t init_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_IC);
-    apic_ptr_t current_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_CC);
+    unsigned int max_leaf, a, b, c, d;
+    uint64_t tsc_hz = 0;
 
     *timer_reg = LAPIC_ONESHOT | LAPIC_MASKED | IRQ(0);
     *timer_div_reg = 0b0000; // Divide by 2
 
-    #define NUM_ITERS   10
-    unsigned int counts[NUM_ITERS];
+    __cpuid(0, max_leaf, b, c, d);
+
+    if(max_leaf >= 0x15) {
+        // eax: TSC/crystal ratio denominator, ebx: numerator, ecx: crystal frequency in Hz
+        __cpuid(0x15, a, b, c, d);
+
+        if(a && b && c) {
+            apic_ticks = c / 2 / 100;
+            apic_calibrated = true;
 
-    for(int i=0; i < NUM_ITERS; i++) {
-        counts[i] = 0xFFFFFFFFu;
+            kprintfln("Number of ticks in 10 ms (from CPUID): %u", apic_ticks);
+            return;
+        }
     }
 
-    int a, b, c, d;
+    if(max_leaf >= 0x16) {
+        // eax: processor base frequency in MHz
+        __cpuid(0x16, a, b, c, d);
+        tsc_hz = (uint64_t)(a & 0xFFFFu) * 1000000u;
+    }
 
-    for(int i=0; i < NUM_ITERS; i++) {
-        // Don't reorder these stores
-        __cpuid(0, a, b, c, d);
+    if(tsc_hz) {
+        apic_ticks = calibrate_apic_with_tsc(tsc_hz);
+        kprintfln("Number of ticks in 10 ms (against the TSC): %u", apic_ticks);
+    } else {
+        apic_ticks = calibrate_apic_with_pit();
+        kprintfln("Number of ticks in 10 ms (against the PIT): %u", apic_ticks);
+    }
 
-        setup_pit_sleep(10000);
+    apic_calibrated = true;
+}
 
-        __cpuid(0, a, b, c, d);
+unsigned int calibrate_apic_with_tsc(uint64_t tsc_hz)
+{
+    apic_ptr_t init_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_IC);
+    apic_ptr_t current_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_CC);
+    uint64_t tsc_per_ms = tsc_hz / 1000u;
+    unsigned int a, b, c, d;
 
-        *init_count_reg = 0xFFFFFFFFu;
+    __cpuid(0, a, b, c, d);
 
-        __cpuid(0, a, b, c, d);
+    *init_count_reg = 0xFFFFFFFFu;
+    uint64_t start = __rdtsc();
 
+    while(__rdtsc() - start < tsc_per_ms)
+        ;
 
-        //enable_irq(0);
-        //enable_int();
+    unsigned int count = 0xFFFFFFFFu - *current_count_reg;
 
-        out_port8((uint16_t)TIMER0, (uint8_t)(C_SELECT0 | C_MODE0 | BIN_COUNTER | RWL_FORMAT0));
+    __cpuid(0, a, b, c, d);
 
-        // Wait for the pit count to equal 0
+    return count * 10;
+}
 
-        uint16_t low, hi;
+unsigned int calibrate_apic_with_pit(void)
+{
+    apic_ptr_t init_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_IC);
+    apic_ptr_t current_count_reg = (apic_ptr_t)LAPIC_REG(LAPIC_TIMER_CC);
+    unsigned int a, b, c, d;
+    uint16_t low, hi;
 
-        while(true) {
-            low = in_port8((uint16_t)TIMER0);
-            hi = in_port8((uint16_t)TIMER0);
+    // Don't reorder these stores
+    __cpuid(0, a, b, c, d);
 
-            if(!low && !hi) break;
-        }
+    setup_pit_sleep(10000);
 
-        __cpuid(0, a, b, c, d);
+    __cpuid(0, a, b, c, d);
 
-        counts[i] -= *current_count_reg;
-    }
+    *init_count_reg = 0xFFFFFFFFu;
+
+    __cpuid(0, a, b, c, d);
+
+    out_port8((uint16_t)TIMER0, (uint8_t)(C_SELECT0 | C_MODE0 | BIN_COUNTER | RWL_FORMAT0));
 
-    apic_ticks = 0;
+    // Wait for the pit count to equal 0
 
-    for(int i=0; i < NUM_ITERS; i++) {
-        apic_ticks += counts[i];
+    while(true) {
+        low = in_port8((uint16_t)TIMER0);
+        hi = in_port8((uint16_t)TIMER0);
+
+        if(!low && !hi) break;
     }
 
-    apic_ticks /= NUM_ITERS;
-    apic_calibrated = true;
+    __cpuid(0, a, b, c, d);
 
-    kprintfln("Avg. number of ticks in 10 ms: %u", apic_ticks);
+    return 0xFFFFFFFFu - *current_count_reg;
 }
 
 int enable_apic(void)
@@ -600,11 +679,15 @@ void show_cpu_features(void)
  */
 void init(multiboot_info_t* info)
 {
+    mark_boot_phase("start");
+
     /* Initialize memory */
 
     if(IS_ERROR(init_memory(info)))
         stop_init("Unable to initialize memory.");
 
+    mark_boot_phase("memory");
+
     info = (multiboot_info_t*)PHYS_TO_VIRT((addr_t)info);
     multiboot_info = info;
 
@@ -619,6 +702,7 @@ void init(multiboot_info_t* info)
 
     kprintfln("Initializing interrupt handling.");
     init_interrupts();
+    mark_boot_phase("interrupts");
 
     int retval = read_acpi_tables();
 
@@ -631,11 +715,16 @@ void init(multiboot_info_t* info)
             num_processors = 1;
     }
 
+    mark_boot_phase("acpi");
+
     kprintfln("Initializing APIC.");
     enable_apic();
 
+    mark_boot_phase("apic");
+
     kprintfln("Initializing timer.");
     init_apic_timer();
+    mark_boot_phase("timer");
 
     // Restory IRQ 0 handler
     //add_idt_entry(IRQ_ISRS[0], IRQ(0), 0);
@@ -650,6 +739,8 @@ void init(multiboot_info_t* info)
         stop_init("A module for the initial server indicated by the --initsrv flag must be loaded.");
     }
 
+    mark_boot_phase("init server");
+
     /* Release the pages for the code and data that will never be used again. */
 
     for(addr_t addr = (addr_t)EXT_PTR(kdcode); addr < (addr_t)EXT_PTR(kbss);
@@ -666,6 +757,9 @@ void init(multiboot_info_t* info)
     // Set initial SSE state
     //_fxrstor(init_server_thread->fxsave_state);
 
+    mark_boot_phase("sysenter");
+    dump_boot_timeline();
+
     kprintfln("Context switching...");
 
     thread_switch_context(schedule(0), false);
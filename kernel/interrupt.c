@@ -7,6 +7,7 @@
 #include <kernel/paging.h>
 #include <kernel/interrupt.h>
 #include <kernel/error.h>
+#include <kernel/fault.h>
 #include <os/msg/kernel.h>
 #include <os/msg/init.h>
 #include <kernel/bits.h>
@@ -279,6 +280,12 @@ void handle_cpu_exception(struct CpuExInterruptFrame* interrupt_frame)
                 kprintfln("Failed to release thread.");
             }
         }
+    } else if(interrupt_frame->ex_num == 14 && interrupt_frame->state.cs == UCODE_SEL
+              && handle_anon_fault(tcb, get_cr2(), interrupt_frame->error_code) == E_OK) {
+        // First-touch fault on an anonymous region. Resume the thread without involving the pager.
+    } else if(interrupt_frame->ex_num == 14 && interrupt_frame->state.cs == UCODE_SEL && tcb->pager != NULL_TID
+              && send_page_fault(tcb, &interrupt_frame->state, get_cr2(), interrupt_frame->error_code) == E_OK) {
+        // Not reached. The thread stays blocked until its pager replies to the fault.
     } else {
         struct ExceptionMessage message_data = {
             .eax = interrupt_frame->state.eax,
@@ -1,11 +1,13 @@
 #include <kernel/bits.h>
 #include <kernel/debug.h>
+#include <kernel/endpoint.h>
 #include <kernel/error.h>
 #include <kernel/memory.h>
 #include <kernel/message.h>
 #include <kernel/mm.h>
 #include <kernel/schedule.h>
 #include <kernel/thread.h>
+#include <os/msg/kernel.h>
 #include <os/syscalls.h>
 
 /** Attach a sending thread to a recipient's send queue. The sender will then enter
@@ -54,6 +56,12 @@ NON_NULL_PARAM(1) void attach_receiver_wait_queue(tcb_t* recipient, tcb_t *sende
  */
 NON_NULL_PARAMS void detach_sender_wait_queue(tcb_t* sender)
 {
+    if(sender->wait_endpoint != NULL_ENDPOINT) {
+        sender->wait_tid = NULL_TID;
+        endpoint_detach(sender);
+        return;
+    }
+
     tcb_t* recipient = get_tcb(sender->wait_tid);
     sender->wait_tid = NULL_TID;
 
@@ -69,6 +77,12 @@ NON_NULL_PARAMS void detach_sender_wait_queue(tcb_t* sender)
  */
 NON_NULL_PARAMS void detach_receiver_wait_queue(tcb_t* recipient)
 {
+    if(recipient->wait_endpoint != NULL_ENDPOINT) {
+        recipient->wait_tid = NULL_TID;
+        endpoint_detach(recipient);
+        return;
+    }
+
     tcb_t* sender = get_tcb(recipient->wait_tid);
     recipient->wait_tid = NULL_TID;
 
@@ -320,6 +334,34 @@ WARN_UNUSED NON_NULL_PARAM(1) int receive_message(tcb_t *recipient, tid_t sender
     if(sender && sender->thread_state == WAIT_FOR_RECV && (sender->wait_for_kernel_msg || sender->wait_tid == recipient_tid || (!is_expecting_kernel_msg && sender->wait_tid == ANY_RECIPIENT))) {
         // kprintf("%d: Receiving message...\n", recipient_tid);
 
+        if(sender->wait_for_fault_reply) {
+            // The faulting thread's registers hold its user state rather than a send buffer,
+            // so the message is built from the fault recorded in its TCB. The thread stays
+            // paused until its pager replies.
+
+            struct PageFaultMessage message_data = {
+                .fault_address = sender->fault_address,
+                .error_code = sender->fault_error_code,
+                .eip = sender->user_exec_state.eip,
+                .who = sender_tid
+            };
+
+            actually_recv = MIN(sizeof message_data, recv_buffer_length);
+            memcpy(recv_buffer, &message_data, actually_recv);
+
+            if(IS_ERROR(thread_pause(sender))) {
+                RET_MSG(E_FAIL, "Unable to pause faulting thread.");
+            }
+
+            sender->wait_for_kernel_msg = 0;
+
+            recipient->user_exec_state.ebx = (uint32_t)KERNEL_TID | ((uint32_t)(MSG_KERNEL | MSG_NOBLOCK) << 16);
+            recipient->user_exec_state.esi = PAGE_FAULT_MSG;
+            recipient->user_exec_state.edi = actually_recv;
+
+            return E_OK;
+        }
+
         addr_t send_buffer = (addr_t)sender->user_exec_state.ebx; // Contains the send buffer (set by this function during the send)
         size_t send_buffer_length = (size_t)sender->user_exec_state.edi; // Contains the send buffer count (also set during the send)
 
@@ -353,10 +395,10 @@ WARN_UNUSED NON_NULL_PARAM(1) int receive_message(tcb_t *recipient, tid_t sender
     {
         // kprintf("%d: Waiting to receive from %d\n", recipient_tid, msg->sender);
 
-        if(IS_ERROR(thread_remove_from_list(sender)))
+        if(IS_ERROR(thread_remove_from_list(recipient)))
             RET_MSG(E_FAIL, "Unable to detach recipient from run queue.");
 
-        attach_receiver_wait_queue(sender, recipient);
+        attach_receiver_wait_queue(recipient, sender);
 
         recipient->wait_for_kernel_msg = is_expecting_kernel_msg;
 
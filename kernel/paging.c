@@ -144,6 +144,106 @@ int initialize_root_pmap(paddr_t pmap)
     return E_OK;
 }
 
+/**
+ Removes every user mapping from a page directory.
+
+ The page directory and each of its page tables are mapped only once, so tearing down
+ an address space takes a single pass over its page tables. The frames that were mapped
+ and the page tables that are no longer needed are handed back to the caller. A page
+ table is only removed if all of its frames fit into `frames`, so a full buffer leaves
+ the remaining PDEs in place for the next call.
+
+ The page directory must not be in use by a running thread, since no TLB entries
+ are flushed.
+
+ @param pdir The physical address of the page directory.
+ @param frames Receives the frames of the 4 KiB pages and the removed page tables.
+ @param frame_count The length of `frames`. Set to the number of frames that were written.
+ @param large_frames Receives the first frame of each removed 4 MiB page.
+ @param large_count The length of `large_frames`. Set to the number of frames that were written.
+ @return `E_OK` if every user mapping has been removed. `E_BOUNDS` if a buffer filled
+ up first. `E_FAIL` on failure.
+ */
+int destroy_user_mappings(paddr_t pdir, pbase_t *frames, size_t *frame_count,
+    pbase_t *large_frames, size_t *large_count)
+{
+    pde_t *pdes = (pde_t *)KERNEL_TEMP_START;
+    pte_t *ptes = (pte_t *)(KERNEL_TEMP_START + PAGE_SIZE);
+    size_t frames_left = *frame_count;
+    size_t large_left = *large_count;
+    int ret_val = E_OK;
+
+    *frame_count = 0;
+    *large_count = 0;
+
+    if(map_temp((addr_t)pdes, pdir, 1) < 1) {
+        RET_MSG(E_FAIL, "Unable to map page directory.");
+    }
+
+    for(unsigned int i = 0; i < PDE_INDEX(KERNEL_VSTART); i++) {
+        pde_t pde = pdes[i];
+
+        if(!pde.is_present) {
+            continue;
+        }
+
+        if(pde.is_page_sized) {
+            if(large_left == 0) {
+                ret_val = E_BOUNDS;
+                break;
+            }
+
+            large_frames[(*large_count)++] = get_pde_frame_number(pde);
+            large_left--;
+            pdes[i].value = 0;
+            continue;
+        }
+
+        if(map_temp((addr_t)ptes, PBASE_TO_PADDR(pde.base), 1) < 1) {
+            ret_val = E_FAIL;
+            break;
+        }
+
+        size_t present_count = 0;
+
+        for(unsigned int j = 0; j < PTE_ENTRY_COUNT; j++) {
+            if(ptes[j].is_present) {
+                present_count++;
+            }
+        }
+
+        // The page table itself needs an entry, too
+
+        if(present_count + 1 > frames_left) {
+            ret_val = E_BOUNDS;
+        } else {
+            for(unsigned int j = 0; j < PTE_ENTRY_COUNT; j++) {
+                if(ptes[j].is_present) {
+                    frames[(*frame_count)++] = (pbase_t)ptes[j].base;
+                }
+            }
+
+            frames[(*frame_count)++] = (pbase_t)pde.base;
+            frames_left -= present_count + 1;
+            pdes[i].value = 0;
+        }
+
+        if(unmap_temp((addr_t)ptes, 1) != 1 && ret_val == E_OK) {
+            ret_val = E_FAIL;
+        }
+
+        if(ret_val != E_OK) {
+            break;
+        }
+    }
+
+    if(unmap_temp((addr_t)pdes, 1) != 1) {
+        RET_MSG(E_FAIL, "Unable to unmap page directory.");
+    }
+
+    return ret_val;
+}
+
 /**
  * Is a particular address in an address space accessible by the user?
  *
@@ -1,6 +1,8 @@
 #include <kernel/bits.h>
 #include <kernel/debug.h>
+#include <kernel/endpoint.h>
 #include <kernel/error.h>
+#include <kernel/fault.h>
 #include <kernel/interrupt.h>
 #include <kernel/lowlevel.h>
 #include <kernel/memory.h>
@@ -52,6 +54,7 @@ static int handle_sys_send(syscall_args_t args);
 static int handle_sys_receive(syscall_args_t args);
 static int handle_sys_read_page_mappings(SysReadPageMappingsArgs* args);
 static int handle_sys_update_page_mappings(SysUpdatePageMappingsArgs* args);
+static int handle_sys_destroy_page_mappings(SysDestroyPageMappingsArgs* args);
 
 static int handle_sys_create_tcb(SysCreateTcbArgs* args);
 static int handle_sys_read_tcb(SysReadTcbArgs* args);
@@ -63,6 +66,16 @@ static int handle_sys_read_int(SysReadIntArgs* args);
 static int handle_sys_update_int(SysUpdateIntArgs* args);
 static int handle_sys_destroy_int(SysDestroyIntArgs* args);
 
+static int handle_sys_create_cap(void);
+static int handle_sys_read_cap(SysReadCapArgs* args);
+static int handle_sys_update_cap(SysUpdateCapArgs* args);
+static int handle_sys_destroy_cap(SysDestroyCapArgs* args);
+
+static int handle_sys_create_anon_region(SysCreateAnonRegionArgs* args);
+static int handle_sys_read_anon_region(SysReadAnonRegionArgs* args);
+static int handle_sys_update_anon_region(SysUpdateAnonRegionArgs* args);
+static int handle_sys_destroy_anon_region(SysDestroyAnonRegionArgs* args);
+
 static int handle_sys_sleep(syscall_args_t args);
 
 #define ARG_RES_TYPE    (SysResource)args.arg1
@@ -74,8 +87,11 @@ static int handle_sys_create(syscall_args_t args)
             return handle_sys_create_tcb(ARG_ARGS);
         case RES_INT:
             return handle_sys_create_int(ARG_ARGS);
-        case RES_PAGE_MAPPING:
         case RES_CAP:
+            return handle_sys_create_cap();
+        case RES_ANON_REGION:
+            return handle_sys_create_anon_region(ARG_ARGS);
+        case RES_PAGE_MAPPING:
         default:
             return ESYS_NOTIMPL;
     }
@@ -95,6 +111,9 @@ static int handle_sys_read(syscall_args_t args)
         case RES_TCB:
             return handle_sys_read_tcb(ARG_ARGS);
         case RES_CAP:
+            return handle_sys_read_cap(ARG_ARGS);
+        case RES_ANON_REGION:
+            return handle_sys_read_anon_region(ARG_ARGS);
         default:
             return ESYS_NOTIMPL;
     }
@@ -114,6 +133,9 @@ static int handle_sys_update(syscall_args_t args)
         case RES_TCB:
             return handle_sys_update_tcb(ARG_ARGS);
         case RES_CAP:
+            return handle_sys_update_cap(ARG_ARGS);
+        case RES_ANON_REGION:
+            return handle_sys_update_anon_region(ARG_ARGS);
         default:
             return ESYS_NOTIMPL;
     }
@@ -130,8 +152,12 @@ static int handle_sys_destroy(syscall_args_t args)
             return handle_sys_destroy_tcb(ARG_ARGS);
         case RES_INT:
             return handle_sys_destroy_int(ARG_ARGS);
+        case RES_ANON_REGION:
+            return handle_sys_destroy_anon_region(ARG_ARGS);
         case RES_PAGE_MAPPING:
+            return handle_sys_destroy_page_mappings(ARG_ARGS);
         case RES_CAP:
+            return handle_sys_destroy_cap(ARG_ARGS);
         default:
             return ESYS_NOTIMPL;
     }
@@ -257,7 +283,7 @@ static int handle_sys_read_page_mappings(SysReadPageMappingsArgs* args)
 
                 pte_t pte;
 
-                if(IS_ERROR(read_pte(&pte, PTE_INDEX(args->virt), PDE_BASE(pde)))) {
+                if(IS_ERROR(read_pte(&pte, PTE_INDEX(virt), PDE_BASE(pde)))) {
                     RET_MSG((int)i, "Unable to read PTE.");
                 }
 
@@ -471,6 +497,44 @@ static int handle_sys_update_page_mappings(SysUpdatePageMappingsArgs* args)
     return (int)i;
 }
 
+// arg1 - addr_space
+// arg2 - frames
+// arg3 - frame_count
+// arg4 - large_frames
+// arg5 - large_count
+
+static int handle_sys_destroy_page_mappings(SysDestroyPageMappingsArgs* args)
+{
+    paddr_t page_dir = (paddr_t)ALIGN_DOWN(args->addr_space, (paddr_t)PAGE_SIZE);
+
+    if(!args->frames || !args->large_frames || page_dir == 0) {
+        return ESYS_ARG;
+    }
+
+    // The TLB isn't flushed, so a thread that still runs in the address space could keep
+    // using the frames after they've been handed back
+
+    if(thread_uses_root_pmap(page_dir)) {
+        RET_MSG(ESYS_PERM, "Address space is still used by a thread.");
+    }
+
+    // Delegated regions would otherwise have their faults resolved in an address space that's gone
+
+    if(IS_ERROR(anon_region_remove(page_dir, 0, 0))) {
+        return ESYS_FAIL;
+    }
+
+    switch(destroy_user_mappings(page_dir, args->frames, &args->frame_count,
+                                 args->large_frames, &args->large_count)) {
+        case E_OK:
+            return ESYS_OK;
+        case E_BOUNDS:
+            return ESYS_NOTREADY;
+        default:
+            return ESYS_FAIL;
+    }
+}
+
 // arg1 - entry
 // arg2 - addr_space
 // arg3 - stack_top
@@ -685,6 +749,114 @@ static int handle_sys_destroy_int(SysDestroyIntArgs* args)
         return E_PERM;
 }
 
+// Capabilities to endpoints. Creating one creates a new endpoint.
+
+static int handle_sys_create_cap(void)
+{
+    int handle = endpoint_create(thread_get_current());
+
+    return IS_ERROR(handle) ? ESYS_FAIL : handle;
+}
+
+static int handle_sys_read_cap(SysReadCapArgs* args)
+{
+    return IS_ERROR(endpoint_read(thread_get_current(), args->handle, &args->rights,
+                                  &args->waiting_senders, &args->waiting_receivers))
+        ? ESYS_ARG : ESYS_OK;
+}
+
+static int handle_sys_update_cap(SysUpdateCapArgs* args)
+{
+    tcb_t* target = get_tcb(args->tid);
+
+    if(!target)
+        return ESYS_ARG;
+
+    int handle = endpoint_grant(thread_get_current(), args->handle, target, args->rights);
+
+    switch(handle) {
+        case E_PERM:
+            return ESYS_PERM;
+        case E_INVALID_ARG:
+        case E_UNREACH:
+            return ESYS_ARG;
+        case E_FAIL:
+            return ESYS_FAIL;
+        default:
+            return handle;
+    }
+}
+
+static int handle_sys_destroy_cap(SysDestroyCapArgs* args)
+{
+    return IS_ERROR(endpoint_revoke(thread_get_current(), args->handle)) ? ESYS_ARG : ESYS_OK;
+}
+
+// arg1 - addr_space
+// arg2 - start
+// arg3 - length
+
+static int handle_sys_create_anon_region(SysCreateAnonRegionArgs* args)
+{
+    paddr_t addr_space = args->addr_space == CURRENT_ROOT_PMAP ? thread_get_current()->root_pmap : args->addr_space;
+
+    if(args->length == 0 || args->start + args->length < args->start) {
+        return ESYS_ARG;
+    }
+
+    switch(anon_region_add(addr_space & CR3_BASE_MASK, args->start, args->start + args->length)) {
+        case E_OK:
+            return ESYS_OK;
+        case E_INVALID_ARG:
+            return ESYS_ARG;
+        default:
+            return ESYS_FAIL;
+    }
+}
+
+// arg1 - frames
+// arg2 - count
+
+static int handle_sys_read_anon_region(SysReadAnonRegionArgs* args)
+{
+    if(!args->frames) {
+        return (int)anon_reserve_count();
+    }
+
+    return (int)anon_reserve_withdraw(args->frames, args->count);
+}
+
+// arg1 - frames
+// arg2 - count
+
+static int handle_sys_update_anon_region(SysUpdateAnonRegionArgs* args)
+{
+    // XXX: Physical frames need to be checked by the kernel in order to prevent
+    // the user from mapping arbitrary addresses.
+
+    if(!args->frames) {
+        return ESYS_ARG;
+    }
+
+    return (int)anon_reserve_donate(args->frames, args->count);
+}
+
+// arg1 - addr_space
+// arg2 - start
+// arg3 - length (revokes every region if both start and length are 0)
+
+static int handle_sys_destroy_anon_region(SysDestroyAnonRegionArgs* args)
+{
+    paddr_t addr_space = args->addr_space == CURRENT_ROOT_PMAP ? thread_get_current()->root_pmap : args->addr_space;
+
+    if(args->start + args->length < args->start || (args->length == 0 && args->start != 0)) {
+        return ESYS_ARG;
+    }
+
+    return IS_ERROR(anon_region_remove(addr_space & CR3_BASE_MASK, args->start, args->start + args->length))
+        ? ESYS_FAIL : ESYS_OK;
+}
+
 // syscall arg - syscall [lowest 8-bits]
 // arg1 - ptr sender message
 // arg2 - ptr to received message
@@ -703,11 +875,38 @@ static int handle_sys_send(syscall_args_t args)
     current_thread->user_exec_state.user_esp = args.user_stack;
     current_thread->user_exec_state.eip = args.return_address;
 
-    switch(send_message(current_thread, recipient_tid, SUBJECT, flags, BUFFER, BUFFER_LENGTH)) {
+    // A pager's reply to a page fault goes to the kernel, which maps the pages and restarts the thread
+
+    if(SUBJECT == PAGE_FAULT_MSG && !IS_FLAG_SET(flags, MSG_ENDPOINT)) {
+        switch(reply_page_fault(current_thread, recipient_tid, BUFFER, BUFFER_LENGTH)) {
+            case E_OK:
+                return ESYS_OK;
+            case E_PERM:
+                return ESYS_PERM;
+            case E_INVALID_ARG:
+            case E_OVERWRITE:
+                return ESYS_ARG;
+            case E_NOT_MAPPED:
+                return ESYS_NOTREADY;
+            case E_FAIL:
+            default:
+                return ESYS_FAIL;
+        }
+    }
+
+    // With `MSG_ENDPOINT`, the recipient is a capability handle rather than a TID
+
+    int result = IS_FLAG_SET(flags, MSG_ENDPOINT)
+        ? endpoint_send(current_thread, (cap_handle_t)recipient_tid, SUBJECT, flags, BUFFER, BUFFER_LENGTH)
+        : send_message(current_thread, recipient_tid, SUBJECT, flags, BUFFER, BUFFER_LENGTH);
+
+    switch(result) {
         case E_OK:
             return ESYS_OK;
         case E_INVALID_ARG:
             return ESYS_ARG;
+        case E_PERM:
+            return ESYS_PERM;
         case E_BLOCK:
             return ESYS_NOTREADY;
         case E_INTERRUPT:
@@ -740,11 +939,17 @@ static int handle_sys_receive(syscall_args_t args)
     current_thread->user_exec_state.user_esp = args.user_stack;
     current_thread->user_exec_state.eip = args.return_address;
 
-    switch(receive_message(current_thread, sender_tid, flags, BUFFER, BUFFER_LENGTH)) {
+    int result = IS_FLAG_SET(flags, MSG_ENDPOINT)
+        ? endpoint_receive(current_thread, (cap_handle_t)sender_tid, flags, BUFFER, BUFFER_LENGTH)
+        : receive_message(current_thread, sender_tid, flags, BUFFER, BUFFER_LENGTH);
+
+    switch(result) {
         case E_OK:
             return ESYS_OK;
         case E_INVALID_ARG:
             return ESYS_ARG;
+        case E_PERM:
+            return ESYS_PERM;
         case E_BLOCK:
             return ESYS_NOTREADY;
         case E_INTERRUPT:
@@ -1,4 +1,5 @@
 #include <kernel/debug.h>
+#include <kernel/endpoint.h>
 #include <kernel/error.h>
 #include <kernel/interrupt.h>
 #include <kernel/lowlevel.h>
@@ -269,6 +270,8 @@ NON_NULL_PARAMS int thread_release(tcb_t* thread)
         }
     }
 
+    endpoint_release_caps(thread);
+
     // Unregister the thread as an exception handler
 
     for(i = 0; i < NUM_IRQS; i++) {
@@ -280,6 +283,30 @@ NON_NULL_PARAMS int thread_release(tcb_t* thread)
     return E_OK;
 }
 
+/**
+ Determines whether an address space is still used by a thread.
+
+ @param root_pmap The physical address of the address space's page directory.
+ @return true if a thread that hasn't been released (including a zombie) uses the
+ page directory. false, otherwise.
+ */
+bool thread_uses_root_pmap(paddr_t root_pmap)
+{
+    bool is_used = false;
+
+    SPINLOCK_ACQUIRE(tcb_table);
+
+    for(size_t i = 0; i < ARRAY_SIZE(LOCK_VAL(tcb_table)) && !is_used; i++) {
+        volatile tcb_t* thread = &LOCK_VAL(tcb_table)[i];
+
+        is_used = thread->thread_state != INACTIVE
+            && (thread->root_pmap & CR3_BASE_MASK) == (root_pmap & CR3_BASE_MASK);
+    }
+
+    SPINLOCK_RELEASE(tcb_table);
+    return is_used;
+}
+
 NON_NULL_PARAMS void thread_switch_context(tcb_t* thread, bool do_fxsave)
 {
     KASSERT(thread->thread_state == RUNNING);
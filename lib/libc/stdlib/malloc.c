@@ -1,4 +1,19 @@
 #pragma GCC diagnostic ignored "-Wduplicated-branches"
+
+/* Large chunks are mapped directly from the init server. Resizing one of them
+   moves its pages instead of copying its contents. */
+
+#include <os/memory.h>
+
+#define MMAP(s)                         mapPages(s)
+#define DIRECT_MMAP(s)                  mapPages(s)
+#define MUNMAP(a, s)                    unmapPages((a), (s))
+#define MREMAP(addr, osz, nsz, mv)      remapPages((addr), (osz), (nsz), (mv))
+
+/* The pages from the init server are already zero-filled, so the /dev/zero
+   fallback (and its cached descriptor) is left out. */
+
+#define MAP_ANONYMOUS                   0
 /*
  This is a version (aka dlmalloc) of malloc/free/realloc written by
  Doug Lea and released to the public domain, as explained at
@@ -0,0 +1,235 @@
+#include <os/lz.h>
+#include <stdint.h>
+#include <string.h>
+
+/* A byte-oriented LZ77 compressor in the style of LZ4.
+
+   The compressed data is a series of sequences. Each sequence starts with a token byte
+   whose upper nibble is the number of literals and whose lower nibble is the length of
+   the match minus MIN_MATCH. A nibble of 15 is followed by more length bytes, which are
+   added up until one of them is less than 255. The literals come next, then the match's
+   offset back from the current position as a little-endian 16-bit value. The last
+   sequence only has literals. */
+
+#define MIN_MATCH       4
+#define MAX_OFFSET      65535u
+#define HASH_BITS       12
+#define NIBBLE_MAX      15
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t length)
+{
+    for(; length >= 255; length -= 255) {
+        if(op >= oend) {
+            return NULL;
+        }
+
+        *op++ = 255;
+    }
+
+    if(op >= oend) {
+        return NULL;
+    }
+
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/** Write a sequence of literals followed by a match.
+ *
+ * @param op The output position.
+ * @param oend The end of the output buffer.
+ * @param literals The literals.
+ * @param literal_length The number of literals.
+ * @param offset The distance back to the start of the match. Zero for the last sequence.
+ * @param match_length The length of the match. Ignored for the last sequence.
+ * @return The new output position. `NULL`, if the sequence doesn't fit.
+ */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals,
+                             size_t literal_length, size_t offset, size_t match_length)
+{
+    uint8_t *token = op;
+    size_t match_code = offset ? match_length - MIN_MATCH : 0;
+
+    if(op >= oend) {
+        return NULL;
+    }
+
+    op++;
+    *token = (uint8_t)(((literal_length < NIBBLE_MAX ? literal_length : NIBBLE_MAX) << 4)
+                       | (match_code < NIBBLE_MAX ? match_code : NIBBLE_MAX));
+
+    if(literal_length >= NIBBLE_MAX && !(op = put_length(op, oend, literal_length - NIBBLE_MAX))) {
+        return NULL;
+    }
+
+    if((size_t)(oend - op) < literal_length) {
+        return NULL;
+    }
+
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if(!offset) {
+        return op;
+    }
+
+    if(oend - op < 2) {
+        return NULL;
+    }
+
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+
+    if(match_code >= NIBBLE_MAX && !(op = put_length(op, oend, match_code - NIBBLE_MAX))) {
+        return NULL;
+    }
+
+    return op;
+}
+
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if(ip >= iend) {
+            return NULL;
+        }
+
+        byte = *ip++;
+        *length += byte;
+    } while(byte == 255);
+
+    return ip;
+}
+
+/** Compress a buffer.
+ *
+ * @param src The data to compress.
+ * @param src_length The length of the data, in bytes. At most `LZ_MAX_INPUT`.
+ * @param dest The buffer for the compressed data.
+ * @param dest_length The size of the buffer, in bytes.
+ * @return The length of the compressed data. Zero, if it doesn't fit in the buffer.
+ */
+size_t lz_compress(const void *src, size_t src_length, void *dest, size_t dest_length)
+{
+    uint16_t table[1u << HASH_BITS];
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + src_length;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dest_length;
+
+    if(src_length > LZ_MAX_INPUT) {
+        return 0;
+    }
+
+    memset(table, 0, sizeof table);
+
+    while(iend - ip >= MIN_MATCH) {
+        uint32_t sequence = read32(ip);
+        uint32_t hash = hash32(sequence);
+        const uint8_t *ref = base + table[hash];
+
+        table[hash] = (uint16_t)(ip - base);
+
+        if(ref < ip && (size_t)(ip - ref) <= MAX_OFFSET && read32(ref) == sequence) {
+            size_t offset = (size_t)(ip - ref);
+            const uint8_t *match_end = ip + MIN_MATCH;
+
+            for(ref += MIN_MATCH; match_end < iend && *match_end == *ref; match_end++, ref++);
+
+            op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), offset, (size_t)(match_end - ip));
+
+            if(!op) {
+                return 0;
+            }
+
+            ip = anchor = match_end;
+        } else {
+            ip++;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+
+    return op ? (size_t)(op - (uint8_t *)dest) : 0;
+}
+
+/** Decompress a buffer that was compressed by `lz_compress()`.
+ *
+ * @param src The compressed data.
+ * @param src_length The length of the compressed data, in bytes.
+ * @param dest The buffer for the decompressed data.
+ * @param dest_length The size of the buffer, in bytes.
+ * @return The length of the decompressed data. `LZ_ERROR`, if the compressed data is
+ * malformed or doesn't fit in the buffer.
+ */
+size_t lz_decompress(const void *src, size_t src_length, void *dest, size_t dest_length)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_length;
+    uint8_t *op = dest;
+    uint8_t *oend = op + dest_length;
+
+    while(ip < iend) {
+        uint8_t token = *ip++;
+        size_t literal_length = token >> 4;
+        size_t match_length = (token & NIBBLE_MAX) + MIN_MATCH;
+        size_t offset;
+
+        if(literal_length == NIBBLE_MAX && !(ip = get_length(ip, iend, &literal_length))) {
+            return LZ_ERROR;
+        }
+
+        if((size_t)(iend - ip) < literal_length || (size_t)(oend - op) < literal_length) {
+            return LZ_ERROR;
+        }
+
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        if(ip == iend) {
+            break;
+        }
+
+        if(iend - ip < 2) {
+            return LZ_ERROR;
+        }
+
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if(match_length == NIBBLE_MAX + MIN_MATCH && !(ip = get_length(ip, iend, &match_length))) {
+            return LZ_ERROR;
+        }
+
+        if(offset == 0 || offset > (size_t)(op - (uint8_t *)dest)
+           || (size_t)(oend - op) < match_length) {
+            return LZ_ERROR;
+        }
+
+        // The match may overlap the bytes that it produces, so it's copied one byte at a time
+
+        for(const uint8_t *ref = op - offset; match_length > 0; match_length--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return (size_t)(op - (uint8_t *)dest);
+}
@@ -59,3 +59,37 @@ void* sbrk(int increment) {
 
   return prevHeapEnd;
 }
+
+/* Maps zero-filled pages outside of the heap. Returns (void *)-1 on failure,
+   like sbrk(). */
+
+void *mapPages(size_t length) {
+  addr_t addr = mapMem((addr_t)NULL, ZERO_DEV, length, 0, 0);
+
+  if(addr == (addr_t)NULL) {
+    errno = -ENOMEM;
+    return (void*)-1;
+  }
+
+  return (void*)addr;
+}
+
+int unmapPages(void *addr, size_t length) {
+  return unmapMem((addr_t)addr, length);
+}
+
+/* Resizes pages that were mapped by mapPages(). The pages are moved to a new
+   address, without copying their contents, if they can't grow in place and
+   mayMove is set. */
+
+void *remapPages(void *addr, size_t oldLength, size_t newLength, int mayMove) {
+  addr_t newAddr = remapMem((addr_t)addr, oldLength, newLength,
+                            mayMove ? REMAP_MAYMOVE : 0);
+
+  if(newAddr == (addr_t)NULL) {
+    errno = -ENOMEM;
+    return (void*)-1;
+  }
+
+  return (void*)newAddr;
+}
@@ -13,32 +13,71 @@
 #include <os/msg/rtc.h>
 #include <drivers/video.h>
 
+#define NAME_CACHE_ENTRIES  16
+
+struct NameCacheEntry {
+  char name[MAX_NAME_LEN];
+  tid_t tid;            // NULL_TID, if the name wasn't registered
+  uint32_t generation;
+};
+
+/* Cached name lookups. An entry stays valid for as long as the init server hasn't
+   bumped the generation counter that its name hashes to, so a repeated lookup is a
+   memory read instead of an IPC. Entries are replaced round-robin. */
+
+static struct NameCacheEntry nameCache[NAME_CACHE_ENTRIES];
+static size_t nameCacheVictim;
+static const volatile uint32_t *nameGenerations;
+static int nameGenerationsUnavailable;
+
 static tid_t videoTid = NULL_TID;
 static tid_t rtcTid = NULL_TID;
 
 static int _lookupVideoTid(void);
 static int _lookupRtcTid(void);
+static const volatile uint32_t *_mapNameGenerations(void);
+static size_t _nameBucket(const char *name);
+static int _lookupNameUncached(const char *name, tid_t *tid);
 
-int _lookupVideoTid(void) {
-  if(videoTid == NULL_TID) {
-    videoTid = lookupName(VIDEO_NAME);
+/* Lookups are cached, so these are cheap enough to do on every call. That way,
+   a restarted server is picked up under its new tid. */
 
-    if(videoTid == NULL_TID)
-      return -1;
-  }
+int _lookupVideoTid(void) {
+  videoTid = lookupName(VIDEO_NAME);
 
-  return 0;
+  return videoTid == NULL_TID ? -1 : 0;
 }
 
 int _lookupRtcTid(void) {
-  if(rtcTid == NULL_TID) {
-    rtcTid = lookupName(RTC_NAME);
+  rtcTid = lookupName(RTC_NAME);
 
-    if(rtcTid == NULL_TID)
-      return -1;
+  return rtcTid == NULL_TID ? -1 : 0;
+}
+
+/* Maps the page of generation counters on first use. Returns NULL if the init
+   server doesn't provide it, in which case every lookup is sent to the init server. */
+
+const volatile uint32_t *_mapNameGenerations(void) {
+  if(!nameGenerations && !nameGenerationsUnavailable) {
+    nameGenerations = (const volatile uint32_t *)mapMem(NULL, NAME_CACHE_DEVICE,
+        NAME_CACHE_BUCKETS * sizeof(uint32_t), 0, MEM_FLG_RO);
+
+    if(!nameGenerations)
+      nameGenerationsUnavailable = 1;
   }
 
-  return 0;
+  return nameGenerations;
+}
+
+// 32-bit FNV-1a. librust and the init server hash names the same way.
+
+size_t _nameBucket(const char *name) {
+  uint32_t hash = 0x811c9dc5u;
+
+  for(; *name; name++)
+    hash = (hash ^ (uint8_t)*name) * 0x01000193u;
+
+  return hash % NAME_CACHE_BUCKETS;
 }
 
 int videoSetScroll(unsigned int offset) {
@@ -146,9 +185,81 @@ int unmapMem(addr_t addr, size_t length) {
           == RESPONSE_OK) ? 0 : -1;
 }
 
+/* Resizes anonymous memory. If the memory can't grow in place and REMAP_MAYMOVE
+   is set, then its pages are moved to a new address without being copied.
+   Returns the (possibly new) address of the memory. */
+
+addr_t remapMem(addr_t addr, size_t oldLength, size_t newLength, int flags) {
+  struct RemapRequest request;
+  struct MapResponse response;
+
+  request.addr = addr;
+  request.oldLength = oldLength;
+  request.newLength = newLength;
+  request.flags = flags;
+
+  msg_t requestMsg = REQUEST_MSG(REMAP_MEM, INIT_SERVER_TID, request);
+  msg_t response_msg = RESPONSE_MSG(response);
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? response.addr : NULL;
+}
+
+/* Starts a thread at entry in a copy of the caller's address space. Both copies
+   share their memory copy-on-write. Returns the new thread's tid, or NULL_TID if
+   the address space couldn't be copied. */
+
+tid_t forkThread(addr_t entry, addr_t stack) {
+  struct ForkRequest request;
+  struct ForkResponse response;
+
+  request.entry = entry;
+  request.stack = stack;
+
+  msg_t requestMsg = REQUEST_MSG(FORK_THREAD, INIT_SERVER_TID, request);
+  msg_t response_msg = RESPONSE_MSG(response);
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? response.tid : NULL_TID;
+}
+
+/* Creates a shared memory object. The object is mapped by passing the returned
+   device to mapMem(). Its memory is freed once it has been destroyed and unmapped
+   everywhere. */
+
+int createShm(size_t length) {
+  struct CreateShmRequest request;
+  struct CreateShmResponse response;
+
+  request.length = length;
+
+  msg_t requestMsg = REQUEST_MSG(CREATE_SHM, INIT_SERVER_TID, request);
+  msg_t response_msg = RESPONSE_MSG(response);
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? response.device : -1;
+}
+
+int destroyShm(int shm) {
+  struct DestroyShmRequest request;
+
+  request.device = shm;
+
+  msg_t requestMsg = REQUEST_MSG(DESTROY_SHM, INIT_SERVER_TID, request);
+  msg_t response_msg = EMPTY_MSG
+  ;
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
 pid_t createPort(pid_t pid, int flags) {
   struct CreatePortRequest request;
-  struct CreatePortResponse response;
+  struct CreatePortResponse response = { .pid = NULL_PID };  // Only the low half is sent back
 
   request.pid = pid;
   request.flags = flags;
@@ -175,6 +286,56 @@ int destroyPort(pid_t port) {
           == RESPONSE_OK) ? 0 : -1;
 }
 
+/* Queues a message on a port. If the port is full, this waits for room unless
+   PORT_NOBLOCK is set. Messages may be up to PORT_MAX_MESSAGE bytes long. */
+
+int sendPortMessage(pid_t port, const void *data, size_t length, int flags) {
+  uint8_t buffer[sizeof(struct SendMessageRequest) + PORT_MAX_MESSAGE];
+  struct SendMessageRequest *request = (struct SendMessageRequest *)buffer;
+
+  if(!data || length == 0 || length > PORT_MAX_MESSAGE)
+    return -1;
+
+  request->port = port;
+  request->flags = flags;
+  request->length = length;
+  memcpy(request->data, data, length);
+
+  msg_t requestMsg = NEW_MSG_BUF(SEND_MESSAGE, INIT_SERVER_TID, buffer,
+                                 sizeof *request + length);
+  msg_t response_msg = EMPTY_MSG
+  ;
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+/* Receives up to maxMessages messages from a port at once. The buffer is laid out as
+   a struct ReceiveMessageResponse. If the port is empty, this waits for a message
+   unless PORT_NOBLOCK is set. Returns the number of messages received. */
+
+int receivePortMessages(pid_t port, void *buffer, size_t bufferLen, size_t maxMessages,
+                        int flags) {
+  struct ReceiveMessageRequest request;
+  struct ReceiveMessageResponse *response = buffer;
+
+  if(!buffer || bufferLen < sizeof *response + sizeof(struct PortMessageHeader) + PORT_MAX_MESSAGE)
+    return -1;
+
+  request.port = port;
+  request.flags = flags;
+  request.maxMessages = maxMessages;
+  request.bufferLen = bufferLen;
+
+  msg_t requestMsg = REQUEST_MSG(RECEIVE_MESSAGE, INIT_SERVER_TID, request);
+  msg_t response_msg = NEW_MSG_BUF(0, INIT_SERVER_TID, buffer, bufferLen);
+
+  return
+      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
+          == RESPONSE_OK) ? (int)response->count : -1;
+}
+
 int registerServer(int type, int id) {
   struct RegisterServerRequest request = {
     .type = type,
@@ -217,21 +378,74 @@ int registerName(const char *name) {
           == RESPONSE_OK) ? 0 : -1;
 }
 
-tid_t lookupName(const char *name) {
+/* Asks the init server for the tid that a name is registered to. *tid is set to
+   NULL_TID if the name isn't registered. Returns -1 if the init server couldn't
+   be reached. */
+
+int _lookupNameUncached(const char *name, tid_t *tid) {
   struct LookupNameRequest request;
   struct LookupNameResponse response;
 
-  if(!name)
-    return NULL_TID;
-
   msg_t requestMsg = REQUEST_MSG(LOOKUP_NAME, INIT_SERVER_TID, request);
   msg_t response_msg = RESPONSE_MSG(response);
 
   strncpy(request.name, name, sizeof request.name);
 
-  return
-      (sys_call(&requestMsg, &response_msg) == ESYS_OK && response_msg.subject
-          == RESPONSE_OK) ? response.tid : NULL_TID;
+  if(sys_call(&requestMsg, &response_msg) != ESYS_OK)
+    return -1;
+
+  *tid = response_msg.subject == RESPONSE_OK ? response.tid : NULL_TID;
+  return 0;
+}
+
+tid_t lookupName(const char *name) {
+  const volatile uint32_t *generations;
+  struct NameCacheEntry *entry;
+  uint32_t generation;
+  tid_t tid;
+
+  if(!name)
+    return NULL_TID;
+
+  generations = _mapNameGenerations();
+
+  if(!generations || name[0] == '\0' || strlen(name) > MAX_NAME_LEN)
+    return _lookupNameUncached(name, &tid) == 0 ? tid : NULL_TID;
+
+  /* The counter is read before the init server is asked, so that a change that
+     races with the lookup leaves the new entry stale rather than the old one valid. */
+
+  generation = generations[_nameBucket(name)];
+
+  for(size_t i = 0; i < NAME_CACHE_ENTRIES; i++) {
+    entry = &nameCache[i];
+
+    if(entry->generation == generation && strncmp(entry->name, name, MAX_NAME_LEN) == 0)
+      return entry->tid;
+  }
+
+  if(_lookupNameUncached(name, &tid) != 0)
+    return NULL_TID;
+
+  entry = NULL;
+
+  for(size_t i = 0; i < NAME_CACHE_ENTRIES; i++) {
+    if(strncmp(nameCache[i].name, name, MAX_NAME_LEN) == 0) {
+      entry = &nameCache[i];
+      break;
+    }
+  }
+
+  if(!entry) {
+    entry = &nameCache[nameCacheVictim];
+    nameCacheVictim = (nameCacheVictim + 1) % NAME_CACHE_ENTRIES;
+  }
+
+  strncpy(entry->name, name, MAX_NAME_LEN);
+  entry->tid = tid;
+  entry->generation = generation;
+
+  return tid;
 }
 
 int unregisterName(const char *name) {
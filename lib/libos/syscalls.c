@@ -76,6 +76,31 @@ int sys_event_eoi(int mask)
     return sys_update(RES_INT, &args);
 }
 
+int sys_endpoint_create(void)
+{
+    return sys_create(RES_CAP, NULL);
+}
+
+int sys_endpoint_grant(cap_handle_t handle, tid_t tid, unsigned int rights)
+{
+    SysUpdateCapArgs args = {
+        .handle = handle,
+        .tid = tid,
+        .rights = rights
+    };
+
+    return sys_update(RES_CAP, &args);
+}
+
+int sys_endpoint_revoke(cap_handle_t handle)
+{
+    SysDestroyCapArgs args = {
+        .handle = handle
+    };
+
+    return sys_destroy(RES_CAP, &args);
+}
+
 noreturn void sys_exit(int status)
 {
     __asm__("hlt\n" :: "a"(status));
@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <string.h>
+#include "tests.h"
+#include <os/lz.h>
+
+#define PAGE_SIZE   4096
+
+int test_zero_page(void);
+int test_text(void);
+int test_random_page(void);
+int test_long_runs(void);
+int test_empty(void);
+int test_small_buffer(void);
+int test_malformed(void);
+
+Test tests[] = {
+    TEST(test_zero_page),
+    TEST(test_text),
+    TEST(test_random_page),
+    TEST(test_long_runs),
+    TEST(test_empty),
+    TEST(test_small_buffer),
+    TEST(test_malformed),
+    END_TESTS
+};
+
+static uint8_t page[PAGE_SIZE];
+static uint8_t compressed[2 * PAGE_SIZE];
+static uint8_t decompressed[PAGE_SIZE];
+
+static uint32_t next_random(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+static int round_trip(size_t length, size_t *compressed_length) {
+    *compressed_length = lz_compress(page, length, compressed, sizeof compressed);
+
+    ASSERT_NON_ZERO(*compressed_length);
+    ASSERT_EQ(lz_decompress(compressed, *compressed_length, decompressed, sizeof decompressed), length);
+    ASSERT_ZERO(memcmp(page, decompressed, length));
+
+    return 0;
+}
+
+int test_zero_page(void) {
+    size_t length;
+
+    memset(page, 0, sizeof page);
+
+    ASSERT_ZERO(round_trip(PAGE_SIZE, &length));
+    ASSERT(length < 64);
+
+    return 0;
+}
+
+int test_text(void) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    size_t length;
+
+    for(size_t i=0; i < PAGE_SIZE; i++) {
+        page[i] = (uint8_t)text[i % (sizeof text - 1)];
+    }
+
+    ASSERT_ZERO(round_trip(PAGE_SIZE, &length));
+    ASSERT(length < PAGE_SIZE / 8);
+
+    return 0;
+}
+
+int test_random_page(void) {
+    uint32_t state = 0x12345678;
+    size_t length;
+
+    for(size_t i=0; i < PAGE_SIZE; i++) {
+        page[i] = (uint8_t)next_random(&state);
+    }
+
+    ASSERT_ZERO(round_trip(PAGE_SIZE, &length));
+
+    // Incompressible data doesn't fit in less space than it started with
+
+    ASSERT_ZERO(lz_compress(page, PAGE_SIZE, compressed, PAGE_SIZE));
+
+    return 0;
+}
+
+int test_long_runs(void) {
+    uint32_t state = 0xCAFEF00D;
+    size_t length;
+
+    // Runs of a few hundred bytes need extra length bytes for both literals and matches
+
+    for(size_t i=0; i < PAGE_SIZE; i++) {
+        page[i] = (i / 300) % 2 ? (uint8_t)next_random(&state) : (uint8_t)(i / 300);
+    }
+
+    ASSERT_ZERO(round_trip(PAGE_SIZE, &length));
+    ASSERT_ZERO(round_trip(PAGE_SIZE - 3, &length));
+
+    return 0;
+}
+
+int test_empty(void) {
+    size_t length;
+
+    ASSERT_ZERO(round_trip(0, &length));
+    ASSERT_ZERO(lz_compress(page, 0, compressed, 0));
+
+    return 0;
+}
+
+int test_small_buffer(void) {
+    size_t length;
+
+    memset(page, 0xAA, sizeof page);
+    length = lz_compress(page, PAGE_SIZE, compressed, sizeof compressed);
+
+    ASSERT_NON_ZERO(length);
+    ASSERT_ZERO(lz_compress(page, PAGE_SIZE, compressed, length - 1));
+    ASSERT_EQ(lz_decompress(compressed, length, decompressed, PAGE_SIZE - 1), LZ_ERROR);
+
+    return 0;
+}
+
+int test_malformed(void) {
+    // A match that reaches back before the start of the output
+
+    static const uint8_t bad_offset[] = { 0x10, 'a', 0x02, 0x00 };
+
+    // A match without its offset
+
+    static const uint8_t truncated[] = { 0x10, 'a', 0x02 };
+
+    ASSERT_EQ(lz_decompress(bad_offset, sizeof bad_offset, decompressed, sizeof decompressed), LZ_ERROR);
+    ASSERT_EQ(lz_decompress(truncated, sizeof truncated, decompressed, sizeof decompressed), LZ_ERROR);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    return tests_run(argc, argv, tests);
+}
@@ -14,3 +14,4 @@ pub mod syscalls;
 pub mod io;
 pub mod device;
 pub mod thread;
+pub mod name;
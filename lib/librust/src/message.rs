@@ -1,4 +1,5 @@
 pub use crate::types::{Tid, CTid};
+use crate::syscalls::CCapHandle;
 
 #[derive(Clone)]
 pub struct MessageHeader {
@@ -11,7 +12,8 @@ impl MessageHeader {
     pub const MSG_NOBLOCK: u16 = 1;
     pub const MSG_STD: u16 = 0;
     pub const MSG_EMPTY: u16 = 2;
-    pub const MSG_KERNEL: u16 = 0x8000;
+    pub const MSG_ENDPOINT: u16 = 4;
+    pub const MSG_KERNEL: u16 = 0x80;
     pub const ANY: Option<Tid> = None;
     pub const ANY_SENDER: Option<Tid> = MessageHeader::ANY;
     pub const ANY_RECIPIENT: Option<Tid> = MessageHeader::ANY;
@@ -20,6 +22,13 @@ impl MessageHeader {
         Self { target, flags, subject }
     }
 
+    /// Addresses a message to an endpoint instead of a thread. `handle` is a capability
+    /// handle. A null handle leaves the target empty, which the kernel rejects.
+
+    pub fn for_endpoint(handle: CCapHandle, subject: u32, flags: u16) -> Self {
+        Self::new(Tid::new(handle), subject, flags | Self::MSG_ENDPOINT)
+    }
+
     pub const fn blank() -> Self {
         Self { target: Self::ANY, flags: 0, subject: 0 }
     }
@@ -38,6 +47,7 @@ pub mod kernel {
     pub const EXIT: u32 = 0xFFFFFFFE;
     pub const LOW_MEMORY: u32 = 0xFFFFFFFD;
     pub const OUT_OF_MEMORY: u32 = 0xFFFFFFFC;
+    pub const PAGE_FAULT: u32 = 0xFFFFFFFB;
 
     #[derive(Clone, Default, Hash)]
     #[repr(C, align(16))]
@@ -148,4 +158,90 @@ pub mod kernel {
             }
         }
     }
+
+    /// Sent to a pager when one of its threads page faults. The thread stays blocked until
+    /// the pager sends it a `PageFaultReply` with the `PAGE_FAULT` subject.
+    #[derive(Clone, Default, Hash)]
+    #[repr(C, align(16))]
+    pub struct PageFaultMessage {
+        pub fault_address: u32,
+        pub error_code: u32,
+        pub eip: u32,
+        pub who: CTid,
+    }
+
+    impl PageFaultMessage {
+        // Error codes
+
+        pub const PRESENT: u32 = ExceptionMessage::PRESENT;
+        pub const WRITE: u32 = ExceptionMessage::WRITE;
+        pub const USER: u32 = ExceptionMessage::USER;
+        pub const RESD_WRITE: u32 = ExceptionMessage::RESD_WRITE;
+        pub const FETCH: u32 = ExceptionMessage::FETCH;
+    }
+
+    impl TryFrom<&[u8]> for PageFaultMessage {
+        type Error = ();
+
+        fn try_from(value: &[u8]) -> Result<Self, Self::Error> {
+            if value.len() >= 14 {
+                Ok(Self {
+                    fault_address: u32::from_le_bytes(*value[0..4].as_array().unwrap()),
+                    error_code: u32::from_le_bytes(*value[4..8].as_array().unwrap()),
+                    eip: u32::from_le_bytes(*value[8..12].as_array().unwrap()),
+                    who: CTid::from_le_bytes(*value[12..14].as_array().unwrap()),
+                })
+            } else {
+                Err(())
+            }
+        }
+    }
+
+    /// A pager's reply to a `PageFaultMessage`. The kernel maps `count` frames, starting
+    /// at `frame`, to the pages starting at `start` and then restarts the faulting thread.
+    /// The range must contain the faulting page and must not cross a page table.
+    ///
+    /// `flags` takes the page mapping flags. With `PAGE_SIZED`, a single large page
+    /// containing the fault address is mapped instead. With `UNMAPPED`, nothing is mapped
+    /// and the thread is just restarted. `DIRTY` marks the new pages as already modified.
+    #[derive(Clone, Default, Hash)]
+    #[repr(C)]
+    pub struct PageFaultReply {
+        pub start: u32,
+        pub frame: u32,
+        pub count: u32,
+        pub flags: u32,
+    }
+
+    impl<'a> From<&'a PageFaultReply> for &'a [u8] {
+        fn from(value: &'a PageFaultReply) -> Self {
+            unsafe {
+                core::slice::from_raw_parts(value as *const PageFaultReply as *const u8,
+                                            core::mem::size_of::<PageFaultReply>())
+            }
+        }
+    }
+
+    /// Sent to a pager when the kernel's reserve of frames for anonymous faults runs low.
+    #[derive(Clone, Default, Hash)]
+    #[repr(C, align(16))]
+    pub struct MemoryMessage {
+        pub reserve_count: u32,
+        pub who: CTid,
+    }
+
+    impl TryFrom<&[u8]> for MemoryMessage {
+        type Error = ();
+
+        fn try_from(value: &[u8]) -> Result<Self, Self::Error> {
+            if value.len() >= 6 {
+                Ok(Self {
+                    reserve_count: u32::from_le_bytes(*value[0..4].as_array().unwrap()),
+                    who: CTid::from_le_bytes(*value[4..6].as_array().unwrap()),
+                })
+            } else {
+                Err(())
+            }
+        }
+    }
 }
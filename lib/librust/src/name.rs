@@ -0,0 +1,263 @@
+//! Client-side cache of name lookups.
+//!
+//! The init server publishes a page of generation counters that any address space may map
+//! read-only. Every name hashes to one of the counters, and the init server bumps the counter
+//! whenever a name with that hash is registered or unregistered. A cached lookup stays valid for
+//! as long as its counter hasn't moved, so a repeated lookup costs a memory read instead of an
+//! IPC to the init server.
+
+use core::ffi::c_void;
+use core::mem;
+use core::ptr;
+use core::slice;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU32, Ordering};
+use crate::message::MessageHeader;
+use crate::syscalls::{self, INIT_TID};
+use crate::types::{CTid, Tid};
+
+/// The longest name that a lookup request can carry.
+pub const MAX_NAME_LEN: usize = 32;
+
+/// The number of generation counters in the shared page.
+pub const GENERATION_COUNT: usize = 1024;
+
+/// The pseudo device that the page of generation counters is mapped from.
+pub const GENERATION_DEVICE: i32 = 2;
+
+const CACHE_SIZE: usize = 16;
+
+const MAP: u32 = 1;
+const LOOKUP_NAME: u32 = 10;
+const RESPONSE_OK: u32 = 0;
+
+const MEM_FLG_RO: i32 = 0x01;
+
+#[repr(C)]
+struct MapRequest {
+    address: *const c_void,
+    device: i32,
+    offset: u64,
+    length: usize,
+    flags: i32,
+}
+
+// Null until the page has been mapped into this address space
+static GENERATIONS: AtomicPtr<AtomicU32> = AtomicPtr::new(ptr::null_mut());
+static MAP_FAILED: AtomicBool = AtomicBool::new(false);
+
+/// Returns the index of the generation counter that lookups of `name` are checked against.
+/// libos hashes names the same way.
+
+pub fn generation_index(name: &[u8]) -> usize {
+    // 32-bit FNV-1a
+    let hash = name.iter()
+        .fold(0x811c9dc5u32, |hash, byte| (hash ^ *byte as u32).wrapping_mul(0x01000193));
+
+    hash as usize % GENERATION_COUNT
+}
+
+/// Maps the page of generation counters on first use. Returns `None` if the init server
+/// doesn't provide one, in which case every lookup goes to the init server.
+
+fn generations() -> Option<&'static [AtomicU32; GENERATION_COUNT]> {
+    let mut page = GENERATIONS.load(Ordering::Acquire);
+
+    if page.is_null() {
+        if MAP_FAILED.load(Ordering::Relaxed) {
+            return None;
+        }
+
+        let request = MapRequest {
+            address: ptr::null(),
+            device: GENERATION_DEVICE,
+            offset: 0,
+            length: GENERATION_COUNT * mem::size_of::<u32>(),
+            flags: MEM_FLG_RO,
+        };
+        let mut address = [0u8; mem::size_of::<usize>()];
+
+        let mapped = unsafe { slice::from_raw_parts(&request as *const MapRequest as *const u8,
+                                                     mem::size_of::<MapRequest>()) };
+
+        let new_page = match call(MAP, mapped, &mut address) {
+            Ok(true) => usize::from_ne_bytes(address) as *mut AtomicU32,
+            _ => ptr::null_mut(),
+        };
+
+        if new_page.is_null() {
+            MAP_FAILED.store(true, Ordering::Relaxed);
+            return None;
+        }
+
+        // Another thread may have mapped the page first. Its mapping is used, and the extra one
+        // is left in place.
+        page = match GENERATIONS.compare_exchange(ptr::null_mut(), new_page, Ordering::AcqRel,
+                                                  Ordering::Acquire) {
+            Ok(_) => new_page,
+            Err(existing) => existing,
+        };
+    }
+
+    Some(unsafe { &*(page as *const [AtomicU32; GENERATION_COUNT]) })
+}
+
+/// Sends a request to the init server and waits for its response. Returns `Ok(false)` if the
+/// init server responded with a failure.
+
+fn call(subject: u32, request: &[u8], response: &mut [u8]) -> syscalls::Result<bool> {
+    let mut header = MessageHeader::new(Tid::new(INIT_TID), subject, 0);
+
+    syscalls::send(&mut header, request)?;
+
+    let mut header = MessageHeader::new(Tid::new(INIT_TID), 0, 0);
+
+    syscalls::receive(&mut header, response)?;
+    Ok(header.subject == RESPONSE_OK)
+}
+
+/// Asks the init server for the tid that `name` is registered to. Returns `Ok(None)` if no
+/// thread has registered the name.
+
+fn lookup_uncached(name: &[u8]) -> syscalls::Result<Option<Tid>> {
+    let mut request = [0u8; MAX_NAME_LEN];
+    let mut tid = [0u8; mem::size_of::<CTid>()];
+
+    request[..name.len()].copy_from_slice(name);
+
+    call(LOOKUP_NAME, &request, &mut tid)
+        .map(|found| found.then(|| Tid::new(CTid::from_ne_bytes(tid))).flatten())
+}
+
+#[derive(Clone, Copy)]
+struct Entry {
+    name: [u8; MAX_NAME_LEN],
+    length: usize,
+    tid: Option<Tid>,       // `None`, if the name wasn't registered
+    generation: u32,
+}
+
+impl Entry {
+    fn name(&self) -> &[u8] {
+        &self.name[..self.length]
+    }
+}
+
+/// A small cache of name lookups. Entries are replaced round-robin once the cache is full.
+
+pub struct NameCache {
+    entries: [Option<Entry>; CACHE_SIZE],
+    next_victim: usize,
+}
+
+impl NameCache {
+    pub const fn new() -> Self {
+        Self {
+            entries: [None; CACHE_SIZE],
+            next_victim: 0,
+        }
+    }
+
+    /// Returns the tid that `name` is registered to, or `None` if it isn't registered or the
+    /// init server couldn't be reached.
+
+    pub fn lookup(&mut self, name: &str) -> Option<Tid> {
+        let name = name.as_bytes();
+
+        if name.is_empty() || name.len() > MAX_NAME_LEN {
+            return None;
+        }
+
+        let index = generation_index(name);
+
+        // The counter is read before the init server is asked, so that a change that races
+        // with the lookup leaves the new entry stale instead of the old one valid.
+        let generation = match generations() {
+            Some(page) => page[index].load(Ordering::Acquire),
+            None => return lookup_uncached(name).ok().flatten(),
+        };
+
+        if let Some(tid) = self.cached(name, generation) {
+            return tid;
+        }
+
+        let tid = lookup_uncached(name).ok()?;
+
+        self.insert(name, tid, generation);
+        tid
+    }
+
+    /// Drops every entry from the cache.
+
+    pub fn clear(&mut self) {
+        self.entries = [None; CACHE_SIZE];
+    }
+
+    fn cached(&self, name: &[u8], generation: u32) -> Option<Option<Tid>> {
+        self.entries.iter()
+            .flatten()
+            .find(|entry| entry.name() == name && entry.generation == generation)
+            .map(|entry| entry.tid)
+    }
+
+    fn insert(&mut self, name: &[u8], tid: Option<Tid>, generation: u32) {
+        let mut entry = Entry {
+            name: [0; MAX_NAME_LEN],
+            length: name.len(),
+            tid,
+            generation,
+        };
+
+        entry.name[..name.len()].copy_from_slice(name);
+
+        let slot = match self.entries.iter().position(|e| e.map_or(false, |e| e.name() == name)) {
+            Some(slot) => slot,
+            None => {
+                let slot = self.next_victim;
+
+                self.next_victim = (self.next_victim + 1) % CACHE_SIZE;
+                slot
+            },
+        };
+
+        self.entries[slot] = Some(entry);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn generation_index_is_fnv1a() {
+        assert_eq!(generation_index(b""), 0x811c9dc5 % GENERATION_COUNT);
+        assert_eq!(generation_index(b"a"), 0xe40c292c % GENERATION_COUNT);
+    }
+
+    #[test]
+    fn stale_entries_are_missed() {
+        let mut cache = NameCache::new();
+
+        cache.insert(b"video", Tid::new(300), 4);
+
+        assert_eq!(cache.cached(b"video", 4), Some(Tid::new(300)));
+        assert_eq!(cache.cached(b"video", 5), None);
+        assert_eq!(cache.cached(b"rtc", 4), None);
+    }
+
+    #[test]
+    fn entries_are_replaced_round_robin() {
+        let mut cache = NameCache::new();
+
+        for i in 0..=CACHE_SIZE {
+            cache.insert(format!("name{}", i).as_bytes(), Tid::new(300 + i as CTid), 0);
+        }
+
+        assert_eq!(cache.cached(b"name0", 0), None);
+        assert_eq!(cache.cached(b"name1", 0), Some(Tid::new(301)));
+
+        cache.insert(b"name1", None, 1);
+
+        assert_eq!(cache.cached(b"name1", 1), Some(None));
+        assert_eq!(cache.cached(b"name2", 0), Some(Tid::new(302)));
+    }
+}
@@ -1,5 +1,5 @@
 pub use crate::types::Tid;
-pub use self::c_types::{CTid, CPageMap};
+pub use self::c_types::{CTid, CPageMap, CCapHandle};
 use core::result;
 pub use core::ffi::{c_void, c_int, c_uint};
 use crate::syscalls::c_types::{CURRENT_ROOT_PMAP, NULL_TID};
@@ -236,8 +236,10 @@ pub mod c_types {
     pub type CPAddr = c_ulong;
     pub type CTid = c_ushort;
     pub type CPageMap = c_ulong;
+    pub type CCapHandle = c_ushort;
 
     pub const NULL_TID: CTid = 0;
+    pub const NULL_CAP: CCapHandle = 0;
     pub const CURRENT_ROOT_PMAP: CPageMap = 0xFFFFFFFF;
 
     #[repr(C)]
@@ -343,6 +345,69 @@ pub mod c_types {
         pub irq: c_uint,    // Event interrupts can't be destroyed.
     }
 
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone)]
+    pub(crate) struct CreateAnonRegionArgs {
+        pub addr_space: CPAddr,
+        pub start: *const c_void,
+        pub length: c_size_t,
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone)]
+    pub(crate) struct ReadAnonRegionArgs {
+        pub frames: *mut c_ulong,   // If null, then only the reserve count is returned.
+        pub count: c_size_t,
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone)]
+    pub(crate) struct UpdateAnonRegionArgs {
+        pub frames: *const c_ulong,
+        pub count: c_size_t,
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone)]
+    pub(crate) struct DestroyAnonRegionArgs {
+        pub addr_space: CPAddr,
+        pub start: *const c_void,
+        pub length: c_size_t,       // If 0, then all regions in the address space are revoked.
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone, Default)]
+    pub(crate) struct ReadCapArgs {
+        pub handle: CCapHandle,
+        pub rights: c_uint,
+        pub waiting_senders: c_size_t,
+        pub waiting_receivers: c_size_t,
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone, Default)]
+    pub(crate) struct UpdateCapArgs {
+        pub handle: CCapHandle,
+        pub tid: CTid,
+        pub rights: c_uint,         // Masked by the rights of `handle`.
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone, Default)]
+    pub(crate) struct DestroyCapArgs {
+        pub handle: CCapHandle,
+    }
+
+    #[repr(C)]
+    #[derive(Debug, Copy, Clone)]
+    pub(crate) struct DestroyPageMappingArgs {
+        pub addr_space: CPAddr,
+        pub frames: *mut c_ulong,
+        pub frame_count: c_size_t,
+        pub large_frames: *mut c_ulong,
+        pub large_count: c_size_t,
+    }
+
     #[repr(C)]
     #[derive(Clone)]
     pub struct LegacyXSaveState {
@@ -525,6 +590,9 @@ pub mod events {
     pub const IRQ23: u32 = 1 << 31;
 }
 
+/// The TID of the init server, which pages every other thread.
+pub const INIT_TID: c_types::CTid = 256;
+
 pub mod status {
     use core::ffi::c_int;
 
@@ -598,6 +666,19 @@ pub mod flags {
         pub const PMAP: u32 = 8;
         pub const EXT_REG_STATE: u32 = 16;
     }
+
+    pub mod capability {
+        /// Messages may be sent through the endpoint.
+        pub const SEND: u32 = 0x01;
+
+        /// Messages may be received from the endpoint.
+        pub const RECEIVE: u32 = 0x02;
+
+        /// The capability may be copied to another thread.
+        pub const GRANT: u32 = 0x04;
+
+        pub const ALL: u32 = SEND | RECEIVE | GRANT;
+    }
 }
 
 /*
@@ -616,7 +697,8 @@ pub enum Resource {
     PageMapping,
     Tcb,
     Interrupt,
-    Capability
+    Capability,
+    AnonRegion
 }
 
 #[derive(Copy, Clone, PartialEq, Eq, Hash)]
@@ -635,7 +717,9 @@ impl Default for SleepGranularity {
 pub const INFINITE_DURATION: u32 = 0xFFFFFFFF;
 use c_types::{
     ThreadState, CreateIntArgs, CreateTcbArgs, UpdateIntArgs, UpdatePageMappingArgs, UpdateTcbArgs,
-    ReadIntArgs, ReadPageMappingArgs, ReadTcbArgs, DestroyIntArgs, DestroyTcbArgs
+    ReadIntArgs, ReadPageMappingArgs, ReadTcbArgs, DestroyIntArgs, DestroyTcbArgs,
+    CreateAnonRegionArgs, ReadAnonRegionArgs, UpdateAnonRegionArgs, DestroyAnonRegionArgs,
+    DestroyPageMappingArgs, ReadCapArgs, UpdateCapArgs, DestroyCapArgs
 };
 
 pub use c_types::PageMapping;
@@ -649,7 +733,14 @@ pub enum CreateArgs {
     IntHandler {
         irq: u8
     },
-    Capability
+    /// Creates an endpoint. The returned handle carries all rights.
+    Capability,
+    /// Delegates an anonymous zero-fill region to the kernel.
+    AnonRegion {
+        addr_space: Option<CPageMap>,
+        start: *const (),
+        length: usize
+    }
 }
 
 pub enum ReadArgs<'a> {
@@ -668,7 +759,19 @@ pub enum ReadArgs<'a> {
         mask: u32,
         blocking: bool
     },
-    Capability
+    /// Sets `rights` to the rights of a capability, and the counts to the number of
+    /// threads that are blocked on its endpoint.
+    Capability {
+        handle: CCapHandle,
+        rights: u32,
+        waiting_senders: usize,
+        waiting_receivers: usize
+    },
+    /// Withdraws frames from the kernel's anonymous frame reserve. If `frames` is `None`,
+    /// then only the number of reserved frames is returned.
+    AnonRegion {
+        frames: Option<&'a mut [u32]>
+    }
 }
 
 pub enum UpdateArgs<'a> {
@@ -686,17 +789,48 @@ pub enum UpdateArgs<'a> {
     IntHandler {
         mask: u32
     },
-    Capability
+    /// Grants a copy of a capability to another thread. The copy's handle in that
+    /// thread's table is returned.
+    Capability {
+        handle: CCapHandle,
+        tid: Tid,
+        rights: u32
+    },
+    /// Donates frames (by frame number) to the kernel's anonymous frame reserve.
+    AnonRegion {
+        frames: &'a [u32]
+    }
 }
 
-pub enum DestroyArgs {
+pub enum DestroyArgs<'a> {
+    /// Removes every user mapping of an address space that no thread runs in anymore.
+    /// The mapped 4 KiB frames and the page tables are returned in `frames`, and the
+    /// first frame of each 4 MiB page in `large_frames` (by frame number). The counts are
+    /// set to the number of frames that were returned. If a buffer fills up, then
+    /// `NotReady` is returned and the call has to be repeated.
+    PageMapping {
+        addr_space: CPageMap,
+        frames: &'a mut [u32],
+        frame_count: usize,
+        large_frames: &'a mut [u32],
+        large_count: usize
+    },
     Tcb {
         tid: Tid
     },
     IntHandler {
         irq: u8
     },
-    Capability
+    Capability {
+        handle: CCapHandle
+    },
+    /// Revokes part of a delegated anonymous region. If both `start` and `length` are 0,
+    /// then every region is revoked.
+    AnonRegion {
+        addr_space: Option<CPageMap>,
+        start: *const (),
+        length: usize
+    }
 }
 
 pub fn create(args: &CreateArgs) -> Result<i32> {
@@ -723,7 +857,22 @@ pub fn create(args: &CreateArgs) -> Result<i32> {
                 SyscallFunction::Create, Resource::Interrupt, &int_args as *const CreateIntArgs as *const c_void
             ))
         }
-        Capability => Err(SyscallError::NotImplemented)
+        Capability => {
+            syscall_result(syscall!(
+                SyscallFunction::Create, Resource::Capability, core::ptr::null::<c_void>()
+            ))
+        },
+        AnonRegion { addr_space, start, length } => {
+            let region_args = CreateAnonRegionArgs {
+                addr_space: addr_space.unwrap_or(CURRENT_ROOT_PMAP),
+                start: *start as *const c_void,
+                length: *length,
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Create, Resource::AnonRegion, &region_args as *const CreateAnonRegionArgs as *const c_void
+            ))
+        }
     }
 }
 
@@ -765,7 +914,37 @@ pub fn read(args: &mut ReadArgs) -> Result<i32> {
                 SyscallFunction::Read, Resource::Interrupt, &int_args as *const ReadIntArgs as *const c_void
             ))
         }
-        Capability => Err(SyscallError::NotImplemented)
+        Capability { handle, rights, waiting_senders, waiting_receivers } => {
+            let mut cap_args = ReadCapArgs {
+                handle: *handle,
+                ..Default::default()
+            };
+
+            let result = syscall_result(syscall!(
+                SyscallFunction::Read, Resource::Capability, &mut cap_args as *mut ReadCapArgs as *const c_void
+            ));
+
+            *rights = cap_args.rights;
+            *waiting_senders = cap_args.waiting_senders;
+            *waiting_receivers = cap_args.waiting_receivers;
+            result
+        },
+        AnonRegion { frames } => {
+            let region_args = match frames {
+                Some(f) => ReadAnonRegionArgs {
+                    frames: f.as_mut_ptr() as *mut _,
+                    count: f.len(),
+                },
+                None => ReadAnonRegionArgs {
+                    frames: core::ptr::null_mut(),
+                    count: 0,
+                }
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Read, Resource::AnonRegion, &region_args as *const ReadAnonRegionArgs as *const c_void
+            ))
+        }
     }
 }
 
@@ -806,14 +985,51 @@ pub fn update(args: &UpdateArgs) -> Result<i32> {
                 SyscallFunction::Update, Resource::Interrupt, &int_args as *const UpdateIntArgs as *const c_void
             ))
         }
-        Capability => Err(SyscallError::NotImplemented)
+        Capability { handle, tid, rights } => {
+            let cap_args = UpdateCapArgs {
+                handle: *handle,
+                tid: CTid::from(*tid),
+                rights: *rights,
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Update, Resource::Capability, &cap_args as *const UpdateCapArgs as *const c_void
+            ))
+        },
+        AnonRegion { frames } => {
+            let region_args = UpdateAnonRegionArgs {
+                frames: frames.as_ptr() as *const _,
+                count: frames.len(),
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Update, Resource::AnonRegion, &region_args as *const UpdateAnonRegionArgs as *const c_void
+            ))
+        }
     }
 }
 
-pub fn destroy(args: &DestroyArgs) -> Result<i32> {
+pub fn destroy(args: &mut DestroyArgs) -> Result<i32> {
     use DestroyArgs::*;
 
     match args {
+        PageMapping { addr_space, frames, frame_count, large_frames, large_count } => {
+            let mut page_mapping_args = DestroyPageMappingArgs {
+                addr_space: *addr_space,
+                frames: frames.as_mut_ptr() as *mut _,
+                frame_count: frames.len(),
+                large_frames: large_frames.as_mut_ptr() as *mut _,
+                large_count: large_frames.len(),
+            };
+
+            let result = syscall_result(syscall!(
+                SyscallFunction::Destroy, Resource::PageMapping, &mut page_mapping_args as *mut DestroyPageMappingArgs as *const c_void
+            ));
+
+            *frame_count = page_mapping_args.frame_count;
+            *large_count = page_mapping_args.large_count;
+            result
+        },
         Tcb { tid } => {
             let tcb_args = DestroyTcbArgs {
                 tid: CTid::from(*tid)
@@ -832,7 +1048,26 @@ pub fn destroy(args: &DestroyArgs) -> Result<i32> {
                 SyscallFunction::Destroy, Resource::Interrupt, &int_args as *const DestroyIntArgs as *const c_void
             ))
         }
-        Capability => Err(SyscallError::NotImplemented)
+        Capability { handle } => {
+            let cap_args = DestroyCapArgs {
+                handle: *handle
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Destroy, Resource::Capability, &cap_args as *const DestroyCapArgs as *const c_void
+            ))
+        },
+        AnonRegion { addr_space, start, length } => {
+            let region_args = DestroyAnonRegionArgs {
+                addr_space: addr_space.unwrap_or(CURRENT_ROOT_PMAP),
+                start: *start as *const c_void,
+                length: *length,
+            };
+
+            syscall_result(syscall!(
+                SyscallFunction::Destroy, Resource::AnonRegion, &region_args as *const DestroyAnonRegionArgs as *const c_void
+            ))
+        }
     }
 }
 
@@ -877,7 +1112,13 @@ pub fn receive(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<usi
     header.flags = (actual_sender_and_flags >> 16) as u16;
     header.subject = subject;
 
-    syscall_result(retval as i32).map(|_|  bytes_rcvd as usize)
+    // A kernel message that preempted the receive has still been received. The caller can
+    // tell by checking for `MSG_KERNEL` in the header's flags.
+
+    match syscall_result(retval as i32) {
+        Ok(_) | Err(SyscallError::Preempted) => Ok(bytes_rcvd as usize),
+        Err(e) => Err(e),
+    }
 }
 
 pub fn get_page_mappings(level: u32, virt: *const (), addr_space: Option<CPageMap>,
@@ -0,0 +1,57 @@
+#![allow(dead_code)]
+
+//! Physical allocator benchmark.
+//!
+//! Started with `allocbench` on the init server's command line. For each block size, a batch
+//! of blocks is allocated from the live allocator and then released in the same order. The
+//! average cost of an allocation and of a release is printed in TSC cycles. Both include
+//! taking the allocator's lock, since every caller pays for that too. A batch stops early if
+//! memory runs out.
+
+use alloc::vec::Vec;
+use crate::address::PAddr;
+use crate::lowlevel;
+use crate::phys_alloc::{self, BlockSize};
+
+// Block sizes and the number of blocks of each to allocate
+const BATCHES: [(BlockSize, usize); 3] = [
+    (BlockSize::Block4k, 16384),
+    (BlockSize::Block128k, 512),
+    (BlockSize::Block4M, 16),
+];
+
+pub fn run() {
+    eprintfln!("allocbench: Average TSC cycles per operation:");
+
+    for (block_size, count) in BATCHES.iter() {
+        let mut blocks = Vec::<PAddr>::with_capacity(*count);
+
+        let start = lowlevel::read_tsc();
+
+        while blocks.len() < *count {
+            match phys_alloc::alloc_phys(*block_size) {
+                Ok((addr, _)) => blocks.push(addr),
+                Err(_) => break,
+            }
+        }
+
+        let alloc_cycles = lowlevel::read_tsc().wrapping_sub(start);
+        let start = lowlevel::read_tsc();
+
+        for addr in blocks.iter() {
+            phys_alloc::release_phys(*addr, *block_size);
+        }
+
+        let release_cycles = lowlevel::read_tsc().wrapping_sub(start);
+
+        if blocks.is_empty() {
+            eprintfln!("allocbench:   {:>8}-byte blocks: out of memory", block_size.bytes());
+        } else {
+            eprintfln!("allocbench:   {:>8}-byte blocks: {} alloc {} release ({} blocks)",
+                       block_size.bytes(),
+                       alloc_cycles / blocks.len() as u64,
+                       release_cycles / blocks.len() as u64,
+                       blocks.len());
+        }
+    }
+}
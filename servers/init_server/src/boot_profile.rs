@@ -0,0 +1,66 @@
+#![allow(dead_code)]
+
+//! Boot timeline.
+//!
+//! Records the time-stamp counter at each step of bringing up the system, from the init
+//! server's start until the last boot module has been loaded, and prints the timeline over the
+//! debug console. The kernel prints its own phases from the same counter, so the absolute
+//! values line the two timelines up.
+//!
+//! Boot modules other than the ramdisk and the init server's own are loaded by the loader
+//! threads (see `worker`), and the timeline is printed once the last of them has been loaded.
+
+use alloc::borrow::Cow;
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use crate::heap;
+use crate::lowlevel;
+use crate::mutex::Mutex;
+
+static MARKS: Mutex<Vec<(Cow<'static, str>, u64)>> = Mutex::new(Vec::new());
+static PENDING_MODULES: AtomicUsize = AtomicUsize::new(0);
+
+/// Records the end of a step.
+
+pub fn mark(step: impl Into<Cow<'static, str>>) {
+    let tsc = lowlevel::read_tsc();
+
+    MARKS.lock().push((step.into(), tsc));
+}
+
+/// Notes that `count` modules are being loaded in the background. The timeline is printed
+/// once they've all been loaded, or right away if there aren't any.
+
+pub fn expect_modules(count: usize) {
+    if count == 0 {
+        dump();
+    } else {
+        PENDING_MODULES.store(count, Ordering::Release);
+    }
+}
+
+/// Notes that one of the modules from `expect_modules()` has been loaded.
+
+pub fn module_loaded() {
+    if PENDING_MODULES.fetch_sub(1, Ordering::AcqRel) == 1 {
+        mark("modules loaded");
+        dump();
+    }
+}
+
+fn dump() {
+    let marks = MARKS.lock();
+    let mut previous = match marks.first() {
+        Some((_, tsc)) => *tsc,
+        None => return,
+    };
+
+    eprintfln!("Init server boot timeline (TSC cycles):");
+
+    for (step, tsc) in marks.iter() {
+        eprintfln!("  {:<24} {:>16} (+{})", step, tsc, tsc.wrapping_sub(previous));
+        previous = *tsc;
+    }
+
+    heap::dump_stats();
+}
@@ -0,0 +1,238 @@
+#![allow(dead_code)]
+
+//! Compressed boot modules.
+//!
+//! A boot module may be packed with `tools/lzpack` to shorten the time that it takes to fetch
+//! it at boot. The format is described in `os/lz.h`. Before such a module is loaded, it's
+//! decompressed into frames of its own, one block at a time: each block is decompressed from
+//! a window over the module straight into a window over the destination frames, so neither
+//! the module nor its decompressed image ever has to be mapped as a whole.
+//!
+//! The decompressed image is kept for as long as the system runs, since the frames of a
+//! module's text are shared by all of its instances.
+//!
+//! The image is made in full before the module's ELF headers are read, rather than while its
+//! segments are mapped. The loader never copies a segment into frames of its own: it maps
+//! each segment onto the image's frames, and they're only touched when they're first faulted
+//! on. So the image's frames are the segments' frames. Leaving a block compressed until one
+//! of its pages is faulted on would put the decompression of a whole block in the pager's
+//! fault path. Overlap comes from the loader threads instead: one decompresses a module while
+//! another sets up the previous one.
+
+use alloc::borrow::Cow;
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use core::mem;
+use rust::align::Align;
+use crate::address::{PAddr, PSize};
+use crate::error::Error;
+use crate::lowlevel::phys::{self, PageMapArea};
+use crate::multiboot::BootModule;
+use crate::mutex::Mutex;
+use crate::page::VirtualPage;
+use crate::phys_alloc::{self, BlockSize};
+
+// See os/lz.h
+const MAGIC: u32 = 0x5A4C4253;
+const BLOCK_SIZE: usize = 65536;
+const STORED: u32 = 0x8000_0000;
+
+/// The largest module that can be decompressed. The decompressed image has to be physically
+/// contiguous.
+pub const MAX_LENGTH: usize = 4 * 1024 * 1024;
+
+#[link(name = "os_init", kind = "static")]
+extern "C" {
+    fn lz_decompress(src: *const c_void, src_length: usize, dest: *mut c_void, dest_length: usize) -> usize;
+}
+
+#[repr(C)]
+#[derive(Default, Clone, Copy)]
+struct RawHeader {
+    magic: u32,
+    length: u32,
+}
+
+/// Decompressed modules, by the address of the compressed module.
+static EXPANDED: Mutex<BTreeMap<PAddr, BootModule>> = Mutex::new(BTreeMap::new());
+
+fn header_of(module: &BootModule) -> Option<RawHeader> {
+    let mut header = RawHeader::default();
+
+    if (module.length as usize) >= mem::size_of::<RawHeader>()
+        && unsafe { phys::try_read_from_phys(module.addr, &mut header) }
+        && header.magic == MAGIC {
+        Some(header)
+    } else {
+        None
+    }
+}
+
+pub fn is_compressed(module: &BootModule) -> bool {
+    header_of(module).is_some()
+}
+
+/// Returns the decompressed image of a module that has already been decompressed.
+
+pub fn expanded(module: &BootModule) -> Option<BootModule> {
+    EXPANDED.lock().get(&module.addr).cloned()
+}
+
+/// Returns a module that can be loaded as it is: the module itself, if it isn't compressed,
+/// or its decompressed image, which is made on first use.
+
+pub fn expand(module: &BootModule) -> Result<BootModule, (Error, Cow<'static, str>)> {
+    let header = match header_of(module) {
+        Some(header) => header,
+        None => return Ok(module.clone()),
+    };
+
+    if let Some(expanded) = expanded(module) {
+        return Ok(expanded);
+    }
+
+    let length = header.length as usize;
+
+    if length == 0 || length > MAX_LENGTH {
+        return Err((Error::TooLong, Cow::Owned(format!("Compressed module @ {:#x} is {} bytes long when decompressed",
+                                                       module.addr, length))));
+    }
+
+    let dest = alloc_image(length)?;
+
+    if let Err(msg) = decompress(module, dest, length) {
+        release_image(dest, length);
+        return Err((Error::ParseError, msg));
+    }
+
+    let new_module = BootModule {
+        addr: dest,
+        length: length as PSize,
+        name: module.name.clone(),
+    };
+
+    let mut expanded_modules = EXPANDED.lock();
+
+    // The module may have been decompressed by another thread in the meantime
+    if let Some(expanded) = expanded_modules.get(&module.addr) {
+        release_image(dest, length);
+        Ok(expanded.clone())
+    } else {
+        expanded_modules.insert(module.addr, new_module.clone());
+        Ok(new_module)
+    }
+}
+
+/// Allocates contiguous frames for a decompressed image. The frames past its end are
+/// released right away.
+
+fn alloc_image(length: usize) -> Result<PAddr, (Error, Cow<'static, str>)> {
+    let block_size = if length <= BlockSize::Block128k.bytes() as usize {
+        BlockSize::Block128k
+    } else {
+        BlockSize::Block4M
+    };
+
+    let (dest, _) = phys_alloc::alloc_phys(block_size)
+        .map_err(|_| (Error::OutOfMemory, Cow::Borrowed("Unable to allocate frames for a decompressed module.")))?;
+
+    // Frames above 4 GiB can't be mapped one at a time
+    if dest + block_size.bytes() as PSize > 1 << 32 {
+        phys_alloc::release_phys(dest, block_size);
+        return Err((Error::OutOfMemory, Cow::Borrowed("Unable to allocate frames below 4 GiB for a decompressed module.")));
+    }
+
+    let end = dest + length.align(VirtualPage::SMALL_PAGE_SIZE) as PSize;
+
+    for frame in (end..dest + block_size.bytes() as PSize).step_by(VirtualPage::SMALL_PAGE_SIZE) {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+
+    Ok(dest)
+}
+
+fn release_image(dest: PAddr, length: usize) {
+    let end = dest + length.align(VirtualPage::SMALL_PAGE_SIZE) as PSize;
+
+    for frame in (dest..end).step_by(VirtualPage::SMALL_PAGE_SIZE) {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+}
+
+/// Maps the frames that hold `[addr, addr+length)`. Returns the window and the offset of
+/// `addr` within it.
+
+fn map_range<'a>(addr: PAddr, length: usize) -> Option<(PageMapArea<'a>, usize)> {
+    let page_size = VirtualPage::SMALL_PAGE_SIZE as PSize;
+    let frames = (addr.align_trunc(page_size)..(addr + length as PSize).align(page_size))
+        .step_by(VirtualPage::SMALL_PAGE_SIZE)
+        .collect::<Vec<PAddr>>();
+
+    unsafe { PageMapArea::new_from_frames(&frames) }
+        .map(|area| (area, (addr % page_size) as usize))
+}
+
+fn decompress(module: &BootModule, dest: PAddr, length: usize) -> Result<(), Cow<'static, str>> {
+    let end = module.addr + module.length;
+    let mut src = module.addr + mem::size_of::<RawHeader>() as PSize;
+    let mut offset = 0;
+
+    while offset < length {
+        let mut block_header = 0u32;
+
+        if src + mem::size_of::<u32>() as PSize > end
+            || !unsafe { phys::try_read_from_phys(src, &mut block_header) } {
+            return Err(Cow::Owned(format!("Compressed module @ {:#x} is truncated", module.addr)));
+        }
+
+        src += mem::size_of::<u32>() as PSize;
+
+        let is_stored = block_header & STORED != 0;
+        let src_length = (block_header & !STORED) as usize;
+        let dest_length = BLOCK_SIZE.min(length - offset);
+
+        if src + src_length as PSize > end || (is_stored && src_length != dest_length) {
+            return Err(Cow::Owned(format!("Compressed module @ {:#x} has a bad block at {:#x}",
+                                          module.addr, src)));
+        }
+
+        let (src_area, src_offset) = map_range(src, src_length)
+            .ok_or(Cow::Borrowed("Unable to map a block of a compressed module."))?;
+        let (mut dest_area, dest_offset) = map_range(dest + offset as PSize, dest_length)
+            .ok_or(Cow::Borrowed("Unable to map the frames of a decompressed module."))?;
+
+        let block = &(*src_area)[src_offset..src_offset + src_length];
+        let output = &mut (*dest_area)[dest_offset..dest_offset + dest_length];
+
+        let is_valid = if is_stored {
+            output.copy_from_slice(block);
+            true
+        } else {
+            unsafe {
+                lz_decompress(block.as_ptr() as *const c_void, block.len(),
+                              output.as_mut_ptr() as *mut c_void, output.len()) == output.len()
+            }
+        };
+
+        if !is_valid {
+            return Err(Cow::Owned(format!("Compressed module @ {:#x} has a corrupt block at {:#x}",
+                                          module.addr, src)));
+        }
+
+        src += src_length as PSize;
+        offset += dest_length;
+    }
+
+    // The rest of the last frame may still hold somebody else's data
+    let tail_length = length.align(VirtualPage::SMALL_PAGE_SIZE) - length;
+
+    if tail_length > 0 {
+        let (mut tail_area, tail_offset) = map_range(dest + length as PSize, tail_length)
+            .ok_or(Cow::Borrowed("Unable to map the frames of a decompressed module."))?;
+
+        (*tail_area)[tail_offset..].fill(0);
+    }
+
+    Ok(())
+}
@@ -0,0 +1,323 @@
+#![allow(dead_code)]
+
+//! A pool of compressed pages in RAM.
+//!
+//! A dirty page that's being evicted is compressed into the pool before the swap area is
+//! tried, so that it can be brought back without any device I/O. The pool is made up of
+//! frames that are cut into chunks of one size class each. A compressed page takes up one
+//! chunk of the smallest class that fits it. Pages that don't compress to at most
+//! `MAX_COMPRESSED_SIZE` bytes aren't worth keeping in the pool and go to the swap area.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::collections::btree_set::BTreeSet;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use crate::address::PAddr;
+use crate::error::Error;
+use crate::frame_cache;
+use crate::lowlevel::phys::{self, PageMapArea};
+use crate::mutex::Mutex;
+use crate::page::VirtualPage;
+
+const CHUNK_SIZE: usize = 64;
+const CLASS_COUNT: usize = 48;
+
+/// The largest compressed page that's kept in the pool.
+pub const MAX_COMPRESSED_SIZE: usize = CHUNK_SIZE * CLASS_COUNT;
+
+/// The share of physical memory, in percent, that the pool may grow to.
+const MAX_POOL_PERCENT: usize = 20;
+
+#[link(name = "os_init", kind = "static")]
+extern "C" {
+    fn lz_compress(src: *const c_void, src_length: usize, dest: *mut c_void, dest_length: usize) -> usize;
+    fn lz_decompress(src: *const c_void, src_length: usize, dest: *mut c_void, dest_length: usize) -> usize;
+}
+
+/// The location of a compressed page in the pool.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub struct Handle {
+    frame: PAddr,
+    chunk: u16,
+    length: u16,
+}
+
+impl Handle {
+    fn class(&self) -> usize {
+        class_of(self.length as usize)
+    }
+
+    fn address(&self) -> PAddr {
+        self.frame + (self.chunk as usize * chunk_size(self.class())) as PAddr
+    }
+}
+
+fn class_of(length: usize) -> usize {
+    (length.max(1) + CHUNK_SIZE - 1) / CHUNK_SIZE - 1
+}
+
+fn chunk_size(class: usize) -> usize {
+    (class + 1) * CHUNK_SIZE
+}
+
+fn chunks_per_frame(class: usize) -> usize {
+    VirtualPage::SMALL_PAGE_SIZE / chunk_size(class)
+}
+
+struct PoolFrame {
+    class: usize,
+
+    // One bit per chunk that's in use
+    used: u64,
+}
+
+struct Pool {
+    frames: BTreeMap<PAddr, PoolFrame>,
+
+    // The frames of each class that have a free chunk
+    partial: Vec<BTreeSet<PAddr>>,
+    max_frames: usize,
+    stored_bytes: usize,
+}
+
+impl Pool {
+    const fn new() -> Self {
+        Self {
+            frames: BTreeMap::new(),
+            partial: Vec::new(),
+            max_frames: 0,
+            stored_bytes: 0,
+        }
+    }
+
+    /// Reserves a chunk for `length` bytes. `alloc_frame` is called if the pool has to grow.
+
+    fn alloc(&mut self, length: usize, alloc_frame: impl FnOnce() -> Result<PAddr, Error>) -> Result<Handle, Error> {
+        if length > MAX_COMPRESSED_SIZE || length > u16::MAX as usize {
+            return Err(Error::BadArgument);
+        }
+
+        let class = class_of(length);
+
+        if self.partial.len() < CLASS_COUNT {
+            self.partial.resize_with(CLASS_COUNT, BTreeSet::new);
+        }
+
+        let frame = match self.partial[class].iter().next() {
+            Some(frame) => *frame,
+            None if self.frames.len() < self.max_frames => {
+                let frame = alloc_frame()?;
+
+                self.frames.insert(frame, PoolFrame { class, used: 0 });
+                self.partial[class].insert(frame);
+                frame
+            },
+            None => return Err(Error::OutOfMemory),
+        };
+
+        let pool_frame = self.frames.get_mut(&frame)
+            .ok_or(Error::Failed)?;
+        let chunk = (!pool_frame.used).trailing_zeros() as usize;
+
+        pool_frame.used |= 1 << chunk;
+
+        if pool_frame.used.count_ones() as usize == chunks_per_frame(class) {
+            self.partial[class].remove(&frame);
+        }
+
+        self.stored_bytes += length;
+
+        Ok(Handle {
+            frame,
+            chunk: chunk as u16,
+            length: length as u16,
+        })
+    }
+
+    /// Frees a chunk. Returns the chunk's frame if it's no longer used by the pool.
+
+    fn free(&mut self, handle: &Handle) -> Option<PAddr> {
+        let pool_frame = self.frames.get_mut(&handle.frame)?;
+        let bit = 1u64 << handle.chunk;
+
+        if pool_frame.used & bit == 0 {
+            return None;
+        }
+
+        pool_frame.used &= !bit;
+        self.stored_bytes -= handle.length as usize;
+
+        if pool_frame.used == 0 {
+            self.frames.remove(&handle.frame);
+            self.partial[handle.class()].remove(&handle.frame);
+            Some(handle.frame)
+        } else {
+            self.partial[handle.class()].insert(handle.frame);
+            None
+        }
+    }
+}
+
+// Only held while a chunk is handed out or given back. The contents of a chunk belong to
+// whoever holds its handle.
+static POOL: Mutex<Pool> = Mutex::new(Pool::new());
+
+/// Sizes the pool for a machine with `total_frames` frames of physical memory.
+
+pub fn init(total_frames: usize) {
+    POOL.lock().max_frames = total_frames * MAX_POOL_PERCENT / 100;
+}
+
+fn store_bytes(data: &[u8]) -> Result<Handle, Error> {
+    let handle = POOL.lock().alloc(data.len(), || frame_cache::alloc_frame().map_err(|_| Error::OutOfMemory))?;
+
+    match unsafe { phys::poke(handle.address(), data) } {
+        Ok(_) => Ok(handle),
+        Err(_) => {
+            free(&handle);
+            Err(Error::Failed)
+        }
+    }
+}
+
+/// Compresses the contents of a frame into the pool.
+///
+/// Fails with `Error::OutOfMemory` if the page doesn't compress well enough or if the pool
+/// is full.
+
+pub fn store(frame: PAddr) -> Result<Handle, Error> {
+    let mut buffer = [0u8; MAX_COMPRESSED_SIZE];
+
+    let length = unsafe { PageMapArea::new_from_addr(frame) }
+        .map(|area| unsafe {
+            lz_compress(area.as_ref().as_ptr() as *const c_void, VirtualPage::SMALL_PAGE_SIZE,
+                        buffer.as_mut_ptr() as *mut c_void, buffer.len())
+        })
+        .ok_or(Error::Failed)?;
+
+    if length == 0 {
+        return Err(Error::OutOfMemory);
+    }
+
+    store_bytes(&buffer[..length])
+}
+
+/// Decompresses a page from the pool into a frame. The page stays in the pool.
+
+pub fn load(handle: &Handle, frame: PAddr) -> Result<(), Error> {
+    let mut buffer = [0u8; MAX_COMPRESSED_SIZE];
+    let compressed = &mut buffer[..handle.length as usize];
+
+    phys::peek(handle.address(), compressed)
+        .map_err(|_| Error::Failed)?;
+
+    let mut area = unsafe { PageMapArea::new_from_addr(frame) }
+        .ok_or(Error::Failed)?;
+
+    let length = unsafe {
+        lz_decompress(compressed.as_ptr() as *const c_void, compressed.len(),
+                      area.as_mut().as_mut_ptr() as *mut c_void, VirtualPage::SMALL_PAGE_SIZE)
+    };
+
+    if length == VirtualPage::SMALL_PAGE_SIZE {
+        Ok(())
+    } else {
+        Err(Error::Failed)
+    }
+}
+
+/// Makes a second copy of a compressed page.
+
+pub fn duplicate(handle: &Handle) -> Result<Handle, Error> {
+    let mut buffer = [0u8; MAX_COMPRESSED_SIZE];
+    let compressed = &mut buffer[..handle.length as usize];
+
+    phys::peek(handle.address(), compressed)
+        .map_err(|_| Error::Failed)?;
+
+    store_bytes(compressed)
+}
+
+/// Removes a page from the pool.
+
+pub fn free(handle: &Handle) {
+    let unused_frame = POOL.lock().free(handle);
+
+    if let Some(frame) = unused_frame {
+        frame_cache::release_frame(frame);
+    }
+}
+
+/// Returns the number of frames that the pool takes up and the number of compressed bytes
+/// that it holds.
+
+pub fn usage() -> (usize, usize) {
+    let pool = POOL.lock();
+
+    (pool.frames.len(), pool.stored_bytes)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_classes() {
+        assert_eq!(class_of(1), 0);
+        assert_eq!(class_of(64), 0);
+        assert_eq!(class_of(65), 1);
+        assert_eq!(class_of(MAX_COMPRESSED_SIZE), CLASS_COUNT - 1);
+        assert_eq!(chunks_per_frame(0), 64);
+        assert_eq!(chunks_per_frame(CLASS_COUNT - 1), 1);
+    }
+
+    #[test]
+    fn test_alloc_free() {
+        let mut pool = Pool::new();
+        let mut next_frame = 0x10000;
+        let mut alloc_frame = || {
+            next_frame += 0x1000;
+            Ok(next_frame)
+        };
+
+        pool.max_frames = 2;
+
+        let first = pool.alloc(1000, &mut alloc_frame).unwrap();
+        let second = pool.alloc(1000, &mut alloc_frame).unwrap();
+        let third = pool.alloc(2000, &mut alloc_frame).unwrap();
+
+        // Four 1 KiB chunks fit in a frame, but a 2 KiB page needs a frame of its own class
+
+        assert_eq!(first.frame, second.frame);
+        assert_eq!(second.address(), first.address() + 1024);
+        assert_ne!(third.frame, first.frame);
+        assert_eq!(pool.alloc(3000, &mut alloc_frame), Err(Error::OutOfMemory));
+        assert_eq!(pool.alloc(MAX_COMPRESSED_SIZE + 1, &mut alloc_frame), Err(Error::BadArgument));
+        assert_eq!(pool.stored_bytes, 4000);
+
+        assert_eq!(pool.free(&first), None);
+        assert_eq!(pool.free(&first), None);
+        assert_eq!(pool.free(&second), Some(first.frame));
+        assert_eq!(pool.stored_bytes, 2000);
+
+        assert!(pool.alloc(3000, &mut alloc_frame).is_ok());
+    }
+
+    #[test]
+    fn test_full_frame_isnt_partial() {
+        let mut pool = Pool::new();
+        let mut alloc_frame = || Ok(0x20000);
+
+        pool.max_frames = 1;
+
+        let handles = (0..4)
+            .map(|_| pool.alloc(900, &mut alloc_frame).unwrap())
+            .collect::<Vec<_>>();
+
+        assert!(pool.partial[class_of(900)].is_empty());
+        assert_eq!(pool.alloc(900, &mut alloc_frame), Err(Error::OutOfMemory));
+
+        pool.free(&handles[2]);
+        assert_eq!(pool.alloc(900, &mut alloc_frame).unwrap().chunk, 2);
+    }
+}
@@ -1,11 +1,11 @@
-use crate::page::{PhysicalPage, VirtualPage};
-use crate::error::{self, Error};
+use crate::page::{FrameSize, PhysicalFrame, VirtualPage};
+use crate::error::Error;
 use core::prelude::v1::*;
 use crate::lowlevel::phys;
-use crate::phys_alloc::{self, BlockSize};
+use crate::swap;
 
-type DeviceMajor = u16;
-type DeviceMinor = u16;
+pub type DeviceMajor = u16;
+pub type DeviceMinor = u16;
 
 pub mod mem {
     use super::DeviceMajor;
@@ -13,6 +13,51 @@ pub mod mem {
 
     pub const MAJOR: DeviceMajor = 1;
     pub const PMEM_MINOR: DeviceMinor = 0;
+    pub const RAMDISK_MINOR: DeviceMinor = 1;
+}
+
+/// The ramdisk is a boot module that stays in physical memory. Its blocks are read and
+/// written by copying frames.
+
+pub mod ramdisk {
+    use crate::address::{PAddr, PSize};
+    use crate::page::PhysicalFrame;
+
+    static mut RAMDISK: Option<(PAddr, PSize)> = None;
+
+    /// Attaches the ramdisk. `base` must be page-aligned.
+
+    pub fn attach(base: PAddr, length: PSize) {
+        unsafe {
+            RAMDISK = Some((base, length));
+        }
+    }
+
+    /// Returns the number of pages in the ramdisk.
+
+    pub fn page_count() -> usize {
+        unsafe {
+            RAMDISK.map(|(_, length)| (length / PhysicalFrame::SMALL_PAGE_SIZE as PSize) as usize)
+                .unwrap_or(0)
+        }
+    }
+
+    /// Returns the physical address of the page at `offset` bytes into the ramdisk.
+
+    pub fn frame_at(offset: u64) -> Option<PAddr> {
+        unsafe {
+            RAMDISK.filter(|(_, length)| offset + PhysicalFrame::SMALL_PAGE_SIZE as PSize <= *length)
+                .map(|(base, _)| base + offset)
+        }
+    }
+}
+
+/// Each minor of the shared memory device is a shared memory object.
+
+pub mod shm {
+    use super::DeviceMajor;
+
+    pub const MAJOR: DeviceMajor = 2;
 }
 
 pub mod pseudo {
@@ -22,6 +67,7 @@ pub mod pseudo {
     pub const MAJOR: DeviceMajor = 0;
     pub const NULL_MINOR: DeviceMinor = 0;
     pub const ZERO_MINOR: DeviceMinor = 1;
+    pub const NAME_CACHE_MINOR: DeviceMinor = 2;    // Generation counters of the name service
 }
 
 #[derive(Clone, PartialEq, Eq)]
@@ -73,55 +119,48 @@ pub mod manager {
     use crate::Tid;
     use crate::error;
     use crate::error::Error;
+    use crate::mutex::Mutex;
 
-    static mut DEVICE_MAP: Option<BTreeMap<DeviceMajor, Tid>> = None;
+    static DEVICE_MAP: Mutex<Option<BTreeMap<DeviceMajor, Tid>>> = Mutex::new(None);
 
     pub fn init() {
-        unsafe {
-            DEVICE_MAP = match DEVICE_MAP {
-                Some(_) => panic!("Device map has already been initialized."),
-                None => Some(BTreeMap::new()),
-            }
-        }
-    }
+        let mut device_map = DEVICE_MAP.lock();
 
-    fn device_map<'a>() -> &'static BTreeMap<DeviceMajor, Tid> {
-        unsafe {
-            DEVICE_MAP.as_ref()
-                .expect("Device map hasn't been initialized yet.")
+        *device_map = match *device_map {
+            Some(_) => panic!("Device map has already been initialized."),
+            None => Some(BTreeMap::new()),
         }
     }
 
-    fn device_map_mut<'a>() -> &'static mut BTreeMap<DeviceMajor, Tid> {
-        unsafe {
-            DEVICE_MAP.as_mut()
-                .expect("Device map hasn't been initialized yet.")
-        }
+    fn with_device_map<R>(f: impl FnOnce(&mut BTreeMap<DeviceMajor, Tid>) -> R) -> R {
+        f(DEVICE_MAP.lock()
+            .as_mut()
+            .expect("Device map hasn't been initialized yet."))
     }
 
     pub fn register(major: DeviceMajor, tid: Tid) -> Result<(), error::Error> {
-        let dev_map = device_map_mut();
-
-        if dev_map.contains_key(&major) {
-            Err(Error::AlreadyRegistered)
-        } else {
-            dev_map.insert(major, tid);
-            Ok(())
-        }
+        with_device_map(|dev_map| {
+            if dev_map.contains_key(&major) {
+                Err(Error::AlreadyRegistered)
+            } else {
+                dev_map.insert(major, tid);
+                Ok(())
+            }
+        })
     }
 
-    pub fn lookup<'a, 'b>(major: &'a DeviceMajor) -> Option<&'b Tid> {
-        device_map().get(major)
+    pub fn lookup(major: &DeviceMajor) -> Option<Tid> {
+        with_device_map(|dev_map| dev_map.get(major).cloned())
     }
 
     pub fn unregister(major: &DeviceMajor) -> Option<Tid> {
-        device_map_mut().remove(major)
+        with_device_map(|dev_map| dev_map.remove(major))
     }
 }
 
 /// Read a block from a device into a physical page
 
-pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
+pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalFrame, Error> {
     let major = vpage.device.major;
     let minor = vpage.device.minor;
 
@@ -130,16 +169,16 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
             match minor {
                 pseudo::NULL_MINOR => Err(Error::ZeroLength),   // handle a read from /dev/null
                 pseudo::ZERO_MINOR => {  // handle a read from /dev/zero
-
-                    phys_alloc::alloc_phys(BlockSize::Block4k)
-                        .map_err(|_| { Error::OutOfMemory })
-                        .and_then(|(new_addr, _)| {
-
-                            unsafe {
-                                phys::clear_frame(new_addr)
-                                    .map(|_| PhysicalPage::new(new_addr))
-                            }
-                        })
+                    let new_addr = swap::alloc_frame()?;
+
+                    unsafe {
+                        phys::clear_frame(new_addr)
+                            .map(|_| PhysicalFrame::new(new_addr, FrameSize::Small))
+                            .map_err(|e| {
+                                swap::release_frame(new_addr);
+                                e
+                            })
+                    }
                 },
                 _ => {
                     Err(Error::DoesntExist)
@@ -149,10 +188,23 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
         mem::MAJOR => {
             match minor {
                 mem::PMEM_MINOR => {  // handle a read from /dev/pmem
-                    PhysicalPage::try_from(vpage.offset)
-                        .map_err(|_| Error::DoesntExist)
+                    Ok(PhysicalFrame::new(vpage.offset, FrameSize::Small))
                 },
-                _ => {  // handle reads from ramdisk
+                mem::RAMDISK_MINOR => {  // handle reads from ramdisk
+                    let block = ramdisk::frame_at(vpage.offset)
+                        .ok_or(Error::EndOfFile)?;
+                    let new_addr = swap::alloc_frame()?;
+
+                    unsafe {
+                        phys::copy_frame(new_addr, block)
+                            .map(|_| PhysicalFrame::new(new_addr, FrameSize::Small))
+                            .map_err(|e| {
+                                swap::release_frame(new_addr);
+                                e
+                            })
+                    }
+                },
+                _ => {
                     Err(Error::DoesntExist)
                 }
             }
@@ -164,7 +216,7 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
 
 /// Write a physical page to a block on a device
 
-pub fn write_page(vpage: &VirtualPage, _page: &PhysicalPage) -> Result<(), Error> {
+pub fn write_page(vpage: &VirtualPage, page: &PhysicalFrame) -> Result<(), Error> {
     let major = vpage.device.major;
     let minor = vpage.device.minor;
 
@@ -183,7 +235,13 @@ pub fn write_page(vpage: &VirtualPage, _page: &PhysicalPage) -> Result<(), Error
                 mem::PMEM_MINOR => {  // handle a write to /dev/pmem
                     Ok(())
                 },
-                _ => {  // handle writes to ramdisk
+                mem::RAMDISK_MINOR => {  // handle writes to ramdisk
+                    let block = ramdisk::frame_at(vpage.offset)
+                        .ok_or(Error::EndOfFile)?;
+
+                    unsafe { phys::copy_frame(block, page.address()) }
+                },
+                _ => {
                     Err(Error::DoesntExist)
                 }
             }
@@ -81,158 +81,325 @@ pub fn is_valid_elf_exe(image: PAddr) -> Result<Box<RawElfHeader>, ()> {
 pub mod loader {
     use crate::elf::{RawElfHeader, RawProgramHeader32};
     use rust::types::Tid;
-    use rust::syscalls;
-    use rust::syscalls::c_types::NULL_TID;
+    use rust::align::Align;
+    use rust::syscalls::{self, SyscallError, CreateArgs, UpdateArgs};
+    use rust::syscalls::c_types::{CTid, ThreadState};
+    use alloc::borrow::Cow;
+    use alloc::collections::btree_map::BTreeMap;
+    use alloc::sync::Arc;
+    use alloc::vec::Vec;
     use core::mem;
     use core::ffi::c_void;
-    use crate::page::VirtualPage;
+    use crate::page::{PageMapBase, VirtualPage};
     use crate::address::{PAddr, VAddr, PSize};
+    use crate::error::Error;
     use crate::mapping::{self, AddrSpace};
-    use crate::lowlevel::phys;
+    use crate::lowlevel::{self, phys};
     use crate::address;
     use crate::device::{self, DeviceId};
-    use rust::syscalls::{ThreadInfo, INIT_TID};
+    use crate::mutex::Mutex;
+    use crate::rmap;
+    use crate::swap;
+    use rust::syscalls::INIT_TID;
     use crate::multiboot::BootModule;
-    use crate::phys_alloc::{self, BlockSize, AllocError};
+    use crate::phys_alloc::{self, BlockSize};
+    use crate::compressed_module;
+
+    /// A loadable segment of a program image.
+
+    struct Segment {
+        vaddr: u32,
+        offset: PAddr,          // Physical address of the segment's file image
+        flags: u32,             // Address space flags, without the ones for writable data
+        is_writable: bool,
+        file_length: usize,
+        length: usize,
+
+        // Frames that hold nothing but the segment's file image. Every instance of a
+        // read-only segment maps them as they are.
+        shared_frames: Vec<PAddr>,
+    }
+
+    /// A program image whose ELF headers have already been read and checked.
+
+    pub struct ProgramImage {
+        entry: u32,
+        segments: Vec<Segment>,
+    }
+
+    /// Images of the modules that have been loaded before, by the physical address of the
+    /// module. A module's headers are only parsed the first time that it's loaded.
+    static IMAGE_CACHE: Mutex<BTreeMap<PAddr, Arc<ProgramImage>>> = Mutex::new(BTreeMap::new());
+
+    impl ProgramImage {
+        fn parse(module: &BootModule) -> Result<ProgramImage, ()> {
+            if (module.length as usize) < mem::size_of::<RawElfHeader>() {
+                return Err(());
+            }
+
+            let header = super::is_valid_elf_exe(module.addr)?;
+            let mut segments = Vec::new();
+
+            for ph_index in 0..header.phnum {
+                let pheader_option = unsafe {
+                    phys::try_from_phys::<RawProgramHeader32>((module.addr + header.phoff as PSize + ph_index as PSize * header.phentsize as PSize) as PAddr)
+                };
+
+                if let Some(pheader) = pheader_option {
+                    if pheader.header_type == RawProgramHeader32::LOAD && pheader.flags != 0
+                        && pheader.mem_size > 0 {
+                        segments.push(Segment::new(module, &pheader));
+                    }
+                }
+            }
+
+            Ok(ProgramImage {
+                entry: header.entry,
+                segments,
+            })
+        }
+
+        /// Returns the entry point of the program.
+
+        pub fn entry(&self) -> u32 {
+            self.entry
+        }
+
+        /// Maps each segment directly onto the module's frames. Frames are only touched when
+        /// they're first faulted on: text and read-only data are shared with every other
+        /// instance of the module, and the bss is zeroed a page at a time. Writable segments
+        /// get `data_flags` on top of their own.
+
+        fn map_segments(&self, addr_space: &mut AddrSpace, data_flags: u32) {
+            let pmem_device = DeviceId::new_from_tuple((device::mem::MAJOR, device::mem::PMEM_MINOR));
+
+            for segment in self.segments.iter() {
+                let flags = if segment.is_writable {
+                    segment.flags | data_flags
+                } else {
+                    segment.flags
+                };
+
+                addr_space.map_segment(address::u32_into_vaddr(segment.vaddr), &pmem_device,
+                                       segment.offset, flags, segment.file_length, segment.length);
+            }
+        }
+
+        /// Maps the shared frames of the read-only segments up front, a batch per segment,
+        /// so that a new instance doesn't fault on text that's already resident.
+
+        fn map_shared_frames(&self, root_pmap: PageMapBase) {
+            for segment in self.segments.iter().filter(|segment| !segment.shared_frames.is_empty()) {
+                let start = (segment.vaddr as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
+                let end = start + segment.shared_frames.len() * VirtualPage::SMALL_PAGE_SIZE;
+
+                if ensure_page_tables(root_pmap, start, end).is_err() {
+                    continue;
+                }
+
+                let mapped = unsafe {
+                    lowlevel::map_frames(Some(root_pmap), start as *mut c_void, &segment.shared_frames,
+                                         syscalls::flags::mapping::READ_ONLY)
+                };
+
+                let count = match mapped {
+                    Ok(count) | Err(SyscallError::PartiallyMapped(count)) => count,
+                    Err(_) => 0,
+                };
+
+                for (i, frame) in segment.shared_frames[..count].iter().enumerate() {
+                    rmap::map(*frame, root_pmap, start + i * VirtualPage::SMALL_PAGE_SIZE);
+                }
+            }
+        }
+    }
+
+    impl Segment {
+        fn new(module: &BootModule, pheader: &RawProgramHeader32) -> Segment {
+            let is_writable = pheader.flags & RawProgramHeader32::WRITE != 0;
+            let offset = module.addr + pheader.offset as PSize;
+            let file_length = pheader.file_size.min(pheader.mem_size) as usize;
+            let length = pheader.mem_size as usize;
+
+            // The page that holds the end of the file image is only shared if nothing but
+            // zeros is supposed to follow it.
+            let data_end = if file_length < length {
+                (offset + file_length as PSize).align_trunc(VirtualPage::SMALL_PAGE_SIZE as PSize)
+            } else {
+                (offset + file_length as PSize).align(VirtualPage::SMALL_PAGE_SIZE as PSize)
+            };
+
+            let shared_frames = if is_writable {
+                Vec::new()
+            } else {
+                (offset.align_trunc(VirtualPage::SMALL_PAGE_SIZE as PSize)..data_end)
+                    .step_by(VirtualPage::SMALL_PAGE_SIZE)
+                    .collect()
+            };
+
+            let mut flags = if is_writable { 0 } else { AddrSpace::READ_ONLY };
+
+            if pheader.flags & RawProgramHeader32::EXECUTE == 0 {
+                flags |= AddrSpace::NO_EXECUTE;
+            }
+
+            Segment {
+                vaddr: pheader.vaddr,
+                offset,
+                flags,
+                is_writable,
+                file_length,
+                length,
+                shared_frames,
+            }
+        }
+    }
+
+    /// Returns the parsed image of a module, parsing it if it hasn't been loaded before.
+
+    pub fn cached_image(module: &BootModule) -> Result<Arc<ProgramImage>, ()> {
+        if let Some(image) = IMAGE_CACHE.lock().get(&module.addr) {
+            return Ok(image.clone());
+        }
+
+        let image = Arc::new(ProgramImage::parse(module)?);
+
+        IMAGE_CACHE.lock().insert(module.addr, image.clone());
+        Ok(image)
+    }
+
+    /// Drops a module's image from the cache, so that it's parsed again on its next load.
+
+    pub fn forget_image(module: &BootModule) {
+        let addr = compressed_module::expanded(module)
+            .map_or(module.addr, |expanded| expanded.addr);
+
+        IMAGE_CACHE.lock().remove(&addr);
+    }
+
+    fn ensure_page_tables(root_pmap: PageMapBase, start: usize, end: usize) -> Result<(), ()> {
+        let table_size = crate::page::PhysicalFrame::PSE_LARGE_PAGE_SIZE;
+
+        for base in (start.align_trunc(table_size)..end).step_by(table_size) {
+            if !lowlevel::has_page_table(Some(root_pmap), base as *const ()).map_err(|_| ())? {
+                let table = swap::alloc_frame().map_err(|_| ())?;
+
+                if unsafe { lowlevel::map_page_table(Some(root_pmap), base as *mut (), table, 0) }.is_err() {
+                    swap::release_frame(table);
+                    return Err(());
+                }
+            }
+        }
+
+        Ok(())
+    }
 
     pub fn load_init_mappings(module: &BootModule) -> bool {
         let stack_top = 0xC0000000usize;
         let stack_size = 64*1024usize - 4096usize;
         let tid = Tid::new(INIT_TID).expect("Init tid shouldn't be null.");
-        let addr_space= mapping::manager::lookup_tid_mut(&tid)
+        let mut addr_space = mapping::manager::lock_tid(&tid)
             .expect("Initial address space wasn't found.");
 
-        if module.length as usize >= mem::size_of::<RawElfHeader>() {
-            super::is_valid_elf_exe(module.addr)
-                .map(|header| {
-                    let mut pheader_option;
-                    let pmem_device = DeviceId::new_from_tuple((device::mem::MAJOR, device::mem::PMEM_MINOR));
-                    let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
-
-                    addr_space.map(Some((stack_top - stack_size) as VAddr),
-                                   &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size);
-                    addr_space.map(Some((stack_top - stack_size - VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                                   &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
-
-                    for ph_index in 0..header.phnum {
-                        pheader_option = unsafe {
-                            phys::try_from_phys::<RawProgramHeader32>((module.addr + header.phoff as PSize + ph_index as PSize * header.phentsize as PSize) as PAddr)
-                        };
-
-                        if let Some(pheader) = pheader_option {
-                            let flags = if pheader.flags == RawProgramHeader32::READ {
-                                AddrSpace::READ_ONLY | AddrSpace::NO_EXECUTE
-                            } else if pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::EXECUTE)
-                                || pheader.flags == RawProgramHeader32::EXECUTE {
-                                AddrSpace::READ_ONLY
-                            } else if pheader.flags == RawProgramHeader32::WRITE
-                                || pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::WRITE) {
-                                AddrSpace::NO_EXECUTE
-                            } else {
-                                0
-                            };
-
-                            if pheader.header_type == RawProgramHeader32::LOAD && pheader.flags != 0 {
-                                if pheader.file_size > 0 {
-                                    addr_space.map(Some(address::u32_into_vaddr(pheader.vaddr)),
-                                                   &pmem_device, module.addr + pheader.offset as u64,
-                                                   flags, pheader.file_size as usize);
-                                }
-
-                                if pheader.mem_size > pheader.file_size {
-                                    addr_space.map(Some(address::u32_into_vaddr(pheader.vaddr + pheader.file_size)),
-                                                   &zero_device, 0, 0, (pheader.mem_size - pheader.file_size) as usize);
-                                }
-                            }
-                        }
-                    }
-                }).is_ok()
-        } else {
-            false
-        }
+        ProgramImage::parse(module)
+            .map(|image| {
+                addr_space.map_stack(Some(stack_top as VAddr), stack_size);
+
+                // The kernel has already mapped the init server's image, with its data
+                // writable in place, so the mappings only have to describe it.
+                image.map_segments(&mut addr_space, 0);
+            }).is_ok()
     }
 
     pub fn load_module(module: &BootModule) -> Result<Tid, ()> {
         let stack_top = 0xC0000000usize;
         let stack_size = 4096*1024usize;
+        let module = compressed_module::expand(module)
+            .map_err(|(e, msg)| crate::error::log_error(e, msg))?;
+        let image = cached_image(&module)?;
         let pmap = phys_alloc::alloc_phys(BlockSize::Block4k)
             .map(|(addr, _)| addr)
             .map_err(|_| ())?;
 
-        if module.length as usize >= mem::size_of::<RawElfHeader>() {
-            super::is_valid_elf_exe(module.addr)
-                .map(|header|
-                    unsafe {
-                        let entry = header.entry;
-                        (header, syscalls::sys_create_thread(
-                                                   entry as *const c_void,
-                                                   pmap as u32,
-                                                   stack_top as *const c_void))
-                    })
-                .and_then(|(header, tid)| {
-                    if tid == NULL_TID {
-                        Err(())
-                    } else {
-                        let mut addr_space = AddrSpace::new(pmap);
-                        let tid = Tid::new(tid);
-                        let mut pheader_option;
-                        let pmem_device = DeviceId::new_from_tuple((device::mem::MAJOR, device::mem::PMEM_MINOR));
-                        let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
-
-                        addr_space.attach_thread(tid.clone());
-
-                        addr_space.map(Some((stack_top - stack_size + VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                                       &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size - VirtualPage::SMALL_PAGE_SIZE);
-                        addr_space.map(Some((stack_top - stack_size) as VAddr),
-                                       &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
-
-                        for ph_index in 0..header.phnum {
-                            pheader_option = unsafe {
-                                phys::try_from_phys::<RawProgramHeader32>((module.addr + header.phoff as PSize + ph_index as PSize * header.phentsize as PSize) as PAddr)
-                            };
-
-                            if let Some(pheader) = pheader_option {
-                                let flags = if pheader.flags == RawProgramHeader32::READ {
-                                    AddrSpace::READ_ONLY | AddrSpace::NO_EXECUTE
-                                } else if pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::EXECUTE)
-                                    || pheader.flags == RawProgramHeader32::EXECUTE {
-                                    AddrSpace::READ_ONLY
-                                } else if pheader.flags == RawProgramHeader32::WRITE
-                                    || pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::WRITE) {
-                                    AddrSpace::NO_EXECUTE
-                                } else {
-                                    0
-                                };
-
-                                if pheader.header_type == RawProgramHeader32::LOAD && pheader.flags != 0 {
-                                    if pheader.file_size > 0 {
-                                        addr_space.map(Some(address::u32_into_vaddr(pheader.vaddr)),
-                                                       &pmem_device, (module.addr + pheader.offset as PSize) as u64,
-                                                       flags, pheader.file_size as usize);
-                                    }
-
-                                    if pheader.mem_size > pheader.file_size {
-                                        addr_space.map(Some(address::u32_into_vaddr(pheader.vaddr + pheader.file_size)),
-                                                       &zero_device, 0, 0, (pheader.mem_size - pheader.file_size) as usize);
-                                    }
-                                }
-                            }
-                        }
-
-                        let mut thread_info= ThreadInfo::default();
-                        thread_info.status = ThreadInfo::READY;
-
-                        let thread_struct = ThreadStruct::new(thread_info, ThreadInfo::STATUS);
-
-                        mapping::manager::register(addr_space);
-                        syscalls::update_thread(&tid, &thread_struct)
-                        .map(|_| tid)
-                        .map_err(|_| { println!("Unable to update thread"); () })
-                        /*Ok(tid)*/
-                    }
-                })
-        } else {
-            Err(())
-        }
+        let tid = match create_thread(image.entry() as VAddr, pmap, stack_top as VAddr) {
+            Ok(tid) => tid,
+            Err((e, msg)) => {
+                phys_alloc::release_phys(pmap, BlockSize::Block4k);
+                crate::error::log_error(e, msg);
+                return Err(());
+            }
+        };
+
+        let mut addr_space = AddrSpace::new(pmap as PageMapBase);
+
+        addr_space.attach_thread(tid.clone());
+
+        addr_space.map_stack(Some(stack_top as VAddr), stack_size - VirtualPage::SMALL_PAGE_SIZE);
+
+        // Writes to a module's data go to private copies, so that the module
+        // can be loaded again from the same image.
+        image.map_segments(&mut addr_space, AddrSpace::COPY_ON_WRITE);
+        image.map_shared_frames(pmap as PageMapBase);
+
+        mapping::manager::register(addr_space);
+
+        start_thread(&tid)
+            .map(|_| tid)
+            .map_err(|(e, msg)| {
+                crate::error::log_error(e, msg);
+                let _ = mapping::manager::release_thread(&tid);
+            })
+    }
+
+    /// Starts a thread at `entry` in a copy of the address space of `parent`. The copy shares
+    /// the parent's memory until either of them writes to it.
+
+    pub fn fork(parent: &Tid, entry: VAddr, stack_top: VAddr) -> Result<Tid, (Error, Cow<'static, str>)> {
+        let pmap = phys_alloc::alloc_phys(BlockSize::Block4k)
+            .map(|(addr, _)| addr)
+            .map_err(|_| (Error::OutOfMemory, Cow::Borrowed("Unable to allocate a page map")))?;
+
+        let tid = create_thread(entry, pmap, stack_top)
+            .map_err(|e| {
+                phys_alloc::release_phys(pmap, BlockSize::Block4k);
+                e
+            })?;
+
+        // The new thread and its page map are released if this fails
+        mapping::manager::clone_addr_space(parent, pmap as PageMapBase, tid.clone())?;
+
+        start_thread(&tid)
+            .map(|_| tid)
+            .map_err(|e| {
+                let _ = mapping::manager::release_thread(&tid);
+                e
+            })
+    }
+
+    /// Creates a thread that starts at `entry` in the address space whose root page map is
+    /// at `pmap`. The thread doesn't run until it's started with `start_thread()`.
+
+    fn create_thread(entry: VAddr, pmap: PAddr, stack_top: VAddr) -> Result<Tid, (Error, Cow<'static, str>)> {
+        syscalls::create(&CreateArgs::Tcb {
+            entry: entry as *const (),
+            addr_space: Some(pmap as rust::types::PAddr),
+            stack_top: stack_top as *const (),
+        })
+            .ok()
+            .and_then(|tid| Tid::new(tid as CTid))
+            .ok_or((Error::Failed, Cow::Borrowed("Unable to create thread")))
+    }
+
+    fn start_thread(tid: &Tid) -> Result<(), (Error, Cow<'static, str>)> {
+        let mut info = ThreadState::default();
+        info.thread_state = ThreadState::READY as u8;
+
+        syscalls::update(&UpdateArgs::Tcb {
+            tid: Some(tid.clone()),
+            flags: ThreadState::STATUS,
+            info,
+        })
+            .map(|_| ())
+            .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to start thread")))
     }
 }
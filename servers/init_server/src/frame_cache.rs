@@ -0,0 +1,293 @@
+//! Per-thread caches of free 4 KiB frames.
+//!
+//! Every registered thread holds two magazines, small stacks of free frames, that it
+//! allocates from and releases to without touching the physical allocator. When a thread
+//! runs out of both, it trades an empty magazine for a full one from the depot, which is
+//! shared by all threads. When both are full, it trades a full magazine for an empty one.
+//! Only when the depot can't help is a whole magazine refilled from (or flushed to) the
+//! allocator's bitmaps at once, so the allocator's lock is taken once per magazine instead
+//! of once per frame.
+//!
+//! The init server has no thread-local storage, so a thread's cache is found by the stack
+//! that it runs on. Threads without a cache go straight to the allocator.
+
+use core::cell::UnsafeCell;
+use core::mem;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use alloc::vec::Vec;
+use crate::address::PAddr;
+use crate::heap;
+use crate::mutex::Mutex;
+use crate::phys_alloc::{self, AllocError, BlockSize};
+
+/// The number of frames that a magazine holds.
+const MAGAZINE_SIZE: usize = 32;
+
+/// The number of full magazines that the depot keeps before it returns frames to the
+/// allocator.
+const DEPOT_LIMIT: usize = 16;
+
+const MAX_THREAD_CACHES: usize = 16;
+
+struct Magazine {
+    frames: [PAddr; MAGAZINE_SIZE],
+    count: usize,
+}
+
+impl Magazine {
+    const fn empty() -> Self {
+        Self {
+            frames: [0; MAGAZINE_SIZE],
+            count: 0,
+        }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.count == 0
+    }
+
+    fn is_full(&self) -> bool {
+        self.count == MAGAZINE_SIZE
+    }
+
+    fn pop(&mut self) -> Option<PAddr> {
+        if self.is_empty() {
+            None
+        } else {
+            self.count -= 1;
+            Some(self.frames[self.count])
+        }
+    }
+
+    fn push(&mut self, frame: PAddr) -> Result<(), PAddr> {
+        if self.is_full() {
+            Err(frame)
+        } else {
+            self.frames[self.count] = frame;
+            self.count += 1;
+            Ok(())
+        }
+    }
+
+    /// Allocates frames from the allocator until the magazine is full or memory runs out.
+
+    fn refill(&mut self) {
+        self.count += phys_alloc::alloc_phys_frames(&mut self.frames[self.count..]);
+    }
+
+    /// Returns every frame in the magazine to the allocator.
+
+    fn flush(&mut self) {
+        phys_alloc::release_phys_frames(&self.frames[..self.count]);
+        self.count = 0;
+    }
+}
+
+/// Full magazines that are shared by all threads. An empty magazine is just an array, so
+/// only full ones are kept.
+
+struct Depot {
+    full: Vec<Magazine>,
+}
+
+impl Depot {
+    /// Trades an empty magazine for a full one.
+
+    fn exchange_empty(&mut self, empty: &mut Magazine) -> bool {
+        match self.full.pop() {
+            Some(full) => {
+                *empty = full;
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Trades a full magazine for an empty one. Fails if the depot is at its limit.
+
+    fn exchange_full(&mut self, full: &mut Magazine) -> bool {
+        if self.full.len() < DEPOT_LIMIT {
+            self.full.push(mem::replace(full, Magazine::empty()));
+            true
+        } else {
+            false
+        }
+    }
+}
+
+static DEPOT: Mutex<Depot> = Mutex::new(Depot { full: Vec::new() });
+
+struct ThreadCache {
+    loaded: Magazine,
+    previous: Magazine,
+}
+
+impl ThreadCache {
+    const fn new() -> Self {
+        Self {
+            loaded: Magazine::empty(),
+            previous: Magazine::empty(),
+        }
+    }
+
+    fn alloc(&mut self) -> Result<PAddr, AllocError> {
+        if self.loaded.is_empty() {
+            if !self.previous.is_empty() {
+                mem::swap(&mut self.loaded, &mut self.previous);
+            } else if !DEPOT.lock().exchange_empty(&mut self.loaded) {
+                self.loaded.refill();
+            }
+        }
+
+        self.loaded.pop()
+            .ok_or(AllocError::OutOfMemory)
+    }
+
+    fn release(&mut self, frame: PAddr) {
+        if self.loaded.is_full() {
+            if self.previous.is_full() && !DEPOT.lock().exchange_full(&mut self.previous) {
+                self.previous.flush();
+            }
+
+            mem::swap(&mut self.loaded, &mut self.previous);
+        }
+
+        let _ = self.loaded.push(frame);
+    }
+
+    /// Hands the cached frames over to the depot or back to the allocator.
+
+    fn drain(&mut self) {
+        for magazine in [&mut self.loaded, &mut self.previous].iter_mut() {
+            if !magazine.is_full() || !DEPOT.lock().exchange_full(magazine) {
+                magazine.flush();
+            }
+        }
+    }
+}
+
+struct CacheSlot {
+    stack_start: AtomicUsize,
+    stack_end: AtomicUsize,
+    cache: UnsafeCell<ThreadCache>,
+}
+
+// A slot's cache is only ever used by the thread whose stack it's registered with
+unsafe impl Sync for CacheSlot {}
+
+const EMPTY_SLOT: CacheSlot = CacheSlot {
+    stack_start: AtomicUsize::new(0),
+    stack_end: AtomicUsize::new(0),
+    cache: UnsafeCell::new(ThreadCache::new()),
+};
+
+static CACHE_SLOTS: [CacheSlot; MAX_THREAD_CACHES] = [EMPTY_SLOT; MAX_THREAD_CACHES];
+
+/// Gives the thread that runs on the stack `[stack_start, stack_end)` its own frame cache.
+/// Returns `false` if every cache is already taken.
+
+pub fn register_thread(stack_start: usize, stack_end: usize) -> bool {
+    CACHE_SLOTS.iter()
+        .find(|slot| slot.stack_start
+            .compare_exchange(0, stack_start, Ordering::AcqRel, Ordering::Relaxed)
+            .is_ok())
+        .map(|slot| slot.stack_end.store(stack_end, Ordering::Release))
+        .is_some()
+}
+
+/// Releases the frame cache of the current thread. Must be called by the thread itself
+/// before it exits.
+
+pub fn unregister_thread() {
+    if let Some(slot) = current_slot() {
+        unsafe { (*slot.cache.get()).drain() };
+        heap::drain_thread_cache();
+
+        slot.stack_end.store(0, Ordering::Release);
+        slot.stack_start.store(0, Ordering::Release);
+    }
+}
+
+fn current_slot() -> Option<&'static CacheSlot> {
+    current_thread().map(|index| &CACHE_SLOTS[index])
+}
+
+/// Returns a number that identifies the current thread among the registered threads.
+
+pub fn current_thread() -> Option<usize> {
+    let marker = 0u8;
+    let stack_pointer = &marker as *const u8 as usize;
+
+    CACHE_SLOTS.iter()
+        .position(|slot| slot.stack_start.load(Ordering::Acquire) <= stack_pointer
+            && stack_pointer < slot.stack_end.load(Ordering::Acquire))
+}
+
+/// Allocates a 4 KiB frame from the current thread's cache.
+
+pub fn alloc_frame() -> Result<PAddr, AllocError> {
+    match current_slot() {
+        Some(slot) => unsafe { (*slot.cache.get()).alloc() },
+        None => phys_alloc::alloc_phys(BlockSize::Block4k)
+            .map(|(frame, _)| frame),
+    }
+}
+
+/// Returns a 4 KiB frame to the current thread's cache. The frame must not be shared with
+/// another mapping.
+
+pub fn release_frame(frame: PAddr) {
+    match current_slot() {
+        Some(slot) => unsafe { (*slot.cache.get()).release(frame) },
+        None => phys_alloc::release_phys(frame, BlockSize::Block4k),
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn full_magazine(first: PAddr) -> Magazine {
+        let mut magazine = Magazine::empty();
+
+        for i in 0..MAGAZINE_SIZE {
+            magazine.push(first + (i * 0x1000) as PAddr).unwrap();
+        }
+
+        magazine
+    }
+
+    #[test]
+    fn test_magazine() {
+        let mut magazine = full_magazine(0x100000);
+
+        assert!(magazine.is_full());
+        assert_eq!(magazine.push(0x1000), Err(0x1000));
+        assert_eq!(magazine.pop(), Some(0x100000 + ((MAGAZINE_SIZE - 1) * 0x1000) as PAddr));
+        assert_eq!(magazine.count, MAGAZINE_SIZE - 1);
+    }
+
+    #[test]
+    fn test_depot_exchange() {
+        let mut depot = Depot { full: Vec::new() };
+        let mut magazine = Magazine::empty();
+
+        assert!(!depot.exchange_empty(&mut magazine));
+
+        for i in 0..DEPOT_LIMIT {
+            let mut full = full_magazine(0x100000 * (i + 1) as PAddr);
+
+            assert!(depot.exchange_full(&mut full));
+            assert!(full.is_empty());
+        }
+
+        let mut full = full_magazine(0);
+
+        assert!(!depot.exchange_full(&mut full));
+        assert!(full.is_full());
+
+        assert!(depot.exchange_empty(&mut magazine));
+        assert!(magazine.is_full());
+        assert_eq!(magazine.pop(), Some(0x100000 * DEPOT_LIMIT as PAddr + ((MAGAZINE_SIZE - 1) * 0x1000) as PAddr));
+    }
+}
@@ -0,0 +1,589 @@
+#![allow(dead_code)]
+
+//! The init server's heap.
+//!
+//! Small allocations are served from slabs: pages that are cut into objects of one size
+//! class each. Free objects are kept on intrusive lists, one per class, so a freed object is
+//! handed out again by the next allocation of its class. Since `GlobalAlloc` is told the
+//! layout of every block that it frees, blocks carry no headers: the class is worked out from
+//! the layout again. Slab pages stay with their class once they've been cut up.
+//!
+//! Every thread with a frame cache (see `frame_cache`) also has a cache of free objects of
+//! each class, which it allocates from and frees to without taking the heap's lock. Objects
+//! move between a thread's cache and the shared lists in batches.
+//!
+//! Allocations that are larger than the largest class are runs of whole pages, which are
+//! taken first-fit from a list of free runs. Freed runs are merged with their neighbors. The
+//! heap grows through `sbrk`.
+//!
+//! The heap's lock and the physical allocator's lock are never held together. Growing the
+//! heap allocates frames, which takes the physical allocator's lock, and the physical
+//! allocator never allocates from the heap while it holds its own lock. So the heap's lock is
+//! dropped before the heap grows. The methods of `Heap` only ever use pages that the heap
+//! already has, and only `grow()`, which is called without the lock, reaches `sbrk`.
+
+use core::alloc::{GlobalAlloc, Layout};
+use core::cell::UnsafeCell;
+use core::ptr;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use rust::align::Align;
+use crate::frame_cache;
+use crate::mutex::Mutex;
+use crate::page::VirtualPage;
+use crate::sbrk;
+
+const PAGE_SIZE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+/// Every class is a multiple of 16 bytes, so every object is at least 16-byte aligned.
+/// Objects of a class that's a multiple of a larger alignment are aligned to it, too, since
+/// slabs are page-aligned.
+const SIZE_CLASSES: [usize; CLASS_COUNT] = [16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+                                            1536, 2048];
+const CLASS_COUNT: usize = 14;
+
+/// The number of objects that move between a thread's cache and the shared lists at once.
+const BATCH_SIZE: usize = 16;
+
+/// The number of objects of a class that a thread's cache holds before it returns a batch.
+const CACHE_LIMIT: usize = 2 * BATCH_SIZE;
+
+/// The least that the heap grows by at once.
+const MIN_GROWTH: usize = 64 * 1024;
+
+const MAX_THREAD_CACHES: usize = 16;
+
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+struct FreeList {
+    head: *mut FreeObject,
+    count: usize,
+}
+
+impl FreeList {
+    const fn new() -> Self {
+        Self {
+            head: ptr::null_mut(),
+            count: 0,
+        }
+    }
+
+    unsafe fn push(&mut self, object: *mut u8) {
+        let object = object as *mut FreeObject;
+
+        (*object).next = self.head;
+        self.head = object;
+        self.count += 1;
+    }
+
+    unsafe fn pop(&mut self) -> Option<*mut u8> {
+        if self.head.is_null() {
+            None
+        } else {
+            let object = self.head;
+
+            self.head = (*object).next;
+            self.count -= 1;
+            Some(object as *mut u8)
+        }
+    }
+
+    /// Moves up to `count` objects from `other` to this list.
+
+    unsafe fn take(&mut self, other: &mut FreeList, count: usize) {
+        for _ in 0..count {
+            match other.pop() {
+                Some(object) => self.push(object),
+                None => break,
+            }
+        }
+    }
+}
+
+struct FreeRun {
+    pages: usize,
+    next: *mut FreeRun,
+}
+
+/// Free runs of pages, sorted by address.
+
+struct RunList {
+    head: *mut FreeRun,
+    pages: usize,
+}
+
+impl RunList {
+    const fn new() -> Self {
+        Self {
+            head: ptr::null_mut(),
+            pages: 0,
+        }
+    }
+
+    /// Adds the run of `pages` pages at `addr` and merges it with the runs that it touches.
+
+    unsafe fn insert(&mut self, addr: usize, pages: usize) {
+        let mut prev: *mut FreeRun = ptr::null_mut();
+        let mut next = self.head;
+
+        while !next.is_null() && (next as usize) < addr {
+            prev = next;
+            next = (*next).next;
+        }
+
+        let run = addr as *mut FreeRun;
+
+        (*run).pages = pages;
+        (*run).next = next;
+
+        if !next.is_null() && addr + pages * PAGE_SIZE == next as usize {
+            (*run).pages += (*next).pages;
+            (*run).next = (*next).next;
+        }
+
+        if prev.is_null() {
+            self.head = run;
+        } else if prev as usize + (*prev).pages * PAGE_SIZE == addr {
+            (*prev).pages += (*run).pages;
+            (*prev).next = (*run).next;
+        } else {
+            (*prev).next = run;
+        }
+
+        self.pages += pages;
+    }
+
+    /// Takes the first run of `pages` pages that starts at a multiple of `align`.
+
+    unsafe fn remove(&mut self, pages: usize, align: usize) -> Option<usize> {
+        let mut prev: *mut FreeRun = ptr::null_mut();
+        let mut run = self.head;
+
+        while !run.is_null() {
+            let start = run as usize;
+            let end = start + (*run).pages * PAGE_SIZE;
+            let aligned_start = start.align(align);
+
+            if aligned_start + pages * PAGE_SIZE <= end {
+                if prev.is_null() {
+                    self.head = (*run).next;
+                } else {
+                    (*prev).next = (*run).next;
+                }
+
+                self.pages -= (*run).pages;
+
+                // Whatever is left on either side goes back on the list
+
+                let aligned_end = aligned_start + pages * PAGE_SIZE;
+
+                if aligned_end < end {
+                    self.insert(aligned_end, (end - aligned_end) / PAGE_SIZE);
+                }
+
+                if start < aligned_start {
+                    self.insert(start, (aligned_start - start) / PAGE_SIZE);
+                }
+
+                return Some(aligned_start);
+            }
+
+            prev = run;
+            run = (*run).next;
+        }
+
+        None
+    }
+}
+
+/// Statistics of one size class.
+#[derive(Clone, Copy, Default, Debug)]
+pub struct ClassStats {
+    pub size: usize,
+    pub slab_pages: usize,
+    pub allocations: usize,     // Objects that have been allocated since boot
+    pub in_use: usize,
+}
+
+struct Heap {
+    classes: [FreeList; CLASS_COUNT],
+    slab_pages: [usize; CLASS_COUNT],
+    runs: RunList,
+    large_pages: usize,         // Pages in use by allocations that are larger than any class
+    total_pages: usize,
+}
+
+impl Heap {
+    /// Returns the address of a free run of `pages` pages. `None` if the heap has to grow
+    /// first.
+
+    unsafe fn alloc_pages(&mut self, pages: usize, align: usize) -> Option<usize> {
+        self.runs.remove(pages, align.max(PAGE_SIZE))
+    }
+
+    unsafe fn release_pages(&mut self, addr: usize, pages: usize) {
+        self.runs.insert(addr, pages);
+    }
+
+    /// Cuts a new slab into objects of a class.
+
+    unsafe fn add_slab(&mut self, class: usize) -> bool {
+        let size = SIZE_CLASSES[class];
+
+        match self.alloc_pages(1, PAGE_SIZE) {
+            Some(page) => {
+                for object in (page..page + PAGE_SIZE - size + 1).step_by(size).rev() {
+                    self.classes[class].push(object as *mut u8);
+                }
+
+                self.slab_pages[class] += 1;
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Moves a batch of objects of a class to `list`. Returns `false` if there are no objects
+    /// of the class left and the heap has to grow first.
+
+    unsafe fn fill(&mut self, class: usize, list: &mut FreeList, count: usize) -> bool {
+        if self.classes[class].count < count && !self.add_slab(class) && self.classes[class].count == 0 {
+            return false;
+        }
+
+        list.take(&mut self.classes[class], count);
+        true
+    }
+}
+
+static HEAP: Mutex<Heap> = Mutex::new(Heap {
+    classes: [const { FreeList::new() }; CLASS_COUNT],
+    slab_pages: [0; CLASS_COUNT],
+    runs: RunList::new(),
+    large_pages: 0,
+    total_pages: 0,
+});
+
+/// Grows the heap by enough pages for a run of `pages` pages that starts at a multiple of
+/// `align`. Must be called without the heap's lock held. The new pages may be taken by
+/// another thread before the caller gets to them, so the caller tries again afterwards.
+/// Returns `false` if the heap can't grow.
+
+fn grow(pages: usize, align: usize) -> bool {
+    let align = align.max(PAGE_SIZE);
+    let length = (pages * PAGE_SIZE + align - PAGE_SIZE).max(MIN_GROWTH);
+
+    match sbrk::extend_pages(length) {
+        Some(start) => {
+            let mut heap = HEAP.lock();
+
+            heap.total_pages += length / PAGE_SIZE;
+            unsafe { heap.runs.insert(start, length / PAGE_SIZE) };
+            true
+        },
+        None => false,
+    }
+}
+
+/// Moves up to `count` objects of a class to `list`, growing the heap if it has none left.
+
+unsafe fn fill(class: usize, list: &mut FreeList, count: usize) -> bool {
+    loop {
+        if HEAP.lock().fill(class, list, count) {
+            return true;
+        } else if !grow(1, PAGE_SIZE) {
+            return false;
+        }
+    }
+}
+
+/// Returns the address of a run of `pages` pages for a large allocation, growing the heap
+/// if there isn't one.
+
+unsafe fn alloc_large(pages: usize, align: usize) -> Option<usize> {
+    loop {
+        {
+            let mut heap = HEAP.lock();
+
+            if let Some(addr) = heap.alloc_pages(pages, align) {
+                heap.large_pages += pages;
+                return Some(addr);
+            }
+        }
+
+        if !grow(pages, align) {
+            return None;
+        }
+    }
+}
+
+static ALLOCATIONS: [AtomicUsize; CLASS_COUNT] = [const { AtomicUsize::new(0) }; CLASS_COUNT];
+static RELEASES: [AtomicUsize; CLASS_COUNT] = [const { AtomicUsize::new(0) }; CLASS_COUNT];
+
+struct ThreadCache {
+    lists: UnsafeCell<[FreeList; CLASS_COUNT]>,
+}
+
+// A cache is only ever used by the thread that `frame_cache` knows by the same index
+unsafe impl Sync for ThreadCache {}
+
+static THREAD_CACHES: [ThreadCache; MAX_THREAD_CACHES] = [const {
+    ThreadCache { lists: UnsafeCell::new([const { FreeList::new() }; CLASS_COUNT]) }
+}; MAX_THREAD_CACHES];
+
+fn thread_cache() -> Option<&'static mut [FreeList; CLASS_COUNT]> {
+    frame_cache::current_thread()
+        .and_then(|index| THREAD_CACHES.get(index))
+        .map(|cache| unsafe { &mut *cache.lists.get() })
+}
+
+/// Returns the smallest class whose objects fit `layout` and are aligned for it. `None`
+/// if the allocation needs whole pages.
+
+fn class_of(layout: &Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align());
+
+    SIZE_CLASSES.iter()
+        .position(|class| *class >= size && *class % layout.align() == 0)
+}
+
+fn page_count(layout: &Layout) -> usize {
+    layout.size().align(PAGE_SIZE) / PAGE_SIZE
+}
+
+unsafe fn alloc_object(class: usize) -> *mut u8 {
+    let object = match thread_cache() {
+        Some(lists) => {
+            let list = &mut lists[class];
+
+            if list.count == 0 {
+                fill(class, list, BATCH_SIZE);
+            }
+
+            list.pop()
+        },
+        None => {
+            let mut list = FreeList::new();
+
+            fill(class, &mut list, 1);
+            list.pop()
+        },
+    };
+
+    match object {
+        Some(object) => {
+            ALLOCATIONS[class].fetch_add(1, Ordering::Relaxed);
+            object
+        },
+        None => ptr::null_mut(),
+    }
+}
+
+unsafe fn release_object(object: *mut u8, class: usize) {
+    RELEASES[class].fetch_add(1, Ordering::Relaxed);
+
+    match thread_cache() {
+        Some(lists) => {
+            let list = &mut lists[class];
+
+            list.push(object);
+
+            if list.count > CACHE_LIMIT {
+                HEAP.lock().classes[class].take(list, BATCH_SIZE);
+            }
+        },
+        None => HEAP.lock().classes[class].push(object),
+    }
+}
+
+/// Returns the objects in the current thread's cache to the shared lists. Must be called by
+/// the thread itself before it exits.
+
+pub fn drain_thread_cache() {
+    if let Some(lists) = thread_cache() {
+        let mut heap = HEAP.lock();
+
+        for (class, list) in lists.iter_mut().enumerate() {
+            let count = list.count;
+
+            unsafe { heap.classes[class].take(list, count) };
+        }
+    }
+}
+
+/// Returns the statistics of every size class.
+
+pub fn class_stats() -> [ClassStats; CLASS_COUNT] {
+    let heap = HEAP.lock();
+    let mut stats = [ClassStats::default(); CLASS_COUNT];
+
+    for (class, class_stats) in stats.iter_mut().enumerate() {
+        let allocations = ALLOCATIONS[class].load(Ordering::Relaxed);
+
+        *class_stats = ClassStats {
+            size: SIZE_CLASSES[class],
+            slab_pages: heap.slab_pages[class],
+            allocations,
+            in_use: allocations.saturating_sub(RELEASES[class].load(Ordering::Relaxed)),
+        };
+    }
+
+    stats
+}
+
+/// Prints the heap's statistics over the debug console.
+
+pub fn dump_stats() {
+    let (total_pages, free_pages, large_pages) = {
+        let heap = HEAP.lock();
+
+        (heap.total_pages, heap.runs.pages, heap.large_pages)
+    };
+
+    eprintfln!("Heap: {} pages ({} free, {} in large allocations)", total_pages, free_pages, large_pages);
+
+    for stats in class_stats().iter().filter(|stats| stats.slab_pages > 0) {
+        eprintfln!("  {:>5} bytes: {:>4} slab pages, {:>7} in use, {:>9} allocated", stats.size,
+                   stats.slab_pages, stats.in_use, stats.allocations);
+    }
+}
+
+pub struct SizeClassAllocator;
+
+unsafe impl GlobalAlloc for SizeClassAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        match class_of(&layout) {
+            Some(class) => alloc_object(class),
+            None => alloc_large(page_count(&layout), layout.align())
+                .map_or(ptr::null_mut(), |addr| addr as *mut u8),
+        }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        match class_of(&layout) {
+            Some(class) => release_object(ptr, class),
+            None => {
+                let pages = page_count(&layout);
+                let mut heap = HEAP.lock();
+
+                heap.large_pages -= pages;
+                heap.release_pages(ptr as usize, pages);
+            },
+        }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+
+        // The block already has room if the new size lands in the same class or page count
+        let fits = match (class_of(&layout), class_of(&new_layout)) {
+            (Some(class), Some(new_class)) => class == new_class,
+            (None, None) => page_count(&layout) == page_count(&new_layout),
+            _ => false,
+        };
+
+        if fits {
+            return ptr;
+        }
+
+        let new_ptr = self.alloc(new_layout);
+
+        if !new_ptr.is_null() {
+            ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+            self.dealloc(ptr, layout);
+        }
+
+        new_ptr
+    }
+}
+
+#[cfg(test)]
+mod test {
+    extern crate std;
+
+    use super::*;
+    use std::vec::Vec;
+
+    #[repr(C, align(4096))]
+    struct Page([u8; PAGE_SIZE]);
+
+    fn pages(count: usize) -> Vec<Page> {
+        (0..count).map(|_| Page([0; PAGE_SIZE])).collect()
+    }
+
+    #[test]
+    fn test_class_of() {
+        let class = |size, align| class_of(&Layout::from_size_align(size, align).unwrap())
+            .map(|class| SIZE_CLASSES[class]);
+
+        assert_eq!(class(1, 1), Some(16));
+        assert_eq!(class(40, 8), Some(48));
+        assert_eq!(class(40, 32), Some(64));
+        assert_eq!(class(100, 256), Some(256));
+        assert_eq!(class(2048, 8), Some(2048));
+        assert_eq!(class(2049, 8), None);
+        assert_eq!(class(8, 4096), None);
+    }
+
+    #[test]
+    fn test_runs_merge() {
+        let buffer = pages(8);
+        let base = buffer.as_ptr() as usize;
+        let mut runs = RunList::new();
+
+        unsafe {
+            runs.insert(base, 2);
+            runs.insert(base + 4 * PAGE_SIZE, 4);
+            runs.insert(base + 2 * PAGE_SIZE, 2);
+
+            assert_eq!(runs.pages, 8);
+            assert_eq!((*runs.head).pages, 8);
+            assert!((*runs.head).next.is_null());
+
+            assert_eq!(runs.remove(3, PAGE_SIZE), Some(base));
+            assert_eq!(runs.remove(6, PAGE_SIZE), None);
+            assert_eq!(runs.remove(5, PAGE_SIZE), Some(base + 3 * PAGE_SIZE));
+            assert!(runs.head.is_null());
+        }
+    }
+
+    #[test]
+    fn test_runs_align() {
+        let buffer = pages(8);
+        let base = buffer.as_ptr() as usize;
+        let align = 2 * PAGE_SIZE;
+        let mut runs = RunList::new();
+
+        unsafe {
+            runs.insert(base, 8);
+
+            let addr = runs.remove(1, align).unwrap();
+
+            assert_eq!(addr % align, 0);
+            assert_eq!(runs.pages, 7);
+
+            runs.insert(addr, 1);
+            assert_eq!((*runs.head).pages, 8);
+        }
+    }
+
+    #[test]
+    fn test_free_list_take() {
+        let mut buffer = pages(1);
+        let mut list = FreeList::new();
+        let mut other = FreeList::new();
+
+        unsafe {
+            for object in buffer[0].0.chunks_exact_mut(64) {
+                other.push(object.as_mut_ptr());
+            }
+
+            list.take(&mut other, BATCH_SIZE);
+
+            assert_eq!(list.count, BATCH_SIZE);
+            assert_eq!(other.count, PAGE_SIZE / 64 - BATCH_SIZE);
+            assert_eq!(list.pop(), Some(buffer[0].0.as_mut_ptr().add((PAGE_SIZE / 64 - BATCH_SIZE) * 64)));
+        }
+    }
+}
@@ -0,0 +1,262 @@
+//! Transparent large pages.
+//!
+//! A 4 MiB-aligned range of an anonymous mapping is collapsed into a single PSE page once all
+//! of its pages are resident and none of its frames is shared with another mapping. If the
+//! range's frames already happen to be contiguous and aligned, then only the page directory
+//! entry has to change. Otherwise, the pages are first migrated into a newly allocated 4 MiB
+//! block. A large page is split back
+//! into 4 KiB pages before only part of it is unmapped or write-protected.
+
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use rust::align::Align;
+use rust::syscalls::flags;
+use crate::address::{PAddr, VAddr};
+use crate::error::Error;
+use crate::lowlevel;
+use crate::mapping::{self, AddrSpace};
+use crate::mutex::Mutex;
+use crate::page::{FrameSize, PageMapBase, PhysicalFrame};
+use crate::phys_alloc::{self, BlockSize};
+use crate::rmap;
+use crate::swap;
+
+const LARGE_PAGE_SIZE: usize = PhysicalFrame::PSE_LARGE_PAGE_SIZE;
+const PAGES_PER_LARGE_PAGE: usize = LARGE_PAGE_SIZE / PhysicalFrame::SMALL_PAGE_SIZE;
+
+// Every page of a range must have the same value for these flags to be collapsed
+const PROTECTION_FLAGS: u32 = flags::mapping::READ_ONLY | flags::mapping::UNCACHED | flags::mapping::WRITE_THRU;
+
+// Held for the whole scan, so only one thread scans at a time
+static SCAN_CURSOR: Mutex<(PageMapBase, usize)> = Mutex::new((0, 0));
+
+/// Examines up to `budget` candidate ranges, continuing where the last scan stopped.
+/// Returns the number of ranges that were collapsed into large pages. Address spaces that
+/// are locked by another thread are passed over.
+
+pub fn scan(budget: usize) -> usize {
+    let mut saved_cursor = SCAN_CURSOR.lock();
+    let mut cursor = *saved_cursor;
+    let mut promoted = 0;
+    let mut wrapped = false;
+
+    for _ in 0..budget {
+        match mapping::manager::next_large_page_range(cursor.0, cursor.1) {
+            Some((root_pmap, base)) => {
+                let is_promoted = mapping::manager::try_lock(root_pmap)
+                    .map_or(false, |addr_space| promote(&addr_space, base) == Ok(true));
+
+                if is_promoted {
+                    promoted += 1;
+                }
+
+                cursor = (root_pmap, base + LARGE_PAGE_SIZE);
+            },
+            None if !wrapped => {
+                cursor = (0, 0);
+                wrapped = true;
+            },
+            None => break,
+        }
+    }
+
+    *saved_cursor = cursor;
+    promoted
+}
+
+/// Returns the first frame if the frames are physically contiguous and the first one is
+/// aligned to a large page.
+
+fn contiguous_base(frames: &[PAddr]) -> Option<PAddr> {
+    let base = *frames.first()?;
+
+    Some(base)
+        .filter(|base| base.is_aligned(LARGE_PAGE_SIZE as PAddr))
+        .filter(|base| frames.iter()
+            .enumerate()
+            .all(|(i, frame)| *frame == base + (i * PhysicalFrame::SMALL_PAGE_SIZE) as PAddr))
+}
+
+/// Tries to collapse the 4 MiB range at `base` into a large page. Returns `false` if some
+/// page of the range isn't resident or the range can't be mapped by a single page.
+
+fn promote(addr_space: &AddrSpace, base: usize) -> Result<bool, Error> {
+    let root_pmap = addr_space.root_pmap();
+    let (table, table_flags) = lowlevel::lookup_page_table(Some(root_pmap), base as *const ())
+        .map_err(|_| Error::Failed)?;
+
+    if rust::is_flag_set!(table_flags, flags::mapping::UNMAPPED)
+        || rust::is_flag_set!(table_flags, flags::mapping::PAGE_SIZED) {
+        return Ok(false);
+    }
+
+    let mut pages = vec![(0 as PAddr, 0u32); PAGES_PER_LARGE_PAGE];
+
+    lowlevel::lookup_pages(Some(root_pmap), base as *const (), &mut pages)
+        .map_err(|_| Error::Failed)?;
+
+    let protection = pages[0].1 & PROTECTION_FLAGS;
+
+    if pages.iter().any(|(_, page_flags)| rust::is_flag_set!(*page_flags, flags::mapping::UNMAPPED)
+        || page_flags & PROTECTION_FLAGS != protection) {
+        return Ok(false);
+    }
+
+    let frames = pages.iter()
+        .map(|(frame, _)| *frame)
+        .collect::<Vec<_>>();
+
+    if !is_collapsible(addr_space, base, &frames) {
+        return Ok(false);
+    }
+
+    // The swap slots of the range are released below, so the large page is marked dirty to
+    // keep its pages from being mistaken for clean zero-filled pages after a split.
+    let large_flags = protection | flags::mapping::DIRTY | flags::mapping::PAGE_SIZED
+        | flags::mapping::OVERWRITE;
+
+    let large_frame = if let Some(large_frame) = contiguous_base(&frames) {
+        unsafe { lowlevel::map(Some(root_pmap), base as *mut c_void, large_frame, large_flags) }
+            .map_err(|_| Error::Failed)?;
+        large_frame
+    } else {
+        migrate(root_pmap, base, &frames, protection, large_flags)?
+    };
+
+    rmap::unmap_range(root_pmap, base, base + LARGE_PAGE_SIZE);
+    rmap::map(large_frame, root_pmap, base);
+
+    // The old page table was taken from the kernel's frame reserve
+
+    if phys_alloc::phys_ref_count(table.address()) == 1 {
+        phys_alloc::release_phys(table.address(), BlockSize::Block4k);
+    }
+
+    swap::discard(root_pmap, base, base + LARGE_PAGE_SIZE);
+    Ok(true)
+}
+
+/// Only frames of anonymous memory that aren't shared with another mapping may be collapsed
+/// or moved.
+
+fn is_collapsible(addr_space: &AddrSpace, base: usize, frames: &[PAddr]) -> bool {
+    addr_space.get_mapping(base as VAddr)
+        .map_or(false, |mapping| mapping.is_anonymous())
+        && frames.iter().all(|frame| phys_alloc::phys_ref_count(*frame) == 1)
+}
+
+/// Copies the pages of a range into a new 4 MiB block and maps the block as a large page.
+/// Returns the block.
+
+fn migrate(root_pmap: PageMapBase, base: usize, frames: &[PAddr], protection: u32, large_flags: u32) -> Result<PAddr, Error> {
+    let (large_frame, _) = phys_alloc::alloc_phys(BlockSize::Block4M)
+        .map_err(|_| Error::OutOfMemory)?;
+
+    let restore_flags = protection | flags::mapping::DIRTY | flags::mapping::OVERWRITE;
+
+    // The pages are write-protected while they're being copied, so that no write gets lost.
+    // A write in the meantime faults and is retried once the large page is in place.
+
+    let result = unsafe {
+        lowlevel::map_frames(Some(root_pmap), base as *mut c_void, frames,
+                             restore_flags | flags::mapping::READ_ONLY)
+            .map_err(|_| Error::Failed)
+            .and_then(|_| frames.iter()
+                .enumerate()
+                .try_for_each(|(i, frame)| lowlevel::phys::copy_frame(
+                    large_frame + (i * PhysicalFrame::SMALL_PAGE_SIZE) as PAddr, *frame)))
+            .and_then(|_| lowlevel::map(Some(root_pmap), base as *mut c_void, large_frame, large_flags)
+                .map_err(|_| Error::Failed))
+    };
+
+    match result {
+        Ok(_) => {
+            for frame in frames {
+                swap::release_frame(*frame);
+            }
+
+            Ok(large_frame)
+        },
+        Err(e) => {
+            let _ = unsafe { lowlevel::map_frames(Some(root_pmap), base as *mut c_void, frames, restore_flags) };
+            phys_alloc::release_phys(large_frame, BlockSize::Block4M);
+            Err(e)
+        }
+    }
+}
+
+/// Splits the large page that covers `addr` into 4 KiB pages that map the same frames.
+/// Returns `false` if `addr` isn't mapped to a large page.
+
+pub fn split(addr_space: &AddrSpace, addr: usize) -> Result<bool, Error> {
+    let root_pmap = addr_space.root_pmap();
+    let base = addr.align_trunc(LARGE_PAGE_SIZE);
+
+    let (large_frame, large_flags) = lowlevel::lookup_page_table(Some(root_pmap), base as *const ())
+        .map_err(|_| Error::Failed)?;
+
+    if rust::is_flag_set!(large_flags, flags::mapping::UNMAPPED)
+        || rust::is_flag_cleared!(large_flags, flags::mapping::PAGE_SIZED)
+        || large_frame.frame_size() != FrameSize::PseLarge {
+        return Ok(false);
+    }
+
+    let table = swap::alloc_frame()?;
+    let frames = (0..PAGES_PER_LARGE_PAGE)
+        .map(|i| large_frame.address() + (i * PhysicalFrame::SMALL_PAGE_SIZE) as PAddr)
+        .collect::<Vec<_>>();
+    let page_flags = (large_flags & (PROTECTION_FLAGS | flags::mapping::DIRTY)) | flags::mapping::OVERWRITE;
+
+    // The range is briefly unmapped while the page table is empty. The kernel mustn't
+    // zero-fill any of its pages in the meantime.
+
+    if lowlevel::revoke_anon_region(Some(root_pmap), base, LARGE_PAGE_SIZE).is_err() {
+        let _ = lowlevel::revoke_anon_region(Some(root_pmap), 0, 0);
+    }
+
+    let result = unsafe {
+        lowlevel::map_page_table(Some(root_pmap), base as *mut (), table, flags::mapping::OVERWRITE)
+            .and_then(|_| lowlevel::map_frames(Some(root_pmap), base as *mut c_void, &frames, page_flags))
+    };
+
+    if result.is_err() {
+        let restore_flags = (large_flags & (PROTECTION_FLAGS | flags::mapping::DIRTY))
+            | flags::mapping::PAGE_SIZED | flags::mapping::OVERWRITE;
+
+        let _ = unsafe { lowlevel::map(Some(root_pmap), base as *mut c_void, large_frame.address(), restore_flags) };
+        swap::release_frame(table);
+    } else {
+        rmap::unmap(root_pmap, base);
+
+        for (i, frame) in frames.iter().enumerate() {
+            rmap::map(*frame, root_pmap, base + i * PhysicalFrame::SMALL_PAGE_SIZE);
+        }
+    }
+
+    addr_space.delegate_anon_range(base, base + LARGE_PAGE_SIZE);
+
+    result
+        .map(|_| true)
+        .map_err(|_| Error::Failed)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_contiguous_base() {
+        let frames = (0..PAGES_PER_LARGE_PAGE)
+            .map(|i| 0x800000 + (i * PhysicalFrame::SMALL_PAGE_SIZE) as PAddr)
+            .collect::<Vec<_>>();
+
+        assert_eq!(contiguous_base(&frames), Some(0x800000));
+        assert_eq!(contiguous_base(&frames[1..]), None);
+
+        let mut gap = frames.clone();
+
+        gap[17] += 0x1000;
+        assert_eq!(contiguous_base(&gap), None);
+        assert_eq!(contiguous_base(&[]), None);
+    }
+}
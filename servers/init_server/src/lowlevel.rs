@@ -1,22 +1,20 @@
 use crate::address::PAddr;
+use crate::heap::SizeClassAllocator;
 use crate::mutex::Mutex;
 use crate::page::{FrameSize, PhysicalFrame};
 use alloc::string::ToString;
-use core::alloc::{GlobalAlloc, Layout};
+use alloc::vec::Vec;
+use core::alloc::Layout;
 use core::ffi::c_void;
 use core::fmt::Write;
 use core::panic::PanicInfo;
 use rust::io;
-use rust::syscalls::{self, flags, CPageMap, PageMapping, SyscallError};
+use rust::syscalls::{self, flags, CPageMap, CreateArgs, DestroyArgs, PageMapping, ReadArgs, SyscallError, UpdateArgs};
 
 static BASE_CHARS: &'static [u8] = b"0123456789abcdefghijklmnopqrstuvwxyz";
 
 #[link(name = "c", kind = "static")]
 extern "C" {
-    fn malloc(length: usize) -> *mut c_void;
-    fn calloc(num_blocks: usize, block_size: usize) -> *mut c_void;
-    fn free(buffer: *mut c_void);
-    fn realloc(buffer: *mut c_void, new_length: usize) -> *mut c_void;
     fn abort() -> !;
 }
 
@@ -176,20 +174,30 @@ pub fn print_debug_i32(num: i32, base: u32) {
 }
 */
 
+/// Reads the processor's time-stamp counter.
+
+#[inline]
+pub fn read_tsc() -> u64 {
+    #[cfg(target_arch = "x86")]
+    unsafe { core::arch::x86::_rdtsc() }
+
+    #[cfg(target_arch = "x86_64")]
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
 pub mod phys {
-    use super::Mutex;
     use super::GLOBAL_ALLOCATOR;
     use crate::address::{PAddr, PSize};
     use crate::error::Error;
-    use crate::page::{FrameSize, PhysicalFrame, VirtualPage};
+    use crate::page::{PhysicalFrame, VirtualPage};
     use crate::phys_alloc::{self, BlockSize};
     use alloc::boxed::Box;
     use alloc::vec::Vec;
     use core::alloc::{GlobalAlloc, Layout};
     use core::ffi::c_void;
     use core::ops::{Deref, DerefMut, Index};
-    use core::{cmp, mem};
-    use crate::mutex::MutexGuard;
+    use core::{cmp, mem, ptr};
+    use core::sync::atomic::{AtomicBool, AtomicU32, Ordering};
     use rust::align::Align;
     use rust::syscalls::SyscallError;
 
@@ -202,13 +210,110 @@ pub mod phys {
         static mut PAGE_MAP_AREA: [u8; 0x400000];
     }
 
-    // FIXME: Instead of using an array of bools, use the page map area to create
-    // a data structure
-    static PMAP_STATUS: Mutex<[bool; 1024]> = Mutex::new([false; 1024]);
+    /// The number of pages in the page map area.
+    const WINDOW_PAGES: usize = 1024;
+
+    /// The number of pages at the end of the page map area that are each reserved for one
+    /// thread (by its index in `frame_cache`). Most temporary mappings are of a single frame,
+    /// and a thread maps them through its own page without searching the bitmap.
+    const THREAD_WINDOWS: usize = 16;
+
+    const SLOT_WORDS: usize = WINDOW_PAGES / u32::BITS as usize;
+
+    /// One bit per page of the page map area that's in use. A run of at most 32 pages is
+    /// claimed within one word with a single compare-and-swap. Longer runs claim whole words.
+    static SLOT_BITMAP: [AtomicU32; SLOT_WORDS] = initial_slots();
+
+    static THREAD_WINDOW_BUSY: [AtomicBool; THREAD_WINDOWS] = [const { AtomicBool::new(false) }; THREAD_WINDOWS];
+
+    const fn initial_slots() -> [AtomicU32; SLOT_WORDS] {
+        let mut slots = [const { AtomicU32::new(0) }; SLOT_WORDS];
+
+        // The threads' own pages are never handed out from the bitmap
+        slots[SLOT_WORDS - 1] = AtomicU32::new(!0u32 << (u32::BITS as usize - THREAD_WINDOWS));
+        slots
+    }
+
+    fn run_mask(count: usize) -> u32 {
+        if count >= u32::BITS as usize {
+            u32::MAX
+        } else {
+            (1u32 << count) - 1
+        }
+    }
+
+    /// Returns the position of the first run of `count` clear bits in `word`.
+
+    fn free_run(word: u32, count: usize) -> Option<usize> {
+        let mask = run_mask(count);
+
+        (0..=u32::BITS as usize - count).find(|shift| word & (mask << shift) == 0)
+    }
+
+    /// Claims `count` consecutive pages of the page map area. Returns the index of the first.
+
+    fn claim_slots(count: usize) -> Option<usize> {
+        let word_bits = u32::BITS as usize;
+
+        if count == 0 || count > WINDOW_PAGES {
+            None
+        } else if count <= word_bits {
+            let mask = run_mask(count);
+
+            for (index, word) in SLOT_BITMAP.iter().enumerate() {
+                let mut current = word.load(Ordering::Relaxed);
+
+                while let Some(shift) = free_run(current, count) {
+                    match word.compare_exchange_weak(current, current | (mask << shift),
+                                                     Ordering::Acquire, Ordering::Relaxed) {
+                        Ok(_) => return Some(index * word_bits + shift),
+                        Err(actual) => current = actual,
+                    }
+                }
+            }
+
+            None
+        } else {
+            let words = (count + word_bits - 1) / word_bits;
+
+            'search: for first in 0..=SLOT_WORDS - words {
+                for i in 0..words {
+                    if SLOT_BITMAP[first + i].compare_exchange(0, u32::MAX, Ordering::Acquire,
+                                                               Ordering::Relaxed).is_err() {
+                        for word in SLOT_BITMAP[first..first + i].iter() {
+                            word.store(0, Ordering::Release);
+                        }
+
+                        continue 'search;
+                    }
+                }
+
+                return Some(first * word_bits);
+            }
+
+            None
+        }
+    }
+
+    /// Releases pages that were claimed by `claim_slots(count)`.
+
+    fn release_slots(first: usize, count: usize) {
+        let word_bits = u32::BITS as usize;
+
+        if count <= word_bits {
+            SLOT_BITMAP[first / word_bits].fetch_and(!(run_mask(count) << (first % word_bits)),
+                                                     Ordering::Release);
+        } else {
+            for word in SLOT_BITMAP[first / word_bits..].iter().take((count + word_bits - 1) / word_bits) {
+                word.store(0, Ordering::Release);
+            }
+        }
+    }
 
     pub struct PageMapArea<'a> {
         slice: &'a mut [u8],
         has_frames_mapped: bool,
+        thread_window: Option<usize>,   // The index of the thread whose page this is
     }
 
     impl<'a> PageMapArea<'a> {
@@ -246,86 +351,74 @@ pub mod phys {
             PageMapArea::new_from_frames(&[addr])
         }
 
-        fn acquire_buffer(
-            guard: &mut MutexGuard<'_, [bool; 1024]>,
-            size: usize,
-        ) -> Option<&'static mut [u8]> {
+        /// Reserves pages of the page map area. Returns the pages and the index of the thread
+        /// window, if that's what they are.
+
+        fn acquire_buffer(page_count: usize) -> Option<(&'static mut [u8], Option<usize>)> {
+            let page_size = VirtualPage::SMALL_PAGE_SIZE;
+
+            let thread_window = if page_count == 1 {
+                crate::frame_cache::current_thread()
+                    .filter(|index| *index < THREAD_WINDOWS
+                        && !THREAD_WINDOW_BUSY[*index].swap(true, Ordering::Acquire))
+            } else {
+                None
+            };
+
+            let first = match thread_window {
+                Some(index) => WINDOW_PAGES - THREAD_WINDOWS + index,
+                None => claim_slots(page_count)?,
+            };
+
             unsafe {
-                if size <= PAGE_MAP_AREA.len() {
-                    let mut len = 0;
-                    let mut offset = 0;
-
-                    for i in 0..guard.len() {
-                        if !guard[i] {
-                            len += 1;
-                        } else {
-                            len = 0;
-                            offset = i + 1;
-                            continue;
-                        };
-
-                        if len * VirtualPage::SMALL_PAGE_SIZE >= size {
-                            for x in offset..offset+len {
-                                guard[x] = true;
-                            }
-                            return Some(
-                                &mut PAGE_MAP_AREA[offset * VirtualPage::SMALL_PAGE_SIZE
-                                    ..(offset + len) * VirtualPage::SMALL_PAGE_SIZE],
-                            );
-                        }
-                    }
-                }
+                let area = &mut *ptr::addr_of_mut!(PAGE_MAP_AREA);
+
+                Some((&mut area[first * page_size..(first + page_count) * page_size], thread_window))
             }
-            None
         }
 
-        fn release_buffer(guard: &mut MutexGuard<'_, [bool; 1024]>, buffer: &mut [u8]) {
-            unsafe {
-                let buffer_start = (buffer.as_ptr() as usize) - (PAGE_MAP_AREA.as_ptr() as usize);
-                let buffer_end = buffer_start + buffer.len();
+        fn release_buffer(buffer: &mut [u8], thread_window: Option<usize>) {
+            match thread_window {
+                Some(index) => THREAD_WINDOW_BUSY[index].store(false, Ordering::Release),
+                None => {
+                    let offset = buffer.as_ptr() as usize - ptr::addr_of!(PAGE_MAP_AREA) as usize;
 
-                for i in (buffer_start / VirtualPage::SMALL_PAGE_SIZE)
-                    ..(buffer_end / VirtualPage::SMALL_PAGE_SIZE)
-                {
-                    guard[i] = false;
-                }
+                    release_slots(offset / VirtualPage::SMALL_PAGE_SIZE,
+                                  buffer.len() / VirtualPage::SMALL_PAGE_SIZE);
+                },
             }
         }
 
+        /// Maps frames into the page map area. The frames are mapped with one system call per
+        /// 32 frames.
+
         pub unsafe fn new_from_frames(frames: &[PAddr]) -> Option<PageMapArea<'a>> {
-            let size = frames.len() * VirtualPage::SMALL_PAGE_SIZE;
-
-            if size > 0 && size <= PAGE_MAP_AREA.len() {
-                let mut guard = PMAP_STATUS.lock();
-
-                Self::acquire_buffer(&mut guard, size).and_then(|base_ref| {
-                    match super::map_frames(None, base_ref.as_ptr() as *mut c_void, &frames, 0) {
-                        Ok(_) => Some(Self {
-                            slice: base_ref,
-                            has_frames_mapped: false,
-                        }),
-                        Err(SyscallError::PartiallyMapped(pages_mapped)) => {
-                            eprintfln!(
-                                "new_from_frames failed. only mapped {} pages instead of {}.",
-                                pages_mapped,
-                                frames.len()
-                            );
-
-                            let mut v = base_ref.as_ptr();
-
-                            for _ in 0..pages_mapped {
-                                let frame = super::unmap(None, v as *mut ()).ok()?;
-
-                                v = v.wrapping_add(frame.frame_size().bytes());
-                            }
+            if frames.is_empty() || frames.len() > WINDOW_PAGES {
+                return None;
+            }
 
-                            None
-                        }
-                        Err(_) => None,
+            let (buffer, thread_window) = Self::acquire_buffer(frames.len())?;
+
+            match super::map_frames(None, buffer.as_ptr() as *mut c_void, &frames, 0) {
+                Ok(_) => Some(Self {
+                    slice: buffer,
+                    has_frames_mapped: false,
+                    thread_window,
+                }),
+                Err(e) => {
+                    if let SyscallError::PartiallyMapped(pages_mapped) = e {
+                        eprintfln!(
+                            "new_from_frames failed. only mapped {} pages instead of {}.",
+                            pages_mapped,
+                            frames.len()
+                        );
+
+                        let _ = super::unmap_pages(None, buffer.as_mut_ptr() as *mut (), pages_mapped);
                     }
-                })
-            } else {
-                None
+
+                    Self::release_buffer(buffer, thread_window);
+                    None
+                },
             }
         }
     }
@@ -359,27 +452,26 @@ pub mod phys {
 
     impl<'a> Drop for PageMapArea<'a> {
         fn drop(&mut self) {
-            let mut guard = PMAP_STATUS.lock();
-
-            let mut v = self.slice.as_ptr();
+            let page_count = self.slice.len() / VirtualPage::SMALL_PAGE_SIZE;
 
-            (0..self.slice.len() / VirtualPage::SMALL_PAGE_SIZE).for_each(|_| {
-                let frame =
-                    unsafe { super::unmap(None, v as *mut ()).expect("Unable to unmap memory") };
+            if self.has_frames_mapped {
+                let mut v = self.slice.as_ptr();
 
-                let block_size = match frame.frame_size() {
-                    FrameSize::PseLarge => BlockSize::Block4M,
-                    _ => BlockSize::Block4k,
-                };
+                (0..page_count).for_each(|_| {
+                    let frame =
+                        unsafe { super::unmap(None, v as *mut ()).expect("Unable to unmap memory") };
 
-                if self.has_frames_mapped {
-                    phys_alloc::release_phys(frame.address(), block_size);
+                    phys_alloc::release_phys(frame.address(), BlockSize::Block4k);
+                    v = v.wrapping_add(frame.frame_size().bytes());
+                });
+            } else {
+                unsafe {
+                    super::unmap_pages(None, self.slice.as_mut_ptr() as *mut (), page_count)
+                        .expect("Unable to unmap memory");
                 }
+            }
 
-                v = v.wrapping_add(frame.frame_size().bytes());
-            });
-
-            Self::release_buffer(&mut guard, self.slice.as_mut());
+            Self::release_buffer(&mut *self.slice, self.thread_window);
         }
     }
 
@@ -429,6 +521,15 @@ pub mod phys {
         }
     }
 
+    /// Copies the contents of one 4 kB frame into another.
+
+    pub unsafe fn copy_frame(dest: PAddr, src: PAddr) -> Result<(), Error> {
+        PageMapArea::new_from_frames(&[src, dest])
+            .ok_or_else(|| Error::Failed)
+            .map(|mut pmap_area| pmap_area.as_mut()
+                .copy_within(..VirtualPage::SMALL_PAGE_SIZE, VirtualPage::SMALL_PAGE_SIZE))
+    }
+
     pub unsafe fn clear_frame(frame: PAddr) -> Result<(), Error> {
         fill_frame(frame, 0)
     }
@@ -522,6 +623,41 @@ pub mod phys {
             Ok(())
         }
     }
+
+    #[cfg(test)]
+    mod test {
+        use super::*;
+
+        #[test]
+        fn test_free_run() {
+            assert_eq!(free_run(0, 32), Some(0));
+            assert_eq!(free_run(0b1011, 1), Some(2));
+            assert_eq!(free_run(0b1011, 2), Some(4));
+            assert_eq!(free_run(u32::MAX >> 1, 1), Some(31));
+            assert_eq!(free_run(1, 32), None);
+        }
+
+        #[test]
+        fn test_claim_slots() {
+            let single = claim_slots(1).unwrap();
+            let run = claim_slots(4).unwrap();
+            let long_run = claim_slots(40).unwrap();
+
+            assert_eq!(long_run % u32::BITS as usize, 0);
+            assert!(run >= single + 1 || run + 4 <= single);
+            assert!(long_run >= run + 4);
+
+            // Only the threads' pages are left past the last free word
+            assert_eq!(claim_slots(WINDOW_PAGES), None);
+
+            release_slots(long_run, 40);
+            release_slots(run, 4);
+            release_slots(single, 1);
+
+            assert_eq!(claim_slots(WINDOW_PAGES - u32::BITS as usize), Some(0));
+            release_slots(0, WINDOW_PAGES - u32::BITS as usize);
+        }
+    }
 }
 
 pub unsafe fn map(
@@ -558,23 +694,23 @@ pub unsafe fn map_frames(
         for i in 0..c.len() {
             page_mappings[i] = PageMapping {
                 number: PhysicalFrame::new(c[i], FrameSize::Small).frame() as u32,
-                flags: syscalls::flags::mapping::ARRAY,
+                flags: flags | syscalls::flags::mapping::ARRAY,
             };
-
-            count += syscalls::set_page_mappings(
-                level,
-                addr_start as *mut (),
-                root_map,
-                &page_mappings[..c.len()],
-            )
-            .map_err(|e| {
-                if let SyscallError::PartiallyMapped(map_count) = e {
-                    SyscallError::PartiallyMapped(map_count + count)
-                } else {
-                    e
-                }
-            })?;
         }
+
+        count += syscalls::set_page_mappings(
+            level,
+            addr_start as *mut (),
+            root_map,
+            &page_mappings[..c.len()],
+        )
+        .map_err(|e| {
+            if let SyscallError::PartiallyMapped(map_count) = e {
+                SyscallError::PartiallyMapped(map_count + count)
+            } else {
+                e
+            }
+        })?;
     }
 
     Ok(count)
@@ -586,37 +722,234 @@ pub unsafe fn unmap(root_map: Option<CPageMap>, vaddr: *mut ()) -> syscalls::Res
     syscalls::get_page_mappings(1, vaddr, root_map, &mut mapping)?;
 
     if is_flag_set!(mapping[0].flags, flags::mapping::PAGE_SIZED) {
+        let frame = PhysicalFrame::new(frame_address(&mapping[0]), FrameSize::PseLarge);
+
         set_flag!(mapping[0].flags, flags::mapping::UNMAPPED);
 
         syscalls::set_page_mappings(1, vaddr, root_map, &mapping)
-            .map(|_| PhysicalFrame::new(vaddr as usize as PAddr, FrameSize::PseLarge))
+            .map(|_| frame)
     } else {
         syscalls::get_page_mappings(0, vaddr, root_map, &mut mapping)?;
 
+        let frame = PhysicalFrame::new(frame_address(&mapping[0]), FrameSize::Small);
+
         set_flag!(mapping[0].flags, flags::mapping::UNMAPPED);
         syscalls::set_page_mappings(0, vaddr, root_map, &mapping)
-            .map(|_| PhysicalFrame::new(vaddr as usize as PAddr, FrameSize::Small))
+            .map(|_| frame)
     }
 }
 
-unsafe impl GlobalAlloc for InitialAllocator {
-    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        malloc(layout.size()) as *mut u8
+/// Unmaps `count` consecutive 4 KiB pages starting at `vaddr`. Returns the number of pages
+/// that were unmapped.
+///
+/// The pages must be covered by page tables, not large pages.
+
+pub unsafe fn unmap_pages(root_map: Option<CPageMap>, vaddr: *mut (), count: usize) -> syscalls::Result<usize> {
+    let page_mappings = [PageMapping {
+        number: 0,
+        flags: flags::mapping::UNMAPPED | flags::mapping::ARRAY,
+    }; 32];
+    let mut unmapped = 0;
+
+    while unmapped < count {
+        let batch_size = (count - unmapped).min(page_mappings.len());
+        let addr = (vaddr as usize + unmapped * PhysicalFrame::SMALL_PAGE_SIZE) as *mut ();
+
+        match syscalls::set_page_mappings(0, addr, root_map, &page_mappings[..batch_size])? {
+            0 => return Err(SyscallError::Failed),
+            n => unmapped += n,
+        }
     }
 
-    unsafe fn dealloc(&self, ptr: *mut u8, _layout: Layout) {
-        free(ptr as *mut c_void)
+    Ok(unmapped)
+}
+
+/// Returns the frame that a virtual address is mapped to along with the mapping's flags.
+///
+/// If the address isn't mapped, then the `UNMAPPED` flag will be set in the returned flags.
+
+pub unsafe fn lookup(root_map: Option<CPageMap>, vaddr: *const ()) -> syscalls::Result<(PhysicalFrame, u32)> {
+    let mut mapping = [PageMapping::default()];
+
+    syscalls::get_page_mappings(1, vaddr, root_map, &mut mapping)?;
+
+    if is_flag_set!(mapping[0].flags, flags::mapping::UNMAPPED) {
+        Ok((PhysicalFrame::new(0, FrameSize::Small), mapping[0].flags))
+    } else if is_flag_set!(mapping[0].flags, flags::mapping::PAGE_SIZED) {
+        Ok((PhysicalFrame::new(frame_address(&mapping[0]), FrameSize::PseLarge), mapping[0].flags))
+    } else {
+        syscalls::get_page_mappings(0, vaddr, root_map, &mut mapping)?;
+
+        Ok((PhysicalFrame::new(frame_address(&mapping[0]), FrameSize::Small), mapping[0].flags))
     }
+}
+
+/// Looks up the page directory entry that covers a virtual address. Returns either the
+/// page table's frame or, if `PAGE_SIZED` is set in the returned flags, the large page.
+
+pub fn lookup_page_table(root_map: Option<CPageMap>, vaddr: *const ()) -> syscalls::Result<(PhysicalFrame, u32)> {
+    let mut mapping = [PageMapping::default()];
+
+    syscalls::get_page_mappings(1, vaddr, root_map, &mut mapping)?;
+
+    let frame_size = if is_flag_set!(mapping[0].flags, flags::mapping::PAGE_SIZED) {
+        FrameSize::PseLarge
+    } else {
+        FrameSize::Small
+    };
+
+    Ok((PhysicalFrame::new(frame_address(&mapping[0]), frame_size), mapping[0].flags))
+}
 
-    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-        calloc(1, layout.size()) as *mut u8
+/// Returns `true` if the page table that covers a virtual address is present (or the
+/// address is mapped to a large page).
+
+pub fn has_page_table(root_map: Option<CPageMap>, vaddr: *const ()) -> syscalls::Result<bool> {
+    lookup_page_table(root_map, vaddr)
+        .map(|(_, flags)| is_flag_cleared!(flags, flags::mapping::UNMAPPED))
+}
+
+/// Reads the page table entries of consecutive 4 KiB pages starting at `vaddr` with a
+/// single call. Each entry is returned as a frame address along with the mapping's flags.
+///
+/// The pages must be covered by a page table, not a large page.
+
+pub fn lookup_pages(root_map: Option<CPageMap>, vaddr: *const (), pages: &mut [(PAddr, u32)]) -> syscalls::Result<()> {
+    let mut mappings = vec![PageMapping::default(); pages.len()];
+
+    syscalls::get_page_mappings(0, vaddr, root_map, &mut mappings)?;
+
+    for (page, mapping) in pages.iter_mut().zip(mappings.iter()) {
+        *page = (frame_address(mapping), mapping.flags);
+    }
+
+    Ok(())
+}
+
+/// Installs a page table at the page directory entry that covers `vaddr`. The kernel
+/// clears the table, so every page that it covers starts out unmapped.
+
+pub unsafe fn map_page_table(root_map: Option<CPageMap>, vaddr: *mut (), table: PAddr, flags: u32) -> syscalls::Result<usize> {
+    let mapping = [PageMapping {
+        number: PhysicalFrame::new(table, FrameSize::Small).frame() as u32,
+        flags: flags & !flags::mapping::PAGE_SIZED,
+    }];
+
+    syscalls::set_page_mappings(1, vaddr, root_map, &mapping)
+}
+
+/// Changes the protection of a mapped page without changing the frame it maps to.
+
+pub unsafe fn protect(root_map: Option<CPageMap>, vaddr: *mut c_void, frame: &PhysicalFrame, flags: u32) -> syscalls::Result<usize> {
+    let flags = flags | flags::mapping::OVERWRITE | match frame.frame_size() {
+        FrameSize::Small => 0,
+        _ => flags::mapping::PAGE_SIZED,
+    };
+
+    map(root_map, vaddr, frame.address(), flags)
+}
+
+/// Lets the kernel resolve first-touch faults within an anonymous zero-fill region using
+/// frames from its reserve instead of sending them to the pager.
+
+pub fn delegate_anon_region(root_map: Option<CPageMap>, start: usize, length: usize) -> syscalls::Result<()> {
+    syscalls::create(&CreateArgs::AnonRegion {
+        addr_space: root_map,
+        start: start as *const (),
+        length,
+    }).map(|_| ())
+}
+
+/// Sends faults within a previously delegated range back to the pager. If both `start` and
+/// `length` are 0, then every region in the address space is revoked.
+
+pub fn revoke_anon_region(root_map: Option<CPageMap>, start: usize, length: usize) -> syscalls::Result<()> {
+    syscalls::destroy(&mut DestroyArgs::AnonRegion {
+        addr_space: root_map,
+        start: start as *const (),
+        length,
+    }).map(|_| ())
+}
+
+/// Hands free frames over to the kernel's anonymous frame reserve.
+///
+/// Returns the number of frames that were accepted. Frames past that count still belong
+/// to the caller.
+
+pub unsafe fn donate_reserve_frames(frames: &[PAddr]) -> syscalls::Result<usize> {
+    let mut frame_numbers = [0u32; 32];
+    let mut accepted = 0;
+
+    for c in frames.chunks(frame_numbers.len()) {
+        for i in 0..c.len() {
+            frame_numbers[i] = PhysicalFrame::new(c[i], FrameSize::Small).frame() as u32;
+        }
+
+        let count = syscalls::update(&UpdateArgs::AnonRegion { frames: &frame_numbers[..c.len()] })? as usize;
+
+        accepted += count;
+
+        if count < c.len() {
+            break;
+        }
     }
 
-    unsafe fn realloc(&self, ptr: *mut u8, _layout: Layout, new_size: usize) -> *mut u8 {
-        realloc(ptr as *mut c_void, new_size) as *mut u8
+    Ok(accepted)
+}
+
+/// Removes every user mapping of an address space that no thread runs in anymore.
+///
+/// Returns the 4 KiB frames that were mapped together with the page tables, followed by
+/// the 4 MiB pages that were mapped. The kernel walks each page table only once, so the
+/// whole address space goes away in a handful of system calls.
+
+pub fn destroy_user_mappings(root_map: CPageMap) -> syscalls::Result<(Vec<PAddr>, Vec<PAddr>)> {
+    // Enough room for at least one full page table along with the table itself
+    let mut frame_numbers = vec![0u32; 2 * (PhysicalFrame::PSE_LARGE_PAGE_SIZE / PhysicalFrame::SMALL_PAGE_SIZE + 1)];
+    let mut large_numbers = [0u32; 32];
+    let mut frames = Vec::new();
+    let mut large_frames = Vec::new();
+
+    loop {
+        let mut args = DestroyArgs::PageMapping {
+            addr_space: root_map,
+            frames: &mut frame_numbers,
+            frame_count: 0,
+            large_frames: &mut large_numbers,
+            large_count: 0,
+        };
+
+        let result = syscalls::destroy(&mut args);
+
+        let (frame_count, large_count) = match args {
+            DestroyArgs::PageMapping { frame_count, large_count, .. } => (frame_count, large_count),
+            _ => (0, 0),
+        };
+
+        frames.extend(frame_numbers[..frame_count].iter()
+            .map(|number| *number as PAddr * PhysicalFrame::SMALL_PAGE_SIZE as PAddr));
+        large_frames.extend(large_numbers[..large_count].iter()
+            .map(|number| *number as PAddr * PhysicalFrame::SMALL_PAGE_SIZE as PAddr));
+
+        match result {
+            Ok(_) => return Ok((frames, large_frames)),
+            Err(SyscallError::NotReady) if frame_count + large_count > 0 => continue,
+            Err(e) => return Err(e),
+        }
     }
 }
 
+/// Returns the number of frames left in the kernel's anonymous frame reserve.
+
+pub fn reserve_frame_count() -> syscalls::Result<usize> {
+    syscalls::read(&mut ReadArgs::AnonRegion { frames: None })
+        .map(|count| count as usize)
+}
+
+fn frame_address(mapping: &PageMapping) -> PAddr {
+    (mapping.number as PAddr) * PhysicalFrame::SMALL_PAGE_SIZE as PAddr
+}
+
 #[panic_handler]
 fn handle_panic(info: &PanicInfo) -> ! {
     eprintf!("Panic occurred");
@@ -658,7 +991,5 @@ fn handle_alloc_error(layout: Layout) -> ! {
     loop {}
 }
 
-struct InitialAllocator;
-
 #[global_allocator]
-static mut GLOBAL_ALLOCATOR: InitialAllocator = InitialAllocator;
+static mut GLOBAL_ALLOCATOR: SizeClassAllocator = SizeClassAllocator;
@@ -48,24 +48,40 @@ mod vfs;
 mod fat;
 mod mutex;
 mod message;
+mod frame_cache;
+mod swap;
+mod large_page;
+mod rmap;
+mod shm;
+mod page_merge;
+mod compressed_pool;
+mod worker;
+mod spawn_bench;
+mod alloc_bench;
+mod boot_profile;
+mod compressed_module;
+mod heap;
 
 use address::PAddr;
 use crate::multiboot::{RawMultibootInfo, MultibootInfo};
 use alloc::boxed::Box;
 use crate::phys_alloc::PhysPageAllocator;
+use rust::align::Align;
 use rust::types::CTid;
-use rust::message::kernel::{self, ExceptionMessage, ExitMessage};
 use rust::message::MessageHeader;
 use rust::syscalls;
 use rust::syscalls::PageMapping;
 use crate::page::PhysicalFrame;
 use alloc::borrow::Cow;
+use alloc::collections::vec_deque::VecDeque;
 use crate::error::Error;
 use crate::Tid;
+use crate::device::DeviceId;
 
 const DATA_BUF_SIZE: usize = 64;
 
-fn init(multiboot_info: *const RawMultibootInfo, first_free_page: PAddr, _stack_size: usize) -> Option<Box<MultibootInfo>> {
+fn init(multiboot_info: *const RawMultibootInfo, first_free_page: PAddr, stack_size: usize) -> Option<Box<MultibootInfo>> {
+    boot_profile::mark("init server start");
     eprintfln!("Initializing bootstrap allocator");
 
     PhysPageAllocator::init_bootstrap(first_free_page);
@@ -117,18 +133,48 @@ fn init(multiboot_info: *const RawMultibootInfo, first_free_page: PAddr, _stack_
     eprintfln!("Initializing page allocator...");
 
     phys_alloc::PhysPageAllocator::init(mmap_iter);
+    boot_profile::mark("page allocator");
+
+    // The init thread's stack ends at the page above the current frame
+
+    let stack_marker = 0u8;
+    let stack_end = (&stack_marker as *const u8 as usize).align(PhysicalFrame::SMALL_PAGE_SIZE);
+
+    frame_cache::register_thread(stack_end - stack_size, stack_end);
 
     eprintfln!("Initializing mapping manager...");
     mapping::manager::init();
+    compressed_pool::init(phys_alloc::allocator().total_count(phys_alloc::BlockSize::Block4k));
+
+    if let Err((e, msg)) = pager::refill_frame_reserve() {
+        error::log_error(e, msg);
+    }
+
+    boot_profile::mark("mapping manager");
 
     eprintfln!("Initializing name manager...");
     name::manager::init();
 
+    if let Err(e) = name::manager::init_generations() {
+        error::log_error(e, Cow::Borrowed("Unable to allocate the name cache generation page."));
+    }
+
     eprintfln!("Initializing device manager...");
     device::manager::init();
 
-    eprintfln!("Initializing idle thread...");
-    init_threads(vec![idle_main, ramdisk::ramdisk_main]);
+    eprintfln!("Initializing idle thread, pager workers and module loaders...");
+
+    let mut thread_entries: Vec<fn() -> !> = vec![idle_main, ramdisk::ramdisk_main];
+
+    // Loaders run the same loop as the workers, but their queues only ever get modules
+    thread_entries.extend(core::iter::repeat(worker::worker_main as fn() -> !)
+        .take(worker::WORKER_COUNT + worker::LOADER_COUNT));
+
+    #[cfg(feature = "page-merging")]
+    thread_entries.push(page_merge::scanner_main);
+
+    init_threads(thread_entries);
+    boot_profile::mark("threads");
 
     eprintfln!("Loading modules...");
 
@@ -143,24 +189,63 @@ fn init(multiboot_info: *const RawMultibootInfo, first_free_page: PAddr, _stack_
 
 fn load_modules(multiboot_info: &Option<Box<MultibootInfo>>) {
     if let Some(ref mb_info) = multiboot_info {
-        let initsrv_name = mb_info.command_line.as_ref()
+        let option_value = |option: &str| mb_info.command_line.as_ref()
             .and_then(|s| {
-                s.split_once("initsrv=")
-                    .map(|(_, suffix)| String::from(suffix.clone()))
+                s.split_once(option)
+                    .and_then(|(_, suffix)| suffix.split_whitespace().next())
+                    .map(String::from)
             });
+        let initsrv_name = option_value("initsrv=");
+        let spawn_bench_name = option_value("spawnbench=");
+        let has_alloc_bench = mb_info.command_line.as_ref()
+            .map_or(false, |s| s.split_whitespace().any(|option| option == "allocbench"));
+
+        if has_alloc_bench {
+            alloc_bench::run();
+        }
 
         if let Some(ref modules) = mb_info.modules {
+            let mut other_modules = Vec::new();
+
             for module in modules {
-                if initsrv_name.is_some() && module.name.is_some()
+                if module.name.as_ref().map_or(false, |name| name.ends_with("ramdisk")) {
+                    // The ramdisk backs the swap area
+
+                    let module = match compressed_module::expand(module) {
+                        Ok(module) => module,
+                        Err((e, msg)) => {
+                            error::log_error(e, msg);
+                            continue;
+                        },
+                    };
+
+                    device::ramdisk::attach(module.addr, module.length);
+                    swap::init(DeviceId::new_from_tuple((device::mem::MAJOR, device::mem::RAMDISK_MINOR)),
+                               device::ramdisk::page_count());
+                    eprintfln!("Using ramdisk @ {:#x} ({} pages) as the swap area.", module.addr,
+                               device::ramdisk::page_count());
+                } else if initsrv_name.is_some() && module.name.is_some()
                     && initsrv_name.as_ref().unwrap() == module.name.as_ref().unwrap() {
                     elf::loader::load_init_mappings(&module);
                 } else {
-                    match elf::loader::load_module(&module) {
-                      Err(_) => eprintfln!("Unable to load module @ {:#x}", module.addr),
-                      _ => (),
-                    };
+                    other_modules.push(module.clone());
                 }
             }
+
+            // The rest are loaded by the loader threads once the swap area is set up. The main
+            // thread enters its message loop and hands the page faults of the modules that have
+            // already started to the pager workers while the others are still loading.
+            boot_profile::mark("swap and init mappings");
+            boot_profile::expect_modules(other_modules.len());
+
+            for module in other_modules {
+                worker::queue_module(module);
+            }
+
+            if let Some(module) = spawn_bench_name.as_ref()
+                .and_then(|name| modules.iter().find(|module| module.name.as_ref() == Some(name))) {
+                spawn_bench::start(module);
+            }
         }
     } else {
         eprintfln!("Multiboot info is missing.");
@@ -172,46 +257,7 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
     let message_sender = header.target.expect("Message should have a sender");
 
     if rust::is_flag_set!(header.flags, MessageHeader::MSG_KERNEL) {
-        let result = match header.subject {
-            kernel::EXCEPTION => {
-                ExceptionMessage::try_from(&recv_buffer[..])
-                    .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read exception message.")))
-                    .and_then(|payload| {
-                        if payload.fault_num == 14 {
-                            pager::handle_page_fault(&payload)
-
-                            /*
-                                                      let mut thread_info = ThreadInfo::default();
-                            thread_info.status = ThreadInfo::READY;
-
-                            syscalls::update_thread(&Tid::from(ex_msg.who),
-                                                   &ThreadStruct::new(thread_info, ThreadInfo::STATUS))
-                                .map_err(|e| (e, None))
-                             */
-                        } else {
-                            error::dump_state(&payload);
-                            Err((Error::NotImplemented, Cow::Borrowed("Not implemented")))
-                        }
-                    })
-            },
-            kernel::EXIT => {
-                ExitMessage::try_from(&recv_buffer[..])
-                    .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read exit message.")))
-                    .and_then(|_payload|
-                        // TODO: Notify threads that are waiting to join with the stopped thread
-
-                        Ok(()))
-            },
-            _ => {
-                Err((Error::BadRequest,
-                                  Cow::Owned(format!("Kernel message with subject {} from TID {}",
-                                               header.subject,
-                                               CTid::from(header.target
-                                                   .expect("Message is supposed to have a sender"))))))
-            },
-        };
-
-        result
+        worker::dispatch(header.subject, &recv_buffer[..])
     }
     else {
         match header.subject {
@@ -238,8 +284,7 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
                     .and_then(|request| {
                         let target_name = request.name_string()
                             .expect("A request with an invalid name was marked as valid.");
-                        let tid_option = name::manager::lookup(&target_name)
-                            .map(|tid_ref| tid_ref.clone());
+                        let tid_option = name::manager::lookup(&target_name);
                         let mut response = LookupNameResponse::new_message(message.sender.clone(),
                                                                            tid_option,
                                                                            RawMessage::MSG_NOBLOCK);
@@ -266,8 +311,8 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
             init::MAP => {
                 MapRequest::try_from(msg)
                     .and_then(|request| {
-                        let addr_option = mapping::manager::lookup_tid_mut(message_sender)
-                            .and_then(|addr_space|
+                        let addr_option = mapping::manager::lock_tid(message_sender)
+                            .and_then(|mut addr_space|
                                 addr_space.map(request.address,
                                                &request.device,
                                                request.offset,
@@ -288,8 +333,8 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
             init::UNMAP => {
                 UnmapRequest::try_from(msg)
                     .and_then(|request| {
-                        let unmap_option = mapping::manager::lookup_tid_mut(&message.sender)
-                            .and_then(|addr_space|
+                        let unmap_option = mapping::manager::lock_tid(&message.sender)
+                            .and_then(|mut addr_space|
                                 match addr_space.unmap(request.address, request.length) {
                                     true => Some(()),
                                     false => None,
@@ -307,17 +352,152 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
                     .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
 
+            init::REMAP => {
+                RemapRequest::try_from(msg)
+                    .and_then(|request| {
+                        let addr_option = mapping::manager::lock_tid(&message.sender)
+                            .and_then(|mut addr_space|
+                                addr_space.remap(request.address,
+                                                 request.old_length,
+                                                 request.new_length,
+                                                 request.may_move));
+
+                        let mut response = MapResponse::new_message(message.sender.clone(),
+                                                                    addr_option,
+                                                                    RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::FORK => {
+                ForkRequest::try_from(msg)
+                    .and_then(|request| {
+                        let tid_option = elf::loader::fork(&message.sender,
+                                                           request.entry,
+                                                           request.stack_top)
+                            .map_err(|(e, msg)| error::log_error(e, msg))
+                            .ok();
+
+                        let mut response = ForkResponse::new_message(message.sender.clone(),
+                                                                     tid_option,
+                                                                     RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::CREATE_SHM => {
+                CreateShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let device_option = mapping::manager::lock_tid(&message.sender)
+                            .and_then(|addr_space| shm::create(addr_space.root_pmap(),
+                                                               request.length as u64).ok());
+
+                        let mut response = CreateShmResponse::new_message(message.sender.clone(),
+                                                                          device_option,
+                                                                          RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::DESTROY_SHM => {
+                DestroyShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let destroy_option = mapping::manager::lock_tid(&message.sender)
+                            .and_then(|addr_space| shm::destroy(addr_space.root_pmap(),
+                                                                &request.device).ok());
+
+                        let mut response = DestroyShmResponse::new_message(message.sender.clone(),
+                                                                           destroy_option.is_some(),
+                                                                           RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+
             init::CREATE_PORT => {
-                Err((Error::NotImplemented, Some(format!("Request {}", msg.subject()))))
+                CreatePortRequest::try_from(msg)
+                    .and_then(|request| {
+                        let pid_option = mapping::manager::root_pmap_of(&message.sender)
+                            .and_then(|pmap| port::create(request.pid, message.sender.clone(), pmap,
+                                                          request.flags).ok());
+
+                        let mut response = CreatePortResponse::new_message(message.sender.clone(),
+                                                                           pid_option,
+                                                                           RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
             init::SEND_PORT => {
-                Err((Error::NotImplemented, Some(format!("Request {}", msg.subject()))))
+                SendPortRequest::try_from(msg)
+                    .and_then(|request| {
+                        // The sender is answered once its message has been queued
+                        let send_result = mapping::manager::root_pmap_of(&message.sender)
+                            .ok_or(Error::NotRegistered)
+                            .and_then(|pmap| port::send(request.pid, message.sender.clone(), pmap,
+                                                        request.data, request.flags));
+
+                        match send_result {
+                            Ok(replies) => send_port_replies(replies),
+                            Err(_) => {
+                                let mut response = SendPortResponse::new_message(message.sender.clone(),
+                                                                                 false,
+                                                                                 RawMessage::MSG_NOBLOCK);
+
+                                message::send(&message.sender, &mut response)
+                                    .map(|_| ())
+                            }
+                        }
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
             init::RECEIVE_PORT => {
-                Err((Error::NotImplemented, Some(format!("Request {}", msg.subject()))))
+                ReceivePortRequest::try_from(msg)
+                    .and_then(|request| {
+                        // The receiver is answered once there are messages for it
+                        let receive_result = mapping::manager::root_pmap_of(&message.sender)
+                            .ok_or(Error::NotRegistered)
+                            .and_then(|pmap| port::receive(request.pid, message.sender.clone(), pmap,
+                                                           request.max_messages, request.buffer_len,
+                                                           request.flags));
+
+                        match receive_result {
+                            Ok(replies) => send_port_replies(replies),
+                            Err(_) => {
+                                let mut response = ReceivePortResponse::new_message(message.sender.clone(),
+                                                                                    None,
+                                                                                    RawMessage::MSG_NOBLOCK);
+
+                                message::send(&message.sender, &mut response)
+                                    .map(|_| ())
+                            }
+                        }
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
             init::DESTROY_PORT => {
-                Err((Error::NotImplemented, Some(format!("Request {}", msg.subject()))))
+                DestroyPortRequest::try_from(msg)
+                    .and_then(|request| {
+                        let destroy_result = port::destroy(request.pid, message.sender.clone());
+                        let mut response = DestroyPortResponse::new_message(message.sender.clone(),
+                                                                            destroy_result.is_ok(),
+                                                                            RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                            .and_then(|_| send_port_replies(destroy_result.unwrap_or_default()))
+                    })
+                    .map_err(|code| (Error::Failed, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
             init::REGISTER_SERVER => {
                 RegisterServerRequest::try_from(msg)
@@ -344,31 +524,73 @@ fn handle_message(header: &mut MessageHeader, recv_buffer: &mut [u8]) -> Result<
     }
 }
 
+/// Answers the requests of threads that used a message port, including those of threads
+/// that were parked in it. The threads are already waiting for their replies.
+///
+/// A thread that's no longer waiting, e.g. because it was interrupted, loses its reply.
+/// Messages that were meant for it go back to their port, which may hand them to another
+/// receiver. Senders' messages are already queued, so nothing is lost if they miss theirs.
+
+pub(crate) fn send_port_replies(replies: Vec<port::Reply>) -> Result<(), i32> {
+    let mut replies = VecDeque::from(replies);
+
+    while let Some(reply) = replies.pop_front() {
+        match reply {
+            port::Reply::Sent(tid) => {
+                let _ = message::send(&tid, &mut SendPortResponse::new_message(tid.clone(), true,
+                                                                               RawMessage::MSG_NOBLOCK));
+            },
+            port::Reply::Received(pid, tid, batch) => {
+                let mut response = ReceivePortResponse::new_message(tid.clone(),
+                                                                    Some(port::encode_batch(&batch)),
+                                                                    RawMessage::MSG_NOBLOCK);
+
+                if message::send(&tid, &mut response).is_err() && !batch.is_empty() {
+                    replies.extend(port::requeue(pid, batch));
+                }
+            },
+            port::Reply::SendFailed(tid) => {
+                let _ = message::send(&tid, &mut SendPortResponse::new_message(tid.clone(), false,
+                                                                               RawMessage::MSG_NOBLOCK));
+            },
+            port::Reply::ReceiveFailed(tid) => {
+                let _ = message::send(&tid, &mut ReceivePortResponse::new_message(tid.clone(), None,
+                                                                                  RawMessage::MSG_NOBLOCK));
+            },
+        }
+    }
+
+    Ok(())
+}
+
 fn idle_main() -> ! {
     loop {}
 }
 
 fn init_threads(thread_entries: Vec<fn() -> !>) {
     let init_tid = Tid::new(INIT_TID);
-    let addr_space = mapping::manager::lookup_tid_mut(&init_tid)
+    let mut addr_space = mapping::manager::lock_tid(&init_tid)
         .expect("Unable to get the initial address space");
     let stack_size = 4096 * 1024;
     let pmap = syscalls::get_init_pmap().unwrap().as_address();
-    let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
 
     for (i, entry) in thread_entries.into_iter().enumerate() {
         let stack_top = 0xF8000000 - (i + 1) * stack_size;
 
+        // The init server's heap isn't tracked by its address space, so its stacks are
+        // placed at fixed addresses instead of wherever there's room
+        addr_space.map_stack(Some(stack_top as VAddr), stack_size - VirtualPage::SMALL_PAGE_SIZE)
+            .expect("Unable to reserve a thread stack.");
+
+        // The thread may start running as soon as it's been created
+        frame_cache::register_thread(stack_top - stack_size, stack_top);
+
         let tid =
             syscalls::create_thread(entry as *const fn() -> ! as *const c_void,
                                        pmap as u32,
                                        stack_top as *const c_void).expect("Unable to create new thread.");
 
-        addr_space.attach_thread(tid.clone());
-        addr_space.map(Some((stack_top - stack_size + VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                       &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size - VirtualPage::SMALL_PAGE_SIZE);
-        addr_space.map(Some((stack_top - stack_size) as VAddr),
-                       &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
+        mapping::manager::attach_thread(&mut addr_space, tid.clone());
 
         let mut thread_info = ThreadInfo::default();
         let mut flags = ThreadInfo::STATUS;
@@ -388,18 +610,27 @@ fn init_threads(thread_entries: Vec<fn() -> !>) {
 }
 
 fn main(_multiboot_info: Option<Box<MultibootInfo>>) {
-    let mut header = MessageHeader::blank();
     let mut recv_buffer= [0; 1024];
 
     loop {
-        match syscalls::receive(&mut header, &mut recv_buffer)
+        // A worker can't be woken up until it's waiting for its wake-up message. Until then,
+        // messages are polled for instead, since the worker may be waiting on a page fault.
+        let is_waking = worker::wake_sleepers();
+        let mut header = MessageHeader::new(MessageHeader::ANY_SENDER, 0,
+                                            if is_waking { MessageHeader::MSG_NOBLOCK } else { 0 });
+
+        let receive_result = syscalls::receive(&mut header, &mut recv_buffer);
+
+        if is_waking && receive_result.is_err() {
+            let _ = syscalls::r#yield();
+            continue;
+        }
+
+        match receive_result
             .map_err(|e| match e {
                 syscalls::SyscallError::Interrupted => {
                     (Error::NotImplemented, Cow::Borrowed("Handling interrupted receives aren't implemented yet"))
                 },
-                syscalls::SyscallError::Preempted => {
-                    (Error::NotImplemented, Cow::Borrowed("Handling kernel message preemption isn't implemented yet"))
-                }
                 _ => (Error::Failed, Cow::Borrowed("Receive failed")),
             })
             .and_then(|msg_len| handle_message(&mut header, &mut recv_buffer[..msg_len])) {
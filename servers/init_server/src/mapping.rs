@@ -1,35 +1,214 @@
-use crate::page::{PageMapBase, VirtualPage};
-use crate::address::VAddr;
+use crate::page::{FrameSize, PageMapBase, PhysicalFrame, VirtualPage};
+use crate::address::{PAddr, VAddr};
 use alloc::collections::btree_set::BTreeSet;
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use alloc::borrow::Cow;
 use rust::align::Align;
-use crate::device::DeviceId;
-use crate::region::{MemoryRegion, RegionSet};
+use rust::syscalls::{flags, SyscallError};
+use crate::device::{self, DeviceId};
+use crate::error::Error;
+use crate::large_page;
+use crate::lowlevel;
+use crate::phys_alloc::{self, BlockSize};
+use crate::region::{FreeRangeIndex, MemoryRegion};
+use crate::rmap;
+use crate::shm;
+use crate::swap;
 use core::cmp::Ordering;
+use core::ops::Range;
+use core::ffi::c_void;
 pub use rust::types::Tid;
 
+// The flags of a page that are carried over when it's moved to another address
+const MOVED_PAGE_FLAGS: u32 = flags::mapping::READ_ONLY | flags::mapping::UNCACHED | flags::mapping::WRITE_THRU
+    | flags::mapping::DIRTY;
+
+/// A page that `AddrSpace::share_frames()` has shared with another address space.
+
+struct SharedPage {
+    addr: usize,
+    frame: PhysicalFrame,
+    is_referenced: bool,
+
+    // The page's flags in the original address space, if it was write-protected
+    old_flags: Option<u32>,
+    is_mapped: bool,
+}
+
+/// Returns the flags that a page of a mapping with `mapping_flags` gets when it's shared with
+/// a forked address space. `frame_flags` are the page's flags in the original address space.
+///
+/// The dirty bit goes along with the frame. Once the original address space writes to the
+/// page and takes a copy, the other address space holds the only copy of the data, and
+/// reclaim must not take it for a clean page that can just be zero-filled again.
+
+pub(crate) fn shared_page_flags(mapping_flags: u32, frame_flags: u32, frame_size: FrameSize) -> u32 {
+    let is_read_only = mapping_flags & (AddrSpace::COPY_ON_WRITE | AddrSpace::READ_ONLY) != 0;
+    let mut page_flags = frame_flags & flags::mapping::DIRTY;
+
+    if is_read_only {
+        page_flags |= flags::mapping::READ_ONLY;
+    }
+
+    if frame_size != FrameSize::Small {
+        page_flags |= flags::mapping::PAGE_SIZED;
+    }
+
+    page_flags
+}
+
+/// Returns `true` if releasing a mapping of `frame` gives up a reference to it. Frames of a
+/// physical memory device (`device_ranges`) are only borrowed, unless they were shared
+/// copy-on-write. Then every mapper holds a reference on top of the device's own.
+
+fn is_owned_frame(frame: PAddr, device_ranges: &[Range<PAddr>]) -> bool {
+    match phys_alloc::phys_ref_count(frame) {
+        0 => false,
+        1 => !device_ranges.iter().any(|range| range.contains(&frame)),
+        _ => true,
+    }
+}
+
+/// Gives an address space a page table for `addr`, if it doesn't have one yet.
+
+fn ensure_page_table(root_pmap: PageMapBase, addr: usize) -> Result<(), Error> {
+    if lowlevel::has_page_table(Some(root_pmap), addr as *const ()).map_err(|_| Error::Failed)? {
+        return Ok(());
+    }
+
+    let table = swap::alloc_frame()?;
+    let base = addr.align_trunc(PhysicalFrame::PSE_LARGE_PAGE_SIZE);
+
+    unsafe { lowlevel::map_page_table(Some(root_pmap), base as *mut (), table, 0) }
+        .map(|_| ())
+        .map_err(|_| {
+            swap::release_frame(table);
+            Error::Failed
+        })
+}
+
 pub mod manager {
+    //! The registry of address spaces.
+    //!
+    //! The registry itself is locked only while an address space is looked up, added or
+    //! removed. Each address space is guarded by a lock of its own, so requests and faults
+    //! for different address spaces can be handled at the same time. The locks come from a
+    //! fixed set of stripes. Then a lock never goes away while a thread waits on it, even if
+    //! its address space is torn down in the meantime. The init server's own address space
+    //! has a lock of its own, since its faults may come from a thread that holds any other
+    //! lock.
+
     use rust::types::Tid;
     use super::AddrSpace;
     use crate::error;
+    use alloc::boxed::Box;
     use alloc::collections::btree_map::BTreeMap;
     use rust::thread;
-    use crate::page::PageMapBase;
+    use crate::address::PAddr;
+    use crate::page::{PageMapBase, VirtualPage};
     use crate::error::Error;
+    use crate::frame_cache;
+    use crate::lowlevel;
+    use crate::mutex::{Mutex, MutexGuard};
+    use crate::phys_alloc::{self, BlockSize};
+    use crate::rmap;
+    use crate::shm;
+    use crate::swap;
     use alloc::borrow::Cow;
-    
-    static mut ADDRESS_SPACES: Option<BTreeMap<PageMapBase, AddrSpace>> = None;
+    use alloc::vec::Vec;
+    use core::ops::{Deref, DerefMut};
+    use core::sync::atomic::{AtomicUsize, Ordering};
+    use rust::syscalls::{self, DestroyArgs};
+
+    const LOCK_STRIPES: usize = 32;
+
+    struct Registry {
+        // Address spaces are boxed, so that they stay put while the map changes around them
+        addr_spaces: BTreeMap<PageMapBase, Box<AddrSpace>>,
+        threads: BTreeMap<Tid, PageMapBase>,
+    }
+
+    static REGISTRY: Mutex<Option<Registry>> = Mutex::new(None);
+
+    struct AddrSpaceLock {
+        lock: Mutex<()>,
+
+        // The registered thread that holds the lock plus one. Zero if the lock is free or
+        // held by a thread without a frame cache.
+        owner: AtomicUsize,
+    }
+
+    const UNLOCKED: AddrSpaceLock = AddrSpaceLock {
+        lock: Mutex::new(()),
+        owner: AtomicUsize::new(0),
+    };
+
+    static LOCKS: [AddrSpaceLock; LOCK_STRIPES] = [UNLOCKED; LOCK_STRIPES];
+    static INIT_LOCK: AddrSpaceLock = UNLOCKED;
+
+    // The init server's own address space. Its pages are never reclaimed, since the init
+    // server would have to handle its own page faults.
+    static mut INIT_ROOT_PMAP: Option<PageMapBase> = None;
+
+    struct LockGuard {
+        lock: &'static AddrSpaceLock,
+
+        // `None` if the current thread already held the lock when the guard was made
+        guard: Option<MutexGuard<'static, ()>>,
+    }
+
+    impl Drop for LockGuard {
+        fn drop(&mut self) {
+            if self.guard.is_some() {
+                self.lock.owner.store(0, Ordering::Release);
+            }
+        }
+    }
+
+    /// Exclusive access to a registered address space. The address space stays registered
+    /// while the guard is held.
+
+    pub struct AddrSpaceGuard {
+        _lock: LockGuard,
+        addr_space: *mut AddrSpace,
+    }
+
+    impl Deref for AddrSpaceGuard {
+        type Target = AddrSpace;
+
+        fn deref(&self) -> &Self::Target {
+            unsafe { &*self.addr_space }
+        }
+    }
+
+    impl DerefMut for AddrSpaceGuard {
+        fn deref_mut(&mut self) -> &mut Self::Target {
+            unsafe { &mut *self.addr_space }
+        }
+    }
 
     pub fn init() {
-        unsafe {
-            ADDRESS_SPACES = match ADDRESS_SPACES {
+        {
+            let mut registry = REGISTRY.lock();
+
+            *registry = match *registry {
                 Some(_) => panic!("Address space map has already been initialized."),
-                None => Some(BTreeMap::new()),
-            }
+                None => Some(Registry {
+                    addr_spaces: BTreeMap::new(),
+                    threads: BTreeMap::new(),
+                }),
+            };
         }
 
         match thread::get_root_pmap() {
             Ok(page) => {
                 let mut addr_space = AddrSpace::new(page);
+
+                unsafe {
+                    INIT_ROOT_PMAP = Some(page);
+                }
+
                 addr_space.attach_thread(thread::get_tid().expect("Unable to determine tid for current thread."));
 
                 if !register(addr_space) {
@@ -43,45 +222,248 @@ pub mod manager {
         }
     }
 
-    fn addr_space_map<'a>() -> &'static BTreeMap<PageMapBase, AddrSpace> {
-        unsafe {
-            ADDRESS_SPACES.as_ref()
-                .expect("Address space map hasn't been initialized yet.")
+    fn with_registry<R>(f: impl FnOnce(&mut Registry) -> R) -> R {
+        f(REGISTRY.lock()
+            .as_mut()
+            .expect("Address space map hasn't been initialized yet."))
+    }
+
+    fn lock_for(pmap: PageMapBase) -> &'static AddrSpaceLock {
+        if Some(pmap) == unsafe { INIT_ROOT_PMAP } {
+            &INIT_LOCK
+        } else {
+            &LOCKS[(pmap as usize / VirtualPage::SMALL_PAGE_SIZE) % LOCK_STRIPES]
         }
     }
 
-    fn addr_space_map_mut<'a>() -> &'static mut BTreeMap<PageMapBase, AddrSpace> {
-        unsafe {
-            ADDRESS_SPACES.as_mut()
-                .expect("Address space map hasn't been initialized yet.")
+    /// Acquires the lock of an address space. A thread that already holds the lock gets
+    /// another guard for it instead of waiting on itself. Returns `None` if the lock is held
+    /// by another thread and `wait` is `false`.
+
+    fn acquire(pmap: PageMapBase, wait: bool) -> Option<LockGuard> {
+        let lock = lock_for(pmap);
+        let current = frame_cache::current_thread().map_or(0, |index| index + 1);
+
+        if current != 0 && lock.owner.load(Ordering::Acquire) == current {
+            return Some(LockGuard { lock, guard: None });
         }
+
+        let guard = if wait {
+            lock.lock.lock()
+        } else {
+            lock.lock.try_lock()?
+        };
+
+        lock.owner.store(current, Ordering::Release);
+        Some(LockGuard { lock, guard: Some(guard) })
+    }
+
+    fn lock_with(pmap: PageMapBase, wait: bool) -> Option<AddrSpaceGuard> {
+        let lock = acquire(pmap, wait)?;
+
+        // The lock is released right away if the address space isn't registered
+        with_registry(|registry| registry.addr_spaces.get_mut(&pmap)
+            .map(|addr_space| &mut **addr_space as *mut AddrSpace))
+            .map(|addr_space| AddrSpaceGuard { _lock: lock, addr_space })
+    }
+
+    /// Locks the address space of `pmap`, waiting for any other thread that holds it.
+
+    pub fn lock(pmap: PageMapBase) -> Option<AddrSpaceGuard> {
+        lock_with(pmap, true)
+    }
+
+    /// Locks the address space of `pmap` only if no other thread holds it.
+
+    pub fn try_lock(pmap: PageMapBase) -> Option<AddrSpaceGuard> {
+        lock_with(pmap, false)
+    }
+
+    /// Locks the address space that a thread is attached to.
+
+    pub fn lock_tid(tid: &Tid) -> Option<AddrSpaceGuard> {
+        root_pmap_of(tid)
+            .and_then(lock)
+            .filter(|addr_space| addr_space.thread_exists(tid))
     }
 
-    pub fn lookup_tid<'a>(tid: &Tid) -> Option<&'a AddrSpace> {
-        addr_space_map()
-            .values()
-            .find(|addr_space| addr_space.thread_exists(tid))
+    /// Returns the root page map of the address space that a thread is attached to. The
+    /// address space isn't locked, so it may go away at any time.
+
+    pub fn root_pmap_of(tid: &Tid) -> Option<PageMapBase> {
+        with_registry(|registry| registry.threads.get(tid).copied())
     }
 
-    pub fn lookup_tid_mut<'a>(tid: &Tid) -> Option<&'a mut AddrSpace> {
-        addr_space_map_mut()
-            .values_mut()
-            .find(|addr_space| addr_space.thread_exists(tid))
+    /// Returns `true` if `pmap` is the init server's own address space.
+
+    pub fn is_init_addr_space(pmap: PageMapBase) -> bool {
+        Some(pmap) == unsafe { INIT_ROOT_PMAP }
     }
 
     pub fn register(addr_space: AddrSpace) -> bool {
-        let aspace_map = addr_space_map_mut();
+        with_registry(|registry| {
+            if registry.addr_spaces.get(&addr_space.root_page_map).is_none() {
+                for tid in addr_space.attached_threads.iter() {
+                    registry.threads.insert(tid.clone(), addr_space.root_page_map);
+                }
+
+                registry.addr_spaces.insert(addr_space.root_page_map, Box::new(addr_space));
+                true
+            } else {
+                false
+            }
+        })
+    }
+
+    /// Attaches a thread to an address space and makes the address space findable by the
+    /// thread.
+
+    pub fn attach_thread(addr_space: &mut AddrSpace, tid: Tid) -> bool {
+        with_registry(|registry| registry.threads.insert(tid.clone(), addr_space.root_page_map));
+        addr_space.attach_thread(tid)
+    }
+
+    /// Unregisters an address space. The caller must hold its lock.
+
+    pub fn unregister(pmap: PageMapBase) -> Option<AddrSpace> {
+        let _ = lowlevel::revoke_anon_region(Some(pmap), 0, 0);
+        swap::discard(pmap, 0, AddrSpace::USER_END);
+        rmap::unmap_range(pmap, 0, AddrSpace::USER_END);
+
+        with_registry(|registry| {
+            registry.threads.retain(|_, thread_pmap| *thread_pmap != pmap);
+            registry.addr_spaces.remove(&pmap)
+        })
+            .map(|addr_space| *addr_space)
+    }
+
+    /// Releases a thread that has exited and detaches it from its address space. The
+    /// address space is torn down along with its last thread.
 
-        if aspace_map.get(&addr_space.root_page_map).is_none() {
-            aspace_map.insert(addr_space.root_page_map, addr_space);
-            true
+    pub fn release_thread(tid: &Tid) -> Result<(), (Error, Cow<'static, str>)> {
+        let mut addr_space = lock_tid(tid)
+            .ok_or((Error::NotRegistered, Cow::Borrowed("Thread's address space isn't registered")))?;
+
+        syscalls::destroy(&mut DestroyArgs::Tcb { tid: tid.clone() })
+            .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to release thread")))?;
+
+        addr_space.detach_thread(tid);
+        with_registry(|registry| registry.threads.remove(tid));
+
+        if addr_space.has_threads() || is_init_addr_space(addr_space.root_pmap()) {
+            Ok(())
         } else {
-            false
+            destroy(addr_space)
         }
     }
 
-    pub fn unregister(pmap: PageMapBase) -> Option<AddrSpace> {
-        addr_space_map_mut().remove(&pmap)
+    /// Unregisters an address space and releases everything that was mapped in it. The
+    /// kernel hands back every frame and page table at once, so they're returned to the
+    /// allocator in a single batch instead of being unmapped page by page.
+
+    fn destroy(locked: AddrSpaceGuard) -> Result<(), (Error, Cow<'static, str>)> {
+        let pmap = locked.root_pmap();
+        let addr_space = unregister(pmap)
+            .ok_or((Error::NotRegistered, Cow::Borrowed("Address space isn't registered")))?;
+
+        // Nothing can find the address space anymore, so its lock can go
+        drop(locked);
+
+        let (frames, large_frames) = lowlevel::destroy_user_mappings(pmap)
+            .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to tear down address space")))?;
+
+        let device_ranges = addr_space.device_frame_ranges();
+
+        let owned_frames = frames.into_iter()
+            .filter(|frame| super::is_owned_frame(*frame, &device_ranges))
+            .collect::<Vec<_>>();
+
+        phys_alloc::release_phys_frames(&owned_frames);
+
+        for frame in large_frames.into_iter().filter(|frame| super::is_owned_frame(*frame, &device_ranges)) {
+            phys_alloc::release_phys(frame, BlockSize::Block4M);
+        }
+
+        // No thread runs in the address space anymore, so its page directory goes, too
+        phys_alloc::release_phys(pmap as PAddr, BlockSize::Block4k);
+
+        for mapping in addr_space.vaddr_map.values().filter(|mapping| mapping.is_shared_object()) {
+            shm::detach(&mapping.base_page.device);
+        }
+
+        shm::destroy_owned(pmap);
+        Ok(())
+    }
+
+    /// Returns the first page at or after `addr` in the address space of `root_pmap`, or in
+    /// an address space that comes after it, that belongs to an anonymous mapping.
+    ///
+    /// Address spaces that are locked by another thread are skipped.
+
+    pub fn next_anonymous_page(root_pmap: PageMapBase, addr: usize) -> Option<(PageMapBase, usize)> {
+        find_in_unlocked(root_pmap, addr, |addr_space, start| addr_space.next_anonymous_page(start))
+    }
+
+    /// Returns the first range at or after `addr` in the address space of `root_pmap`, or in
+    /// an address space that comes after it, that could be mapped by a single large page.
+    ///
+    /// Address spaces that are locked by another thread are skipped.
+
+    pub fn next_large_page_range(root_pmap: PageMapBase, addr: usize) -> Option<(PageMapBase, usize)> {
+        find_in_unlocked(root_pmap, addr, |addr_space, start| addr_space.next_large_page_range(start))
+    }
+
+    fn find_in_unlocked(root_pmap: PageMapBase, addr: usize,
+                        find: impl Fn(&AddrSpace, usize) -> Option<usize>) -> Option<(PageMapBase, usize)> {
+        with_registry(|registry| registry.addr_spaces.range(root_pmap..)
+            .filter(|(pmap, _)| !is_init_addr_space(**pmap))
+            .find_map(|(pmap, addr_space)| {
+                let start = if *pmap == root_pmap { addr } else { AddrSpace::USER_START };
+
+                // The registry is locked, so the address space's lock may only be tried
+                let _guard = acquire(*pmap, false)?;
+
+                find(addr_space, start)
+                    .map(|page| (*pmap, page))
+            }))
+    }
+
+    /// Clones the address space of a thread into a new root page map and registers it.
+    ///
+    /// `root_pmap` must have already been initialized by the kernel (i.e. the new thread has
+    /// been created with it). The new thread is attached to the cloned address space.
+    ///
+    /// If the address space can't be cloned, then the new thread is released along with
+    /// `root_pmap` and whatever was mapped in it.
+
+    pub fn clone_addr_space(parent: &Tid, root_pmap: PageMapBase, child: Tid) -> Result<(), (Error, Cow<'static, str>)> {
+        let mut parent_addr_space = lock_tid(parent)
+            .ok_or((Error::NotRegistered, Cow::Borrowed("Thread's address space isn't registered")))?;
+
+        // A failed fork leaves nothing mapped in the new address space but page tables, so
+        // an empty address space is registered in its place to release them with the thread
+        let (mut new_addr_space, fork_result) = match parent_addr_space.fork(root_pmap) {
+            Ok(addr_space) => (addr_space, Ok(())),
+            Err(e) => (AddrSpace::new(root_pmap), Err(e)),
+        };
+
+        let parent_pmap = parent_addr_space.root_pmap();
+
+        new_addr_space.attach_thread(child.clone());
+
+        if !register(new_addr_space) {
+            return Err((Error::AlreadyRegistered, Cow::Borrowed("Address space has already been registered")));
+        }
+
+        let result = fork_result.and_then(|_| swap::clone_slots(parent_pmap, root_pmap)
+            .map_err(|e| (e, Cow::Borrowed("Unable to copy swapped-out pages"))));
+
+        if result.is_err() {
+            drop(parent_addr_space);
+            let _ = release_thread(&child);
+        }
+
+        result
     }
 }
 
@@ -90,6 +472,10 @@ pub struct AddressMapping {
     pub base_page: VirtualPage,
     pub region: MemoryRegion<usize>,
     pub flags: u32,
+
+    // Device offset at which the mapped data ends. The rest of the mapping reads as zeros,
+    // like the part of an ELF segment that's past its file image.
+    pub data_end: Option<u64>,
 }
 
 /*
@@ -122,13 +508,52 @@ impl AddressMapping {
             base_page,
             region,
             flags,
+            data_end: None,
+        }
+    }
+
+    /// Returns the end address of the mapping. A mapping that extends to the end of memory
+    /// ends at `AddrSpace::USER_END`.
+
+    pub fn end(&self) -> usize {
+        if self.region.end() == MemoryRegion::memory_end() {
+            AddrSpace::USER_END
+        } else {
+            self.region.end()
         }
     }
+
+    /// Returns `true` if writes to this mapping must not be seen by other address spaces.
+
+    pub fn is_private(&self) -> bool {
+        self.flags & (AddrSpace::READ_ONLY | AddrSpace::SHARED | AddrSpace::GUARD) == 0
+    }
+
+    /// Returns `true` if the mapping is private zero-filled memory, so that a first-touch
+    /// fault only needs a cleared frame.
+
+    pub fn is_anonymous(&self) -> bool {
+        self.is_private()
+            && self.base_page.device.major == device::pseudo::MAJOR
+            && self.base_page.device.minor == device::pseudo::ZERO_MINOR
+    }
+
+    /// Returns `true` if the mapping maps a shared memory object.
+
+    pub fn is_shared_object(&self) -> bool {
+        self.base_page.device.major == device::shm::MAJOR
+    }
 }
 
 pub struct AddrSpace {
     root_page_map: PageMapBase,
-    vaddr_map: BTreeSet<AddressMapping>,
+
+    // Mappings keyed by the start address of their regions. Regions never overlap, so the
+    // mapping that contains an address is the last one that starts at or below it.
+    vaddr_map: BTreeMap<usize, AddressMapping>,
+
+    // The unmapped ranges of the address space
+    free_ranges: FreeRangeIndex,
     attached_threads: BTreeSet<Tid>,
 }
 
@@ -138,25 +563,232 @@ impl AddrSpace {
     pub const COPY_ON_WRITE: u32 = 0x00000004;
     pub const GUARD: u32 = 0x00000008;
     pub const EXTEND_DOWN: u32 = 0x00000010;
+    pub const SHARED: u32 = 0x00000020;
+
+    /// The lowest address that can be mapped. The first page is left unmapped to catch
+    /// null pointer accesses.
+    pub const USER_START: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+    /// One past the highest address that can be mapped.
+    pub const USER_END: usize = usize::MAX & !(VirtualPage::SMALL_PAGE_SIZE - 1);
 
     pub fn new(root_pmap: PageMapBase) -> Self {
         Self {
             root_page_map: root_pmap,
-            vaddr_map: BTreeSet::new(),
+            vaddr_map: BTreeMap::new(),
+            free_ranges: FreeRangeIndex::new(Self::USER_START, Self::USER_END),
             attached_threads: BTreeSet::new(),
         }
     }
 
-    // todo: to be implemented
+    /// Reserves a stack of `stack_size` bytes at any free address. Returns the lowest address
+    /// of the stack along with its size.
+
+    pub fn allocate_stack_memory(&mut self, stack_size: usize) -> Option<(VAddr, usize)> {
+        self.map_stack(None, stack_size)
+    }
+
+    /// Reserves a stack of `stack_size` bytes that ends at `stack_top`, with a guard page
+    /// right below it. Returns the lowest address of the stack along with its size.
+    ///
+    /// Nothing is committed up front. The stack is anonymous memory, so a page only gets a
+    /// frame once the thread grows its stack down into it. The guard page is never committed,
+    /// so running past the bottom of the stack faults instead of overwriting whatever lies
+    /// below it.
+
+    pub fn map_stack(&mut self, stack_top: Option<VAddr>, stack_size: usize) -> Option<(VAddr, usize)> {
+        let stack_size = stack_size.align(VirtualPage::SMALL_PAGE_SIZE);
+        let guard_size = VirtualPage::SMALL_PAGE_SIZE;
+        let reserved_size = stack_size.checked_add(guard_size)?;
+        let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
+
+        if stack_size == 0 {
+            return None;
+        }
+
+        let guard_start = match stack_top {
+            Some(stack_top) => {
+                let stack_top = (stack_top as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
+                let guard_start = stack_top.checked_sub(reserved_size)
+                    .filter(|start| *start >= Self::USER_START)?;
+
+                if self.contains_region(&MemoryRegion::new(guard_start, stack_top)) {
+                    return None;
+                }
+
+                self.free_ranges.remove(guard_start, stack_top);
+                guard_start
+            },
+            None => self.free_ranges.allocate(reserved_size, VirtualPage::SMALL_PAGE_SIZE)?,
+        };
+
+        let stack_start = guard_start + guard_size;
+        let guard_flags = Self::GUARD | Self::NO_EXECUTE;
+        let stack_flags = Self::EXTEND_DOWN | Self::NO_EXECUTE;
 
-    pub fn allocate_stack_memory(&mut self, _stack_size: usize) -> Option<(VAddr, usize)> {
-        None
+        self.add_mapping(AddressMapping::new(VirtualPage::new(zero_device.clone(), 0, guard_flags),
+                                             MemoryRegion::new(guard_start, stack_start), guard_flags));
+        self.add_mapping(AddressMapping::new(VirtualPage::new(zero_device, 0, stack_flags),
+                                             MemoryRegion::new(stack_start, stack_start + stack_size),
+                                             stack_flags));
+
+        Some((stack_start as VAddr, stack_size))
     }
 
     pub fn root_pmap(&self) -> PageMapBase {
         self.root_page_map
     }
 
+    /// Creates a copy of this address space that uses `root_pmap` as its root page map.
+    ///
+    /// Committed frames aren't copied. Anonymous mappings are marked as copy-on-write in both
+    /// address spaces and their frames are mapped read-only, so a frame only gets copied when
+    /// one side first writes to it. Mappings that already are copy-on-write stay that way.
+    /// Every other mapping maps the same frames in both address spaces, so that writes to a
+    /// device (e.g. a frame buffer) reach it from either side.
+    ///
+    /// If the frames can't all be shared, then the mappings and frames of this address space
+    /// are left as they were. Only large pages that were split stay split.
+
+    pub fn fork(&mut self, root_pmap: PageMapBase) -> Result<AddrSpace, (Error, Cow<'static, str>)> {
+        let mut marked = Vec::new();
+
+        for (start, mapping) in self.vaddr_map.iter_mut() {
+            if mapping.is_anonymous() && mapping.flags & Self::COPY_ON_WRITE == 0 {
+                mapping.flags |= Self::COPY_ON_WRITE;
+                marked.push(*start);
+            }
+        }
+
+        let mut new_addr_space = AddrSpace::new(root_pmap);
+        let mut shared_pages = Vec::new();
+        let mut result = Ok(());
+
+        for mapping in self.vaddr_map.values() {
+            if mapping.flags & Self::GUARD != Self::GUARD {
+                result = self.share_frames(root_pmap, mapping, &mut shared_pages);
+
+                if result.is_err() {
+                    break;
+                }
+            }
+
+            new_addr_space.insert_mapping(mapping.clone());
+        }
+
+        if let Err(e) = result {
+            self.unshare_frames(root_pmap, shared_pages);
+
+            for start in marked {
+                if let Some(mapping) = self.vaddr_map.get_mut(&start) {
+                    mapping.flags &= !Self::COPY_ON_WRITE;
+                }
+            }
+
+            Err(e)
+        } else {
+            Ok(new_addr_space)
+        }
+    }
+
+    /// Maps every committed frame of a mapping into another address space at the same
+    /// virtual addresses. Frames of copy-on-write mappings are made read-only in both address
+    /// spaces. Each page that gets shared is added to `shared_pages`, even if sharing it
+    /// fails halfway.
+
+    fn share_frames(&self, root_pmap: PageMapBase, mapping: &AddressMapping,
+                    shared_pages: &mut Vec<SharedPage>) -> Result<(), (Error, Cow<'static, str>)> {
+        let is_cow = mapping.flags & Self::COPY_ON_WRITE == Self::COPY_ON_WRITE;
+        let end = mapping.end();
+
+        let mut addr = mapping.region.start();
+
+        while addr < end {
+            let (frame, frame_flags) = unsafe { lowlevel::lookup(Some(self.root_page_map), addr as *const ()) }
+                .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to read page mapping.")))?;
+
+            let next_addr = match frame.frame_size() {
+                FrameSize::Small => addr + VirtualPage::SMALL_PAGE_SIZE,
+                size => (addr + 1).align(size.bytes()),
+            };
+
+            if rust::is_flag_set!(frame_flags, flags::mapping::UNMAPPED) {
+                addr = next_addr;
+                continue;
+            } else if is_cow && frame.frame_size() != FrameSize::Small {
+                // Copy-on-write works on 4 KiB pages, so split the large page and look again
+                large_page::split(self, addr)
+                    .map_err(|e| (e, Cow::Borrowed("Unable to split a large page.")))?;
+                continue;
+            }
+
+            let page_flags = shared_page_flags(mapping.flags, frame_flags, frame.frame_size());
+
+            if frame.frame_size() == FrameSize::Small {
+                ensure_page_table(root_pmap, addr)
+                    .map_err(|e| (e, Cow::Borrowed("Unable to add a page table.")))?;
+            }
+
+            shared_pages.push(SharedPage {
+                addr,
+                frame,
+                is_referenced: phys_alloc::ref_phys(frame.address()).is_some(),
+                old_flags: None,
+                is_mapped: false,
+            });
+
+            let shared_page = shared_pages.last_mut().unwrap();
+
+            unsafe {
+                if is_cow && rust::is_flag_cleared!(frame_flags, flags::mapping::READ_ONLY) {
+                    // Keep the dirty bit, so that reclaim doesn't mistake the page for a
+                    // clean zero-filled page
+                    lowlevel::protect(Some(self.root_page_map), addr as *mut c_void, &frame,
+                                      flags::mapping::READ_ONLY | (frame_flags & flags::mapping::DIRTY))
+                        .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to write-protect a copy-on-write page.")))?;
+
+                    shared_page.old_flags = Some(frame_flags & MOVED_PAGE_FLAGS);
+                }
+
+                lowlevel::map(Some(root_pmap), addr as *mut c_void, frame.address(), page_flags)
+                    .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to map a shared page.")))?;
+
+                shared_page.is_mapped = true;
+            }
+
+            // The frame may have been zero-filled by the kernel, so the parent's mapping
+            // might not have been recorded yet
+            rmap::map(frame.address(), self.root_page_map, addr);
+            rmap::map(frame.address(), root_pmap, addr);
+
+            addr = next_addr;
+        }
+
+        Ok(())
+    }
+
+    /// Undoes `share_frames()`: unmaps the shared pages from the other address space, drops
+    /// their references and makes them writable again in this one.
+
+    fn unshare_frames(&self, root_pmap: PageMapBase, shared_pages: Vec<SharedPage>) {
+        for page in shared_pages.into_iter().rev() {
+            if page.is_mapped {
+                let _ = unsafe { lowlevel::unmap(Some(root_pmap), page.addr as *mut ()) };
+                rmap::unmap(root_pmap, page.addr);
+            }
+
+            if let Some(old_flags) = page.old_flags {
+                let _ = unsafe {
+                    lowlevel::protect(Some(self.root_page_map), page.addr as *mut c_void, &page.frame, old_flags)
+                };
+            }
+
+            if page.is_referenced {
+                phys_alloc::release_phys(page.frame.address(), BlockSize::Block4k);
+            }
+        }
+    }
+
     pub fn attach_thread(&mut self, tid: Tid) -> bool {
         self.attached_threads.insert(tid)
     }
@@ -169,24 +801,141 @@ impl AddrSpace {
         self.attached_threads.remove(tid)
     }
 
-    pub fn get_mapping(&self, addr: VAddr) -> Option<&AddressMapping> {
-        for map in self.vaddr_map.iter() {
-            if map.region.contains(addr as usize) {
-                return Some(map);
-            }
+    pub fn has_threads(&self) -> bool {
+        !self.attached_threads.is_empty()
+    }
+
+    /// Returns the physical ranges that are mapped directly from the physical memory device.
+
+    fn device_frame_ranges(&self) -> Vec<Range<PAddr>> {
+        self.vaddr_map.values()
+            .filter(|mapping| mapping.base_page.device.major == device::mem::MAJOR)
+            .map(|mapping| {
+                let start = (mapping.base_page.offset as PAddr).align_trunc(VirtualPage::SMALL_PAGE_SIZE as PAddr);
+                let end = start + (mapping.end() - mapping.region.start()) as PAddr;
+
+                // Pages past the end of the data are backed by frames of their own
+                start..mapping.data_end.map_or(end, |data_end| end.min(data_end as PAddr))
+            })
+            .collect()
+    }
+
+    /// Returns the first page at or after `addr` that belongs to an anonymous mapping.
+
+    pub fn next_anonymous_page(&self, addr: usize) -> Option<usize> {
+        if addr >= Self::USER_END {
+            return None;
+        }
+
+        self.overlapping_mappings(addr, Self::USER_END)
+            .find(|mapping| mapping.is_anonymous())
+            .map(|mapping| mapping.region.start().max(addr))
+    }
+
+    /// Returns the first 4 MiB-aligned range at or after `addr` that lies entirely within a
+    /// private mapping that isn't copy-on-write. Such a range may be mapped by a large page.
+
+    pub fn next_large_page_range(&self, addr: usize) -> Option<usize> {
+        let page_size = PhysicalFrame::PSE_LARGE_PAGE_SIZE;
+
+        if addr >= Self::USER_END {
+            return None;
         }
 
-        None
+        // Only anonymous memory is collapsed. Device frames and frames that are shared with
+        // other mappings belong to somebody else.
+        self.overlapping_mappings(addr, Self::USER_END)
+            .filter(|mapping| mapping.is_anonymous() && mapping.flags & Self::COPY_ON_WRITE == 0)
+            .find_map(|mapping| {
+                let start = mapping.region.start().max(addr);
+
+                Some(start)
+                    .filter(|start| *start <= Self::USER_END - page_size)
+                    .map(|start| start.align(page_size))
+                    .filter(|base| base + page_size <= mapping.end())
+            })
+    }
+
+    /// Lets the kernel resolve first-touch faults again on the anonymous parts of
+    /// `[start, end)`.
+
+    pub fn delegate_anon_range(&self, start: usize, end: usize) {
+        for mapping in self.overlapping_mappings(start, end).filter(|mapping| mapping.is_anonymous()) {
+            let region_start = mapping.region.start().max(start);
+            let region_end = mapping.end().min(end);
+
+            let _ = lowlevel::delegate_anon_region(Some(self.root_page_map), region_start,
+                                                   region_end - region_start);
+        }
+    }
+
+    pub fn get_mapping(&self, addr: VAddr) -> Option<&AddressMapping> {
+        let addr = addr as usize;
+
+        self.vaddr_map.range(..=addr)
+            .next_back()
+            .map(|(_, mapping)| mapping)
+            .filter(|mapping| mapping.region.contains(addr))
+    }
+
+    /// Returns the mappings that overlap `[start, end)` in order of address.
+
+    fn overlapping_mappings(&self, start: usize, end: usize) -> impl Iterator<Item=&AddressMapping> {
+        let first = self.vaddr_map.range(..start)
+            .next_back()
+            .map(|(_, mapping)| mapping)
+            .filter(|mapping| mapping.end() > start);
+
+        first.into_iter()
+            .chain(self.vaddr_map.range(start..end).map(|(_, mapping)| mapping))
     }
 
     fn contains_region(&self, region: &MemoryRegion<usize>) -> bool {
-        for map in self.vaddr_map.iter() {
-            if map.region.overlaps(region) {
-                return true;
+        let end = if region.end() == MemoryRegion::memory_end() {
+            Self::USER_END
+        } else {
+            region.end()
+        };
+
+        self.overlapping_mappings(region.start(), end).next().is_some()
+    }
+
+    fn insert_mapping(&mut self, mapping: AddressMapping) {
+        self.free_ranges.remove(mapping.region.start(), mapping.end());
+        self.add_mapping(mapping);
+    }
+
+    /// Adds a mapping whose range has already been taken out of the free ranges.
+    ///
+    /// First-touch faults on anonymous mappings are left to the kernel. If the kernel can't
+    /// take the region, then its faults just keep coming to the pager.
+
+    fn add_mapping(&mut self, mapping: AddressMapping) {
+        if mapping.is_anonymous() {
+            let _ = lowlevel::delegate_anon_region(Some(self.root_page_map), mapping.region.start(),
+                                                   mapping.end() - mapping.region.start());
+        } else if mapping.is_shared_object() {
+            shm::attach(&mapping.base_page.device);
+        }
+
+        self.vaddr_map.insert(mapping.region.start(), mapping);
+    }
+
+    /// Maps a loadable segment of an executable image that's held by a device. Only the
+    /// first `file_length` bytes come from the device. The rest, up to `length` bytes, read
+    /// as zeros. Nothing is read or zeroed until a page is first touched.
+
+    pub fn map_segment(&mut self, addr: VAddr, dev_id: &DeviceId, offset: u64, flags: u32,
+                       file_length: usize, length: usize) -> Option<VAddr> {
+        let start_address = self.map(Some(addr), dev_id, offset, flags, length)?;
+
+        if file_length < length {
+            if let Some(mapping) = self.vaddr_map.get_mut(&(start_address as usize)) {
+                mapping.data_end = Some(offset + file_length as u64);
             }
         }
 
-        false
+        Some(start_address)
     }
 
     /// Maps a region of memory to some block device in a particular address space.
@@ -195,6 +944,35 @@ impl AddrSpace {
 
     pub fn map(&mut self, addr: Option<VAddr>, dev_id: &DeviceId, offset: u64, flags: u32,
                length: usize) -> Option<VAddr> {
+        self.map_aligned(addr, dev_id, offset, flags, length, VirtualPage::SMALL_PAGE_SIZE)
+    }
+
+    /// Maps a region of memory to some block device in a particular address space.
+    ///
+    /// If the desired address is `None`, then the smallest free range that can hold the
+    /// region at an `alignment`-byte boundary (a power of two) is used.
+    ///
+    /// Writes to a shared memory object are always seen by its other mappings, so such a
+    /// mapping is never copy-on-write.
+
+    pub fn map_aligned(&mut self, addr: Option<VAddr>, dev_id: &DeviceId, offset: u64, flags: u32,
+                       length: usize, alignment: usize) -> Option<VAddr> {
+        let flags = if dev_id.major == device::shm::MAJOR {
+            if !shm::contains(dev_id, offset, length) {
+                return None;
+            }
+
+            (flags | Self::SHARED) & !Self::COPY_ON_WRITE
+        } else if dev_id.major == device::pseudo::MAJOR && dev_id.minor == device::pseudo::NAME_CACHE_MINOR {
+            if offset + length as u64 > VirtualPage::SMALL_PAGE_SIZE as u64 {
+                return None;
+            }
+
+            (flags | Self::SHARED | Self::READ_ONLY) & !Self::COPY_ON_WRITE
+        } else {
+            flags
+        };
+
         let new_page = VirtualPage::new(dev_id.clone(), offset, flags);
 
         if let Some(start_address) = addr {
@@ -210,34 +988,229 @@ impl AddrSpace {
                 if self.contains_region(&new_region) {
                     None
                 } else {
-                    self.vaddr_map.insert(AddressMapping::new(new_page, new_region, flags));
+                    self.insert_mapping(AddressMapping::new(new_page, new_region, flags));
                     Some(start_address as VAddr)
                 }
             }
         } else {
-            let available_regions = self.vaddr_map
-                .iter()
-                .fold(RegionSet::empty(), |acc, mapping| {
-                    acc.union(&RegionSet::from(mapping.region.clone()))
+            let length = length.align(VirtualPage::SMALL_PAGE_SIZE);
+            let alignment = alignment.max(VirtualPage::SMALL_PAGE_SIZE);
+
+            self.free_ranges.allocate(length, alignment)
+                .map(|start_address| {
+                    let new_region: MemoryRegion<usize> =
+                        MemoryRegion::new(start_address, start_address + length);
+
+                    self.add_mapping(AddressMapping::new(new_page, new_region, flags));
+                    start_address as VAddr
                 })
-                .complement();
+        }
+    }
 
-            for region in available_regions.into_iter() {
-                if let Ok(l) = region.length() {
-                    if l < length {
-                        continue;
-                    }
+    /// Resizes the anonymous memory at `[addr, addr + old_length)`. Returns the address of
+    /// the resized memory.
+    ///
+    /// The memory shrinks or grows in place if it can. Otherwise, if `may_move` is set, it's
+    /// moved to a free range that's large enough. Its frames are moved by remapping them at
+    /// the new address, so nothing gets copied no matter how much of the memory is committed.
+
+    pub fn remap(&mut self, addr: VAddr, old_length: usize, new_length: usize, may_move: bool) -> Option<VAddr> {
+        let start = addr as usize;
+        let old_length = old_length.align(VirtualPage::SMALL_PAGE_SIZE);
+        let new_length = new_length.align(VirtualPage::SMALL_PAGE_SIZE);
+        let old_end = start.checked_add(old_length)?;
+        let new_end = start.checked_add(new_length)?;
+
+        if !start.is_aligned(VirtualPage::SMALL_PAGE_SIZE) || old_length == 0 || new_length == 0 {
+            return None;
+        }
+
+        let flags = self.get_mapping(addr)
+            .filter(|mapping| mapping.is_anonymous() && mapping.end() >= old_end)
+            .map(|mapping| mapping.flags)?;
+
+        if new_length <= old_length {
+            if new_length < old_length {
+                self.unmap(new_end as VAddr, old_length - new_length);
+            }
+
+            return Some(addr);
+        }
+
+        let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
+
+        if !self.contains_region(&MemoryRegion::new(old_end, new_end)) {
+            return self.map(Some(old_end as VAddr), &zero_device, 0, flags, new_end - old_end)
+                .map(|_| addr);
+        } else if !may_move {
+            return None;
+        }
+
+        let new_start = self.free_ranges.allocate(new_length, VirtualPage::SMALL_PAGE_SIZE)?;
+
+        if self.move_pages(start, old_end, new_start).is_err() {
+            self.free_ranges.insert(new_start, new_start + new_length);
+            return None;
+        }
+
+        self.add_mapping(AddressMapping::new(VirtualPage::new(zero_device, 0, flags),
+                                             MemoryRegion::new(new_start, new_start + new_length), flags));
+        swap::move_slots(self.root_page_map, start, old_end, new_start);
+        self.unmap(addr, old_length);
+
+        Some(new_start as VAddr)
+    }
+
+    /// Moves the pages of `[start, end)` to the range at `new_start`. Each frame stays mapped
+    /// exactly once, so it keeps its references.
+    ///
+    /// Every page is mapped at its new address before any of the old ones are unmapped. If
+    /// that fails, then the new mappings are taken down again and nothing has moved.
+
+    fn move_pages(&self, start: usize, end: usize, new_start: usize) -> Result<(), Error> {
+        let root_pmap = self.root_page_map;
+        let table_size = PhysicalFrame::PSE_LARGE_PAGE_SIZE;
+        let mut pages = vec![(0 as PAddr, 0u32); table_size / VirtualPage::SMALL_PAGE_SIZE];
+        let mut moved_runs = Vec::new();
+
+        // The parts of the range that are covered by a single page directory entry
+        let tables = (start.align_trunc(table_size)..end).step_by(table_size)
+            .map(|base| (base.max(start), base.saturating_add(table_size).min(end)))
+            .collect::<Vec<_>>();
+
+        // Large pages are moved 4 KiB at a time
+        for (table_start, _) in tables.iter() {
+            large_page::split(self, *table_start)?;
+        }
+
+        // Keep the kernel from zero-filling pages of the old range while they're being moved
+        let _ = lowlevel::revoke_anon_region(Some(root_pmap), start, end - start);
+
+        for (table_start, table_end) in tables.iter().copied() {
+            let page_count = (table_end - table_start) / VirtualPage::SMALL_PAGE_SIZE;
+            let new_table_start = table_start - start + new_start;
+
+            let result = lowlevel::has_page_table(Some(root_pmap), table_start as *const ())
+                .map_err(|_| Error::Failed)
+                .and_then(|has_table| if has_table {
+                    lowlevel::lookup_pages(Some(root_pmap), table_start as *const (), &mut pages[..page_count])
+                        .map_err(|_| Error::Failed)
+                        .and_then(|_| Self::map_page_runs(root_pmap, new_table_start, &pages[..page_count],
+                                                          &mut moved_runs))
+                } else {
+                    Ok(())
+                });
+
+            if let Err(e) = result {
+                for (addr, count) in moved_runs {
+                    let _ = unsafe { lowlevel::unmap_pages(Some(root_pmap), addr as *mut (), count) };
                 }
 
-                let new_region: MemoryRegion<usize> =
-                    MemoryRegion::new(region.start(), region.start() + length);
+                self.delegate_anon_range(start, end);
+                return Err(e);
+            }
+        }
+
+        // Every page is in place at the new address, so the old range can go
+
+        for (table_start, table_end) in tables.iter().copied() {
+            if let Ok(true) = lowlevel::has_page_table(Some(root_pmap), table_start as *const ()) {
+                let _ = unsafe { lowlevel::unmap_pages(Some(root_pmap), table_start as *mut (),
+                                                       (table_end - table_start) / VirtualPage::SMALL_PAGE_SIZE) };
+            }
+        }
+
+        for (page, frame) in rmap::unmap_range(root_pmap, start, end) {
+            rmap::map(frame, root_pmap, page - start + new_start);
+        }
+
+        Ok(())
+    }
+
+    /// Maps the present pages of a page table's worth of entries at `addr`. Consecutive pages
+    /// with the same flags are mapped with a single call. Each run that was mapped is added
+    /// to `runs`.
 
-                self.vaddr_map.insert(AddressMapping::new(new_page, new_region, flags));
-                return Some(region.start() as VAddr);
+    fn map_page_runs(root_pmap: PageMapBase, addr: usize, pages: &[(PAddr, u32)],
+                     runs: &mut Vec<(usize, usize)>) -> Result<(), Error> {
+        let mut i = 0;
+
+        while i < pages.len() {
+            if rust::is_flag_set!(pages[i].1, flags::mapping::UNMAPPED) {
+                i += 1;
+                continue;
+            }
+
+            let run_flags = pages[i].1 & MOVED_PAGE_FLAGS;
+            let run_length = pages[i..].iter()
+                .take_while(|(_, page_flags)| rust::is_flag_cleared!(*page_flags, flags::mapping::UNMAPPED)
+                    && page_flags & MOVED_PAGE_FLAGS == run_flags)
+                .count();
+            let frames = pages[i..i + run_length].iter()
+                .map(|(frame, _)| *frame)
+                .collect::<Vec<_>>();
+            let run_addr = addr + i * VirtualPage::SMALL_PAGE_SIZE;
+
+            let mapped = unsafe { lowlevel::map_frames(Some(root_pmap), run_addr as *mut c_void, &frames,
+                                                       run_flags | flags::mapping::OVERWRITE) };
+
+            match mapped {
+                Ok(_) => runs.push((run_addr, run_length)),
+                Err(SyscallError::PartiallyMapped(count)) => {
+                    runs.push((run_addr, count));
+                    return Err(Error::Failed);
+                },
+                Err(_) => return Err(Error::Failed),
             }
 
-            None
+            i += run_length;
         }
+
+        Ok(())
+    }
+
+    /// Unmaps the pages in `[start, end)` and releases the frames that the address space owns
+    /// (see `is_owned_frame()`). A large page must lie entirely within the range.
+
+    fn release_pages(&self, start: usize, end: usize, device_ranges: &[Range<PAddr>]) {
+        let table_size = PhysicalFrame::PSE_LARGE_PAGE_SIZE;
+        let mut pages = vec![(0 as PAddr, 0u32); table_size / VirtualPage::SMALL_PAGE_SIZE];
+        let mut owned_frames = Vec::new();
+        let mut base = start;
+
+        while base < end {
+            let table_end = (base + 1).align(table_size).min(end);
+
+            match lowlevel::lookup_page_table(Some(self.root_page_map), base as *const ()) {
+                Ok((_, table_flags)) if rust::is_flag_set!(table_flags, flags::mapping::UNMAPPED) => (),
+                Ok((large_frame, table_flags)) if rust::is_flag_set!(table_flags, flags::mapping::PAGE_SIZED) => {
+                    let is_whole = base.is_aligned(table_size) && base + table_size <= end;
+
+                    if is_whole && unsafe { lowlevel::unmap(Some(self.root_page_map), base as *mut ()) }.is_ok()
+                        && is_owned_frame(large_frame.address(), device_ranges) {
+                        phys_alloc::release_phys(large_frame.address(), BlockSize::Block4M);
+                    }
+                },
+                Ok(_) => {
+                    let table_pages = &mut pages[..(table_end - base) / VirtualPage::SMALL_PAGE_SIZE];
+
+                    let is_unmapped = lowlevel::lookup_pages(Some(self.root_page_map), base as *const (), table_pages).is_ok()
+                        && unsafe { lowlevel::unmap_pages(Some(self.root_page_map), base as *mut (), table_pages.len()) }.is_ok();
+
+                    if is_unmapped {
+                        owned_frames.extend(table_pages.iter()
+                            .filter(|(_, page_flags)| rust::is_flag_cleared!(*page_flags, flags::mapping::UNMAPPED))
+                            .map(|(frame, _)| *frame)
+                            .filter(|frame| is_owned_frame(*frame, device_ranges)));
+                    }
+                },
+                Err(_) => (),
+            }
+
+            base = table_end;
+        }
+
+        phys_alloc::release_phys_frames(&owned_frames);
     }
 
     pub fn unmap(&mut self, start_address: VAddr, length: usize) -> bool {
@@ -246,26 +1219,77 @@ impl AddrSpace {
         let start_address = (start_address as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
 
         if end_address > start_address {
-            let addr_map = self.get_mapping(start_address as VAddr)
-                .map(|m| m.clone());
-
             let unmapped_region: MemoryRegion<usize> = MemoryRegion::new(start_address, end_address);
+            let affected = self.overlapping_mappings(start_address, end_address)
+                .map(|mapping| mapping.region.start())
+                .collect::<Vec<usize>>();
+
+            if !affected.is_empty() {
+                // A large page that's only partly unmapped has to be split first
+
+                for boundary in [start_address, end_address].iter() {
+                    if !boundary.is_aligned(PhysicalFrame::PSE_LARGE_PAGE_SIZE) {
+                        let _ = large_page::split(self, *boundary);
+                    }
+                }
+
+                let _ = lowlevel::revoke_anon_region(Some(self.root_page_map), start_address,
+                                                     end_address - start_address);
+                swap::discard(self.root_page_map, start_address, end_address);
 
-            match addr_map {
-                Some(mapping) => {
-                    self.vaddr_map.remove(&mapping);
+                // Each page of a shared memory object holds a reference to the object's frame
 
-                    for region in mapping.region.difference(&unmapped_region).into_iter() {
-                        let mut vpage = mapping.base_page.clone();
+                let unmapped_pages = rmap::unmap_range(self.root_page_map, start_address, end_address);
 
-                        vpage.offset += (region.start() - mapping.region.start()) as u64;
-                        self.vaddr_map.insert(AddressMapping::new(vpage, region, mapping.flags));
+                for (page, frame) in unmapped_pages.into_iter()
+                    .filter(|(page, _)| self.get_mapping(*page as VAddr)
+                        .map_or(false, |mapping| mapping.is_shared_object())) {
+                    let _ = unsafe { lowlevel::unmap(Some(self.root_page_map), page as *mut ()) };
+                    phys_alloc::release_phys(frame, phys_alloc::BlockSize::Block4k);
+                }
+
+                // The rest of the pages are unmapped as well, and their frames released, so
+                // that memory mapped over the range later starts out zero-filled
+
+                let device_ranges = self.device_frame_ranges();
+                let private_ranges = self.overlapping_mappings(start_address, end_address)
+                    .filter(|mapping| !mapping.is_shared_object())
+                    .map(|mapping| (mapping.region.start().max(start_address), mapping.end().min(end_address)))
+                    .collect::<Vec<_>>();
+
+                for (start, end) in private_ranges {
+                    self.release_pages(start, end, &device_ranges);
+                }
+            }
+
+            for mapping_start in affected.iter() {
+                let mapping = self.vaddr_map.remove(mapping_start)
+                    .expect("Overlapping mapping should exist");
+
+                self.free_ranges.insert(mapping.region.start().max(start_address),
+                                        mapping.end().min(end_address));
+
+                for region in mapping.region.difference(&unmapped_region).into_iter() {
+                    let mut vpage = mapping.base_page.clone();
+
+                    vpage.offset += (region.start() - mapping.region.start()) as u64;
+
+                    if mapping.is_shared_object() {
+                        shm::attach(&vpage.device);
                     }
 
-                    true
-                },
-                None => false,
+                    let mut remaining = AddressMapping::new(vpage, region, mapping.flags);
+
+                    remaining.data_end = mapping.data_end;
+                    self.vaddr_map.insert(region.start(), remaining);
+                }
+
+                if mapping.is_shared_object() {
+                    shm::detach(&mapping.base_page.device);
+                }
             }
+
+            !affected.is_empty()
         } else {
             false
         }
@@ -13,6 +13,7 @@ use alloc::boxed::Box;
 use core::convert::{TryInto, TryFrom};
 use core::ptr;
 use core::mem::MaybeUninit;
+use crate::port::{CPid, Pid};
 
 type Result<T> = core::result::Result<T, error::Error>;
 
@@ -64,6 +65,12 @@ pub mod init {
     // Reserve an IO port range
     pub const UNMAP_IO: u32 = 13;       // Release an IO port range
 
+    pub const CREATE_SHM: u32 = 14;     // Create a shared memory object
+    pub const DESTROY_SHM: u32 = 15;    // Drop the creator's handle to a shared memory object
+
+    pub const REMAP: u32 = 16;          // Resize anonymous memory, moving its pages if needed
+    pub const FORK: u32 = 17;           // Start a thread in a copy of the sender's address space
+
     pub trait Valid {
         fn validate(&self) -> Result<()>;
     }
@@ -292,82 +299,306 @@ impl Valid for UnmapRequest {
 pub struct UnmapResponse {}
 impl SimpleResponse for UnmapResponse {}
 
-
-pub struct CreatePortRequest {
-    pub pid: Pid,
-    pub flags: u32,
+#[derive(Clone)]
+#[repr(C)]
+pub struct RawRemapRequest {
+    pub address: *const c_void,
+    pub old_length: usize,
+    pub new_length: usize,
+    pub flags: i32,
 }
 
-impl CreatePortRequest {
-    pub fn new(message: RawMessage) -> Result<Self> {
-        let request;
+impl TryFrom<RawMessage> for RawRemapRequest {
+    type Error = i32;
 
-        unsafe {
-            request = Self {
-                pid: message.payload.u16[0].into(),
-                flags: message.payload.u32[1],
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawRemapRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let address_arr;
+            let old_length_arr;
+            let new_length_arr;
+            let flags_arr;
+
+            let address_ptr = (msg.buffer.wrapping_add(offset_of!(RawRemapRequest, address))) as *const [u8; mem::size_of::<usize>()];
+            let old_length_ptr = (msg.buffer.wrapping_add(offset_of!(RawRemapRequest, old_length))) as *const [u8; mem::size_of::<usize>()];
+            let new_length_ptr = (msg.buffer.wrapping_add(offset_of!(RawRemapRequest, new_length))) as *const [u8; mem::size_of::<usize>()];
+            let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawRemapRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+
+            unsafe {
+                address_arr = address_ptr.read();
+                old_length_arr = old_length_ptr.read();
+                new_length_arr = new_length_ptr.read();
+                flags_arr = flags_ptr.read();
             }
+
+            Ok(RawRemapRequest {
+                address: usize::from_le_bytes(address_arr) as *const c_void,
+                old_length: usize::from_le_bytes(old_length_arr),
+                new_length: usize::from_le_bytes(new_length_arr),
+                flags: i32::from_le_bytes(flags_arr),
+            })
         }
+    }
+}
+
+pub struct RemapRequest {
+    pub address: VAddr,
+    pub old_length: usize,
+    pub new_length: usize,
+    pub may_move: bool,
+}
 
-        match request.validate() {
-            Err(x) => Err(x),
-            Ok(_) => Ok(request),
+impl RemapRequest {
+    pub const MAY_MOVE: i32 = 0x01;
+}
+
+impl TryFrom<RawRemapRequest> for RemapRequest {
+    type Error = i32;
+
+    fn try_from(raw_msg: RawRemapRequest) -> result::Result<Self, Self::Error> {
+        if raw_msg.address.is_null() {
+            result::Result::Err(Error::ParseError)
+        } else {
+            result::Result::Ok(RemapRequest {
+                address: raw_msg.address as VAddr,
+                old_length: raw_msg.old_length,
+                new_length: raw_msg.new_length,
+                may_move: raw_msg.flags & Self::MAY_MOVE == Self::MAY_MOVE,
+            })
         }
     }
 }
 
-impl Valid for CreatePortRequest {
+impl TryFrom<RawMessage> for RemapRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawRemapRequest::try_from(value)
+            .and_then(|request| Self::try_from(request))
+    }
+}
+
+impl Valid for RemapRequest {
     fn validate(&self) -> Result<()> {
-        if self.pid.is_null() {
-            Err(INVALID_PORT)
+        if self.old_length == 0 || self.new_length == 0 {
+            Err(ZERO_LENGTH)
+        } else if self.address.align_offset(VirtualPage::SMALL_PAGE_SIZE) != 0 {
+            Err(INVALID_ADDRESS)
         } else {
             Ok(())
         }
     }
 }
 
-pub struct CreatePortResponse {}
+#[derive(Clone)]
+#[repr(C)]
+pub struct RawForkRequest {
+    pub entry: *const c_void,
+    pub stack_top: *const c_void,
+}
 
-impl CreatePortResponse {
-    pub fn new_message(recipient: Tid, new_pid: Option<Pid>) -> RawMessage {
-        let mut payload = ShortMessagePayload::new();
+impl TryFrom<RawMessage> for RawForkRequest {
+    type Error = i32;
 
-        let subject = match new_pid {
-            Some(pid) => {
-                unsafe {
-                    payload.u16[0] = pid.into();
-                }
-                RawMessage::RESPONSE_OK
-            },
-            None => RawMessage::RESPONSE_FAIL
-        };
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawForkRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let entry_arr;
+            let stack_top_arr;
+
+            let entry_ptr = (msg.buffer.wrapping_add(offset_of!(RawForkRequest, entry))) as *const [u8; mem::size_of::<usize>()];
+            let stack_top_ptr = (msg.buffer.wrapping_add(offset_of!(RawForkRequest, stack_top))) as *const [u8; mem::size_of::<usize>()];
+
+            unsafe {
+                entry_arr = entry_ptr.read();
+                stack_top_arr = stack_top_ptr.read();
+            }
 
-        RawMessage::new(subject, recipient.into(), payload)
+            Ok(RawForkRequest {
+                entry: usize::from_le_bytes(entry_arr) as *const c_void,
+                stack_top: usize::from_le_bytes(stack_top_arr) as *const c_void,
+            })
+        }
     }
 }
 
+pub struct ForkRequest {
+    pub entry: VAddr,
+    pub stack_top: VAddr,
+}
 
-pub struct DestroyPortRequest {
+impl TryFrom<RawForkRequest> for ForkRequest {
+    type Error = i32;
+
+    fn try_from(raw_msg: RawForkRequest) -> result::Result<Self, Self::Error> {
+        if raw_msg.entry.is_null() {
+            result::Result::Err(Error::ParseError)
+        } else {
+            result::Result::Ok(ForkRequest {
+                entry: raw_msg.entry as VAddr,
+                stack_top: raw_msg.stack_top as VAddr,
+            })
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for ForkRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawForkRequest::try_from(value)
+            .and_then(|request| Self::try_from(request))
+    }
+}
+
+pub struct ForkResponse {}
+
+impl ForkResponse {
+    pub fn new_message(recipient: Tid, tid_option: Option<Tid>, flags: i32) -> Message<CTid> {
+        match tid_option {
+            None => Message {
+                subject: RawMessage::RESPONSE_FAIL,
+                sender: Tid::null(),
+                recipient: recipient.clone(),
+                data: None,
+                bytes_transferred: None,
+                flags,
+            },
+            Some(tid) => Message {
+                subject: RawMessage::RESPONSE_OK,
+                sender: Tid::null(),
+                recipient: recipient.into(),
+                data: Some(Box::new(tid.into())),
+                bytes_transferred: None,
+                flags,
+            }
+        }
+    }
+}
+
+
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawCreatePortRequest {
+    pid: CPid,
+    flags: i32,
+}
+
+pub struct CreatePortRequest {
     pub pid: Pid,
+    pub flags: u32,
+}
+
+impl From<RawCreatePortRequest> for CreatePortRequest {
+    fn from(raw_msg: RawCreatePortRequest) -> Self {
+        Self {
+            pid: Pid::new(raw_msg.pid),
+            flags: raw_msg.flags as u32,
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for RawCreatePortRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawCreatePortRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let pid_ptr = (msg.buffer.wrapping_add(offset_of!(RawCreatePortRequest, pid))) as *const [u8; mem::size_of::<CPid>()];
+            let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawCreatePortRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+            let (pid_arr, flags_arr) = unsafe { (pid_ptr.read(), flags_ptr.read()) };
+
+            Ok(RawCreatePortRequest {
+                pid: CPid::from_le_bytes(pid_arr),
+                flags: i32::from_le_bytes(flags_arr),
+            })
+        }
+    }
 }
 
-impl DestroyPortRequest {
-    pub fn new(message: RawMessage) -> Result<Self> {
-        let request;
+impl TryFrom<RawMessage> for CreatePortRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawCreatePortRequest::try_from(value)
+            .map(|request| Self::from(request))
+    }
+}
 
-        unsafe {
-            request = Self {
-                pid: message.payload.u16[0].into(),
+pub struct CreatePortResponse {}
+
+impl CreatePortResponse {
+    pub fn new_message(recipient: Tid, pid_option: Option<Pid>, flags: i32) -> Message<CPid> {
+        match pid_option {
+            None => Message {
+                subject: RawMessage::RESPONSE_FAIL,
+                sender: Tid::null(),
+                recipient: recipient.clone(),
+                data: None,
+                bytes_transferred: None,
+                flags,
+            },
+            Some(pid) => Message {
+                subject: RawMessage::RESPONSE_OK,
+                sender: Tid::null(),
+                recipient: recipient.into(),
+                data: Some(Box::new(pid.into())),
+                bytes_transferred: None,
+                flags,
             }
         }
+    }
+}
+
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawDestroyPortRequest {
+    pid: CPid,
+}
+
+pub struct DestroyPortRequest {
+    pub pid: Pid,
+}
+
+impl From<RawDestroyPortRequest> for DestroyPortRequest {
+    fn from(raw_msg: RawDestroyPortRequest) -> Self {
+        Self {
+            pid: Pid::new(raw_msg.pid),
+        }
+    }
+}
 
-        match request.validate() {
-            Err(x) => Err(x),
-            Ok(_) => Ok(request),
+impl TryFrom<RawMessage> for RawDestroyPortRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawDestroyPortRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let pid_ptr = (msg.buffer.wrapping_add(offset_of!(RawDestroyPortRequest, pid))) as *const [u8; mem::size_of::<CPid>()];
+            let pid_arr = unsafe { pid_ptr.read() };
+
+            Ok(RawDestroyPortRequest {
+                pid: CPid::from_le_bytes(pid_arr),
+            })
         }
     }
 }
 
+impl TryFrom<RawMessage> for DestroyPortRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawDestroyPortRequest::try_from(value)
+            .and_then(|request| {
+                let request = Self::from(request);
+
+                request.validate()
+                    .map(|_| request)
+                    .map_err(|_| Error::ParseError)
+            })
+    }
+}
+
 impl Valid for DestroyPortRequest {
     fn validate(&self) -> Result<()> {
         if self.pid.is_null() {
@@ -379,51 +610,65 @@ impl Valid for DestroyPortRequest {
 }
 
 pub struct DestroyPortResponse {}
+impl SimpleResponse for DestroyPortResponse {}
 
-impl DestroyPortResponse {
-    pub fn new_message(recipient: Tid, is_ok: bool) -> RawMessage {
-        let subject = if is_ok {
-            RawMessage::RESPONSE_OK
-        } else {
-            RawMessage::RESPONSE_FAIL
-        };
-
-        RawMessage::new_short(subject, recipient.into())
-    }
+/// The message's data follows the header.
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawSendPortRequest {
+    pid: CPid,
+    flags: i32,
+    length: usize,
 }
 
-
 pub struct SendPortRequest {
     pub pid: Pid,
-    pub buffer: VAddr,
-    pub buffer_len: usize,
+    pub flags: u32,
+    pub data: Vec<u8>,
 }
 
-impl SendPortRequest {
-    pub fn new(message: super::RawMessage) -> Result<Self> {
-        let request;
+impl TryFrom<RawMessage> for SendPortRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        let header_len = mem::size_of::<RawSendPortRequest>();
 
-        unsafe {
-            request = Self {
-                pid: message.payload.u16[0].into(),
-                buffer: (message.payload.u16[1] as usize | ((message.payload.u16[2] as usize) << 16)) as VAddr,
-                buffer_len: (message.payload.u16[3] as usize) | ((message.payload.u16[4] as usize) << 16),
+        if msg.buffer_len < header_len {
+            Err(Error::ParseError)
+        } else {
+            let pid_ptr = (msg.buffer.wrapping_add(offset_of!(RawSendPortRequest, pid))) as *const [u8; mem::size_of::<CPid>()];
+            let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawSendPortRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+            let length_ptr = (msg.buffer.wrapping_add(offset_of!(RawSendPortRequest, length))) as *const [u8; mem::size_of::<usize>()];
+            let (pid_arr, flags_arr, length_arr) = unsafe { (pid_ptr.read(), flags_ptr.read(), length_ptr.read()) };
+            let length = usize::from_le_bytes(length_arr);
+
+            // The data has to have arrived with the request
+
+            if length > msg.buffer_len - header_len {
+                return Err(Error::ParseError);
             }
-        }
 
-        match request.validate() {
-            Err(x) => Err(x),
-            Ok(_) => Ok(request),
+            let data = unsafe {
+                core::slice::from_raw_parts(msg.buffer.wrapping_add(header_len) as *const u8, length)
+            };
+
+            let request = SendPortRequest {
+                pid: Pid::new(CPid::from_le_bytes(pid_arr)),
+                flags: i32::from_le_bytes(flags_arr) as u32,
+                data: data.to_vec(),
+            };
+
+            request.validate()
+                .map(|_| request)
+                .map_err(|_| Error::ParseError)
         }
     }
 }
 
 impl Valid for SendPortRequest {
     fn validate(&self) -> Result<()> {
-        if self.buffer_len == 0 {
+        if self.data.is_empty() {
             Err(ZERO_LENGTH)
-        } else if self.buffer == NULL_VADDR {
-            Err(INVALID_ADDRESS)
         } else if self.pid.is_null() {
             Err(INVALID_PORT)
         }
@@ -434,76 +679,92 @@ impl Valid for SendPortRequest {
 }
 
 pub struct SendPortResponse {}
+impl SimpleResponse for SendPortResponse {}
 
-impl SendPortResponse {
-    pub fn new_message(recipient: Tid, sent_bytes: Option<usize>) -> RawMessage {
-        let mut payload = ShortMessagePayload::new();
-
-        let subject = if let Some(b) = sent_bytes {
-            unsafe {
-                payload.u32[0] = b as u32;
-            }
-            RawMessage::RESPONSE_OK
-        } else {
-            RawMessage::RESPONSE_FAIL
-        };
-
-        RawMessage::new(subject, recipient.into(), payload)
-    }
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawReceivePortRequest {
+    pid: CPid,
+    flags: i32,
+    max_messages: usize,
+    buffer_len: usize,
 }
 
-
 pub struct ReceivePortRequest {
     pub pid: Pid,
-    pub buffer: VAddr,
+    pub flags: u32,
+    pub max_messages: usize,
     pub buffer_len: usize,
 }
 
-impl ReceivePortRequest {
-    pub fn new(message: super::RawMessage) -> Result<Self> {
-        let request;
-
-        unsafe {
-            request = Self {
-                pid: message.payload.u16[0].into(),
-                buffer: (message.payload.u16[1] as usize | ((message.payload.u16[2] as usize) << 16)) as VAddr,
-                buffer_len: (message.payload.u16[3] as usize) | ((message.payload.u16[4] as usize) << 16),
-            }
+impl From<RawReceivePortRequest> for ReceivePortRequest {
+    fn from(raw_msg: RawReceivePortRequest) -> Self {
+        Self {
+            pid: Pid::new(raw_msg.pid),
+            flags: raw_msg.flags as u32,
+            max_messages: raw_msg.max_messages,
+            buffer_len: raw_msg.buffer_len,
         }
-
-        request.validate().map(|_| request)
     }
 }
 
-impl Valid for ReceivePortRequest {
-    fn validate(&self) -> Result<()> {
-        if self.buffer_len == 0 {
-            Err(ZERO_LENGTH)
-        } else if self.buffer == NULL_VADDR {
-            Err(INVALID_ADDRESS)
+impl TryFrom<RawMessage> for RawReceivePortRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawReceivePortRequest>() {
+            Err(Error::ParseError)
         } else {
-            Ok(())
+            let pid_ptr = (msg.buffer.wrapping_add(offset_of!(RawReceivePortRequest, pid))) as *const [u8; mem::size_of::<CPid>()];
+            let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawReceivePortRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+            let max_messages_ptr = (msg.buffer.wrapping_add(offset_of!(RawReceivePortRequest, max_messages))) as *const [u8; mem::size_of::<usize>()];
+            let buffer_len_ptr = (msg.buffer.wrapping_add(offset_of!(RawReceivePortRequest, buffer_len))) as *const [u8; mem::size_of::<usize>()];
+            let (pid_arr, flags_arr, max_messages_arr, buffer_len_arr) = unsafe {
+                (pid_ptr.read(), flags_ptr.read(), max_messages_ptr.read(), buffer_len_ptr.read())
+            };
+
+            Ok(RawReceivePortRequest {
+                pid: CPid::from_le_bytes(pid_arr),
+                flags: i32::from_le_bytes(flags_arr),
+                max_messages: usize::from_le_bytes(max_messages_arr),
+                buffer_len: usize::from_le_bytes(buffer_len_arr),
+            })
         }
     }
 }
 
+impl TryFrom<RawMessage> for ReceivePortRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawReceivePortRequest::try_from(value)
+            .map(|request| Self::from(request))
+    }
+}
+
 pub struct ReceivePortResponse {}
 
 impl ReceivePortResponse {
-    pub fn new_message(recipient: Tid, received_info: Option<(Tid, usize)>) -> RawMessage {
-        let mut payload = ShortMessagePayload::new();
+    /// `batch` is laid out by `port::encode_batch()`.
 
-        let subject = if let Some((tid, bytes)) = received_info {
-            unsafe {
-                payload.u32[0] = bytes as u32;
-                payload.u16[2] = tid.into();
+    pub fn new_message(recipient: Tid, batch: Option<Vec<u8>>, flags: i32) -> Message<Vec<u8>> {
+        match batch {
+            None => Message {
+                subject: RawMessage::RESPONSE_FAIL,
+                sender: Tid::null(),
+                recipient: recipient.clone(),
+                data: None,
+                bytes_transferred: None,
+                flags,
+            },
+            Some(batch) => Message {
+                subject: RawMessage::RESPONSE_OK,
+                sender: Tid::null(),
+                recipient: recipient.into(),
+                data: Some(Box::new(batch)),
+                bytes_transferred: None,
+                flags,
             }
-            RawMessage::RESPONSE_OK
-        } else {
-            RawMessage::RESPONSE_FAIL
-        };
-
-        RawMessage::new(subject, recipient.into(), payload)
+        }
     }
 }
 
@@ -974,4 +1235,118 @@ impl TryFrom<RawMessage> for UnmapIoRequest {
         RawUnmapIoRequest::try_from(value)
             .map(|request| Self::from(request))
     }
-}
\ No newline at end of file
+}
+
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawCreateShmRequest {
+    length: usize,
+}
+
+pub struct CreateShmRequest {
+    pub length: usize,
+}
+
+impl From<RawCreateShmRequest> for CreateShmRequest {
+    fn from(raw_msg: RawCreateShmRequest) -> Self {
+        Self {
+            length: raw_msg.length,
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for RawCreateShmRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawCreateShmRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let length_ptr = (msg.buffer.wrapping_add(offset_of!(RawCreateShmRequest, length))) as *const [u8; mem::size_of::<usize>()];
+            let length_arr = unsafe { length_ptr.read() };
+
+            Ok(RawCreateShmRequest {
+                length: usize::from_le_bytes(length_arr),
+            })
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for CreateShmRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawCreateShmRequest::try_from(value)
+            .map(|request| Self::from(request))
+    }
+}
+
+pub struct CreateShmResponse {}
+
+impl CreateShmResponse {
+    pub fn new_message(recipient: Tid, device_option: Option<DeviceId>, flags: i32) -> Message<i32> {
+        match device_option {
+            None => Message {
+                subject: RawMessage::RESPONSE_FAIL,
+                sender: Tid::null(),
+                recipient: recipient.clone(),
+                data: None,
+                bytes_transferred: None,
+                flags,
+            },
+            Some(device) => Message {
+                subject: RawMessage::RESPONSE_OK,
+                sender: Tid::null(),
+                recipient: recipient.into(),
+                data: Some(Box::new(device.into())),
+                bytes_transferred: None,
+                flags,
+            }
+        }
+    }
+}
+
+#[repr(C)]
+#[derive(Clone)]
+pub struct RawDestroyShmRequest {
+    device: i32,
+}
+
+pub struct DestroyShmRequest {
+    pub device: DeviceId,
+}
+
+impl From<RawDestroyShmRequest> for DestroyShmRequest {
+    fn from(raw_msg: RawDestroyShmRequest) -> Self {
+        Self {
+            device: DeviceId::from(raw_msg.device),
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for RawDestroyShmRequest {
+    type Error = i32;
+
+    fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+        if msg.buffer_len < mem::size_of::<RawDestroyShmRequest>() {
+            Err(Error::ParseError)
+        } else {
+            let device_ptr = (msg.buffer.wrapping_add(offset_of!(RawDestroyShmRequest, device))) as *const [u8; mem::size_of::<i32>()];
+            let device_arr = unsafe { device_ptr.read() };
+
+            Ok(RawDestroyShmRequest {
+                device: i32::from_le_bytes(device_arr),
+            })
+        }
+    }
+}
+
+impl TryFrom<RawMessage> for DestroyShmRequest {
+    type Error = i32;
+    fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+        RawDestroyShmRequest::try_from(value)
+            .map(|request| Self::from(request))
+    }
+}
+
+pub struct DestroyShmResponse {}
+impl SimpleResponse for DestroyShmResponse {}
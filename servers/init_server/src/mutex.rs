@@ -2,6 +2,7 @@ use core::cell::UnsafeCell;
 use core::sync::atomic::AtomicBool;
 use core::sync::atomic::Ordering;
 use core::ops::{Deref, DerefMut};
+use rust::syscalls;
 
 pub struct Mutex<T: ?Sized> {
     locked: AtomicBool,
@@ -27,9 +28,22 @@ impl<T> Mutex<T> {
     pub fn lock(&self) -> MutexGuard<'_, T> {
         while self.locked
             .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
-            .is_err() {}
+            .is_err() {
+            // The holder may have been preempted, so let it run instead of spinning out the
+            // rest of the time slice
+            let _ = syscalls::r#yield();
+        }
         MutexGuard { mutex_ref: &self }
     }
+
+    /// Acquires the lock only if it's free.
+
+    pub fn try_lock(&self) -> Option<MutexGuard<'_, T>> {
+        self.locked
+            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .ok()
+            .map(|_| MutexGuard { mutex_ref: &self })
+    }
 }
 
 impl<'a, T> Deref for MutexGuard<'a, T> {
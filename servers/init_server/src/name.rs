@@ -8,34 +8,85 @@ pub(crate) mod manager {
     use alloc::string::String;
     use alloc::vec::Vec;
     use alloc::string::ToString;
+    use crate::address::PAddr;
+    use crate::lowlevel::phys::{self, PageMapArea};
+    use crate::mutex::Mutex;
+    use crate::page::VirtualPage;
+    use crate::phys_alloc;
+    use crate::swap;
+    use rust::name::{GENERATION_COUNT, generation_index};
 
-    static mut NAME_MAP: Option<BTreeMap<String, Tid>> = None;
+    static NAME_MAP: Mutex<Option<BTreeMap<String, Tid>>> = Mutex::new(None);
+
+    // Clients map this frame read-only to check their cached lookups. Each counter is
+    // bumped whenever a name that hashes to it is registered or unregistered.
+    static GENERATION_FRAME: Mutex<Option<PAddr>> = Mutex::new(None);
+
+    const _: () = assert!(GENERATION_COUNT * core::mem::size_of::<u32>() == VirtualPage::SMALL_PAGE_SIZE);
 
     /// Initialize the name map. This should only be called once.
 
     pub fn init() {
-        unsafe {
-            NAME_MAP = match NAME_MAP {
-                Some(_) => panic!("Name map has already been initialized."),
-                None => Some(BTreeMap::new()),
-            }
+        let mut name_map = NAME_MAP.lock();
+
+        *name_map = match *name_map {
+            Some(_) => panic!("Name map has already been initialized."),
+            None => Some(BTreeMap::new()),
         }
     }
 
-    fn name_map() -> &'static BTreeMap<String, Tid> {
-        unsafe {
-            NAME_MAP.as_ref()
-                .expect("Name map hasn't been initialized yet.")
+    /// Allocate the page of generation counters. Until this is called, no counters are kept
+    /// and clients have to send every lookup to the init server.
+
+    pub fn init_generations() -> Result<(), Error> {
+        let frame = swap::alloc_frame()?;
+
+        if let Err(e) = unsafe { phys::clear_frame(frame) } {
+            swap::release_frame(frame);
+            return Err(e);
         }
+
+        *GENERATION_FRAME.lock() = Some(frame);
+        Ok(())
     }
 
-    fn name_map_mut() -> &'static mut BTreeMap<String, Tid> {
-        unsafe {
-            NAME_MAP.as_mut()
-                .expect("Name map hasn't been initialized yet.")
+    /// Returns the frame that holds the generation counters, so that it can be mapped into a
+    /// client. The frame gains a reference for the mapping.
+
+    pub fn generation_frame(offset: u64) -> Result<PAddr, Error> {
+        match *GENERATION_FRAME.lock() {
+            Some(frame) if offset < VirtualPage::SMALL_PAGE_SIZE as u64 => {
+                phys_alloc::ref_phys(frame);
+                Ok(frame)
+            },
+            Some(_) => Err(Error::InvalidAddress),
+            None => Err(Error::NotReady),
         }
     }
 
+    /// Invalidates clients' cached lookups of `name` (and of any name that shares its counter).
+    /// Counters are written whole, so a client never reads a torn value.
+
+    fn bump_generation(name: &str) {
+        if let Some(frame) = *GENERATION_FRAME.lock() {
+            let index = generation_index(name.as_bytes());
+
+            unsafe {
+                if let Some(mut pmap_area) = PageMapArea::new_from_addr(frame) {
+                    let counter = pmap_area.as_mut_ptr().cast::<u32>().add(index);
+
+                    counter.write_volatile(counter.read_volatile().wrapping_add(1));
+                }
+            }
+        }
+    }
+
+    fn with_name_map<R>(f: impl FnOnce(&mut BTreeMap<String, Tid>) -> R) -> R {
+        f(NAME_MAP.lock()
+            .as_mut()
+            .expect("Name map hasn't been initialized yet."))
+    }
+
     /// Associate a name with a thread id.
     ///
     /// Returns `Ok(())` on success. Otherwise, it returns `Err()` if the name is
@@ -52,23 +103,24 @@ pub(crate) mod manager {
     /// # init();
     /// let tid = Tid::new(14);
     ///
-    /// assert_eq!(lookup("pager"), &None);
+    /// assert_eq!(lookup("pager"), None);
     /// register("pager", tid);
-    /// assert_eq!(lookup("pager"), &Some(Tid::new(14)));
+    /// assert_eq!(lookup("pager"), Some(Tid::new(14)));
     /// # }
     /// ```
 
     pub fn register(name: &str, id: Tid) -> Result<(), Error> {
-        let nm = name_map_mut();
-
-        if name.len() > MAX_NAME_LEN {
-            Err(Error::TooLong)
-        } else if nm.contains_key(name) {
-            Err(Error::AlreadyRegistered)
-        } else {
-            nm.insert(name.to_string(), id);
-            Ok(())
-        }
+        with_name_map(|nm| {
+            if name.len() > MAX_NAME_LEN {
+                Err(Error::TooLong)
+            } else if nm.contains_key(name) {
+                Err(Error::AlreadyRegistered)
+            } else {
+                nm.insert(name.to_string(), id);
+                Ok(())
+            }
+        })
+        .map(|_| bump_generation(name))
     }
 
     /// Retrieve the thread id that's registered to a name, if it exists.
@@ -85,14 +137,14 @@ pub(crate) mod manager {
     /// register("init", Tid::new(1));
     /// register("rtc", Tid::new(1001));
     ///
-    /// assert_eq!(lookup("rtc"), &Some(Tid::new(1001)));
-    /// assert_eq!(lookup("device"), &None);
+    /// assert_eq!(lookup("rtc"), Some(Tid::new(1001)));
+    /// assert_eq!(lookup("device"), None);
     /// # }
     /// ```
 
     #[inline]
-    pub fn lookup<'a, 'b>(name: &'a str) -> Option<&'b Tid> {
-        name_map().get(name)
+    pub fn lookup(name: &str) -> Option<Tid> {
+        with_name_map(|nm| nm.get(name).cloned())
     }
 
     /// Remove a name that has been registered to a TID from the name map and
@@ -112,15 +164,21 @@ pub(crate) mod manager {
     /// register("time", time_tid.clone());
     /// register("init", Tid::new(1));
     ///
-    /// assert_eq!(lookup("time"), &Some(time_tid.clone()));
-    /// assert_eq!(unregister("time"), &Some(time_tid.clone()));
-    /// assert_eq!(lookup("time"), &None);
+    /// assert_eq!(lookup("time"), Some(time_tid.clone()));
+    /// assert_eq!(unregister("time"), Some(time_tid.clone()));
+    /// assert_eq!(lookup("time"), None);
     /// # }
     /// ```
 
     #[inline]
     pub fn unregister(name: &str) -> Option<Tid> {
-        name_map_mut().remove(name)
+        let old_tid = with_name_map(|nm| nm.remove(name));
+
+        if old_tid.is_some() {
+            bump_generation(name);
+        }
+
+        old_tid
     }
 
     /// Removes all names that are registered to a TID and returns the previously
@@ -147,14 +205,22 @@ pub(crate) mod manager {
     /// assert!(old_names.contains("time"));
     /// assert!(!old_names.contains("init"));
     ///
-    /// assert_eq!(lookup("init"), &Some(init_tid.clone()));
-    /// assert_eq!(lookup("clock"), &None);
+    /// assert_eq!(lookup("init"), Some(init_tid.clone()));
+    /// assert_eq!(lookup("clock"), None);
     /// # }
     /// ```
 
     pub fn unregister_tid(id: &Tid) -> Option<Vec<String>> {
-        let name_map = name_map_mut();
+        let old_names = with_name_map(|name_map| unregister_tid_from(name_map, id));
+
+        old_names.iter()
+            .flatten()
+            .for_each(|name| bump_generation(name));
+
+        old_names
+    }
 
+    fn unregister_tid_from(name_map: &mut BTreeMap<String, Tid>, id: &Tid) -> Option<Vec<String>> {
         let matched_keys: Vec<String> = name_map
             .iter()
             .filter_map(|(k, v)| {
@@ -216,7 +282,7 @@ mod test {
             let option1 = lookup("initsrv");
 
             assert!(option1.is_some());
-            assert_eq!(option1.unwrap(), &Tid::new(1024));
+            assert_eq!(option1.unwrap(), Tid::new(1024));
         }
 
         assert!(lookup("").is_none());
@@ -226,10 +292,10 @@ mod test {
 
             assert!(option2.is_some());
 
-            assert_eq!(option2.unwrap(), &Tid::new(1026));
+            assert_eq!(option2.unwrap(), Tid::new(1026));
         }
 
-        assert_ne!(lookup("rtc").unwrap(), &Tid::new(1024));
+        assert_ne!(lookup("rtc").unwrap(), Tid::new(1024));
     }
 
     #[test]
@@ -250,7 +316,7 @@ mod test {
         {
             let option = unregister("rtc");
 
-            assert_eq!(&option, &Some(Tid::new(2)));
+            assert_eq!(&option, Some(Tid::new(2)));
         }
 
         assert!(lookup("rtc").is_none());
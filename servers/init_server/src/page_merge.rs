@@ -0,0 +1,424 @@
+#![allow(dead_code)]
+
+//! Same-page merging.
+//!
+//! Instances of the same server start out with the same data, and much of their anonymous
+//! memory is never written to again after it's zero-filled. The scanner looks for resident
+//! anonymous pages with identical contents and maps all of them to one read-only frame. A
+//! write to a merged page faults and gets a private copy, just like a copy-on-write page.
+//!
+//! With the page-merging feature, a scanner thread examines a batch of pages every
+//! `SCAN_INTERVAL`. Low memory notifications start an extra scan.
+//!
+//! A page is only merged once two scans in a row have found the same contents in it, so that
+//! pages that are being written to aren't merged just to be split again right away. Merged
+//! frames are kept in a table that's keyed by a hash of their contents. The table holds its
+//! own reference to each frame and drops it once nothing else maps the frame.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use core::time::Duration;
+use rust::syscalls::flags;
+use crate::address::PAddr;
+use crate::error::Error;
+use crate::lowlevel::{self, phys::PageMapArea};
+use crate::mapping::{self, AddrSpace};
+use crate::mutex::Mutex;
+use crate::page::{FrameSize, PageMapBase, PhysicalFrame, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::rmap::{self, Mapper};
+use crate::swap;
+use crate::thread;
+
+// The flags of a page that are kept when it's write-protected or merged
+const KEPT_FLAGS: u32 = flags::mapping::UNCACHED | flags::mapping::WRITE_THRU | flags::mapping::DIRTY;
+
+/// The time between the scanner thread's scans.
+const SCAN_INTERVAL: Duration = Duration::from_millis(500);
+
+/// The number of anonymous pages that the scanner thread examines per scan.
+const SCAN_BUDGET: usize = 256;
+
+const FNV_OFFSET: u64 = 0xcbf29ce484222325;
+const FNV_PRIME: u64 = 0x100000001b3;
+
+struct MergeTable {
+    // Merged frames keyed by the hash of their contents. Different contents may share a hash.
+    stable: BTreeMap<u64, Vec<PAddr>>,
+    merged: BTreeMap<PAddr, u64>,
+
+    // Pages from the current pass whose contents haven't matched any other page yet
+    unstable: BTreeMap<u64, (Mapper, PAddr)>,
+
+    // The hash of each candidate page when it was last visited, along with the pass
+    checksums: BTreeMap<Mapper, (u64, u32)>,
+    pass: u32,
+    cursor: Mapper,
+}
+
+impl MergeTable {
+    const fn new() -> Self {
+        Self {
+            stable: BTreeMap::new(),
+            merged: BTreeMap::new(),
+            unstable: BTreeMap::new(),
+            checksums: BTreeMap::new(),
+            pass: 0,
+            cursor: (0, 0),
+        }
+    }
+
+    /// Records the hash of a page's contents. Returns `true` if the contents hadn't changed
+    /// since the page was last visited.
+
+    fn update_checksum(&mut self, mapper: Mapper, hash: u64) -> bool {
+        self.checksums.insert(mapper, (hash, self.pass))
+            .map_or(false, |(old_hash, _)| old_hash == hash)
+    }
+
+    fn forget_checksum(&mut self, mapper: Mapper) {
+        self.checksums.remove(&mapper);
+    }
+
+    fn stable_frames(&self, hash: u64) -> &[PAddr] {
+        self.stable.get(&hash)
+            .map_or(&[], |frames| frames.as_slice())
+    }
+
+    fn insert_stable(&mut self, hash: u64, frame: PAddr) {
+        self.stable.entry(hash)
+            .or_insert_with(Vec::new)
+            .push(frame);
+        self.merged.insert(frame, hash);
+    }
+
+    fn is_merged(&self, frame: PAddr) -> bool {
+        self.merged.contains_key(&frame)
+    }
+
+    /// Starts a new pass over all anonymous pages. Pages that weren't visited during the
+    /// last pass have gone away, so their checksums are dropped.
+
+    fn next_pass(&mut self) {
+        let pass = self.pass;
+
+        self.checksums.retain(|_, (_, visited)| *visited == pass);
+        self.unstable.clear();
+        self.pass = pass.wrapping_add(1);
+    }
+
+    /// Removes the merged frames that `is_unused` picks out. Returns the removed frames.
+
+    fn prune(&mut self, is_unused: impl Fn(PAddr) -> bool) -> Vec<PAddr> {
+        let unused = self.merged.iter()
+            .filter(|(frame, _)| is_unused(**frame))
+            .map(|(frame, hash)| (*frame, *hash))
+            .collect::<Vec<_>>();
+
+        for (frame, hash) in unused.iter() {
+            self.merged.remove(frame);
+
+            if let Some(frames) = self.stable.get_mut(hash) {
+                frames.retain(|f| f != frame);
+
+                if frames.is_empty() {
+                    self.stable.remove(hash);
+                }
+            }
+        }
+
+        unused.into_iter()
+            .map(|(frame, _)| frame)
+            .collect()
+    }
+}
+
+// Held for a whole scan, so only one thread scans at a time
+static MERGE_TABLE: Mutex<MergeTable> = Mutex::new(MergeTable::new());
+
+fn hash_page(contents: &[u8]) -> u64 {
+    contents.chunks_exact(4)
+        .fold(FNV_OFFSET, |hash, word| {
+            let word = u32::from_le_bytes([word[0], word[1], word[2], word[3]]);
+
+            (hash ^ word as u64).wrapping_mul(FNV_PRIME)
+        })
+}
+
+fn hash_frame(frame: PAddr) -> Result<u64, Error> {
+    unsafe { PageMapArea::new_from_addr(frame) }
+        .map(|area| hash_page(&area.as_ref()[..VirtualPage::SMALL_PAGE_SIZE]))
+        .ok_or(Error::Failed)
+}
+
+fn frames_equal(first: PAddr, second: PAddr) -> bool {
+    unsafe { PageMapArea::new_from_frames(&[first, second]) }
+        .map_or(false, |area| {
+            let (first, second) = area.as_ref().split_at(VirtualPage::SMALL_PAGE_SIZE);
+            first == &second[..VirtualPage::SMALL_PAGE_SIZE]
+        })
+}
+
+fn map_page(mapper: Mapper, frame: PAddr, page_flags: u32) -> Result<(), Error> {
+    unsafe { lowlevel::map(Some(mapper.0), mapper.1 as *mut c_void, frame, page_flags | flags::mapping::OVERWRITE) }
+        .map(|_| ())
+        .map_err(|_| Error::Failed)
+}
+
+/// The scanner thread. It scans for pages to merge in the background, a batch at a time.
+
+pub fn scanner_main() -> ! {
+    loop {
+        thread::sleep(SCAN_INTERVAL);
+        scan(SCAN_BUDGET);
+    }
+}
+
+/// Examines up to `budget` anonymous pages, continuing where the last scan stopped.
+/// Returns the number of pages that were merged. Address spaces that are locked by another
+/// thread are passed over.
+
+pub fn scan(budget: usize) -> usize {
+    let mut table = MERGE_TABLE.lock();
+    let mut cursor = table.cursor;
+    let mut merged = 0;
+    let mut wrapped = false;
+
+    for _ in 0..budget {
+        match mapping::manager::next_anonymous_page(cursor.0, cursor.1) {
+            Some((root_pmap, page)) => {
+                let (was_merged, next_page) = visit_page(&mut table, root_pmap, page)
+                    .unwrap_or((false, page + VirtualPage::SMALL_PAGE_SIZE));
+
+                if was_merged {
+                    merged += 1;
+                }
+
+                cursor = (root_pmap, next_page);
+            },
+            None if !wrapped => {
+                end_pass(&mut table);
+                cursor = (0, 0);
+                wrapped = true;
+            },
+            None => break,
+        }
+    }
+
+    table.cursor = cursor;
+    merged
+}
+
+/// Drops the merged frames that are no longer mapped anywhere and starts a new pass.
+
+fn end_pass(table: &mut MergeTable) {
+    for frame in table.prune(|frame| phys_alloc::phys_ref_count(frame) <= 1) {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+
+    table.next_pass();
+}
+
+/// Examines a page of an anonymous mapping. Returns whether the page was merged along with
+/// the next address to examine.
+
+fn visit_page(table: &mut MergeTable, root_pmap: PageMapBase, page: usize) -> Result<(bool, usize), Error> {
+    let next_page = page + VirtualPage::SMALL_PAGE_SIZE;
+    let next_table = (page | (PhysicalFrame::PSE_LARGE_PAGE_SIZE - 1)).saturating_add(1);
+
+    let _addr_space = match mapping::manager::try_lock(root_pmap) {
+        Some(addr_space) => addr_space,
+        None => return Ok((false, AddrSpace::USER_END)),
+    };
+
+    if !lowlevel::has_page_table(Some(root_pmap), page as *const ()).map_err(|_| Error::Failed)? {
+        return Ok((false, next_table));
+    }
+
+    let (frame, page_flags) = unsafe { lowlevel::lookup(Some(root_pmap), page as *const ()) }
+        .map_err(|_| Error::Failed)?;
+
+    if frame.frame_size() != FrameSize::Small {
+        return Ok((false, next_table));
+    }
+
+    // Merged pages are read-only and frames that are shared with a cloned address space are
+    // already copy-on-write
+
+    if rust::is_flag_set!(page_flags, flags::mapping::UNMAPPED)
+        || rust::is_flag_set!(page_flags, flags::mapping::READ_ONLY)
+        || phys_alloc::phys_ref_count(frame.address()) != 1 {
+        return Ok((false, next_page));
+    }
+
+    let mapper = (root_pmap, page);
+    let frame = frame.address();
+    let kept_flags = page_flags & KEPT_FLAGS;
+    let hash = hash_frame(frame)?;
+
+    if !table.update_checksum(mapper, hash) {
+        return Ok((false, next_page));
+    }
+
+    // The page is write-protected before it's compared, so that its contents can't change
+    // until it has been merged. A write in the meantime faults and is retried afterwards.
+
+    map_page(mapper, frame, kept_flags | flags::mapping::READ_ONLY)?;
+
+    let stable_frame = table.stable_frames(hash).iter()
+        .copied()
+        .find(|stable_frame| frames_equal(*stable_frame, frame));
+
+    let result = match stable_frame {
+        Some(stable_frame) => replace_frame(table, mapper, frame, stable_frame, kept_flags),
+        None => merge_unstable(table, hash, mapper, frame, kept_flags),
+    };
+
+    if result != Ok(true) {
+        map_page(mapper, frame, kept_flags)?;
+    }
+
+    result.map(|merged| (merged, next_page))
+}
+
+/// Maps a write-protected page to a merged frame with the same contents and frees the page's
+/// own frame.
+
+fn replace_frame(table: &mut MergeTable, mapper: Mapper, frame: PAddr, merged_frame: PAddr, kept_flags: u32) -> Result<bool, Error> {
+    map_page(mapper, merged_frame, kept_flags | flags::mapping::READ_ONLY)?;
+
+    phys_alloc::ref_phys(merged_frame);
+    rmap::map(merged_frame, mapper.0, mapper.1);
+    swap::release_frame(frame);
+    table.forget_checksum(mapper);
+    Ok(true)
+}
+
+/// Merges a write-protected page with an earlier page of this pass that had the same hash.
+/// If there's no such page, then the page waits for a later one.
+
+fn merge_unstable(table: &mut MergeTable, hash: u64, mapper: Mapper, frame: PAddr, kept_flags: u32) -> Result<bool, Error> {
+    let (twin, twin_frame) = match table.unstable.insert(hash, (mapper, frame)) {
+        Some(entry) => entry,
+        None => return Ok(false),
+    };
+
+    // The twin is left alone if its address space is busy
+    let _twin_addr_space = match mapping::manager::try_lock(twin.0) {
+        Some(addr_space) => addr_space,
+        None => return Ok(false),
+    };
+
+    // The twin must still be mapped, unshared and writable, to the frame it was found with
+
+    let (current, twin_flags) = unsafe { lowlevel::lookup(Some(twin.0), twin.1 as *const ()) }
+        .map_err(|_| Error::Failed)?;
+
+    if current.frame_size() != FrameSize::Small || current.address() != twin_frame
+        || rust::is_flag_set!(twin_flags, flags::mapping::UNMAPPED)
+        || rust::is_flag_set!(twin_flags, flags::mapping::READ_ONLY)
+        || phys_alloc::phys_ref_count(twin_frame) != 1 {
+        return Ok(false);
+    }
+
+    let twin_kept_flags = twin_flags & KEPT_FLAGS;
+
+    map_page(twin, twin_frame, twin_kept_flags | flags::mapping::READ_ONLY)?;
+
+    if !frames_equal(twin_frame, frame) {
+        map_page(twin, twin_frame, twin_kept_flags)?;
+        return Ok(false);
+    }
+
+    // The twin's frame becomes the merged frame, with a reference taken for the table
+
+    table.unstable.remove(&hash);
+    table.forget_checksum(twin);
+    table.insert_stable(hash, twin_frame);
+
+    phys_alloc::ref_phys(twin_frame);
+    rmap::map(twin_frame, twin.0, twin.1);
+
+    replace_frame(table, mapper, frame, twin_frame, kept_flags)
+}
+
+/// Returns `true` if a page is mapped to a merged frame. A write to such a page must be
+/// given a private copy of the frame.
+
+pub fn is_merged_page(root_pmap: PageMapBase, page: usize) -> bool {
+    unsafe { lowlevel::lookup(Some(root_pmap), page as *const ()) }
+        .map_or(false, |(frame, page_flags)| frame.frame_size() == FrameSize::Small
+            && rust::is_flag_cleared!(page_flags, flags::mapping::UNMAPPED)
+            && MERGE_TABLE.lock().is_merged(frame.address()))
+}
+
+/// Returns the number of frames that merging currently saves.
+
+pub fn saved_frame_count() -> usize {
+    // Each merged frame has a reference for the table and one for each page that maps it
+
+    MERGE_TABLE.lock().merged.keys()
+        .map(|frame| (phys_alloc::phys_ref_count(*frame) as usize).saturating_sub(2))
+        .sum()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_hash_page() {
+        let zero = [0u8; 4096];
+        let mut other = [0u8; 4096];
+
+        other[4095] = 1;
+
+        assert_eq!(hash_page(&zero), hash_page(&[0u8; 4096]));
+        assert_ne!(hash_page(&zero), hash_page(&other));
+    }
+
+    #[test]
+    fn test_checksum_must_repeat() {
+        let mut table = MergeTable::new();
+
+        assert!(!table.update_checksum((0x1000, 0x400000), 5));
+        assert!(table.update_checksum((0x1000, 0x400000), 5));
+        assert!(!table.update_checksum((0x1000, 0x400000), 6));
+
+        table.forget_checksum((0x1000, 0x400000));
+        assert!(!table.update_checksum((0x1000, 0x400000), 6));
+    }
+
+    #[test]
+    fn test_next_pass() {
+        let mut table = MergeTable::new();
+
+        table.update_checksum((0x1000, 0x400000), 5);
+        table.unstable.insert(5, ((0x1000, 0x400000), 0x9000));
+        table.next_pass();
+
+        table.update_checksum((0x1000, 0x401000), 7);
+        table.next_pass();
+
+        assert!(table.unstable.is_empty());
+        assert!(!table.checksums.contains_key(&(0x1000, 0x400000)));
+        assert!(table.checksums.contains_key(&(0x1000, 0x401000)));
+    }
+
+    #[test]
+    fn test_prune() {
+        let mut table = MergeTable::new();
+
+        table.insert_stable(5, 0x9000);
+        table.insert_stable(5, 0xA000);
+        table.insert_stable(6, 0xB000);
+
+        assert_eq!(table.stable_frames(5), &[0x9000, 0xA000]);
+        assert_eq!(table.prune(|frame| frame != 0xA000), vec![0x9000, 0xB000]);
+        assert_eq!(table.stable_frames(5), &[0xA000]);
+        assert_eq!(table.stable_frames(6), &[]);
+        assert!(table.is_merged(0xA000));
+        assert!(!table.is_merged(0x9000));
+    }
+}
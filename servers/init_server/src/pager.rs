@@ -4,14 +4,25 @@ use rust::types::Tid;
 use rust::syscalls;
 use crate::lowlevel;
 use crate::mapping;
+use crate::name;
 use crate::error::{self, Error};
-use core::ffi::c_void;
 use crate::eprintfln;
 use core::convert::TryInto;
-use rust::message::kernel::ExceptionMessage;
+use rust::message::MessageHeader;
+use rust::message::kernel::{self, MemoryMessage, PageFaultMessage, PageFaultReply};
 use crate::mapping::AddrSpace;
 use alloc::borrow::Cow;
 use crate::device;
+use crate::page::{FrameSize, PageMapBase, PhysicalFrame, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::frame_cache;
+use crate::large_page;
+use crate::page_merge;
+use crate::rmap;
+use crate::shm;
+use crate::swap;
+use crate::address::{PAddr, VAddr};
+use rust::align::Align;
 
 mod new_allocator {
     use crate::address::{PAddr, PSize};
@@ -246,39 +257,156 @@ pub type DeviceId = u32;
 
 use crate::address;
 
-/// The main page fault handler. Receives page fault messages from the kernel and attempts to
-/// resolve the page fault by allocating memory, mapping pages, etc.
+/// The number of frames that the kernel's anonymous frame reserve is topped up to.
+const FRAME_RESERVE_TARGET: usize = 128;
+
+/// The number of ranges that are examined for large page promotion per low memory
+/// notification.
+const PROMOTION_SCAN_BUDGET: usize = 4;
+
+/// The number of anonymous pages that are examined for merging per low memory notification.
+const MERGE_SCAN_BUDGET: usize = 64;
+
+/// Tops up the kernel's reserve of frames that it uses to resolve first-touch faults on
+/// anonymous regions.
+
+pub(crate) fn refill_frame_reserve() -> Result<(), (error::Error, Cow<'static, str>)> {
+    let reserve_count = lowlevel::reserve_frame_count()
+        .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to read the frame reserve.")))?;
+    let mut frames = [0 as PAddr; 32];
+    let mut needed = FRAME_RESERVE_TARGET.saturating_sub(reserve_count);
+
+    while needed > 0 {
+        let batch_size = needed.min(frames.len());
+        let mut allocated = 0;
+
+        for frame in frames[..batch_size].iter_mut() {
+            match frame_cache::alloc_frame() {
+                Ok(addr) => {
+                    *frame = addr;
+                    allocated += 1;
+                },
+                Err(_) => break,
+            }
+        }
+
+        let accepted = unsafe { lowlevel::donate_reserve_frames(&frames[..allocated]) }
+            .unwrap_or(0);
+
+        for frame in &frames[accepted..allocated] {
+            frame_cache::release_frame(*frame);
+        }
+
+        if accepted < batch_size {
+            break;
+        }
+
+        needed -= accepted;
+    }
+
+    Ok(())
+}
+
+/// Handles a low memory notification from the kernel.
+
+pub(crate) fn handle_low_memory(_request: &MemoryMessage) -> Result<(), (error::Error, Cow<'static, str>)> {
+    refill_frame_reserve()?;
+
+    // Anonymous memory is being touched, so look for ranges that have become fully resident
+    large_page::scan(PROMOTION_SCAN_BUDGET);
 
-pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error::Error, Cow<'static, str>)> {
-    let is_read_access = rust::is_flag_cleared!(request.error_code, ExceptionMessage::WRITE);
-    let is_kernel_access = rust::is_flag_cleared!(request.error_code, ExceptionMessage::USER);
-    let is_not_present = rust::is_flag_cleared!(request.error_code, ExceptionMessage::PRESENT);
+    #[cfg(feature = "page-merging")]
+    page_merge::scan(MERGE_SCAN_BUDGET);
 
-    let addr_space = mapping::manager::lookup_tid_mut(&Tid::try_from(request.who)
-        .expect("Faulting thread should not have a NULL tid"))
+    Ok(())
+}
+
+/// Replies to a page fault. The kernel maps the frame at `fault_page` and restarts the
+/// faulting thread.
+///
+/// If the kernel needs a new page table, but its frame reserve is empty, then the reserve is
+/// refilled and the reply is sent again.
+
+fn reply_page_fault(tid: Tid, fault_page: usize, frame: PAddr, flags: u32) -> Result<(), (error::Error, Cow<'static, str>)> {
+    let reply = PageFaultReply {
+        start: fault_page as u32,
+        frame: (frame / PhysicalFrame::SMALL_PAGE_SIZE as PAddr) as u32,
+        count: 1,
+        flags,
+    };
+
+    let send_reply = || {
+        let mut header = MessageHeader::new(Some(tid), kernel::PAGE_FAULT, 0);
+        syscalls::send(&mut header, (&reply).into())
+    };
+
+    match send_reply() {
+        Err(syscalls::SyscallError::NotReady) => {
+            refill_frame_reserve()?;
+            send_reply()
+        },
+        result => result,
+    }
+        .map(|_| ())
+        .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to reply to page fault.")))
+}
+
+/// The main page fault handler. Receives page fault messages from the kernel and attempts to
+/// resolve the page fault by allocating memory, mapping pages, etc. The mapping is installed
+/// by the kernel when the pager replies.
+
+pub(crate) fn handle_page_fault(request: &PageFaultMessage) -> Result<(), (error::Error, Cow<'static, str>)> {
+    let is_read_access = rust::is_flag_cleared!(request.error_code, PageFaultMessage::WRITE);
+    let is_kernel_access = rust::is_flag_cleared!(request.error_code, PageFaultMessage::USER);
+    let is_not_present = rust::is_flag_cleared!(request.error_code, PageFaultMessage::PRESENT);
+    let tid = Tid::try_from(request.who)
+        .expect("Faulting thread should not have a NULL tid");
+
+    // The address space stays locked until the fault has been resolved
+    let addr_space = mapping::manager::lock_tid(&tid)
         .ok_or((Error::NotRegistered, Cow::Borrowed("Thread's address space isn't registered")))?;
 
     let root_pmap = addr_space.root_pmap();
 
     /* Is the fault address mapped in the thread's address space, but not yet committed? */
 
-    if let Some(mapping) = addr_space.get_mapping(address::u32_into_vaddr(request.cr2)) {
+    if let Some(mapping) = addr_space.get_mapping(address::u32_into_vaddr(request.fault_address)) {
+        let fault_page = (request.fault_address as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
+
+        // The fault may have been resolved while it was queued (e.g. its page was promoted to
+        // or split from a large page). Then the thread only has to be restarted.
+
+        if is_resolved(root_pmap, fault_page, is_read_access) {
+            return reply_page_fault(tid, fault_page, 0, syscalls::flags::mapping::UNMAPPED);
+        }
+
+        // Guard pages are never committed. One that sits right below a stack catches the
+        // thread running off the bottom of its stack.
+
+        if mapping.flags & AddrSpace::GUARD == AddrSpace::GUARD {
+            let is_stack_guard = addr_space.get_mapping(mapping.end() as VAddr)
+                .map_or(false, |above| above.flags & AddrSpace::EXTEND_DOWN == AddrSpace::EXTEND_DOWN);
+
+            let reason = if is_stack_guard {
+                "overflowed its stack"
+            } else {
+                "touched a guard page"
+            };
+
+            return Err((Error::IllegalMemoryAccess,
+                        Cow::Owned(format!("Tid {} {} at address {:#x} (eip: {:#x})",
+                                           request.who.try_into().unwrap_or(0u16), reason,
+                                           request.fault_address, request.eip))));
+        }
+
         /* Either swap the page into memory, load the page from disk into memory, or allocate a new physical page
             depending on swap status and device. */
 
         // The address hasn't been committed to memory
 
         if is_not_present {
-            let mapped_frame = {
-                let mapping_offset = (request.cr2 as usize - mapping.region.start()) as u64;
-
-                match mapping.base_page.device.major {
-                    device::mem::MAJOR => Ok(mapping.base_page.add_offset(mapping_offset).offset),
-                    device::pseudo::MAJOR if mapping.base_page.device.minor == device::pseudo::ZERO_MINOR => Ok(0),
-                    _ => Err((Error::NotImplemented, Cow::Borrowed("Reading block from device resulted in error"))),
-                }?
-            };
-
+            let mapping_offset = (fault_page - mapping.region.start()) as u64;
+            let is_cow = mapping.flags & AddrSpace::COPY_ON_WRITE == AddrSpace::COPY_ON_WRITE;
             let mut flags = 0;
 
             flags |= if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
@@ -287,18 +415,78 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
                 0
             };
 
+            let mapped_frame = match mapping.base_page.device.major {
+                device::mem::MAJOR => {
+                    let device_frame = mapping.base_page.add_offset(mapping_offset).offset
+                        .align_trunc(PhysicalFrame::SMALL_PAGE_SIZE as u64);
+                    let data_end = mapping.data_end
+                        .filter(|data_end| device_frame + PhysicalFrame::SMALL_PAGE_SIZE as u64 > *data_end);
+
+                    // Device frames of a copy-on-write mapping are never written to directly.
+                    // A write gets a private copy right away. A read shares the device frame
+                    // read-only, with the device holding the frame's first reference. Frames
+                    // that the allocator doesn't track can't be shared that way, so a read
+                    // gets a private copy of those, too.
+                    //
+                    // A page that reaches past the end of the data (an ELF segment's bss, for
+                    // example) always gets a private frame, since the device's bytes there
+                    // belong to something else.
+
+                    if let Some(data_end) = data_end {
+                        if data_end <= device_frame {
+                            alloc_zeroed_frame()?
+                        } else {
+                            alloc_frame_prefix(device_frame, (data_end - device_frame) as usize)?
+                        }
+                    } else if is_cow && !is_read_access {
+                        alloc_frame_copy(device_frame)?
+                    } else if is_cow {
+                        match phys_alloc::ref_phys(device_frame) {
+                            Some(_) => {
+                                flags |= syscalls::flags::mapping::READ_ONLY;
+                                device_frame
+                            },
+                            None => alloc_frame_copy(device_frame)?,
+                        }
+                    } else {
+                        device_frame
+                    }
+                },
+                device::pseudo::MAJOR if mapping.base_page.device.minor == device::pseudo::ZERO_MINOR => {
+                    // The page may have been evicted to the swap area
+                    match swap::swap_in(root_pmap, fault_page) {
+                        Ok(Some((frame, swap_flags))) => {
+                            flags |= swap_flags;
+                            frame
+                        },
+                        Ok(None) => alloc_zeroed_frame()?,
+                        Err(e) => Err((e, Cow::Borrowed("Unable to read page from swap area.")))?,
+                    }
+                },
+                device::pseudo::MAJOR if mapping.base_page.device.minor == device::pseudo::NAME_CACHE_MINOR => {
+                    // Only the init server writes to the generation counters
+                    let frame = name::manager::generation_frame(mapping.base_page.add_offset(mapping_offset).offset)
+                        .map_err(|e| (e, Cow::Borrowed("Unable to map the name cache generation page.")))?;
+
+                    flags |= syscalls::flags::mapping::READ_ONLY;
+                    frame
+                },
+                device::shm::MAJOR => {
+                    let object_offset = mapping.base_page.add_offset(mapping_offset).offset;
+
+                    shm::map_frame(&mapping.base_page.device, object_offset)
+                        .map_err(|e| (e, Cow::Borrowed("Unable to get a frame of a shared memory object.")))?
+                },
+                _ => Err((Error::NotImplemented, Cow::Borrowed("Reading block from device resulted in error")))?,
+            };
+
             /*eprintfln!("Fault mapping {:p} -> {:#x} pmap: {:#x}",
                       request.fault_address, mapped_frame, root_pmap); */
 
-            return unsafe {
-                lowlevel::map(Some(root_pmap),
-                              request.cr2 as usize as *mut c_void,
-                              mapped_frame,
-                              flags)
-            }
-                .map(|_| ())
-                .map_err(|_| (Error::Failed, Cow::Borrowed("Operation failed.")));
-        } else if is_kernel_access && request.cs != 0x10 { // Don't allow access to kernel memory
+            reply_page_fault(tid, fault_page, mapped_frame, flags)?;
+            rmap::map(mapped_frame, root_pmap, fault_page);
+            return Ok(());
+        } else if is_kernel_access { // Don't allow access to kernel memory
             eprintfln!("Attempted to access kernel memory.");
         } else if is_read_access {     // This isn't supposed to happen
             eprintfln!("Address has been committed to memory, but a read access resulted in a page fault.");
@@ -306,8 +494,13 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
             /* TODO: Someone wrote to a read-only page. Find out whether
                                 it is allowed (COW, for example) or not and perform the
                                 relevant operation. */
-            if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
-                eprintfln!("Handling of read-only page faults isn't implemented yet");
+            if mapping.flags & AddrSpace::COPY_ON_WRITE == AddrSpace::COPY_ON_WRITE {
+                return handle_cow_fault(tid, root_pmap, fault_page);
+            } else if mapping.is_anonymous() && page_merge::is_merged_page(root_pmap, fault_page) {
+                // The page was merged with identical pages, so it gets its own copy again
+                return handle_cow_fault(tid, root_pmap, fault_page);
+            } else if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
+                eprintfln!("Attempted to write to a read-only mapping.");
             } else {
                 //  eprintfln!("No problem here...");
 
@@ -317,7 +510,8 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
         eprintfln!("Fault address is not mapped in address space");
     }
 
-    error::dump_state(&request);
+    eprintfln!("Page fault by tid {} at eip: {:#x} error code: {:#x}",
+               request.who, request.eip, request.error_code);
 
     let access = if is_read_access {
         "read from"
@@ -333,5 +527,99 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
 
     Err((Error::IllegalMemoryAccess,
          Cow::Owned(format!("Tid {} attempted to {}{} memory at address {:#x}",
-                      request.who.try_into().unwrap_or(0u16), access, privilege, request.cr2))))
-}
\ No newline at end of file
+                      request.who.try_into().unwrap_or(0u16), access, privilege, request.fault_address))))
+}
+/// Returns `true` if the page is now mapped with the access that faulted.
+
+fn is_resolved(root_pmap: PageMapBase, fault_page: usize, is_read_access: bool) -> bool {
+    unsafe { lowlevel::lookup(Some(root_pmap), fault_page as *const ()) }
+        .map(|(_, page_flags)| rust::is_flag_cleared!(page_flags, syscalls::flags::mapping::UNMAPPED)
+            && (is_read_access || rust::is_flag_cleared!(page_flags, syscalls::flags::mapping::READ_ONLY)))
+        .unwrap_or(false)
+}
+
+/// Resolves a write to a present page of a copy-on-write mapping.
+///
+/// Unless the faulting address space holds the frame's only reference, it gets its own copy of
+/// the frame. That includes frames that the allocator doesn't track, which aren't the address
+/// space's to write to. If it does hold the only reference, the frame is just made writable.
+
+fn handle_cow_fault(tid: Tid, root_pmap: PageMapBase, fault_page: usize) -> Result<(), (error::Error, Cow<'static, str>)> {
+    let (frame, _) = unsafe { lowlevel::lookup(Some(root_pmap), fault_page as *const ()) }
+        .map_err(|_| (Error::Failed, Cow::Borrowed("Unable to read page mapping.")))?;
+
+    if frame.frame_size() != FrameSize::Small {
+        return Err((Error::NotImplemented, Cow::Borrowed("Copy-on-write of large pages isn't supported.")));
+    }
+
+    let ref_count = phys_alloc::phys_ref_count(frame.address());
+
+    if ref_count != 1 {
+        let new_frame = alloc_frame_copy(frame.address())?;
+
+        // The page is marked dirty, since its contents may differ from what's in the swap area
+
+        reply_page_fault(tid, fault_page, new_frame,
+                         syscalls::flags::mapping::OVERWRITE | syscalls::flags::mapping::DIRTY)
+            .map_err(|e| {
+                swap::release_frame(new_frame);
+                e
+            })?;
+
+        rmap::map(new_frame, root_pmap, fault_page);
+
+        if ref_count > 1 {
+            phys_alloc::release_phys(frame.address(), BlockSize::Block4k);
+        }
+
+        Ok(())
+    } else {
+        reply_page_fault(tid, fault_page, frame.address(),
+                         syscalls::flags::mapping::OVERWRITE | syscalls::flags::mapping::DIRTY)
+    }
+}
+
+/// Allocates a new frame and fills it with the contents of another frame.
+
+fn alloc_frame_copy(src: PAddr) -> Result<PAddr, (error::Error, Cow<'static, str>)> {
+    let new_frame = swap::alloc_frame()
+        .map_err(|e| (e, Cow::Borrowed("Unable to allocate frame for copy.")))?;
+
+    unsafe { lowlevel::phys::copy_frame(new_frame, src) }
+        .map(|_| new_frame)
+        .map_err(|e| {
+            swap::release_frame(new_frame);
+            (e, Cow::Borrowed("Unable to copy frame."))
+        })
+}
+
+/// Allocates a new frame that holds the first `length` bytes of another frame, followed
+/// by zeros.
+
+fn alloc_frame_prefix(src: PAddr, length: usize) -> Result<PAddr, (error::Error, Cow<'static, str>)> {
+    let new_frame = alloc_zeroed_frame()?;
+
+    unsafe { lowlevel::phys::PageMapArea::new_from_frames(&[src, new_frame]) }
+        .map(|mut pmap_area| {
+            pmap_area.as_mut().copy_within(..length, VirtualPage::SMALL_PAGE_SIZE);
+            new_frame
+        })
+        .ok_or_else(|| {
+            swap::release_frame(new_frame);
+            (Error::Failed, Cow::Borrowed("Unable to copy frame."))
+        })
+}
+
+/// Allocates a new, cleared frame for anonymous memory.
+
+fn alloc_zeroed_frame() -> Result<PAddr, (error::Error, Cow<'static, str>)> {
+    let new_frame = swap::alloc_frame()
+        .map_err(|e| (e, Cow::Borrowed("Unable to allocate frame.")))?;
+
+    unsafe { lowlevel::phys::clear_frame(new_frame) }
+        .map(|_| new_frame)
+        .map_err(|e| {
+            swap::release_frame(new_frame);
+            (e, Cow::Borrowed("Unable to clear frame."))
+        })
+}
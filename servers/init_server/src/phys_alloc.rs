@@ -1,21 +1,34 @@
 use crate::region::{MemoryRegion, RegionSet};
 use crate::address::{PAddr, PSize};
 use crate::multiboot::{RawMemoryMap, RawMemoryMapIterator};
+use crate::mutex::Mutex;
 
-use rust::types::bit_array::{BitArray, BitIterator, BitFilter};
 use rust::align::Align;
 use alloc::vec::Vec;
+use core::ffi::c_void;
+use core::{mem, ptr, slice};
+use crate::lowlevel;
 use crate::page::PhysicalFrame;
 
 static mut PAGE_ALLOCATOR: Option<PhysPageAllocator> = None;
 static mut BOOTSTRAP_MEM: Option<BootstrapAllocator> = None;
 
+// Serializes access to the page allocator's bitmaps and reference counts. Nothing may be
+// allocated from the heap while it's held: growing the heap allocates frames, which would
+// take this lock again.
+static ALLOCATOR_LOCK: Mutex<()> = Mutex::new(());
+
 /// 1 + the highest physical address that can be accessed with PSE
 pub const MAX_PHYS_ADDR: PAddr = 1 << 40;
 
 /// 1 + the highest physical address that can be accessed via 4 kiB pages
 const MAX_PHYS_ADDR_4K: PAddr = 1 << 32;
 
+extern "C" {
+    // Virtual space for the reference counts of the frames below 4G (see link.ld)
+    static mut FRAME_REF_AREA: [u32; 0x100000];
+}
+
 struct BootstrapAllocator {
     start: PAddr,
     end: PAddr,
@@ -112,28 +125,285 @@ impl BlockSize {
     }
 }
 
-pub struct PhysPageAllocator {
-    memory_size: PSize,
+/// The number of blocks of the next smaller size that make up a block. This is the same for
+/// every block size, so the sub-blocks of a block are exactly one word of a bitmap.
+const SUB_BLOCKS: usize = u32::BITS as usize;
+
+const TOP_LEVEL: usize = BlockSize::total_sizes() - 1;
+
+/// The block status bitmaps of a contiguous range of physical memory.
+///
+/// `used[l]` has a bit set for every block of level `l` that's at least partly in use. For
+/// every allocation size `s`, the summary bitmaps `full[s]` have a bit set for every larger
+/// block that contains no free block of size `s`. Such a bit is set exactly when all of the
+/// bits of its word one level below are set. A free block is found by starting at the top
+/// level and taking the first zero bit of a single word at each level below, so allocating
+/// and releasing a block take a fixed number of steps regardless of the amount of memory.
+
+struct BlockTree {
+    base: PAddr,
+    end: PAddr,
+
+    // The smallest block size that can be allocated from this range
+    min_level: usize,
 
-    // Each BitArray corresponds to the free/occupied status a BlockSize level
-    // If bit is 0, then the block is free.
-    // If bit is 1, then block contains at least one used sub-block
-    occupied_status: Vec<BitArray>,
+    // Indexed by level - min_level
+    used: Vec<Vec<u32>>,
 
-    // Each BitArray corresponds to the available/filled status a BlockSize level
-    // If bit is 0, then the block contains at least one free sub-block.
-    // If bit is 1, then the block is completely used and doesn't contain any free sub-blocks
-    filled_status: Vec<BitArray>,
+    // Indexed by [size - min_level][level - size - 1]
+    full: Vec<Vec<Vec<u32>>>,
+
+    // For each size, the word of its bitmap that the last block of that size came from
+    hints: Vec<usize>,
+
+    // For each size, the top-level word where the last search stopped
+    top_cursors: Vec<usize>,
+}
+
+impl BlockTree {
+    fn new(base: PAddr, end: PAddr, min_level: usize) -> Self {
+        let top_bytes = BlockSize::new(TOP_LEVEL).bytes();
+        let top_blocks = ((end - base).align(top_bytes) / top_bytes) as usize;
+
+        // Every level below the top has exactly 32 times as many bits as the level above it
+
+        let word_count = |level: usize| if level == TOP_LEVEL {
+            (top_blocks + SUB_BLOCKS - 1) / SUB_BLOCKS
+        } else {
+            top_blocks * SUB_BLOCKS.pow((TOP_LEVEL - level - 1) as u32)
+        };
+
+        let mut tree = BlockTree {
+            base,
+            end,
+            min_level,
+            used: (min_level..=TOP_LEVEL)
+                .map(|level| vec![0; word_count(level)])
+                .collect(),
+            full: (min_level..TOP_LEVEL)
+                .map(|size| (size + 1..=TOP_LEVEL)
+                    .map(|level| vec![0; word_count(level)])
+                    .collect())
+                .collect(),
+            hints: vec![0; TOP_LEVEL + 1 - min_level],
+            top_cursors: vec![0; TOP_LEVEL + 1 - min_level],
+        };
+
+        // Blocks past the end of the range are permanently in use
+
+        if top_blocks % SUB_BLOCKS != 0 {
+            let padding = !((1u32 << (top_blocks % SUB_BLOCKS)) - 1);
+
+            for size in min_level..=TOP_LEVEL {
+                if let Some(word) = tree.bitmap_mut(size, TOP_LEVEL).last_mut() {
+                    *word |= padding;
+                }
+            }
+        }
+
+        let min_bytes = BlockSize::new(min_level).bytes();
+
+        tree.mark_range(end.align_trunc(min_bytes), base + top_blocks as PSize * top_bytes, true);
+        tree
+    }
+
+    fn bitmap(&self, size: usize, level: usize) -> &Vec<u32> {
+        if level == size {
+            &self.used[level - self.min_level]
+        } else {
+            &self.full[size - self.min_level][level - size - 1]
+        }
+    }
+
+    fn bitmap_mut(&mut self, size: usize, level: usize) -> &mut Vec<u32> {
+        if level == size {
+            &mut self.used[level - self.min_level]
+        } else {
+            &mut self.full[size - self.min_level][level - size - 1]
+        }
+    }
+
+    fn index(&self, address: PAddr, level: usize) -> usize {
+        ((address - self.base) / BlockSize::new(level).bytes()) as usize
+    }
 
-    // Free/occupied status of a block above 4G (pages must be 4M)
-    occupied_status_upper: Vec<BitArray>,
+    fn address(&self, index: usize, level: usize) -> PAddr {
+        self.base + index as PSize * BlockSize::new(level).bytes()
+    }
+
+    /// The number of blocks of a level that start within the range.
+
+    fn block_count(&self, level: usize) -> usize {
+        let bytes = BlockSize::new(level).bytes();
+
+        ((self.end - self.base).align(bytes) / bytes) as usize
+    }
+
+    fn is_set(bitmap: &[u32], index: usize) -> bool {
+        bitmap[index / SUB_BLOCKS] & (1 << (index % SUB_BLOCKS)) != 0
+    }
+
+    fn set_to(bitmap: &mut [u32], index: usize, set: bool) {
+        if set {
+            bitmap[index / SUB_BLOCKS] |= 1 << (index % SUB_BLOCKS);
+        } else {
+            bitmap[index / SUB_BLOCKS] &= !(1 << (index % SUB_BLOCKS));
+        }
+    }
+
+    /// Returns `true` if any part of a block is in use.
+
+    fn is_used(&self, address: PAddr, level: usize) -> bool {
+        Self::is_set(self.bitmap(level, level), self.index(address, level))
+    }
+
+    /// Returns `true` if a block contains no free block of the smallest size.
+
+    fn is_full(&self, address: PAddr, level: usize) -> bool {
+        Self::is_set(self.bitmap(self.min_level, level), self.index(address, level))
+    }
+
+    /// Returns `true` if not even a block of the smallest size is free.
+
+    fn is_exhausted(&self) -> bool {
+        self.bitmap(self.min_level, TOP_LEVEL)
+            .iter()
+            .all(|word| *word == u32::MAX)
+    }
+
+    /// Marks a block and all of its sub-blocks as used or free and updates the status of
+    /// the blocks that contain it.
+
+    fn mark(&mut self, index: usize, level: usize, used: bool) {
+        let fill = if used { u32::MAX } else { 0 };
+        let mut words = index..index + 1;
+
+        for sub_level in (self.min_level..level).rev() {
+            for size in self.min_level..=sub_level {
+                self.bitmap_mut(size, sub_level)[words.clone()]
+                    .iter_mut()
+                    .for_each(|word| *word = fill);
+            }
+
+            words = words.start * SUB_BLOCKS..words.end * SUB_BLOCKS;
+        }
+
+        for size in self.min_level..=level {
+            Self::set_to(self.bitmap_mut(size, level), index, used);
+        }
+
+        let mut index = index;
+
+        for level in level + 1..=TOP_LEVEL {
+            let parent = index / SUB_BLOCKS;
+            let is_used = self.used[level - 1 - self.min_level][parent] != 0;
+
+            Self::set_to(&mut self.used[level - self.min_level], parent, is_used);
+
+            for size in self.min_level..level {
+                let is_full = self.bitmap(size, level - 1)[parent] == u32::MAX;
+
+                Self::set_to(self.bitmap_mut(size, level), parent, is_full);
+            }
+
+            index = parent;
+        }
+    }
 
-    // Available/filled status of a block above 4G (pages must be 4M)
-    filled_status_upper: Vec<BitArray>,
+    /// Marks `[start, end)` as used or free using the largest blocks that fit. The bounds
+    /// must be aligned to the smallest block size.
+
+    fn mark_range(&mut self, start: PAddr, end: PAddr, used: bool) {
+        let mut address = start;
+
+        while address < end {
+            let level = (self.min_level..=TOP_LEVEL)
+                .rev()
+                .find(|level| {
+                    let bytes = BlockSize::new(*level).bytes();
+
+                    (address - self.base).is_aligned(bytes) && address + bytes <= end
+                })
+                .unwrap_or(self.min_level);
+
+            self.mark(self.index(address, level), level, used);
+            address += BlockSize::new(level).bytes();
+        }
+    }
+
+    /// Finds a free block of a level without marking it as used.
+
+    fn find(&mut self, size: usize) -> Option<PAddr> {
+        let hint = self.hints[size - self.min_level];
+
+        // Blocks of the same size tend to be allocated together, so try the word that the
+        // last one came from before searching from the top
+
+        if let Some(word) = self.bitmap(size, size).get(hint).filter(|word| **word != u32::MAX) {
+            let index = hint * SUB_BLOCKS + word.trailing_ones() as usize;
+
+            return Some(self.address(index, size));
+        }
+
+        let top = self.bitmap(size, TOP_LEVEL);
+        let cursor = self.top_cursors[size - self.min_level];
+        let top_word = (0..top.len())
+            .map(|i| (cursor + i) % top.len())
+            .find(|word| top[*word] != u32::MAX)?;
+        let mut index = top_word * SUB_BLOCKS + top[top_word].trailing_ones() as usize;
+
+        for level in (size..TOP_LEVEL).rev() {
+            index = index * SUB_BLOCKS + self.bitmap(size, level)[index].trailing_ones() as usize;
+        }
+
+        self.top_cursors[size - self.min_level] = top_word;
+        self.hints[size - self.min_level] = index / SUB_BLOCKS;
+
+        Some(self.address(index, size))
+    }
+
+    /// Counts the blocks of a level whose bit in a bitmap has the given value.
+
+    fn count(&self, size: usize, level: usize, set: bool) -> usize {
+        let bitmap = self.bitmap(size, level);
+        let blocks = self.block_count(level);
+        let whole_words = blocks / SUB_BLOCKS;
+
+        let ones = bitmap[..whole_words]
+            .iter()
+            .map(|word| word.count_ones() as usize)
+            .sum::<usize>() + if blocks % SUB_BLOCKS != 0 {
+                (bitmap[whole_words] & ((1 << (blocks % SUB_BLOCKS)) - 1)).count_ones() as usize
+            } else {
+                0
+            };
+
+        if set {
+            ones
+        } else {
+            blocks - ones
+        }
+    }
+}
+
+pub struct PhysPageAllocator {
+    memory_size: PSize,
+
+    // Blocks below 4G, which can be of any size
+    lower: BlockTree,
+
+    // Blocks above 4G, which can only be accessed with PSE (4M and up)
+    upper: Option<BlockTree>,
 
     // The regions that cannot be allocated (because they're: being used by the kernel, MMIO ranges,
     // non-existent, marked as bad, etc.)
     resd_regions: RegionSet<PAddr>,
+
+    // The references to each 4 KiB frame below 4G beyond the first, by frame number. They
+    // come from mappings that share a frame (e.g. copy-on-write frames). The counts live in
+    // frames that are reserved when the allocator is initialized, so that a frame can be
+    // shared without allocating from the heap.
+    extra_refs: &'static mut [u32],
 }
 
 pub fn allocator() -> &'static PhysPageAllocator {
@@ -166,6 +436,8 @@ pub fn is_allocator_ready() -> bool {
 
 pub fn alloc_phys(block_size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
     if is_allocator_ready() {
+        let _guard = ALLOCATOR_LOCK.lock();
+
         allocator_mut().alloc(block_size)
     } else if is_bootstrap_ready() {
         let bootstrap_alloc = unsafe {
@@ -181,12 +453,77 @@ pub fn alloc_phys(block_size: BlockSize) -> Result<(PAddr, BlockSize), AllocErro
 
 pub fn release_phys(address: PAddr, block_size: BlockSize) {
     if is_allocator_ready() {
+        let _guard = ALLOCATOR_LOCK.lock();
+
         allocator_mut().release(address, block_size)
     } /*else if !is_bootstrap_ready() {
         panic!("Bootstrap allocator hasn't been initialized yet.");
     }*/
 }
 
+/// Allocates 4 KiB frames into `frames` while holding the allocator's lock only once.
+/// Returns the number of frames that were allocated, which is less than requested if
+/// memory runs out.
+
+pub fn alloc_phys_frames(frames: &mut [PAddr]) -> usize {
+    if !is_allocator_ready() {
+        return 0;
+    }
+
+    let _guard = ALLOCATOR_LOCK.lock();
+
+    frames.iter_mut()
+        .map_while(|frame| allocator_mut().alloc(BlockSize::Block4k)
+            .map(|(address, _)| *frame = address)
+            .ok())
+        .count()
+}
+
+/// Releases 4 KiB frames while holding the allocator's lock only once.
+
+pub fn release_phys_frames(frames: &[PAddr]) {
+    if is_allocator_ready() {
+        let _guard = ALLOCATOR_LOCK.lock();
+
+        for frame in frames {
+            allocator_mut().release(*frame, BlockSize::Block4k);
+        }
+    }
+}
+
+/// Adds a reference to a frame that's about to be shared by another mapping. Returns the
+/// new reference count, or `None` if the frame isn't managed by the allocator (e.g. MMIO).
+
+pub fn ref_phys(address: PAddr) -> Option<u32> {
+    if is_allocator_ready() && address < MAX_PHYS_ADDR_4K {
+        let _guard = ALLOCATOR_LOCK.lock();
+
+        if allocator().contains(address) {
+            allocator_mut().add_ref(address)
+        } else {
+            None
+        }
+    } else {
+        None
+    }
+}
+
+/// Returns the number of mappings that refer to a frame.
+
+pub fn phys_ref_count(address: PAddr) -> u32 {
+    if is_allocator_ready() && address < MAX_PHYS_ADDR_4K {
+        let _guard = ALLOCATOR_LOCK.lock();
+
+        if allocator().contains(address) {
+            allocator().ref_count(address)
+        } else {
+            0
+        }
+    } else {
+        0
+    }
+}
+
 impl PhysPageAllocator {
     pub fn init_bootstrap(first_free_page: PAddr) {
         if is_allocator_ready() {
@@ -203,6 +540,52 @@ impl PhysPageAllocator {
         }
     }
 
+    /// Creates an allocator for `memory_size` bytes of physical memory, all of which is free.
+    /// `extra_refs` must have `ref_count_len(memory_size)` zeroed counts.
+
+    fn new(memory_size: PSize, extra_refs: &'static mut [u32]) -> Self {
+        PhysPageAllocator {
+            memory_size,
+            lower: BlockTree::new(0, memory_size.min(MAX_PHYS_ADDR_4K), BlockSize::Block4k.level()),
+            upper: if memory_size > MAX_PHYS_ADDR_4K {
+                Some(BlockTree::new(MAX_PHYS_ADDR_4K, memory_size, BlockSize::Block4M.level()))
+            } else {
+                None
+            },
+            resd_regions: RegionSet::empty(),
+            extra_refs,
+        }
+    }
+
+    /// Returns the number of reference counts that an allocator for `memory_size` bytes needs.
+
+    fn ref_count_len(memory_size: PSize) -> usize {
+        (memory_size.min(MAX_PHYS_ADDR_4K) / BlockSize::Block4k.bytes()) as usize
+    }
+
+    /// Maps zeroed frames over enough of `FRAME_REF_AREA` to count the references to every
+    /// 4 KiB frame below `memory_end`. The frames come from the bootstrap allocator, so they're
+    /// marked as used along with the rest of its range once the allocator takes over.
+
+    unsafe fn reserve_ref_counts(memory_end: PSize) -> &'static mut [u32] {
+        let count = Self::ref_count_len(memory_end);
+        let start = ptr::addr_of_mut!(FRAME_REF_AREA) as *mut u32;
+        let length = (count * mem::size_of::<u32>()).align(PhysicalFrame::SMALL_PAGE_SIZE);
+
+        for offset in (0..length).step_by(PhysicalFrame::SMALL_PAGE_SIZE) {
+            let (frame, _) = alloc_phys(BlockSize::Block4k)
+                .unwrap_or_else(|_| panic!("Unable to allocate frames for reference counts."));
+
+            lowlevel::map(None, (start as usize + offset) as *mut c_void, frame, 0)
+                .unwrap_or_else(|_| panic!("Unable to map reference counts."));
+        }
+
+        let extra_refs = slice::from_raw_parts_mut(start, count);
+
+        extra_refs.fill(0);
+        extra_refs
+    }
+
     pub fn init(mmap_iter: RawMemoryMapIterator) {
         if is_allocator_ready() {
             panic!("Physical page allocator has already been initialized.");
@@ -225,47 +608,9 @@ impl PhysPageAllocator {
                 .clamp(1, MAX_PHYS_ADDR)
         };
 
-        let mut allocator = PhysPageAllocator {
-            memory_size: memory_end,
-            occupied_status: Vec::new(),
-            filled_status: Vec::new(),
-            occupied_status_upper: Vec::new(),
-            filled_status_upper: Vec::new(),
-            resd_regions: RegionSet::empty(),
-        };
-
-        // Create the block status bit arrays for the first 4G
-
-        for i in 0..BlockSize::total_sizes() {
-            let block_size = BlockSize::new(i);
-            let blocks = memory_end.clamp(0, MAX_PHYS_ADDR_4K).align(block_size.bytes()) / block_size.bytes();
-
-            allocator.occupied_status.push(BitArray::new(blocks as usize, false));
-
-            // 4k blocks have no sub blocks, so don't add status bits for them
-
-            if i > 0 {
-                allocator.filled_status.push(BitArray::new(blocks as usize, false));
-            }
-        }
-
-        if memory_end > MAX_PHYS_ADDR_4K {
-            // Create the block status bit arrays
-
-            for i in BlockSize::Block4M.level()..BlockSize::total_sizes() {
-                let block_size = BlockSize::new(i);
-                let blocks = (memory_end.clamp(0, MAX_PHYS_ADDR) - MAX_PHYS_ADDR_4K)
-                    .align(block_size.bytes()) / block_size.bytes();
-
-                allocator.occupied_status_upper.push(BitArray::new(blocks as usize, false));
-
-                // 4k blocks have no sub blocks, so don't add status bits for them
-
-                if i > BlockSize::Block4M.level() {
-                    allocator.filled_status_upper.push(BitArray::new(blocks as usize, false));
-                }
-            }
-        }
+        // This has to happen before the bootstrap allocator's range is marked as used below
+        let extra_refs = unsafe { PhysPageAllocator::reserve_ref_counts(memory_end) };
+        let mut allocator = PhysPageAllocator::new(memory_end, extra_refs);
 
         let bootstrap_alloc = unsafe { BOOTSTRAP_MEM.as_mut()
             .unwrap_or_else(|| panic!("Unable to get bootstrap allocator")) };
@@ -285,25 +630,7 @@ impl PhysPageAllocator {
             };
 
             if mmap.base_addr < memory_end {
-                let mmap_start = mmap.base_addr;
-                let block128k_start = mmap_start.align(BlockSize::Block128k.bytes());
-                let mmap_end = end.clamp(0, memory_end);
-                let block128k_end = mmap_end.align_trunc(BlockSize::Block128k.bytes());
-
-                for address in (mmap.base_addr..block128k_start)
-                    .step_by(BlockSize::Block4k.bytes() as usize) {
-                    allocator.mark_used(address, BlockSize::Block4k);
-                }
-
-                for address in (block128k_start..block128k_end)
-                    .step_by(BlockSize::Block128k.bytes() as usize) {
-                    allocator.mark_used(address, BlockSize::Block128k);
-                }
-
-                for address in (block128k_end..mmap_end)
-                    .step_by(BlockSize::Block4k.bytes() as usize) {
-                    allocator.mark_used(address, BlockSize::Block4k);
-                }
+                allocator.mark_range_used(mmap.base_addr, end);
             }
 
             match mmap.map_type {
@@ -315,9 +642,7 @@ impl PhysPageAllocator {
         // Mark the bootstrap pages as used
         // todo(): This doesn't free any unused bootstrap pages
 
-        (bootstrap_alloc.start..bootstrap_alloc.end)
-            .step_by(PhysicalFrame::SMALL_PAGE_SIZE as usize)
-            .for_each(|addr| allocator.mark_used(addr, BlockSize::Block4k));
+        allocator.mark_range_used(bootstrap_alloc.start, bootstrap_alloc.end);
 
         // From this point on, we'll use the physical memory allocator instead of the bootstrap
         // allocator for physical pages
@@ -338,101 +663,53 @@ impl PhysPageAllocator {
         for r in hole_regions.into_iter() {
             let alloc_mut = allocator_mut();
 
-            let mmap_start = r.start();
-            let block128k_start = mmap_start.align(BlockSize::Block128k.bytes());
-            let mmap_end = r.end().clamp(0, memory_end);
-            let block128k_end = r.end().align_trunc(BlockSize::Block128k.bytes());
-
-            for address in (mmap_start..block128k_start)
-                .step_by(BlockSize::Block4k.bytes() as usize) {
-                alloc_mut.mark_used(address, BlockSize::Block4k);
-            }
-
-            for address in (block128k_start..block128k_end)
-                .step_by(BlockSize::Block128k.bytes() as usize) {
-                alloc_mut.mark_used(address, BlockSize::Block128k);
-            }
-
-            for address in (block128k_end..mmap_end)
-                .step_by(BlockSize::Block4k.bytes() as usize) {
-                alloc_mut.mark_used(address, BlockSize::Block4k);
-            }
-
-            allocator_mut().mark_reserved(r);
+            alloc_mut.mark_range_used(r.start(), r.end());
+            alloc_mut.mark_reserved(r);
         }
     }
 
-    fn filled_status(&self, block: BlockSize) -> &BitArray {
-        match block {
-            BlockSize::Block4k => &self.occupied_status[0],
-            b => &self.filled_status[b.level()-1],
-        }
-    }
+    /// Returns the bitmaps that track a block along with the block's level.
 
-    fn filled_status_mut(&mut self, block: BlockSize) -> &mut BitArray {
-        match block {
-            BlockSize::Block4k => &mut self.occupied_status[0],
-            b => &mut self.filled_status[b.level()-1],
-        }
-    }
+    fn tree(&self, address: PAddr, size: BlockSize) -> &BlockTree {
+        match &self.upper {
+            Some(upper) if address >= MAX_PHYS_ADDR_4K => {
+                if size.level() < upper.min_level {
+                    panic!("Block of size {} doesn't exist for {:#x}", size.bytes(), address);
+                }
 
-    fn filled_status_upper(&self, block: BlockSize) -> &BitArray {
-        match block {
-            BlockSize::Block4M => &self.occupied_status_upper[0],
-            b if b.level() < BlockSize::Block4M.level() => panic!("Block level {} is not supported.", b.level()),
-            b => &self.filled_status_upper[b.level()-BlockSize::Block4M.level()-1],
+                upper
+            },
+            _ if address >= MAX_PHYS_ADDR_4K => panic!("Block at {:#x} is past the end of memory.", address),
+            _ => &self.lower,
         }
     }
 
-    fn filled_status_upper_mut(&mut self, block: BlockSize) -> &mut BitArray {
-        match block {
-            BlockSize::Block4M => &mut self.occupied_status_upper[0],
-            b if b.level() < BlockSize::Block4M.level() => panic!("Block level {} is not supported.", b.level()),
-            b => &mut self.filled_status_upper[b.level()-BlockSize::Block4M.level()-1],
+    fn tree_mut(&mut self, address: PAddr, size: BlockSize) -> &mut BlockTree {
+        match &mut self.upper {
+            Some(upper) if address >= MAX_PHYS_ADDR_4K => {
+                if size.level() < upper.min_level {
+                    panic!("Block of size {} doesn't exist for {:#x}", size.bytes(), address);
+                }
+
+                upper
+            },
+            _ if address >= MAX_PHYS_ADDR_4K => panic!("Block at {:#x} is past the end of memory.", address),
+            _ => &mut self.lower,
         }
     }
 
     pub fn is_block_free(&self, address: PAddr, block_size: BlockSize) -> bool {
-        if address >= MAX_PHYS_ADDR_4K {
-            if block_size.level() < BlockSize::Block4M.level() {
-                panic!("Block of size {} doesn't exist for {:#x}", block_size.bytes(), address);
-            } else {
-                self.occupied_status_upper[block_size.level() - BlockSize::Block4M.level()]
-                    .is_cleared(((address - MAX_PHYS_ADDR_4K) / block_size.bytes()) as usize)
-            }
-        } else {
-            self.occupied_status[block_size.level()].is_cleared((address / block_size.bytes()) as usize)
-        }
+        !self.tree(address, block_size).is_used(address, block_size.level())
     }
 
     pub fn is_block_partially_used(&self, address: PAddr, size: BlockSize) -> bool {
-        if address >= MAX_PHYS_ADDR_4K {
-            if size.level() < BlockSize::Block4M.level() {
-                panic!("Block of size {} doesn't exist for {:#x}", size.bytes(), address);
-            } else {
-                let bit_index = ((address - MAX_PHYS_ADDR_4K) / size.bytes()) as usize;
-
-                self.occupied_status_upper[size.level() - BlockSize::Block4M.level()].is_set(bit_index)
-                    && self.filled_status_upper(size).is_cleared(bit_index)
-            }
-        } else {
-            let bit_index = (address / size.bytes()) as usize;
+        let tree = self.tree(address, size);
 
-            self.occupied_status[size.level()].is_set(bit_index)
-                && self.filled_status(size).is_cleared(bit_index)
-        }
+        tree.is_used(address, size.level()) && !tree.is_full(address, size.level())
     }
 
     pub fn is_block_used(&self, address: PAddr, size: BlockSize) -> bool {
-        if address >= MAX_PHYS_ADDR_4K {
-            if size.level() < BlockSize::Block4M.level() {
-                panic!("Block of size {} doesn't exist for {:#x}", size.bytes(), address);
-            } else {
-                self.filled_status_upper(size).is_set(((address - MAX_PHYS_ADDR_4K) / size.bytes()) as usize)
-            }
-        } else {
-            self.filled_status(size).is_set((address / size.bytes()) as usize)
-        }
+        self.tree(address, size).is_full(address, size.level())
     }
 
     /// Mark a block (and possibly its super-block(s)) as used.
@@ -442,113 +719,40 @@ impl PhysPageAllocator {
             panic!("Cannot mark block of size {} @ {:#x} as used.", size.bytes(), address);
         }
 
-        // Mark this block and all of its sub-blocks as used
-        {
-            let mut bit_start = if address >= MAX_PHYS_ADDR_4K {
-                ((address - MAX_PHYS_ADDR_4K) / size.bytes()) as usize
-            } else {
-                (address / size.bytes()) as usize
-            };
-
-            let mut bit_end = bit_start + 1;
-
-            for level in (0..size.level() + 1).rev() {
-                if address >= MAX_PHYS_ADDR_4K {
-                    if level < BlockSize::Block4M.level() {
-                        continue;
-                    }
-
-                    self.occupied_status_upper[level - BlockSize::Block4M.level()]
-                        .set_bits(bit_start, bit_end);
-
-                    // Only blocks larger than 4 MB have sub-blocks to be marked as used
-
-                    if level > BlockSize::Block4M.level() {
-                        self.filled_status_upper_mut(BlockSize::new(level))
-                            .set_bits(bit_start, bit_end);
-                    }
-                } else {
-                    self.occupied_status[level].set_bits(bit_start, bit_end);
-
-                    // Only blocks larger than 4 kB have sub-blocks to be marked as used
-
-                    if level > 0 {
-                        self.filled_status_mut(BlockSize::new(level))
-                            .set_bits(bit_start, bit_end);
-                    }
-                }
-
-                bit_start *= BitArray::bits_per_word();
-                bit_end *= BitArray::bits_per_word();
-            }
-        }
-
-        /* Mark the super-blocks as partially used, unless the super-blocks' sub-blocks are
-           all marked as used (in that case, mark the super-block as completely used.) */
-
-        for level in size.level()..BlockSize::total_sizes() {
-            let level_size = BlockSize::new(level).bytes();
-
-            if address >= MAX_PHYS_ADDR_4K {
-                let bit_index = ((address - MAX_PHYS_ADDR_4K) / level_size) as usize;
-
-                if level > size.level() {
-                    self.occupied_status_upper[level - BlockSize::Block4M.level()].set(bit_index);
-                }
-
-                if self.filled_status_upper(BlockSize::new(level)).is_word_set(bit_index)
-                    && level + 1 < BlockSize::total_sizes() {
-                    self.filled_status_upper_mut(BlockSize::new(level + 1))
-                        .set(((address - MAX_PHYS_ADDR_4K) / BlockSize::new(level + 1).bytes()) as usize);
-                }
-            } else {
-                let bit_index = (address / level_size) as usize;
-
-                if level > size.level() {
-                    self.occupied_status[level].set(bit_index);
-                }
+        let tree = self.tree_mut(address, size);
+        let index = tree.index(address, size.level());
 
-                if self.filled_status(BlockSize::new(level)).is_word_set(bit_index)
-                    && level + 1 < BlockSize::total_sizes() {
-                    self.filled_status_mut(BlockSize::new(level + 1))
-                        .set((address / BlockSize::new(level + 1).bytes()) as usize);
-                }
-            }
-        }
+        tree.mark(index, size.level(), true);
     }
 
     /// Mark a block as free.
 
     fn mark_free(&mut self, address: PAddr, size: BlockSize) {
-        let mut bit_start = if address >= MAX_PHYS_ADDR_4K {
-            ((address - MAX_PHYS_ADDR_4K) / size.bytes()) as usize
-        } else {
-            (address / size.bytes()) as usize
-        };
+        let tree = self.tree_mut(address, size);
+        let index = tree.index(address, size.level());
 
-        let mut bit_end = bit_start+1;
+        tree.mark(index, size.level(), false);
+    }
 
-        for level in (0..size.level()+1).rev() {
-            if address >= MAX_PHYS_ADDR_4K {
-                if level < BlockSize::Block4M.level() {
-                    continue;
-                }
+    /// Marks every block that overlaps `[start, end)` as used. Above 4G, that includes
+    /// whole 4M blocks that are only partly covered.
 
-                self.occupied_status_upper[level - BlockSize::Block4M.level()].clear_bits(bit_start, bit_end);
+    fn mark_range_used(&mut self, start: PAddr, end: PAddr) {
+        let end = end.min(self.memory_size);
 
-                if level > BlockSize::Block4M.level() {
-                    self.filled_status_upper_mut(BlockSize::new(level)).clear_bits(bit_start, bit_end);
-                }
-            } else {
-                self.occupied_status[level].clear_bits(bit_start, bit_end);
+        if start < end.min(MAX_PHYS_ADDR_4K) {
+            let small_bytes = BlockSize::Block4k.bytes();
 
-                if level > 0 {
-                    self.filled_status_mut(BlockSize::new(level)).clear_bits(bit_start, bit_end);
-                }
-            }
+            self.lower.mark_range(start.align_trunc(small_bytes), end.min(MAX_PHYS_ADDR_4K).align(small_bytes), true);
+        }
 
-            bit_start *= BitArray::bits_per_word();
-            bit_end *= BitArray::bits_per_word();
+        if let Some(upper) = self.upper.as_mut() {
+            let large_bytes = BlockSize::Block4M.bytes();
+            let start = start.max(MAX_PHYS_ADDR_4K).align_trunc(large_bytes);
+
+            if start < end {
+                upper.mark_range(start, end.align(large_bytes), true);
+            }
         }
     }
 
@@ -556,51 +760,29 @@ impl PhysPageAllocator {
         self.resd_regions.insert(region);
     }
 
-    pub fn alloc(&mut self, size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
-        let result = self
-            .find_block(size)
-            .map(|addr| (addr, size))
-            .ok_or_else(|| {
-                let filled_status = if size.level() >= BlockSize::Block4M.level() {
-                    allocator()
-                        .filled_status_upper(BlockSize::new(BlockSize::total_sizes() - 1))
-                } else {
-                    allocator()
-                        .filled_status(BlockSize::new(BlockSize::total_sizes() - 1))
-                };
-
-                if filled_status.count_ones() == filled_status.bit_count() {
-                    AllocError::OutOfMemory
-                } else {
-                    AllocError::TooBig
-                }
-            })?;
-
-        self.mark_used(result.0, result.1);
-
-        Ok(result)
-    }
+    /// Allocates a block. Blocks of 4M and up are taken from above 4G only once there are
+    /// none left below it.
 
-    fn find_block(&self, size: BlockSize) -> Option<PAddr> {
-        self._find_block(0, BlockSize::total_sizes()-1, size)
-    }
-
-    // todo: Implement _find_block for 4M blocks and up in the upper 4G section
+    pub fn alloc(&mut self, size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
+        let address = match self.lower.find(size.level()) {
+            Some(address) => Some(address),
+            None => self.upper
+                .as_mut()
+                .filter(|upper| size.level() >= upper.min_level)
+                .and_then(|upper| upper.find(size.level())),
+        };
 
-    fn _find_block(&self, start_index: usize, level: usize, size: BlockSize) -> Option<PAddr> {
-        if level == size.level() {
-            BitIterator::start_from(start_index, &self.occupied_status[level], BitFilter::Zero)
-                .next()
-                .map(|b| (b as PSize * size.bytes()) as PAddr)
-        } else {
-            for b in BitIterator::start_from(start_index, &self.filled_status(BlockSize::new(level)), BitFilter::Zero) {
-                if let option@Some(_) = self._find_block(BitArray::bits_per_word()*start_index + b, level - 1, size) {
-                    return option;
-                }
+        let address = address.ok_or_else(|| {
+            if self.trees(size).all(|tree| tree.is_exhausted()) {
+                AllocError::OutOfMemory
+            } else {
+                AllocError::TooBig
             }
+        })?;
 
-            None
-        }
+        self.mark_used(address, size);
+
+        Ok((address, size))
     }
 
     pub fn is_free(&self, address: PAddr) -> bool {
@@ -612,8 +794,7 @@ impl PhysPageAllocator {
     }
 
     pub fn is_reserved(&self, address: PAddr) -> bool {
-        allocator()
-            .resd_regions
+        self.resd_regions
             .iter()
             .any(|region| region.contains(address))
     }
@@ -623,152 +804,193 @@ impl PhysPageAllocator {
             && !self.is_reserved(address)
     }
 
+    /// Releases a reference to a block. The block is only marked as free once its last
+    /// reference has been released.
+
     pub fn release(&mut self, address: PAddr, block_size: BlockSize) {
         if self.is_block_free(address, block_size) {
             panic!("Attempted to release a {}-byte block at {:#x} that's already free", block_size.bytes(), address);
+        } else if let Some(count) = self.extra_refs_mut(address).filter(|count| **count > 0) {
+            *count -= 1;
         } else {
             self.mark_free(address, block_size);
         }
     }
 
-    pub fn free_count(&self, size: BlockSize) -> usize {
-        self.occupied_status[size.level()].count_zeros() + if size.level() >= BlockSize::Block4M.level() {
-            self.occupied_status_upper[size.level() - size.level()].count_zeros()
+    fn extra_refs_mut(&mut self, address: PAddr) -> Option<&mut u32> {
+        self.extra_refs.get_mut((address / BlockSize::Block4k.bytes()) as usize)
+    }
+
+    /// Adds a reference to a used block. Returns the new reference count or `None`
+    /// if the block is free or above 4G.
+
+    pub fn add_ref(&mut self, address: PAddr) -> Option<u32> {
+        if self.is_free(address) {
+            None
         } else {
-            0
+            self.extra_refs_mut(address)
+                .map(|count| {
+                    *count += 1;
+                    *count + 1
+                })
         }
     }
 
-    pub fn used_count(&self, size: BlockSize) -> usize {
-        self.filled_status(size).count_ones() + if size.level() >= BlockSize::Block4M.level() {
-            self.filled_status_upper(size).count_ones()
-        } else {
+    /// Returns the reference count of a block (zero if the block is free).
+
+    pub fn ref_count(&self, address: PAddr) -> u32 {
+        if self.is_free(address) {
             0
+        } else {
+            self.extra_refs.get((address / BlockSize::Block4k.bytes()) as usize)
+                .map_or(1, |count| count + 1)
         }
     }
 
+    /// Returns the trees that have blocks of a size.
+
+    fn trees(&self, size: BlockSize) -> impl Iterator<Item=&BlockTree> {
+        Some(&self.lower)
+            .into_iter()
+            .chain(self.upper.as_ref().filter(|upper| size.level() >= upper.min_level))
+    }
+
+    pub fn free_count(&self, size: BlockSize) -> usize {
+        self.trees(size)
+            .map(|tree| tree.count(size.level(), size.level(), false))
+            .sum()
+    }
+
+    pub fn used_count(&self, size: BlockSize) -> usize {
+        self.trees(size)
+            .map(|tree| tree.count(tree.min_level, size.level(), true))
+            .sum()
+    }
+
     pub fn total_count(&self, size: BlockSize) -> usize {
-        self.occupied_status[size.level()].bit_count() + if size.level() >= BlockSize::Block4M.level() {
-            self.occupied_status_upper[size.level() - size.level()].bit_count()
-        } else {
-            0
-        }
+        self.trees(size)
+            .map(|tree| tree.block_count(size.level()))
+            .sum()
     }
 }
 
-/*
 #[cfg(test)]
 mod test {
-    use crate::page::PhysicalFrame;
-    use super::new_allocator::Page;
-    use rust::align::Align;
-    use super::BlockSize;
-    use crate::address::{PSize, PAddr};
-    use alloc::vec::Vec;
+    extern crate std;
 
-    #[test]
-    fn test_allocation() {
-        let (start_addr, total_mem) = (0x1000, 0x10000);
-        super::allocator().init_test(start_addr, total_mem);
+    use super::*;
 
-        assert_eq!(super::allocator().total_count(BlockSize::Block4k), (total_mem-start_addr) / PhysicalFrame::SMALL_PAGE_SIZE);
-        assert_eq!(super::allocator().total_count(BlockSize::Block4k), super::allocator().free_count(BlockSize::Block4k));
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+    const MIB: PSize = 1024 * 1024;
+    const GIB: PSize = 1024 * MIB;
 
-        let alloc_result = super::allocator().alloc(BlockSize::Block4k);
+    fn new_allocator(memory_size: PSize) -> PhysPageAllocator {
+        let extra_refs = vec![0; PhysPageAllocator::ref_count_len(memory_size)];
 
-        assert!(alloc_result.is_some());
+        PhysPageAllocator::new(memory_size, extra_refs.leak())
+    }
 
-        let address = alloc_result.unwrap().0;
+    #[test]
+    fn test_alloc_release() {
+        let mut allocator = new_allocator(64 * MIB);
+        let total = allocator.total_count(BlockSize::Block4k);
 
-        assert!(address >= start_addr);
-        assert!(address < total_mem as PAddr);
-        assert!(address.is_aligned(PhysicalFrame::SMALL_PAGE_SIZE as PSize));
-        assert!(!super::allocator().is_free(address));
-        assert!(super::allocator().is_used(address));
+        assert_eq!(total, 16384);
+        assert_eq!(allocator.free_count(BlockSize::Block4k), total);
+        assert_eq!(allocator.used_count(BlockSize::Block4k), 0);
 
-        let page2 = page.clone();
+        let (address, _) = allocator.alloc(BlockSize::Block4k).unwrap();
 
-        super::allocator().release(address, BlockSize::Block4k);
+        assert!(address.is_aligned(BlockSize::Block4k.bytes()));
+        assert!(allocator.is_used(address));
+        assert!(allocator.is_block_partially_used(address.align_trunc(BlockSize::Block128k.bytes()),
+                                                  BlockSize::Block128k));
+        assert_eq!(allocator.free_count(BlockSize::Block4k), total - 1);
 
-        assert!(super::allocator().is_free(address));
-        assert!(super::allocator().is_used(address));
+        allocator.release(address, BlockSize::Block4k);
+
+        assert!(allocator.is_free(address));
+        assert!(allocator.is_block_free(address.align_trunc(BlockSize::Block4M.bytes()), BlockSize::Block4M));
+        assert_eq!(allocator.free_count(BlockSize::Block4k), total);
     }
 
     #[test]
-    fn test_free_page_count() {
-        let (start_addr, total_mem) = (0x0000, 0x100000);
-        super::allocator().init_test(start_addr, total_mem);
+    fn test_release_part_of_large_block() {
+        let mut allocator = new_allocator(8 * MIB);
+        let (large, _) = allocator.alloc(BlockSize::Block4M).unwrap();
+
+        assert!(allocator.is_block_used(large, BlockSize::Block4M));
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), (total_mem-start_addr as PSize) / PhysicalFrame::SMALL_PAGE_SIZE);
+        // e.g. the frames of a large page that was split
+        for i in 0..1024 {
+            allocator.release(large + i * BlockSize::Block4k.bytes(), BlockSize::Block4k);
+        }
 
-        let p1 = super::allocator().alloc(BlockSize::Block4k).unwrap().0;
-        let p2 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p3 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
+        assert!(allocator.is_block_free(large, BlockSize::Block4M));
+        assert_eq!(allocator.alloc(BlockSize::Block4M).ok().map(|(address, _)| address), Some(large));
+    }
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), ((total_mem-start_addr as PSize) / PhysicalFrame::SMALL_PAGE_SIZE - 3) as PSize);
+    #[test]
+    fn test_exhaustion() {
+        let mut allocator = new_allocator(MIB);
+        let frames = (0..256)
+            .map(|_| allocator.alloc(BlockSize::Block4k).unwrap().0)
+            .collect::<Vec<_>>();
 
-        [p1, p2, p3]
-            .iter()
-            .for_each(|a| super::allocator_mut().release(*a, BlockSize::Block4k));
+        assert!(matches!(allocator.alloc(BlockSize::Block4k), Err(AllocError::OutOfMemory)));
+
+        allocator.release(frames[100], BlockSize::Block4k);
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), (total_mem-start_addr as PSize) / PhysicalFrame::SMALL_PAGE_SIZE);
+        assert!(matches!(allocator.alloc(BlockSize::Block128k), Err(AllocError::TooBig)));
+        assert_eq!(allocator.alloc(BlockSize::Block4k).ok().map(|(address, _)| address), Some(frames[100]));
     }
 
     #[test]
-    fn test_used_page_count() {
-        let (start_addr, total_mem) = (0x0000, 0x100000);
-        super::allocator().init_test(start_addr, total_mem);
+    fn test_upper_memory() {
+        let mut allocator = new_allocator(4 * GIB + 8 * MIB);
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+        allocator.mark_range_used(0, MAX_PHYS_ADDR_4K);
 
-        let p1 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p2 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p3 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
+        let (first, _) = allocator.alloc(BlockSize::Block4M).unwrap();
+        let (second, _) = allocator.alloc(BlockSize::Block4M).unwrap();
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 3);
+        assert_eq!(first, MAX_PHYS_ADDR_4K);
+        assert_eq!(second, MAX_PHYS_ADDR_4K + 4 * MIB);
+        assert!(allocator.alloc(BlockSize::Block4M).is_err());
+        assert_eq!(allocator.total_count(BlockSize::Block4M), 1026);
 
-        [p1, p2, p3]
-            .iter()
-            .for_each(|a| super::allocator_mut().release(*a, BlockSize::Block4k));
+        allocator.release(first, BlockSize::Block4M);
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+        assert!(allocator.is_block_free(first, BlockSize::Block4M));
+        assert!(matches!(allocator.alloc(BlockSize::Block4k), Err(AllocError::OutOfMemory)));
     }
 
     #[test]
-    fn test_empty_allocator() {
-        let (start_addr, total_mem) = (0x0000, 0x0000);
+    fn test_shared_frame() {
+        let mut allocator = new_allocator(MIB);
+        let (address, _) = allocator.alloc(BlockSize::Block4k).unwrap();
 
-        super::allocator().init_test(start_addr, total_mem);
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), 0);
-        assert!(super::allocator_mut().alloc(BlockSize::Block4k).is_none());
-    }
+        assert_eq!(allocator.add_ref(address), Some(2));
+        assert_eq!(allocator.add_ref(address), Some(3));
 
-    #[test]
-    #[should_panic]
-    fn test_double_release() {
-        let (start_addr, total_mem) = (0x0000, 0x10000);
-        super::allocator().init_test(start_addr, total_mem);
+        allocator.release(address, BlockSize::Block4k);
+        allocator.release(address, BlockSize::Block4k);
 
-        let result = super::allocator_mut().alloc(BlockSize::Block4k);
+        assert!(allocator.is_used(address));
+        assert_eq!(allocator.ref_count(address), 1);
 
-        assert!(result.is_some());
+        allocator.release(address, BlockSize::Block4k);
 
-        let page = result.unwrap().0;
-        let cloned_page = page.clone().0;
-
-        super::allocator().release(page, BlockSize::Block4k);
-        super::allocator().release(cloned_page, BlockSize::Block4k);
+        assert!(allocator.is_free(address));
+        assert_eq!(allocator.add_ref(address), None);
     }
 
     #[test]
-    fn test_page_sizes() {
-        assert!(PhysicalFrame::SMALL_PAGE_SIZE < PhysicalFrame::PAE_LARGE_PAGE_SIZE);
-        assert!(PhysicalFrame::PAE_LARGE_PAGE_SIZE < PhysicalFrame::HUGE_PAGE_SIZE);
-        assert!(PhysicalFrame::SMALL_PAGE_SIZE > 0);
-        assert_eq!(PhysicalFrame::PAE_LARGE_PAGE_SIZE % PhysicalFrame::SMALL_PAGE_SIZE, 0);
-        assert_eq!(PhysicalFrame::HUGE_PAGE_SIZE % PhysicalFrame::SMALL_PAGE_SIZE, 0);
-        assert_eq!(PhysicalFrame::HUGE_PAGE_SIZE % PhysicalFrame::PAE_LARGE_PAGE_SIZE, 0);
+    #[should_panic]
+    fn test_double_release() {
+        let mut allocator = new_allocator(MIB);
+        let (address, _) = allocator.alloc(BlockSize::Block4k).unwrap();
+
+        allocator.release(address, BlockSize::Block4k);
+        allocator.release(address, BlockSize::Block4k);
     }
 }
- */
\ No newline at end of file
@@ -1,11 +1,42 @@
 #![allow(dead_code)]
 
+//! Message ports.
+//!
+//! A port is a bounded queue of messages that any number of threads may send to and receive
+//! from. A sender doesn't have to wait for a receiver as long as the port has room for its
+//! message. Receivers take messages in the order in which they were sent, several at a time,
+//! so a pool of server threads can drain a port that many clients send to.
+//!
+//! A sender to a full port or a receiver of an empty port is parked in the port, unless it
+//! asked not to wait. Its request is answered once the port can satisfy it. So every
+//! operation returns all of the replies that have become due, which may include replies to
+//! parked threads.
+
 use alloc::collections::btree_map::BTreeMap;
-use crate::region::MemoryRegion;
+use alloc::collections::vec_deque::VecDeque;
 use crate::CTid;
+use crate::Tid;
+use crate::error::Error;
+use crate::mutex::Mutex;
+use crate::page::PageMapBase;
 use core::prelude::v1::*;
 use alloc::vec::Vec;
 
+/// The longest message that a port takes.
+pub const MAX_MESSAGE_LEN: usize = 512;
+
+/// The space that a batch of received messages needs for its message count.
+pub const BATCH_HEADER_LEN: usize = 4;
+
+/// The space that a message in a batch needs for its sender and length.
+pub const RECORD_HEADER_LEN: usize = 4;
+
+/// Fail instead of waiting for room in the port or for a message to arrive.
+pub const NO_BLOCK: u32 = 0x01;
+
+const MAX_QUEUED_MESSAGES: usize = 64;
+const MAX_QUEUED_BYTES: usize = 16 * 1024;
+
 pub type CPid = u16;
 pub const NULL_PID: CPid = 0;
 
@@ -44,16 +75,32 @@ impl From<Pid> for CPid {
     }
 }
 
-#[derive(PartialEq, Eq, Copy, Clone)]
-enum Status {
-    Ready,
-    Busy,
-    Waiting,
+pub struct PortMessage {
+    pub sender: Tid,
+    pub data: Vec<u8>,
+}
+
+/// A reply that's due to a thread.
+#[derive(PartialEq, Debug)]
+pub enum Reply {
+    /// The thread's message has been queued.
+    Sent(Tid),
+
+    /// Messages from a port for a receiving thread. Empty if the thread didn't want to wait
+    /// for any. The messages go back to the port with `requeue()` if they can't be delivered.
+    Received(Pid, Tid, Vec<(Tid, Vec<u8>)>),
+
+    /// The thread was parked to send a message, but its port has been destroyed.
+    SendFailed(Tid),
+
+    /// The thread was parked to receive messages, but its port has been destroyed.
+    ReceiveFailed(Tid),
 }
 
-struct Binding {
-    buffer: MemoryRegion<usize>,
-    status: Status,
+struct Receiver {
+    tid: Tid,
+    max_count: usize,
+    max_bytes: usize,
 }
 
 struct AclRule {
@@ -76,9 +123,16 @@ enum Permission {
 
 struct Port {
     creator: CTid,
-    receivers: BTreeMap<CTid, Binding>,
-    sender: Option<(CTid, Binding)>,
+    creator_pmap: PageMapBase,
     flags: u32,
+    queue: VecDeque<PortMessage>,
+    queued_bytes: usize,
+
+    // Messages of senders that are waiting for room in the queue
+    blocked_senders: VecDeque<PortMessage>,
+
+    // Receivers that are waiting for messages, in the order in which they arrived
+    receivers: VecDeque<Receiver>,
     acl_default: AclDefault,
     acl: Vec<AclRule>,
 }
@@ -89,13 +143,20 @@ enum AclDefault {
 }
 
 impl Port {
-    fn new(creator: CTid, flags: u32) -> Port {
+    /// Any thread may use the port unless its ACL says otherwise. Otherwise, only threads in
+    /// the creator's address space and those in the ACL may.
+    pub const PUBLIC: u32 = 0x01;
+
+    fn new(creator: CTid, creator_pmap: PageMapBase, flags: u32) -> Port {
         Port {
             creator,
+            creator_pmap,
             flags,
-            sender: None,
-            receivers: BTreeMap::new(),
-            acl_default: AclDefault::Whitelist,
+            queue: VecDeque::new(),
+            queued_bytes: 0,
+            blocked_senders: VecDeque::new(),
+            receivers: VecDeque::new(),
+            acl_default: if flags & Self::PUBLIC != 0 { AclDefault::Blacklist } else { AclDefault::Whitelist },
             acl: Vec::new(),
         }
     }
@@ -133,11 +194,290 @@ impl Port {
             false
         }
     }
+
+    /// Threads in the creator's address space may always use the port.
+
+    fn is_permitted(&self, tid: Tid, pmap: PageMapBase, permission: Permission) -> bool {
+        let is_listed = self.acl.iter()
+            .any(|rule| rule.tid == CTid::from(tid)
+                && (rule.permission == permission || rule.permission == Permission::Any));
+
+        pmap == self.creator_pmap || match self.acl_default {
+            AclDefault::Whitelist => is_listed,
+            AclDefault::Blacklist => !is_listed,
+        }
+    }
+
+    fn has_room(&self, length: usize) -> bool {
+        self.queue.len() < MAX_QUEUED_MESSAGES && self.queued_bytes + length <= MAX_QUEUED_BYTES
+    }
+
+    fn push(&mut self, message: PortMessage) {
+        self.queued_bytes += message.data.len();
+        self.queue.push_back(message);
+    }
+
+    /// Dequeues as many messages as fit in a batch of `max_bytes` bytes, up to `max_count`.
+
+    fn take_batch(&mut self, max_count: usize, max_bytes: usize) -> Vec<(Tid, Vec<u8>)> {
+        let mut batch = Vec::new();
+        let mut batch_bytes = 0;
+
+        while batch.len() < max_count {
+            match self.queue.front() {
+                Some(message) if batch_bytes + RECORD_HEADER_LEN + message.data.len() <= max_bytes => {
+                    batch_bytes += RECORD_HEADER_LEN + message.data.len();
+                    self.queued_bytes -= message.data.len();
+
+                    let message = self.queue.pop_front().unwrap();
+                    batch.push((message.sender, message.data));
+                },
+                _ => break,
+            }
+        }
+
+        batch
+    }
+
+    /// Moves blocked senders' messages into the queue while it has room and hands queued
+    /// messages to parked receivers.
+
+    fn settle(&mut self, pid: Pid, replies: &mut Vec<Reply>) {
+        loop {
+            while self.blocked_senders.front()
+                .map_or(false, |message| self.has_room(message.data.len())) {
+                let message = self.blocked_senders.pop_front().unwrap();
+
+                replies.push(Reply::Sent(message.sender));
+                self.push(message);
+            }
+
+            if self.queue.is_empty() {
+                break;
+            }
+
+            match self.receivers.pop_front() {
+                Some(receiver) => {
+                    let batch = self.take_batch(receiver.max_count, receiver.max_bytes);
+
+                    if batch.is_empty() {
+                        self.receivers.push_front(receiver);
+                        break;
+                    }
+
+                    replies.push(Reply::Received(pid, receiver.tid, batch));
+                },
+                None => break,
+            }
+        }
+    }
+}
+
+struct PortTable {
+    ports: BTreeMap<CPid, Port>,
+    next_pid: CPid,
+}
+
+static PORT_TABLE: Mutex<PortTable> = Mutex::new(PortTable {
+    ports: BTreeMap::new(),
+    next_pid: 1,
+});
+
+fn allocate_pid(table: &mut PortTable) -> Option<CPid> {
+    for _ in 0..CPid::MAX {
+        let pid = table.next_pid;
+
+        table.next_pid = table.next_pid.checked_add(1).unwrap_or(1);
+
+        if !table.ports.contains_key(&pid) {
+            return Some(pid);
+        }
+    }
+
+    None
+}
+
+/// Creates a port. A free port id is picked if `pid` is null.
+
+pub fn create(pid: Pid, creator: Tid, creator_pmap: PageMapBase, flags: u32) -> Result<Pid, Error> {
+    let mut table = PORT_TABLE.lock();
+
+    let pid = match CPid::from(pid) {
+        NULL_PID => allocate_pid(&mut table).ok_or(Error::OutOfMemory)?,
+        pid if table.ports.contains_key(&pid) => return Err(Error::AlreadyRegistered),
+        pid => pid,
+    };
+
+    table.ports.insert(pid, Port::new(CTid::from(creator), creator_pmap, flags));
+    Ok(Pid::new(pid))
+}
+
+/// Destroys a port. Only its creator may destroy it. Threads that are parked in the port
+/// are told that their requests failed.
+
+pub fn destroy(pid: Pid, tid: Tid) -> Result<Vec<Reply>, Error> {
+    let mut table = PORT_TABLE.lock();
+    let cpid = CPid::from(pid);
+
+    match table.ports.get(&cpid) {
+        None => return Err(Error::InvalidPort),
+        Some(port) if port.creator != CTid::from(tid) => return Err(Error::NotPermitted),
+        Some(_) => (),
+    }
+
+    let port = table.ports.remove(&cpid).unwrap();
+
+    Ok(port.blocked_senders.iter()
+        .map(|message| Reply::SendFailed(message.sender))
+        .chain(port.receivers.iter().map(|receiver| Reply::ReceiveFailed(receiver.tid)))
+        .collect())
+}
+
+/// Queues a message on a port. If the port is full, the sender waits for room unless
+/// `NO_BLOCK` is set, in which case `Error::WouldBlock` is returned.
+
+pub fn send(pid: Pid, sender: Tid, sender_pmap: PageMapBase, data: Vec<u8>, flags: u32) -> Result<Vec<Reply>, Error> {
+    let mut table = PORT_TABLE.lock();
+    let port = table.ports.get_mut(&CPid::from(pid))
+        .ok_or(Error::InvalidPort)?;
+
+    if !port.is_permitted(sender, sender_pmap, Permission::SendOnly) {
+        return Err(Error::NotPermitted);
+    } else if data.is_empty() {
+        return Err(Error::ZeroLength);
+    } else if data.len() > MAX_MESSAGE_LEN {
+        return Err(Error::TooLong);
+    }
+
+    let message = PortMessage { sender, data };
+    let mut replies = Vec::new();
+
+    // Messages are queued in the order in which they were sent, so a sender has to wait
+    // behind any that are already waiting
+
+    if port.blocked_senders.is_empty() && port.has_room(message.data.len()) {
+        replies.push(Reply::Sent(sender));
+        port.push(message);
+    } else if flags & NO_BLOCK != 0 {
+        return Err(Error::WouldBlock);
+    } else {
+        port.blocked_senders.push_back(message);
+    }
+
+    port.settle(pid, &mut replies);
+    Ok(replies)
+}
+
+/// Dequeues up to `max_count` messages that fit in a batch of `buffer_len` bytes. If the
+/// port is empty, the receiver waits for a message unless `NO_BLOCK` is set, in which case
+/// it gets an empty batch.
+
+pub fn receive(pid: Pid, receiver: Tid, receiver_pmap: PageMapBase, max_count: usize, buffer_len: usize,
+               flags: u32) -> Result<Vec<Reply>, Error> {
+    let mut table = PORT_TABLE.lock();
+    let port = table.ports.get_mut(&CPid::from(pid))
+        .ok_or(Error::InvalidPort)?;
+
+    if !port.is_permitted(receiver, receiver_pmap, Permission::ReceiveOnly) {
+        return Err(Error::NotPermitted);
+    } else if max_count == 0 {
+        return Err(Error::ZeroLength);
+    } else if buffer_len < BATCH_HEADER_LEN + RECORD_HEADER_LEN + MAX_MESSAGE_LEN {
+        // Otherwise, the receiver may never fit the next message
+        return Err(Error::TooLong);
+    }
+
+    let receiver = Receiver {
+        tid: receiver,
+        max_count,
+        max_bytes: buffer_len - BATCH_HEADER_LEN,
+    };
+    let mut replies = Vec::new();
+
+    if !port.queue.is_empty() {
+        let batch = port.take_batch(receiver.max_count, receiver.max_bytes);
+
+        replies.push(Reply::Received(pid, receiver.tid, batch));
+    } else if flags & NO_BLOCK != 0 {
+        replies.push(Reply::Received(pid, receiver.tid, Vec::new()));
+    } else {
+        port.receivers.push_back(receiver);
+    }
+
+    port.settle(pid, &mut replies);
+    Ok(replies)
+}
+
+/// Puts a batch that couldn't be delivered back at the front of its port, in its original
+/// order, and hands it to the next parked receiver if there is one. The batch is dropped if
+/// the port has been destroyed in the meantime.
+///
+/// The port may briefly hold more than its limits, since blocked senders may have filled
+/// the room that the batch left. Those limits only decide when senders have to wait.
+
+pub fn requeue(pid: Pid, batch: Vec<(Tid, Vec<u8>)>) -> Vec<Reply> {
+    let mut table = PORT_TABLE.lock();
+    let mut replies = Vec::new();
+
+    if let Some(port) = table.ports.get_mut(&CPid::from(pid)) {
+        for (sender, data) in batch.into_iter().rev() {
+            port.queued_bytes += data.len();
+            port.queue.push_front(PortMessage { sender, data });
+        }
+
+        port.settle(pid, &mut replies);
+    }
+
+    replies
+}
+
+/// Removes a thread that has exited from every port that it was parked in. Messages that
+/// it has already queued stay in their ports. Removing a blocked sender may make room for
+/// the senders behind it, so this returns the replies that have become due.
+
+pub fn release_thread(tid: Tid) -> Vec<Reply> {
+    let mut table = PORT_TABLE.lock();
+    let mut replies = Vec::new();
+
+    for (cpid, port) in table.ports.iter_mut() {
+        port.receivers.retain(|receiver| receiver.tid != tid);
+        port.blocked_senders.retain(|message| message.sender != tid);
+        port.settle(Pid::new(*cpid), &mut replies);
+    }
+
+    replies
+}
+
+/// Lays out a batch of messages the way that a receiver expects it: the number of messages,
+/// followed by each message's sender, length and data. All values are little-endian.
+
+pub fn encode_batch(batch: &[(Tid, Vec<u8>)]) -> Vec<u8> {
+    let length = BATCH_HEADER_LEN + batch.iter()
+        .map(|(_, data)| RECORD_HEADER_LEN + data.len())
+        .sum::<usize>();
+    let mut buffer = Vec::with_capacity(length);
+
+    buffer.extend_from_slice(&(batch.len() as u32).to_le_bytes());
+
+    for (sender, data) in batch {
+        buffer.extend_from_slice(&CTid::from(*sender).to_le_bytes());
+        buffer.extend_from_slice(&(data.len() as u16).to_le_bytes());
+        buffer.extend_from_slice(data);
+    }
+
+    buffer
 }
 
 #[cfg(test)]
 mod test {
-    use super::Pid;
+    use super::*;
+
+    const CREATOR_PMAP: PageMapBase = 0x100000;
+    const OTHER_PMAP: PageMapBase = 0x200000;
+
+    fn tid(id: CTid) -> Tid {
+        Tid::new(id).unwrap()
+    }
 
     #[test]
     fn test_null() {
@@ -150,4 +490,137 @@ mod test {
         assert!(!Pid::new(7000).is_null());
         assert!(!Pid::new(28529).is_null());
     }
+
+    #[test]
+    fn test_batched_receive() {
+        let pid = create(Pid::new(100), tid(1000), CREATOR_PMAP, Port::PUBLIC).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + 2 * (RECORD_HEADER_LEN + MAX_MESSAGE_LEN);
+
+        for i in 0..3u8 {
+            assert_eq!(send(pid, tid(1001), OTHER_PMAP, vec![i], 0), Ok(vec![Reply::Sent(tid(1001))]));
+        }
+
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 2, buffer_len, 0),
+                   Ok(vec![Reply::Received(pid, tid(1000), vec![(tid(1001), vec![0]), (tid(1001), vec![1])])]));
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 2, buffer_len, NO_BLOCK),
+                   Ok(vec![Reply::Received(pid, tid(1000), vec![(tid(1001), vec![2])])]));
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 2, buffer_len, NO_BLOCK),
+                   Ok(vec![Reply::Received(pid, tid(1000), vec![])]));
+    }
+
+    #[test]
+    fn test_parked_receivers() {
+        let pid = create(Pid::new(101), tid(1000), CREATOR_PMAP, Port::PUBLIC).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + RECORD_HEADER_LEN + MAX_MESSAGE_LEN;
+
+        // Two threads of a server's pool wait on the port. Each message goes to the receiver
+        // that has waited the longest.
+
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 4, buffer_len, 0), Ok(vec![]));
+        assert_eq!(receive(pid, tid(1002), CREATOR_PMAP, 4, buffer_len, 0), Ok(vec![]));
+        assert_eq!(send(pid, tid(1001), OTHER_PMAP, vec![1, 2], 0),
+                   Ok(vec![Reply::Sent(tid(1001)), Reply::Received(pid, tid(1000), vec![(tid(1001), vec![1, 2])])]));
+        assert_eq!(send(pid, tid(1003), OTHER_PMAP, vec![3], 0),
+                   Ok(vec![Reply::Sent(tid(1003)), Reply::Received(pid, tid(1002), vec![(tid(1003), vec![3])])]));
+    }
+
+    #[test]
+    fn test_full_port() {
+        let pid = create(Pid::new(102), tid(1000), CREATOR_PMAP, Port::PUBLIC).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + RECORD_HEADER_LEN + MAX_MESSAGE_LEN;
+
+        for _ in 0..MAX_QUEUED_MESSAGES {
+            assert!(send(pid, tid(1001), OTHER_PMAP, vec![0], 0).is_ok());
+        }
+
+        assert_eq!(send(pid, tid(1001), OTHER_PMAP, vec![1], NO_BLOCK), Err(Error::WouldBlock));
+        assert_eq!(send(pid, tid(1002), OTHER_PMAP, vec![2], 0), Ok(vec![]));
+
+        // Taking a message out makes room for the blocked sender
+
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 1, buffer_len, 0),
+                   Ok(vec![Reply::Received(pid, tid(1000), vec![(tid(1001), vec![0])]), Reply::Sent(tid(1002))]));
+    }
+
+    #[test]
+    fn test_permissions() {
+        let pid = create(Pid::null().into(), tid(1000), CREATOR_PMAP, 0).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + RECORD_HEADER_LEN + MAX_MESSAGE_LEN;
+
+        assert!(!pid.is_null());
+        assert_eq!(create(pid, tid(1000), CREATOR_PMAP, 0), Err(Error::AlreadyRegistered));
+        assert_eq!(send(pid, tid(1001), OTHER_PMAP, vec![0], 0), Err(Error::NotPermitted));
+        assert_eq!(send(pid, tid(1000), CREATOR_PMAP, vec![0; MAX_MESSAGE_LEN + 1], 0), Err(Error::TooLong));
+        assert_eq!(receive(pid, tid(1004), CREATOR_PMAP, 1, buffer_len - 1, 0), Err(Error::TooLong));
+
+        // Another thread in the creator's address space waits on the port
+
+        assert_eq!(receive(pid, tid(1004), CREATOR_PMAP, 1, buffer_len, 0), Ok(vec![]));
+        assert_eq!(destroy(pid, tid(1004)), Err(Error::NotPermitted));
+        assert_eq!(destroy(pid, tid(1000)), Ok(vec![Reply::ReceiveFailed(tid(1004))]));
+        assert_eq!(send(pid, tid(1000), CREATOR_PMAP, vec![0], 0), Err(Error::InvalidPort));
+    }
+
+    #[test]
+    fn test_requeue() {
+        let pid = create(Pid::new(103), tid(1000), CREATOR_PMAP, Port::PUBLIC).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + 2 * (RECORD_HEADER_LEN + MAX_MESSAGE_LEN);
+
+        for i in 0..3u8 {
+            assert!(send(pid, tid(1001), OTHER_PMAP, vec![i], 0).is_ok());
+        }
+
+        // A batch that couldn't be delivered goes to the next receiver in its original order
+
+        assert_eq!(receive(pid, tid(1000), CREATOR_PMAP, 2, buffer_len, 0),
+                   Ok(vec![Reply::Received(pid, tid(1000), vec![(tid(1001), vec![0]), (tid(1001), vec![1])])]));
+        assert_eq!(requeue(pid, vec![(tid(1001), vec![0]), (tid(1001), vec![1])]), vec![]);
+        assert_eq!(receive(pid, tid(1002), CREATOR_PMAP, 4, buffer_len, 0),
+                   Ok(vec![Reply::Received(pid, tid(1002),
+                                           vec![(tid(1001), vec![0]), (tid(1001), vec![1]), (tid(1001), vec![2])])]));
+
+        // A parked receiver gets a requeued batch right away
+
+        assert_eq!(receive(pid, tid(1002), CREATOR_PMAP, 4, buffer_len, 0), Ok(vec![]));
+        assert_eq!(requeue(pid, vec![(tid(1001), vec![3])]),
+                   vec![Reply::Received(pid, tid(1002), vec![(tid(1001), vec![3])])]);
+
+        assert_eq!(destroy(pid, tid(1000)), Ok(vec![]));
+        assert_eq!(requeue(pid, vec![(tid(1001), vec![4])]), vec![]);
+    }
+
+    #[test]
+    fn test_release_thread() {
+        let pid = create(Pid::new(104), tid(2000), CREATOR_PMAP, Port::PUBLIC).unwrap();
+        let buffer_len = BATCH_HEADER_LEN + RECORD_HEADER_LEN + MAX_MESSAGE_LEN;
+
+        // A receiver that exits while parked no longer takes messages
+
+        assert_eq!(receive(pid, tid(2001), CREATOR_PMAP, 1, buffer_len, 0), Ok(vec![]));
+        assert_eq!(receive(pid, tid(2002), CREATOR_PMAP, 1, buffer_len, 0), Ok(vec![]));
+        assert_eq!(release_thread(tid(2001)), vec![]);
+        assert_eq!(send(pid, tid(2003), OTHER_PMAP, vec![1], 0),
+                   Ok(vec![Reply::Sent(tid(2003)), Reply::Received(pid, tid(2002), vec![(tid(2003), vec![1])])]));
+
+        // Nor does a sender that exits while parked send its message. The senders behind it
+        // move up.
+
+        let message_len = MAX_QUEUED_BYTES / MAX_QUEUED_MESSAGES;
+
+        for _ in 0..MAX_QUEUED_MESSAGES - 1 {
+            assert!(send(pid, tid(2003), OTHER_PMAP, vec![0; message_len], 0).is_ok());
+        }
+
+        assert_eq!(send(pid, tid(2004), OTHER_PMAP, vec![0; MAX_MESSAGE_LEN], 0), Ok(vec![]));
+        assert_eq!(send(pid, tid(2005), OTHER_PMAP, vec![5], 0), Ok(vec![]));
+        assert_eq!(release_thread(tid(2004)), vec![Reply::Sent(tid(2005))]);
+        assert_eq!(destroy(pid, tid(2000)), Ok(vec![]));
+    }
+
+    #[test]
+    fn test_encode_batch() {
+        assert_eq!(encode_batch(&[]), vec![0, 0, 0, 0]);
+        assert_eq!(encode_batch(&[(tid(0x1234), vec![7, 8]), (tid(2), vec![9])]),
+                   vec![2, 0, 0, 0, 0x34, 0x12, 2, 0, 7, 8, 2, 0, 1, 0, 9]);
+    }
 }
\ No newline at end of file
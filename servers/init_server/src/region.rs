@@ -2,6 +2,8 @@ use num_traits::Num;
 use core::ops::{Index, Not};
 use alloc::vec::IntoIter;
 use alloc::vec::Vec;
+use alloc::collections::btree_map::BTreeMap;
+use alloc::collections::btree_set::BTreeSet;
 use crate::error::Error;
 use core::cmp::{PartialOrd, Ord, Ordering};
 
@@ -375,9 +377,155 @@ impl<A> Index<usize> for RegionSet<A>
     }
 }
 
+/// An index of the free ranges of an address space.
+///
+/// Free ranges are kept in two trees: one that's ordered by start address (for finding
+/// and coalescing neighbors) and one that's ordered by length (for best-fit placement). All
+/// operations are O(log n) in the number of free ranges. Ranges are half-open (`[start, end)`).
+
+pub struct FreeRangeIndex {
+    by_start: BTreeMap<usize, usize>,
+    by_length: BTreeSet<(usize, usize)>,
+}
+
+impl FreeRangeIndex {
+    /// Creates an index where `[start, end)` is entirely free.
+
+    pub fn new(start: usize, end: usize) -> Self {
+        let mut index = Self {
+            by_start: BTreeMap::new(),
+            by_length: BTreeSet::new(),
+        };
+
+        index.insert(start, end);
+        index
+    }
+
+    fn add_range(&mut self, start: usize, end: usize) {
+        self.by_start.insert(start, end);
+        self.by_length.insert((end - start, start));
+    }
+
+    fn remove_range(&mut self, start: usize) -> Option<usize> {
+        self.by_start.remove(&start)
+            .map(|end| {
+                self.by_length.remove(&(end - start, start));
+                end
+            })
+    }
+
+    /// Returns the free range that contains `addr`, if there is one.
+
+    pub fn get(&self, addr: usize) -> Option<(usize, usize)> {
+        self.by_start.range(..=addr)
+            .next_back()
+            .filter(|&(_, &end)| addr < end)
+            .map(|(&start, &end)| (start, end))
+    }
+
+    /// Returns `true` if all of `[start, end)` is free.
+
+    pub fn is_free(&self, start: usize, end: usize) -> bool {
+        start >= end || self.get(start).map_or(false, |(_, free_end)| end <= free_end)
+    }
+
+    /// Marks `[start, end)` as free, merging it with any adjacent free ranges.
+    /// The range must not overlap a range that's already free.
+
+    pub fn insert(&mut self, mut start: usize, mut end: usize) {
+        if start >= end {
+            return;
+        }
+
+        let prev = self.by_start.range(..start)
+            .next_back()
+            .map(|(&s, &e)| (s, e));
+
+        if let Some((prev_start, prev_end)) = prev {
+            if prev_end == start {
+                self.remove_range(prev_start);
+                start = prev_start;
+            }
+        }
+
+        if let Some(next_end) = self.remove_range(end) {
+            end = next_end;
+        }
+
+        self.add_range(start, end);
+    }
+
+    /// Marks `[start, end)` as used. Returns `false` (and changes nothing) if some part of the
+    /// range isn't free.
+
+    pub fn remove(&mut self, start: usize, end: usize) -> bool {
+        if start >= end {
+            return true;
+        }
+
+        match self.get(start) {
+            Some((free_start, free_end)) if end <= free_end => {
+                self.remove_range(free_start);
+
+                if free_start < start {
+                    self.add_range(free_start, start);
+                }
+
+                if end < free_end {
+                    self.add_range(end, free_end);
+                }
+
+                true
+            },
+            _ => false,
+        }
+    }
+
+    /// Finds the smallest free range that can hold `length` bytes starting at a multiple
+    /// of `alignment` (which must be a power of two). Returns the aligned start address.
+
+    pub fn find_best_fit(&self, length: usize, alignment: usize) -> Option<usize> {
+        if length == 0 {
+            return None;
+        }
+
+        let alignment = alignment.max(1);
+
+        self.by_length.range((length, 0)..)
+            .find_map(|&(_, start)| {
+                let end = self.by_start[&start];
+                let aligned_start = start.checked_add(alignment - 1)? & !(alignment - 1);
+
+                aligned_start.checked_add(length)
+                    .filter(|&new_end| new_end <= end)
+                    .map(|_| aligned_start)
+            })
+    }
+
+    /// Finds a best-fit range for `length` bytes (see `find_best_fit()`) and marks it as used.
+
+    pub fn allocate(&mut self, length: usize, alignment: usize) -> Option<usize> {
+        self.find_best_fit(length, alignment)
+            .map(|start| {
+                self.remove(start, start + length);
+                start
+            })
+    }
+
+    /// Returns the number of disjoint free ranges.
+
+    pub fn len(&self) -> usize {
+        self.by_start.len()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item=(usize, usize)> + '_ {
+        self.by_start.iter().map(|(&start, &end)| (start, end))
+    }
+}
+
 #[cfg(test)]
 mod test {
-    use super::{MemoryRegion, RegionSet};
+    use super::{FreeRangeIndex, MemoryRegion, RegionSet};
     use crate::address::{self, VAddr};
     use crate::error;
 
@@ -483,4 +631,39 @@ mod test {
         assert_eq!(region_set3.disjoint_count(), 1);
         assert_eq!(&region_set3[0], &MemoryRegion::new(0x200000, 0x300000));
     }
-}
\ No newline at end of file
+
+    #[test]
+    fn test_free_range_index() {
+        let mut index = FreeRangeIndex::new(0x1000, 0x100000);
+
+        assert!(index.remove(0x10000, 0x20000));
+        assert!(!index.remove(0x18000, 0x19000));
+        assert_eq!(index.len(), 2);
+        assert!(index.is_free(0x1000, 0x10000));
+        assert!(!index.is_free(0xF000, 0x11000));
+
+        index.insert(0x10000, 0x20000);
+
+        assert_eq!(index.len(), 1);
+        assert_eq!(index.get(0x18000), Some((0x1000, 0x100000)));
+    }
+
+    #[test]
+    fn test_free_range_best_fit() {
+        let mut index = FreeRangeIndex::new(0x1000, 0x100000);
+
+        assert!(index.remove(0x3000, 0x10000));
+        assert!(index.remove(0x12000, 0x80000));
+
+        // Free ranges: [0x1000, 0x3000), [0x10000, 0x12000), [0x80000, 0x100000)
+
+        assert_eq!(index.find_best_fit(0x2000, 0x1000), Some(0x1000));
+        assert_eq!(index.find_best_fit(0x2000, 0x10000), Some(0x10000));
+        assert_eq!(index.find_best_fit(0x3000, 0x1000), Some(0x80000));
+        assert_eq!(index.find_best_fit(0x100000, 0x1000), None);
+
+        assert_eq!(index.allocate(0x1000, 0x1000), Some(0x1000));
+        assert_eq!(index.get(0x1000), None);
+        assert_eq!(index.get(0x2000), Some((0x2000, 0x3000)));
+    }
+}
@@ -0,0 +1,335 @@
+#![allow(dead_code)]
+
+//! Reverse mappings from frames to the pages that map them.
+//!
+//! Every frame that the pager maps into an address space is recorded along with the
+//! address space and page that it's mapped at, so that all of a frame's mappings can be
+//! found without walking every address space. Most frames are only mapped once, so a
+//! frame's mappers are kept inline until it's shared. A second index from pages to frames
+//! lets a mapping be dropped when only its address is known.
+//!
+//! Frames that the kernel zero-fills on its own for anonymous regions are private to a
+//! single page, so they're only recorded once the pager shares, moves or remaps them. Every
+//! frame that has more than one reference has all of its mappers recorded. A large page is
+//! recorded once, at its first page.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use core::slice;
+use rust::syscalls::flags;
+use crate::address::PAddr;
+use crate::error::Error;
+use crate::lowlevel;
+use crate::mutex::Mutex;
+use crate::page::{FrameSize, PageMapBase};
+use crate::phys_alloc::{self, BlockSize};
+use crate::swap;
+
+/// An address space and the address of a page in it.
+pub type Mapper = (PageMapBase, usize);
+
+// The flags of a mapping that are carried over when it's moved to another frame
+const KEPT_FLAGS: u32 = flags::mapping::READ_ONLY | flags::mapping::UNCACHED | flags::mapping::WRITE_THRU
+    | flags::mapping::DIRTY;
+
+enum Mappers {
+    One(Mapper),
+    Many(Vec<Mapper>),
+}
+
+impl Mappers {
+    fn as_slice(&self) -> &[Mapper] {
+        match self {
+            Mappers::One(mapper) => slice::from_ref(mapper),
+            Mappers::Many(mappers) => mappers,
+        }
+    }
+
+    fn add(&mut self, mapper: Mapper) {
+        match self {
+            Mappers::One(first) => *self = Mappers::Many(vec![*first, mapper]),
+            Mappers::Many(mappers) => mappers.push(mapper),
+        }
+    }
+
+    /// Removes a mapper. Returns `true` if no mappers are left.
+
+    fn remove(&mut self, mapper: Mapper) -> bool {
+        match self {
+            Mappers::One(first) => *first == mapper,
+            Mappers::Many(mappers) => {
+                mappers.retain(|m| *m != mapper);
+
+                match mappers[..] {
+                    [] => true,
+                    [last] => {
+                        *self = Mappers::One(last);
+                        false
+                    },
+                    _ => false,
+                }
+            },
+        }
+    }
+}
+
+struct ReverseMap {
+    frames: BTreeMap<PAddr, Mappers>,
+    pages: BTreeMap<Mapper, PAddr>,
+}
+
+impl ReverseMap {
+    const fn new() -> Self {
+        Self {
+            frames: BTreeMap::new(),
+            pages: BTreeMap::new(),
+        }
+    }
+
+    /// Records that `frame` is mapped at a page. Whatever frame the page was mapped to
+    /// before is forgotten.
+
+    fn insert(&mut self, frame: PAddr, mapper: Mapper) {
+        match self.pages.insert(mapper, frame) {
+            Some(old_frame) if old_frame == frame => return,
+            Some(old_frame) => self.remove_mapper(old_frame, mapper),
+            None => (),
+        }
+
+        match self.frames.get_mut(&frame) {
+            Some(mappers) => mappers.add(mapper),
+            None => {
+                self.frames.insert(frame, Mappers::One(mapper));
+            },
+        }
+    }
+
+    /// Forgets the mapping of a page. Returns the frame that it was mapped to.
+
+    fn remove(&mut self, mapper: Mapper) -> Option<PAddr> {
+        let frame = self.pages.remove(&mapper)?;
+
+        self.remove_mapper(frame, mapper);
+        Some(frame)
+    }
+
+    fn remove_mapper(&mut self, frame: PAddr, mapper: Mapper) {
+        if self.frames.get_mut(&frame).map_or(false, |mappers| mappers.remove(mapper)) {
+            self.frames.remove(&frame);
+        }
+    }
+
+    /// Forgets the mappings of the pages in `[start, end)` of an address space. Returns the
+    /// pages along with the frames that they were mapped to.
+
+    fn remove_range(&mut self, root_pmap: PageMapBase, start: usize, end: usize) -> Vec<(usize, PAddr)> {
+        let removed = self.pages.range((root_pmap, start)..(root_pmap, end))
+            .map(|(&(_, page), &frame)| (page, frame))
+            .collect::<Vec<_>>();
+
+        for (page, frame) in removed.iter() {
+            self.pages.remove(&(root_pmap, *page));
+            self.remove_mapper(*frame, (root_pmap, *page));
+        }
+
+        removed
+    }
+
+    fn mappers(&self, frame: PAddr) -> &[Mapper] {
+        self.frames.get(&frame)
+            .map_or(&[], |mappers| mappers.as_slice())
+    }
+
+    /// Records every mapping of `old_frame` as a mapping of `new_frame` instead.
+
+    fn move_frame(&mut self, old_frame: PAddr, new_frame: PAddr) {
+        if let Some(mappers) = self.frames.remove(&old_frame) {
+            for mapper in mappers.as_slice() {
+                self.pages.insert(*mapper, new_frame);
+            }
+
+            self.frames.insert(new_frame, mappers);
+        }
+    }
+}
+
+static REVERSE_MAP: Mutex<ReverseMap> = Mutex::new(ReverseMap::new());
+
+/// Records that `frame` has been mapped at `page` in the address space of `root_pmap`.
+
+pub fn map(frame: PAddr, root_pmap: PageMapBase, page: usize) {
+    REVERSE_MAP.lock().insert(frame, (root_pmap, page));
+}
+
+/// Forgets the mapping of `page`. Returns the frame that it was mapped to, if known.
+
+pub fn unmap(root_pmap: PageMapBase, page: usize) -> Option<PAddr> {
+    REVERSE_MAP.lock().remove((root_pmap, page))
+}
+
+/// Forgets the mappings of the pages in `[start, end)` of an address space. Returns the
+/// pages that were recorded along with their frames.
+
+pub fn unmap_range(root_pmap: PageMapBase, start: usize, end: usize) -> Vec<(usize, PAddr)> {
+    REVERSE_MAP.lock().remove_range(root_pmap, start, end)
+}
+
+/// Returns every recorded page that maps `frame`.
+
+pub fn mappers(frame: PAddr) -> Vec<Mapper> {
+    REVERSE_MAP.lock().mappers(frame).to_vec()
+}
+
+/// Unmaps a 4 KiB frame from every page that maps it and drops each mapping's reference to
+/// the frame. Returns the number of mappings that were removed.
+
+pub fn unmap_frame(frame: PAddr) -> usize {
+    let mappers = mappers(frame);
+
+    for &(root_pmap, page) in mappers.iter() {
+        let _ = unsafe { lowlevel::unmap(Some(root_pmap), page as *mut ()) };
+
+        REVERSE_MAP.lock().remove((root_pmap, page));
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+
+    mappers.len()
+}
+
+/// Moves the contents of a 4 KiB frame into a new frame and remaps every page that maps it.
+/// Returns the new frame.
+///
+/// Every reference to the frame must belong to a recorded mapping. The pages are
+/// write-protected while the frame is being copied, so a write in the meantime faults and
+/// is retried once the page has been remapped.
+
+pub fn migrate_frame(frame: PAddr) -> Result<PAddr, Error> {
+    let mappers = mappers(frame);
+
+    if mappers.is_empty() || phys_alloc::phys_ref_count(frame) as usize != mappers.len() {
+        return Err(Error::NotPermitted);
+    }
+
+    let mut page_flags = Vec::with_capacity(mappers.len());
+
+    for &(root_pmap, page) in mappers.iter() {
+        let (mapped_frame, mapping_flags) = unsafe { lowlevel::lookup(Some(root_pmap), page as *const ()) }
+            .map_err(|_| Error::Failed)?;
+
+        if mapped_frame.address() != frame || mapped_frame.frame_size() != FrameSize::Small
+            || rust::is_flag_set!(mapping_flags, flags::mapping::UNMAPPED) {
+            return Err(Error::Failed);
+        }
+
+        page_flags.push(mapping_flags & KEPT_FLAGS);
+    }
+
+    let new_frame = swap::alloc_frame()?;
+
+    let result = mappers.iter()
+        .zip(page_flags.iter())
+        .try_for_each(|(&(root_pmap, page), &kept_flags)| unsafe {
+            lowlevel::map(Some(root_pmap), page as *mut c_void, frame,
+                          kept_flags | flags::mapping::READ_ONLY | flags::mapping::OVERWRITE)
+                .map(|_| ())
+                .map_err(|_| Error::Failed)
+        })
+        .and_then(|_| unsafe { lowlevel::phys::copy_frame(new_frame, frame) });
+
+    let target = if result.is_ok() { new_frame } else { frame };
+
+    // Either every page moves to the new frame or every page is put back as it was
+
+    for (&(root_pmap, page), &kept_flags) in mappers.iter().zip(page_flags.iter()) {
+        let _ = unsafe { lowlevel::map(Some(root_pmap), page as *mut c_void, target,
+                                       kept_flags | flags::mapping::OVERWRITE) };
+    }
+
+    match result {
+        Ok(_) => {
+            for _ in 1..mappers.len() {
+                phys_alloc::ref_phys(new_frame);
+            }
+
+            for _ in 0..mappers.len() {
+                phys_alloc::release_phys(frame, BlockSize::Block4k);
+            }
+
+            REVERSE_MAP.lock().move_frame(frame, new_frame);
+            Ok(new_frame)
+        },
+        Err(e) => {
+            swap::release_frame(new_frame);
+            Err(e)
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_insert_remove() {
+        let mut rmap = ReverseMap::new();
+
+        rmap.insert(0x5000, (0x1000, 0x400000));
+        rmap.insert(0x5000, (0x2000, 0x400000));
+        rmap.insert(0x5000, (0x2000, 0x400000));
+
+        assert_eq!(rmap.mappers(0x5000), &[(0x1000, 0x400000), (0x2000, 0x400000)]);
+
+        assert_eq!(rmap.remove((0x1000, 0x400000)), Some(0x5000));
+        assert_eq!(rmap.remove((0x1000, 0x400000)), None);
+        assert_eq!(rmap.mappers(0x5000), &[(0x2000, 0x400000)]);
+
+        assert_eq!(rmap.remove((0x2000, 0x400000)), Some(0x5000));
+        assert!(rmap.frames.is_empty());
+        assert!(rmap.pages.is_empty());
+    }
+
+    #[test]
+    fn test_remap_page() {
+        let mut rmap = ReverseMap::new();
+
+        rmap.insert(0x5000, (0x1000, 0x400000));
+        rmap.insert(0x5000, (0x2000, 0x400000));
+
+        // A copy-on-write fault gives one side its own frame
+        rmap.insert(0x9000, (0x2000, 0x400000));
+
+        assert_eq!(rmap.mappers(0x5000), &[(0x1000, 0x400000)]);
+        assert_eq!(rmap.mappers(0x9000), &[(0x2000, 0x400000)]);
+    }
+
+    #[test]
+    fn test_remove_range() {
+        let mut rmap = ReverseMap::new();
+
+        for i in 0..8 {
+            rmap.insert(0x10000 + i * 0x1000, (0x1000, 0x400000 + i as usize * 0x1000));
+            rmap.insert(0x10000 + i * 0x1000, (0x2000, 0x400000 + i as usize * 0x1000));
+        }
+
+        let removed = rmap.remove_range(0x1000, 0x402000, 0x404000);
+
+        assert_eq!(removed, vec![(0x402000, 0x12000), (0x403000, 0x13000)]);
+        assert_eq!(rmap.mappers(0x12000), &[(0x2000, 0x402000)]);
+        assert_eq!(rmap.mappers(0x14000), &[(0x1000, 0x404000), (0x2000, 0x404000)]);
+        assert_eq!(rmap.pages.len(), 14);
+    }
+
+    #[test]
+    fn test_move_frame() {
+        let mut rmap = ReverseMap::new();
+
+        rmap.insert(0x5000, (0x1000, 0x400000));
+        rmap.insert(0x5000, (0x2000, 0x800000));
+        rmap.move_frame(0x5000, 0x7000);
+
+        assert_eq!(rmap.mappers(0x5000), &[]);
+        assert_eq!(rmap.mappers(0x7000), &[(0x1000, 0x400000), (0x2000, 0x800000)]);
+        assert_eq!(rmap.remove((0x2000, 0x800000)), Some(0x7000));
+    }
+}
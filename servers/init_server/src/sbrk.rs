@@ -7,11 +7,18 @@ use crate::page::PhysicalFrame;
 use crate::page::VirtualPage;
 use crate::phys_alloc::{self, BlockSize};
 use crate::lowlevel;
+use crate::mutex::Mutex;
 use rust::syscalls::flags::mapping::PAGE_SIZED;
 use rust::syscalls::SyscallError;
 use core;
 
 static mut HEAP_REGION: Option<HeapRegion> = None;
+
+// Serializes changes to the end of the heap. Growing the heap takes the physical allocator's
+// lock while this is held, so it must not be taken by code that holds the heap allocator's
+// lock (see `heap`).
+static GROWTH_LOCK: Mutex<()> = Mutex::new(());
+
 const MFAIL: * const c_void = -1isize as * const c_void;
 const MIN_INCREMENT: usize = 128*1024;
 const MAX_UNUSED_LEN: usize = 262144;
@@ -306,8 +313,31 @@ impl HeapRegion {
     }
 }
 
+/// Extends the heap by `length` bytes, starting at the next page boundary. Returns the start
+/// of the new memory.
+
+pub fn extend_pages(length: usize) -> Option<usize> {
+    let _guard = GROWTH_LOCK.lock();
+
+    unsafe {
+        if HEAP_REGION.is_none() {
+            HeapRegion::init();
+        }
+    }
+
+    // The heap's end may not be page-aligned if anything else has moved it
+    let end = heap().end;
+    let padding = end.align(VirtualPage::SMALL_PAGE_SIZE) - end;
+
+    heap_mut().increment_end((padding + length) as isize)
+        .ok()
+        .map(|prev_end| prev_end + padding)
+}
+
 #[no_mangle]
 extern "C" fn sbrk(increment: isize) -> * mut c_void {
+    let _guard = GROWTH_LOCK.lock();
+
     unsafe {
         if HEAP_REGION.is_none() {
             HeapRegion::init();
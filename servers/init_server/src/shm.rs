@@ -0,0 +1,319 @@
+//! Shared memory objects.
+//!
+//! A shared memory object is a run of zero-filled pages that can be mapped into several
+//! address spaces at once, at different addresses and with different protections. Each object
+//! is a minor of the shared memory device, so it's mapped with an ordinary map request. A page
+//! of the object gets its frame the first time that it's touched through any mapping.
+//!
+//! An object holds a reference to each of its frames and every page that maps a frame holds
+//! another one. The object itself stays alive while its creator holds on to it or while any
+//! mapping of it is left. Once both are gone, the object drops its frame references, so each
+//! frame is freed as soon as the last page that maps it goes away.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use rust::align::Align;
+use crate::address::PAddr;
+use crate::device::{self, DeviceId, DeviceMinor};
+use crate::error::Error;
+use crate::lowlevel;
+use crate::mutex::Mutex;
+use crate::page::{PageMapBase, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::swap;
+
+struct SharedObject {
+    // The address space that created the object, until it destroys its handle
+    owner: Option<PageMapBase>,
+    length: u64,
+
+    // Committed frames keyed by their offset into the object
+    frames: BTreeMap<u64, PAddr>,
+    map_count: usize,
+}
+
+impl SharedObject {
+    fn is_alive(&self) -> bool {
+        self.owner.is_some() || self.map_count > 0
+    }
+
+    fn into_frames(self) -> Vec<PAddr> {
+        self.frames.into_iter()
+            .map(|(_, frame)| frame)
+            .collect()
+    }
+}
+
+struct ObjectTable {
+    objects: BTreeMap<DeviceMinor, SharedObject>,
+
+    // The handle that the next search for an unused handle starts at
+    next_handle: DeviceMinor,
+}
+
+impl ObjectTable {
+    const fn new() -> Self {
+        Self {
+            objects: BTreeMap::new(),
+            next_handle: 0,
+        }
+    }
+
+    fn create(&mut self, owner: PageMapBase, length: u64) -> Result<DeviceMinor, Error> {
+        if length == 0 {
+            return Err(Error::ZeroLength);
+        }
+
+        let handle = (0..=DeviceMinor::MAX)
+            .map(|i| self.next_handle.wrapping_add(i))
+            .find(|handle| !self.objects.contains_key(handle))
+            .ok_or(Error::OutOfMemory)?;
+
+        self.objects.insert(handle, SharedObject {
+            owner: Some(owner),
+            length: length.align(VirtualPage::SMALL_PAGE_SIZE as u64),
+            frames: BTreeMap::new(),
+            map_count: 0,
+        });
+
+        self.next_handle = handle.wrapping_add(1);
+        Ok(handle)
+    }
+
+    /// Removes an object that is no longer alive. Returns the frames that it held.
+
+    fn reap(&mut self, handle: DeviceMinor) -> Vec<PAddr> {
+        match self.objects.get(&handle) {
+            Some(object) if !object.is_alive() => self.objects.remove(&handle)
+                .map_or(Vec::new(), |object| object.into_frames()),
+            _ => Vec::new(),
+        }
+    }
+
+    /// Drops the creator's handle to an object. Returns the frames of the object if that was
+    /// its last reference.
+
+    fn destroy(&mut self, owner: PageMapBase, handle: DeviceMinor) -> Result<Vec<PAddr>, Error> {
+        let object = self.objects.get_mut(&handle)
+            .ok_or(Error::DoesntExist)?;
+
+        if object.owner != Some(owner) {
+            return Err(Error::NotPermitted);
+        }
+
+        object.owner = None;
+        Ok(self.reap(handle))
+    }
+
+    /// Drops the handles of every object that an address space created.
+
+    fn destroy_owned(&mut self, owner: PageMapBase) -> Vec<PAddr> {
+        let owned = self.objects.iter()
+            .filter(|(_, object)| object.owner == Some(owner))
+            .map(|(handle, _)| *handle)
+            .collect::<Vec<_>>();
+
+        owned.into_iter()
+            .flat_map(|handle| self.destroy(owner, handle).unwrap_or_default())
+            .collect()
+    }
+
+    /// Returns `true` if `[offset, offset + length)` lies within an object.
+
+    fn contains(&self, handle: DeviceMinor, offset: u64, length: u64) -> bool {
+        self.objects.get(&handle)
+            .map_or(false, |object| offset.is_aligned(VirtualPage::SMALL_PAGE_SIZE as u64)
+                && offset.checked_add(length).map_or(false, |end| end <= object.length))
+    }
+
+    fn attach(&mut self, handle: DeviceMinor) {
+        if let Some(object) = self.objects.get_mut(&handle) {
+            object.map_count += 1;
+        }
+    }
+
+    fn detach(&mut self, handle: DeviceMinor) -> Vec<PAddr> {
+        match self.objects.get_mut(&handle) {
+            Some(object) if object.map_count > 0 => {
+                object.map_count -= 1;
+                self.reap(handle)
+            },
+            _ => Vec::new(),
+        }
+    }
+}
+
+static OBJECT_TABLE: Mutex<ObjectTable> = Mutex::new(ObjectTable::new());
+
+fn release_frames(frames: Vec<PAddr>) {
+    for frame in frames {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+}
+
+/// Creates an object of `length` bytes on behalf of the address space of `owner`. Returns the
+/// device that maps the object.
+
+pub fn create(owner: PageMapBase, length: u64) -> Result<DeviceId, Error> {
+    OBJECT_TABLE.lock().create(owner, length)
+        .map(|handle| DeviceId::new_from_tuple((device::shm::MAJOR, handle)))
+}
+
+/// Drops the handle that `owner` got when it created an object. The object lives on until it
+/// has been unmapped everywhere.
+
+pub fn destroy(owner: PageMapBase, device: &DeviceId) -> Result<(), Error> {
+    if device.major != device::shm::MAJOR {
+        return Err(Error::BadArgument);
+    }
+
+    let released = OBJECT_TABLE.lock().destroy(owner, device.minor);
+
+    released.map(release_frames)
+}
+
+/// Drops the handles of every object that was created by an address space that's going away.
+
+pub fn destroy_owned(owner: PageMapBase) {
+    let released = OBJECT_TABLE.lock().destroy_owned(owner);
+
+    release_frames(released);
+}
+
+/// Returns `true` if `length` bytes at `offset` of an object may be mapped.
+
+pub fn contains(device: &DeviceId, offset: u64, length: usize) -> bool {
+    device.major == device::shm::MAJOR
+        && OBJECT_TABLE.lock().contains(device.minor, offset, length as u64)
+}
+
+/// Records a new mapping of an object.
+
+pub fn attach(device: &DeviceId) {
+    OBJECT_TABLE.lock().attach(device.minor);
+}
+
+/// Records that a mapping of an object has gone away.
+
+pub fn detach(device: &DeviceId) {
+    let released = OBJECT_TABLE.lock().detach(device.minor);
+
+    release_frames(released);
+}
+
+/// Returns the frame of the page at `offset` in an object, with a reference taken for the
+/// page that's about to map it. A page that hasn't been touched yet gets a cleared frame.
+
+pub fn map_frame(device: &DeviceId, offset: u64) -> Result<PAddr, Error> {
+    let offset = offset.align_trunc(VirtualPage::SMALL_PAGE_SIZE as u64);
+
+    if let Some(frame) = committed_frame(device, offset)? {
+        return Ok(frame);
+    }
+
+    // The table isn't kept locked while the frame is allocated, since that may have to
+    // reclaim memory. Another mapping may commit the page in the meantime.
+
+    let new_frame = swap::alloc_frame()?;
+
+    if let Err(e) = unsafe { lowlevel::phys::clear_frame(new_frame) } {
+        swap::release_frame(new_frame);
+        return Err(e);
+    }
+
+    let frame = {
+        let mut table = OBJECT_TABLE.lock();
+        let object = table.objects.get_mut(&device.minor)
+            .filter(|object| offset < object.length);
+
+        object.map(|object| {
+            let frame = *object.frames.entry(offset).or_insert(new_frame);
+
+            phys_alloc::ref_phys(frame);
+            frame
+        })
+    };
+
+    match frame {
+        Some(frame) => {
+            if frame != new_frame {
+                swap::release_frame(new_frame);
+            }
+
+            Ok(frame)
+        },
+        None => {
+            swap::release_frame(new_frame);
+            Err(Error::DoesntExist)
+        },
+    }
+}
+
+/// Returns the frame of a page that has already been committed, with a reference taken.
+
+fn committed_frame(device: &DeviceId, offset: u64) -> Result<Option<PAddr>, Error> {
+    let table = OBJECT_TABLE.lock();
+    let object = table.objects.get(&device.minor)
+        .filter(|object| offset < object.length)
+        .ok_or(Error::DoesntExist)?;
+
+    Ok(object.frames.get(&offset)
+        .map(|frame| {
+            phys_alloc::ref_phys(*frame);
+            *frame
+        }))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_create_destroy() {
+        let mut table = ObjectTable::new();
+
+        assert_eq!(table.create(0x1000, 0), Err(Error::ZeroLength));
+
+        let handle = table.create(0x1000, 0x1800).unwrap();
+
+        assert_eq!(table.objects[&handle].length, 0x2000);
+        assert!(table.contains(handle, 0x1000, 0x1000));
+        assert!(!table.contains(handle, 0x1000, 0x1001));
+        assert!(!table.contains(handle, 0x800, 0x800));
+
+        assert_eq!(table.destroy(0x2000, handle), Err(Error::NotPermitted));
+        assert_eq!(table.destroy(0x1000, handle), Ok(vec![]));
+        assert_eq!(table.destroy(0x1000, handle), Err(Error::DoesntExist));
+    }
+
+    #[test]
+    fn test_last_mapping_frees_frames() {
+        let mut table = ObjectTable::new();
+        let handle = table.create(0x1000, 0x4000).unwrap();
+
+        table.objects.get_mut(&handle).unwrap().frames.insert(0x3000, 0x9000);
+        table.attach(handle);
+        table.attach(handle);
+
+        assert_eq!(table.destroy(0x1000, handle), Ok(vec![]));
+        assert_eq!(table.detach(handle), vec![]);
+        assert_eq!(table.detach(handle), vec![0x9000]);
+        assert!(table.objects.is_empty());
+    }
+
+    #[test]
+    fn test_destroy_owned() {
+        let mut table = ObjectTable::new();
+        let first = table.create(0x1000, 0x1000).unwrap();
+        let second = table.create(0x2000, 0x1000).unwrap();
+        let third = table.create(0x1000, 0x1000).unwrap();
+
+        assert_ne!(first, second);
+        table.attach(third);
+
+        assert_eq!(table.destroy_owned(0x1000), vec![]);
+        assert!(!table.objects.contains_key(&first));
+        assert!(table.objects.contains_key(&second));
+        assert_eq!(table.objects[&third].owner, None);
+    }
+}
@@ -0,0 +1,118 @@
+#![allow(dead_code)]
+
+//! Spawn latency benchmark.
+//!
+//! Started with `spawnbench=<module>` on the init server's command line. The module is spawned
+//! `SPAWN_COUNT` times, one instance after another. The first spawn parses the module's
+//! headers, and the rest reuse its cached image. A spawn is timed from the start of loading
+//! until the kernel first reports on the new thread (its first page fault or its exit), which
+//! happens within the thread's first few instructions. A module that exits right away makes
+//! for the most stable numbers.
+
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, Ordering};
+use crate::Tid;
+use crate::elf;
+use crate::lowlevel;
+use crate::multiboot::BootModule;
+use crate::mutex::Mutex;
+
+pub const SPAWN_COUNT: usize = 16;
+
+struct Bench {
+    module: BootModule,
+    pending: Option<(Tid, u64)>,    // The instance that hasn't been seen yet and its start time
+    cycles: Vec<u64>,
+}
+
+static BENCH: Mutex<Option<Bench>> = Mutex::new(None);
+static IS_RUNNING: AtomicBool = AtomicBool::new(false);
+
+/// Starts the benchmark by spawning the first instance of `module`.
+
+pub fn start(module: &BootModule) {
+    let mut bench = BENCH.lock();
+
+    // The first spawn is timed with a cold cache
+    elf::loader::forget_image(module);
+
+    let mut new_bench = Bench {
+        module: module.clone(),
+        pending: None,
+        cycles: Vec::with_capacity(SPAWN_COUNT),
+    };
+
+    if spawn_next(&mut new_bench) {
+        *bench = Some(new_bench);
+        IS_RUNNING.store(true, Ordering::Release);
+    }
+}
+
+#[inline]
+pub fn is_running() -> bool {
+    IS_RUNNING.load(Ordering::Acquire)
+}
+
+/// Notes that the kernel has sent a message about `tid`. If it's the first one about the
+/// latest instance, then that spawn is done and the next one is started.
+
+pub fn observe(tid: &Tid) {
+    let now = lowlevel::read_tsc();
+    let mut bench_guard = BENCH.lock();
+
+    let is_done = match bench_guard.as_mut() {
+        Some(bench) => match bench.pending {
+            Some((pending_tid, start)) if pending_tid == *tid => {
+                bench.pending = None;
+                bench.cycles.push(now.wrapping_sub(start));
+
+                if bench.cycles.len() < SPAWN_COUNT {
+                    !spawn_next(bench)
+                } else {
+                    report(bench);
+                    true
+                }
+            },
+            _ => false,
+        },
+        None => false,
+    };
+
+    if is_done {
+        *bench_guard = None;
+        IS_RUNNING.store(false, Ordering::Release);
+    }
+}
+
+fn spawn_next(bench: &mut Bench) -> bool {
+    let start = lowlevel::read_tsc();
+
+    match elf::loader::load_module(&bench.module) {
+        Ok(tid) => {
+            bench.pending = Some((tid, start));
+            true
+        },
+        Err(_) => {
+            eprintfln!("spawnbench: Unable to spawn module @ {:#x}", bench.module.addr);
+            false
+        },
+    }
+}
+
+fn report(bench: &Bench) {
+    let (cold, warm) = match bench.cycles.split_first() {
+        Some(split) => split,
+        None => return,
+    };
+
+    eprintfln!("spawnbench: {} spawns of module @ {:#x}, in TSC cycles from spawn to first instruction:",
+               bench.cycles.len(), bench.module.addr);
+    eprintfln!("spawnbench:   cold: {}", cold);
+
+    if !warm.is_empty() {
+        eprintfln!("spawnbench:   warm: min {} avg {} max {}",
+                   warm.iter().min().unwrap(),
+                   warm.iter().sum::<u64>() / warm.len() as u64,
+                   warm.iter().max().unwrap());
+    }
+}
@@ -0,0 +1,518 @@
+//! Page reclaim for anonymous memory.
+//!
+//! Resident pages of anonymous mappings are reclaimed with the CLOCK algorithm. The clock
+//! hand sweeps over the pages of every anonymous mapping, one address space after another.
+//! A page that was accessed since the hand last passed it has its accessed bit cleared and
+//! gets a second chance. Otherwise, the page is evicted. A dirty page is compressed into
+//! the compressed pool first, or written to a slot in the swap area if it doesn't fit
+//! there. A clean page either still has an up-to-date copy in its slot or has never been
+//! written to, in which case it will just be zero-filled again.
+
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+use rust::syscalls::flags;
+use crate::address::PAddr;
+use crate::compressed_pool::{self, Handle};
+use crate::device::{self, DeviceId};
+use crate::error::Error;
+use crate::frame_cache;
+use crate::lowlevel;
+use crate::mapping::{self, AddrSpace};
+use crate::mutex::Mutex;
+use crate::page::{FrameSize, PageMapBase, PhysicalFrame, VirtualPage};
+use crate::phys_alloc;
+use crate::rmap;
+
+/// The number of pages to reclaim when a frame allocation fails.
+const RECLAIM_BATCH: usize = 32;
+
+/// Tracks which slots of the swap area are in use.
+
+struct SlotBitmap {
+    words: Vec<u32>,
+    slot_count: usize,
+    free_count: usize,
+
+    // The word where the last search for a free slot stopped
+    next_word: usize,
+}
+
+impl SlotBitmap {
+    fn new(slot_count: usize) -> Self {
+        Self {
+            words: vec![0; (slot_count + 31) / 32],
+            slot_count,
+            free_count: slot_count,
+            next_word: 0,
+        }
+    }
+
+    fn alloc(&mut self) -> Option<u32> {
+        if self.free_count == 0 {
+            return None;
+        }
+
+        for i in 0..self.words.len() {
+            let word_index = (self.next_word + i) % self.words.len();
+            let word = self.words[word_index];
+
+            if word != u32::MAX {
+                let bit = (!word).trailing_zeros() as usize;
+                let slot = word_index * 32 + bit;
+
+                if slot < self.slot_count {
+                    self.words[word_index] |= 1 << bit;
+                    self.free_count -= 1;
+                    self.next_word = word_index;
+                    return Some(slot as u32);
+                }
+            }
+        }
+
+        None
+    }
+
+    fn release(&mut self, slot: u32) {
+        let (word_index, bit) = (slot as usize / 32, slot as usize % 32);
+
+        if self.words[word_index] & (1 << bit) != 0 {
+            self.words[word_index] &= !(1 << bit);
+            self.free_count += 1;
+        }
+    }
+}
+
+struct SwapArea {
+    device: DeviceId,
+    slots: SlotBitmap,
+}
+
+impl SwapArea {
+    fn block(&self, slot: u32) -> VirtualPage {
+        VirtualPage::new(self.device.clone(), slot as u64 * VirtualPage::SMALL_PAGE_SIZE as u64, 0)
+    }
+}
+
+/// Where the contents of a page are kept while it isn't resident.
+#[derive(Clone, Copy)]
+enum Slot {
+    Area(u32),
+    Compressed(Handle),
+}
+
+// The slot bitmap is only locked while a slot is taken or given back. Pages are read and
+// written without holding any lock.
+static SWAP_AREA: Mutex<Option<SwapArea>> = Mutex::new(None);
+
+// Pages that have a copy in the swap area or the compressed pool, keyed by address space and
+// page address. A page in this map is either swapped out or resident and unchanged since it
+// was read back from the swap area. A page leaves the compressed pool when it's swapped in.
+//
+// The entries of an address space only change while its lock is held.
+static SWAP_SLOTS: Mutex<BTreeMap<(PageMapBase, usize), Slot>> = Mutex::new(BTreeMap::new());
+
+// Held for a whole sweep, so only one thread reclaims at a time
+static CLOCK_HAND: Mutex<(PageMapBase, usize)> = Mutex::new((0, 0));
+
+/// Uses the first `slot_count` pages of a block device as the swap area.
+
+pub fn init(device: DeviceId, slot_count: usize) {
+    let mut swap_area = SWAP_AREA.lock();
+
+    *swap_area = match *swap_area {
+        Some(_) => panic!("Swap area has already been initialized."),
+        None => Some(SwapArea { device, slots: SlotBitmap::new(slot_count) }),
+    }
+}
+
+fn alloc_area_slot() -> Option<u32> {
+    SWAP_AREA.lock().as_mut()
+        .and_then(|swap_area| swap_area.slots.alloc())
+}
+
+fn release_area_slot(slot: u32) {
+    if let Some(swap_area) = SWAP_AREA.lock().as_mut() {
+        swap_area.slots.release(slot);
+    }
+}
+
+fn area_block(slot: u32) -> Result<VirtualPage, Error> {
+    SWAP_AREA.lock().as_ref()
+        .map(|swap_area| swap_area.block(slot))
+        .ok_or(Error::DoesntExist)
+}
+
+fn release_slot(slot: Slot) {
+    match slot {
+        Slot::Area(slot) => release_area_slot(slot),
+        Slot::Compressed(handle) => compressed_pool::free(&handle),
+    }
+}
+
+/// Allocates a 4 KiB frame. If physical memory has run out, then pages are reclaimed
+/// until the allocation succeeds.
+
+pub fn alloc_frame() -> Result<PAddr, Error> {
+    loop {
+        match frame_cache::alloc_frame() {
+            Ok(frame) => return Ok(frame),
+            Err(_) => {
+                if reclaim(RECLAIM_BATCH) == 0 {
+                    return Err(Error::OutOfMemory);
+                }
+            }
+        }
+    }
+}
+
+pub fn release_frame(frame: PAddr) {
+    frame_cache::release_frame(frame);
+}
+
+/// Reads a swapped-out page back into a new frame. Returns the frame along with the flags
+/// that the page must be mapped with.
+///
+/// Returns `None` if the page isn't in the swap area or the compressed pool. A page from the
+/// swap area keeps its slot, so it doesn't have to be written out again if it's evicted
+/// before it's modified. A page from the compressed pool leaves the pool to make room, so
+/// it's mapped dirty.
+
+pub fn swap_in(root_pmap: PageMapBase, page: usize) -> Result<Option<(PAddr, u32)>, Error> {
+    let key = (root_pmap, page);
+    let slot = SWAP_SLOTS.lock().get(&key).copied();
+
+    match slot {
+        Some(Slot::Area(slot)) => {
+            device::read_page(&area_block(slot)?)
+                .map(|frame| Some((frame.address(), 0)))
+        },
+        Some(Slot::Compressed(handle)) => {
+            let frame = alloc_frame()?;
+
+            if let Err(e) = compressed_pool::load(&handle, frame) {
+                release_frame(frame);
+                return Err(e);
+            }
+
+            SWAP_SLOTS.lock().remove(&key);
+            compressed_pool::free(&handle);
+
+            Ok(Some((frame, flags::mapping::DIRTY)))
+        },
+        None => Ok(None),
+    }
+}
+
+/// Releases the swap slots of the pages in `[start, end)` of an address space.
+
+pub fn discard(root_pmap: PageMapBase, start: usize, end: usize) {
+    let discarded = {
+        let mut slots = SWAP_SLOTS.lock();
+        let pages = slots.range((root_pmap, start)..(root_pmap, end))
+            .map(|(key, _)| *key)
+            .collect::<Vec<_>>();
+
+        pages.into_iter()
+            .filter_map(|key| slots.remove(&key))
+            .collect::<Vec<_>>()
+    };
+
+    for slot in discarded {
+        release_slot(slot);
+    }
+}
+
+/// Moves the swap slots of the pages in `[start, end)` of an address space over to the pages
+/// at the same offsets from `new_start`.
+
+pub fn move_slots(root_pmap: PageMapBase, start: usize, end: usize, new_start: usize) {
+    let new_pages = {
+        let mut slots = SWAP_SLOTS.lock();
+        let moved = slots.range((root_pmap, start)..(root_pmap, end))
+            .map(|(&(_, page), &slot)| (page, slot))
+            .collect::<Vec<_>>();
+
+        moved.into_iter()
+            .map(|(page, slot)| {
+                let new_page = page - start + new_start;
+
+                slots.remove(&(root_pmap, page));
+                slots.insert((root_pmap, new_page), slot);
+                new_page
+            })
+            .collect::<Vec<_>>()
+    };
+
+    for new_page in new_pages {
+        // A resident page just keeps its slot as a copy. A swapped-out page must be read back
+        // in by the pager instead of being zero-filled by the kernel.
+
+        let is_swapped_out = unsafe { lowlevel::lookup(Some(root_pmap), new_page as *const ()) }
+            .map(|(_, page_flags)| rust::is_flag_set!(page_flags, flags::mapping::UNMAPPED))
+            .unwrap_or(true);
+
+        if is_swapped_out {
+            revoke_page(root_pmap, new_page);
+        }
+    }
+}
+
+/// Gives a newly cloned address space its own copy of every page that the parent has
+/// swapped out. Such pages have no frame for the child to share.
+
+pub fn clone_slots(parent_pmap: PageMapBase, child_pmap: PageMapBase) -> Result<(), Error> {
+    let parent_slots = SWAP_SLOTS.lock().range((parent_pmap, 0)..=(parent_pmap, usize::MAX))
+        .map(|(&(_, page), &slot)| (page, slot))
+        .collect::<Vec<_>>();
+
+    let swapped_out = parent_slots.into_iter()
+        .filter(|(page, _)| unsafe { lowlevel::lookup(Some(parent_pmap), *page as *const ()) }
+            .map(|(_, page_flags)| rust::is_flag_set!(page_flags, flags::mapping::UNMAPPED))
+            .unwrap_or(false))
+        .collect::<Vec<_>>();
+
+    for (page, slot) in swapped_out {
+        let new_slot = match slot {
+            Slot::Area(slot) => Slot::Area(copy_area_slot(slot)?),
+            Slot::Compressed(handle) => Slot::Compressed(compressed_pool::duplicate(&handle)?),
+        };
+
+        SWAP_SLOTS.lock().insert((child_pmap, page), new_slot);
+        revoke_page(child_pmap, page);
+    }
+
+    Ok(())
+}
+
+fn copy_area_slot(slot: u32) -> Result<u32, Error> {
+    let block = area_block(slot)?;
+    let new_slot = alloc_area_slot()
+        .ok_or(Error::OutOfMemory)?;
+
+    let result = area_block(new_slot)
+        .and_then(|new_block| {
+            let frame = device::read_page(&block)?;
+            let result = device::write_page(&new_block, &frame);
+
+            release_frame(frame.address());
+            result
+        });
+
+    match result {
+        Ok(_) => Ok(new_slot),
+        Err(e) => {
+            release_area_slot(new_slot);
+            Err(e)
+        }
+    }
+}
+
+/// Keeps the kernel from zero-filling a page that has contents in the swap area.
+
+fn revoke_page(root_pmap: PageMapBase, page: usize) {
+    if lowlevel::revoke_anon_region(Some(root_pmap), page, VirtualPage::SMALL_PAGE_SIZE).is_err() {
+        // The region couldn't be split, so send all of the address space's faults to the pager
+        let _ = lowlevel::revoke_anon_region(Some(root_pmap), 0, 0);
+    }
+}
+
+/// Evicts up to `target` pages by sweeping the clock hand at most twice around all
+/// anonymous pages. Returns the number of frames that were freed.
+///
+/// Address spaces that are locked by another thread are passed over, so reclaiming never
+/// waits on a thread that's waiting for memory itself.
+
+pub fn reclaim(target: usize) -> usize {
+    let mut saved_hand = CLOCK_HAND.lock();
+    let mut hand = *saved_hand;
+    let mut reclaimed = 0;
+    let mut wraps = 0;
+
+    while reclaimed < target && wraps < 2 {
+        match mapping::manager::next_anonymous_page(hand.0, hand.1) {
+            Some((root_pmap, page)) => {
+                let (evicted, next_page) = visit_page(root_pmap, page)
+                    .unwrap_or((false, page + VirtualPage::SMALL_PAGE_SIZE));
+
+                if evicted {
+                    reclaimed += 1;
+                }
+
+                hand = (root_pmap, next_page);
+            },
+            None => {
+                hand = (0, 0);
+                wraps += 1;
+            },
+        }
+    }
+
+    *saved_hand = hand;
+    reclaimed
+}
+
+/// Examines the page under the clock hand. Returns whether the page was evicted along with
+/// the next address to examine.
+
+fn visit_page(root_pmap: PageMapBase, page: usize) -> Result<(bool, usize), Error> {
+    let next_page = page + VirtualPage::SMALL_PAGE_SIZE;
+    let next_table = (page | (PhysicalFrame::PSE_LARGE_PAGE_SIZE - 1)).saturating_add(1);
+
+    // The address space was locked by another thread after it was found, so move on to the
+    // next one
+    let _addr_space = match mapping::manager::try_lock(root_pmap) {
+        Some(addr_space) => addr_space,
+        None => return Ok((false, AddrSpace::USER_END)),
+    };
+
+    if !lowlevel::has_page_table(Some(root_pmap), page as *const ()).map_err(|_| Error::Failed)? {
+        return Ok((false, next_table));
+    }
+
+    let (frame, page_flags) = unsafe { lowlevel::lookup(Some(root_pmap), page as *const ()) }
+        .map_err(|_| Error::Failed)?;
+
+    if frame.frame_size() != FrameSize::Small {
+        Ok((false, next_table))
+    } else if rust::is_flag_set!(page_flags, flags::mapping::UNMAPPED)
+        || phys_alloc::phys_ref_count(frame.address()) > 1 {
+        // Frames that are shared with a cloned address space stay resident
+        Ok((false, next_page))
+    } else if rust::is_flag_set!(page_flags, flags::mapping::ACCESSED) {
+        let kept_flags = page_flags & (flags::mapping::READ_ONLY | flags::mapping::DIRTY);
+
+        unsafe { lowlevel::protect(Some(root_pmap), page as *mut c_void, &frame, kept_flags) }
+            .map(|_| (false, next_page))
+            .map_err(|_| Error::Failed)
+    } else {
+        evict_page(root_pmap, page, &frame, page_flags)
+            .map(|evicted| (evicted, next_page))
+    }
+}
+
+/// Returns `true` if a page's contents have to be saved before its frame can be taken away.
+
+fn has_unsaved_data(page_flags: u32) -> bool {
+    rust::is_flag_set!(page_flags, flags::mapping::DIRTY)
+}
+
+fn evict_page(root_pmap: PageMapBase, page: usize, frame: &PhysicalFrame, page_flags: u32) -> Result<bool, Error> {
+    let key = (root_pmap, page);
+
+    if has_unsaved_data(page_flags) {
+        // Compressing the page is much faster than writing it out to the swap area
+
+        let slot = match compressed_pool::store(frame.address()) {
+            Ok(handle) => Slot::Compressed(handle),
+            Err(_) => match write_to_area(key, frame)? {
+                Some(slot) => Slot::Area(slot),
+                None => return Ok(false),
+            },
+        };
+
+        let old_slot = SWAP_SLOTS.lock().insert(key, slot);
+
+        if let Some(old_slot) = old_slot {
+            if !matches!((old_slot, slot), (Slot::Area(old), Slot::Area(new)) if old == new) {
+                release_slot(old_slot);
+            }
+        }
+    }
+
+    // A clean page without a slot hasn't been written to since it was zero-filled, so the
+    // kernel may zero-fill it again on the next touch.
+
+    let has_slot = SWAP_SLOTS.lock().contains_key(&key);
+
+    if has_slot {
+        revoke_page(root_pmap, page);
+    }
+
+    unsafe { lowlevel::unmap(Some(root_pmap), page as *mut ()) }
+        .map_err(|_| Error::Failed)?;
+
+    rmap::unmap(root_pmap, page);
+    release_frame(frame.address());
+    Ok(true)
+}
+
+/// Writes a page to the swap area. The page reuses its old slot if it has one. Returns
+/// `None` if there's no swap area or it's full.
+
+fn write_to_area(key: (PageMapBase, usize), frame: &PhysicalFrame) -> Result<Option<u32>, Error> {
+    let old_slot = match SWAP_SLOTS.lock().get(&key) {
+        Some(Slot::Area(slot)) => Some(*slot),
+        _ => None,
+    };
+
+    let slot = match old_slot.or_else(alloc_area_slot) {
+        Some(slot) => slot,
+        None => return Ok(None),
+    };
+
+    if let Err(e) = area_block(slot).and_then(|block| device::write_page(&block, frame)) {
+        if old_slot.is_none() {
+            release_area_slot(slot);
+        }
+
+        return Err(e);
+    }
+
+    Ok(Some(slot))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_slot_alloc() {
+        let mut slots = SlotBitmap::new(40);
+
+        for i in 0..40 {
+            assert_eq!(slots.alloc(), Some(i));
+        }
+
+        assert_eq!(slots.alloc(), None);
+
+        slots.release(35);
+        slots.release(3);
+
+        assert_eq!(slots.free_count, 2);
+        assert_eq!(slots.alloc(), Some(35));
+        assert_eq!(slots.alloc(), Some(3));
+        assert_eq!(slots.alloc(), None);
+    }
+
+    #[test]
+    fn test_forked_dirty_page_is_saved() {
+        // The parent wrote to the page before the fork, and the child shares its frame
+        let parent_flags = flags::mapping::DIRTY | flags::mapping::ACCESSED;
+        let child_flags = mapping::shared_page_flags(AddrSpace::COPY_ON_WRITE, parent_flags, FrameSize::Small);
+
+        assert!(rust::is_flag_set!(child_flags, flags::mapping::READ_ONLY));
+
+        // The parent's next write gives it a copy, so the child holds the only copy of the
+        // data. Evicting the child's page has to save it.
+        assert!(has_unsaved_data(child_flags));
+
+        // A page that was never written to can still just be zero-filled again
+        let clean_flags = mapping::shared_page_flags(AddrSpace::COPY_ON_WRITE, flags::mapping::ACCESSED,
+                                                     FrameSize::Small);
+
+        assert!(!has_unsaved_data(clean_flags));
+    }
+
+    #[test]
+    fn test_slot_double_release() {
+        let mut slots = SlotBitmap::new(8);
+
+        let slot = slots.alloc().unwrap();
+
+        slots.release(slot);
+        slots.release(slot);
+
+        assert_eq!(slots.free_count, 8);
+    }
+}
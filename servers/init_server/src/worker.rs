@@ -0,0 +1,288 @@
+#![allow(dead_code)]
+
+//! Pager worker threads.
+//!
+//! Messages from the kernel are handed off to a set of workers, so that page faults in
+//! different address spaces can be resolved at the same time. Requests from clients are still
+//! served by the main thread, since clients wait for their replies to come from `INIT_TID`.
+//!
+//! Each address space belongs to one worker, so faults in an address space are resolved in
+//! the order in which they arrived. Low memory messages go to whichever worker has the least
+//! work queued. Messages about the init server's own threads are handled by the main thread,
+//! since it's the pager of the workers, too.
+//!
+//! A worker with nothing left to do sleeps in a receive from the main thread. The main thread
+//! only sends it a message to wake it up.
+//!
+//! The boot modules are loaded by loader threads of their own, which work the same way, but
+//! take no messages. A module takes a while to decompress and load, so the workers keep
+//! resolving the page faults of the modules that have already been started in the meantime.
+
+use alloc::borrow::Cow;
+use alloc::collections::vec_deque::VecDeque;
+use core::ops::Range;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use rust::message::MessageHeader;
+use rust::message::kernel::{self, ExceptionMessage, ExitMessage, MemoryMessage, PageFaultMessage};
+use rust::syscalls::{self, INIT_TID};
+use rust::thread;
+use crate::Tid;
+use crate::boot_profile;
+use crate::compressed_module;
+use crate::elf;
+use crate::error::{self, Error};
+use crate::mapping;
+use crate::multiboot::BootModule;
+use crate::mutex::Mutex;
+use crate::page::VirtualPage;
+use crate::pager;
+use crate::port;
+use crate::spawn_bench;
+
+pub const WORKER_COUNT: usize = 2;
+
+/// The number of threads that load boot modules. Their queues come after the workers'.
+pub const LOADER_COUNT: usize = 2;
+
+const QUEUE_COUNT: usize = WORKER_COUNT + LOADER_COUNT;
+
+// Large enough for any kernel message
+const PAYLOAD_SIZE: usize = 128;
+
+// The depth of stack that's committed before a worker starts taking work
+const STACK_PROBE_SIZE: usize = 64 * 1024;
+
+enum Work {
+    Message {
+        subject: u32,
+        payload: [u8; PAYLOAD_SIZE],
+        length: usize,
+    },
+    LoadModule(BootModule),
+}
+
+struct WorkQueue {
+    work: VecDeque<Work>,
+    tid: Option<Tid>,
+
+    // Set once the worker has found its queue empty. Cleared when it's woken up.
+    sleeping: bool,
+}
+
+const EMPTY_QUEUE: Mutex<WorkQueue> = Mutex::new(WorkQueue {
+    work: VecDeque::new(),
+    tid: None,
+    sleeping: false,
+});
+
+static QUEUES: [Mutex<WorkQueue>; QUEUE_COUNT] = [EMPTY_QUEUE; QUEUE_COUNT];
+static STARTED_WORKERS: AtomicUsize = AtomicUsize::new(0);
+
+/// Handles a message from the kernel. The message is queued for the worker that owns the
+/// address space that it's about, or handled right away if it's about the init server.
+
+pub fn dispatch(subject: u32, payload: &[u8]) -> Result<(), (Error, Cow<'static, str>)> {
+    if spawn_bench::is_running() {
+        if let Some(tid) = sender_of(subject, payload) {
+            spawn_bench::observe(&tid);
+        }
+    }
+
+    let owner = match subject {
+        kernel::LOW_MEMORY => Some(least_busy(0..WORKER_COUNT)),
+        _ => sender_of(subject, payload)
+            .and_then(|tid| mapping::manager::root_pmap_of(&tid))
+            .filter(|pmap| !mapping::manager::is_init_addr_space(*pmap))
+            .map(|pmap| (pmap as usize / VirtualPage::SMALL_PAGE_SIZE) % WORKER_COUNT),
+    };
+
+    match owner {
+        Some(index) if payload.len() <= PAYLOAD_SIZE => {
+            let mut copied_payload = [0; PAYLOAD_SIZE];
+
+            copied_payload[..payload.len()].copy_from_slice(payload);
+            push_work(index, Work::Message {
+                subject,
+                payload: copied_payload,
+                length: payload.len(),
+            });
+            Ok(())
+        },
+        _ => handle(subject, payload),
+    }
+}
+
+/// Queues a boot module to be loaded and started by whichever loader has the least work
+/// queued.
+
+pub fn queue_module(module: BootModule) {
+    push_work(least_busy(WORKER_COUNT..QUEUE_COUNT), Work::LoadModule(module));
+}
+
+fn push_work(index: usize, work: Work) {
+    let mut queue = QUEUES[index].lock();
+
+    queue.work.push_back(work);
+    wake(&mut queue);
+}
+
+/// Retries waking up workers that have work queued, but weren't waiting for the wake-up
+/// message yet. Returns `true` if any of them still has to be woken up.
+
+pub fn wake_sleepers() -> bool {
+    QUEUES.iter()
+        .filter(|queue| {
+            let mut queue = queue.lock();
+
+            !queue.work.is_empty() && !wake(&mut queue)
+        })
+        .count() > 0
+}
+
+/// Sends a wake-up message to a sleeping worker. The message isn't waited on, since the
+/// worker may still need the main thread to resolve a fault before it can receive it.
+/// Returns `false` if the worker is asleep, but couldn't be woken up yet.
+
+fn wake(queue: &mut WorkQueue) -> bool {
+    if !queue.sleeping {
+        return true;
+    }
+
+    let is_woken = queue.tid
+        .map_or(false, |tid| {
+            let mut header = MessageHeader::new(Some(tid), 0, MessageHeader::MSG_NOBLOCK);
+
+            syscalls::send(&mut header, &[]).is_ok()
+        });
+
+    queue.sleeping = !is_woken;
+    is_woken
+}
+
+fn least_busy(indices: Range<usize>) -> usize {
+    let first = indices.start;
+
+    indices
+        .min_by_key(|index| QUEUES[*index].lock().work.len())
+        .unwrap_or(first)
+}
+
+fn sender_of(subject: u32, payload: &[u8]) -> Option<Tid> {
+    let who = match subject {
+        kernel::PAGE_FAULT => PageFaultMessage::try_from(payload).ok()?.who,
+        kernel::EXIT => ExitMessage::try_from(payload).ok()?.who,
+        kernel::EXCEPTION => ExceptionMessage::try_from(payload).ok()?.who,
+        _ => return None,
+    };
+
+    Tid::try_from(who).ok()
+}
+
+fn handle(subject: u32, payload: &[u8]) -> Result<(), (Error, Cow<'static, str>)> {
+    match subject {
+        kernel::EXCEPTION => {
+            ExceptionMessage::try_from(payload)
+                .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read exception message.")))
+                .and_then(|payload| {
+                    // User page faults arrive as PAGE_FAULT messages
+                    error::dump_state(&payload);
+                    Err((Error::NotImplemented, Cow::Borrowed("Not implemented")))
+                })
+        },
+        kernel::PAGE_FAULT => {
+            PageFaultMessage::try_from(payload)
+                .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read page fault message.")))
+                .and_then(|payload| pager::handle_page_fault(&payload))
+        },
+        kernel::LOW_MEMORY => {
+            MemoryMessage::try_from(payload)
+                .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read memory message.")))
+                .and_then(|payload| pager::handle_low_memory(&payload))
+        },
+        kernel::EXIT => {
+            ExitMessage::try_from(payload)
+                .map_err(|_| (Error::ParseError, Cow::Borrowed("Unable to read exit message.")))
+                .and_then(|payload| {
+                    // TODO: Notify threads that are waiting to join with the stopped thread
+
+                    Tid::try_from(payload.who)
+                        .map_err(|_| (Error::BadArgument, Cow::Borrowed("Exit message has a NULL tid.")))
+                        .and_then(|tid| {
+                            // Drop the requests that the thread left parked in ports. Senders
+                            // that were waiting behind it may get their messages in now.
+                            let _ = crate::send_port_replies(port::release_thread(tid.clone()));
+
+                            mapping::manager::release_thread(&tid)
+                        })
+                })
+        },
+        _ => Err((Error::BadRequest, Cow::Owned(format!("Kernel message with subject {}", subject)))),
+    }
+}
+
+fn load_module(module: &BootModule) {
+    // While one loader decompresses a module, another may be setting up the previous one
+    if compressed_module::is_compressed(module) {
+        match compressed_module::expand(module) {
+            Ok(_) => boot_profile::mark(match module.name {
+                Some(ref name) => Cow::Owned(format!("decompressed {}", name)),
+                None => Cow::Owned(format!("decompressed {:#x}", module.addr)),
+            }),
+            Err((e, msg)) => error::log_error(e, msg),
+        }
+    }
+
+    if elf::loader::load_module(module).is_err() {
+        eprintfln!("Unable to load module @ {:#x}", module.addr);
+    }
+
+    boot_profile::mark(match module.name {
+        Some(ref name) => Cow::Owned(format!("loaded {}", name)),
+        None => Cow::Owned(format!("loaded {:#x}", module.addr)),
+    });
+    boot_profile::module_loaded();
+}
+
+/// Faults on a worker's own stack are resolved by the main thread. Committing the stack up
+/// front keeps a worker from faulting on it while it holds a lock that the main thread may
+/// need.
+
+#[inline(never)]
+fn probe_stack() {
+    let probe = [0u8; STACK_PROBE_SIZE];
+
+    core::hint::black_box(&probe);
+}
+
+pub fn worker_main() -> ! {
+    let index = STARTED_WORKERS.fetch_add(1, Ordering::AcqRel);
+    let queue = QUEUES.get(index)
+        .expect("Too many pager workers and loaders were started.");
+
+    probe_stack();
+    queue.lock().tid = thread::get_tid().ok();
+
+    loop {
+        let next_work = {
+            let mut queue = queue.lock();
+            let next_work = queue.work.pop_front();
+
+            queue.sleeping = next_work.is_none();
+            next_work
+        };
+
+        match next_work {
+            Some(Work::Message { subject, payload, length }) => {
+                if let Err((e, msg)) = handle(subject, &payload[..length]) {
+                    error::log_error(e, msg);
+                }
+            },
+            Some(Work::LoadModule(module)) => load_module(&module),
+            None => {
+                let mut header = MessageHeader::new(Tid::new(INIT_TID), 0, 0);
+
+                let _ = syscalls::receive(&mut header, &mut []);
+            },
+        }
+    }
+}
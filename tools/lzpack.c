@@ -0,0 +1,90 @@
+/* Packs a boot module into the compressed format that the init server decompresses
+   at boot (see os/lz.h).
+
+   Usage: lzpack <input> <output> */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <os/lz.h>
+
+// lz_compress() may expand incompressible data slightly
+#define MAX_COMPRESSED_BLOCK    (LZ_MODULE_BLOCK_SIZE + LZ_MODULE_BLOCK_SIZE / 255 + 16)
+
+static int write32(FILE *file, uint32_t value)
+{
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+
+    return fwrite(bytes, sizeof bytes, 1, file) == 1 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static uint8_t block[LZ_MODULE_BLOCK_SIZE];
+    static uint8_t compressed[MAX_COMPRESSED_BLOCK];
+    FILE *in, *out;
+    long length;
+    size_t total = 0;
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s <input> <output>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(!(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if(fseek(in, 0, SEEK_END) || (length = ftell(in)) < 0 || fseek(in, 0, SEEK_SET)) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if((unsigned long)length > UINT32_MAX) {
+        fprintf(stderr, "%s: Too large to pack.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if(!(out = fopen(argv[2], "wb"))) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    if(write32(out, LZ_MODULE_MAGIC) || write32(out, (uint32_t)length)) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    for(size_t block_length; (block_length = fread(block, 1, sizeof block, in)) > 0; total += block_length) {
+        size_t compressed_length = lz_compress(block, block_length, compressed, sizeof compressed);
+        int is_stored = compressed_length == 0 || compressed_length >= block_length;
+
+        if(is_stored) {
+            if(write32(out, (uint32_t)block_length | LZ_MODULE_STORED)
+               || fwrite(block, block_length, 1, out) != 1) {
+                perror(argv[2]);
+                return EXIT_FAILURE;
+            }
+        } else if(write32(out, (uint32_t)compressed_length)
+                  || fwrite(compressed, compressed_length, 1, out) != 1) {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(ferror(in) || total != (size_t)length) {
+        fprintf(stderr, "%s: Unable to read the whole file.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    fclose(in);
+
+    if(fclose(out)) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}